@@ -79,13 +79,21 @@ static void open_filesystem(char *device, int open_flags, blk_t superblock,
 		open_flags &= ~EXT2_FLAG_RW;
 	}
 
+	/*
+	 * Most commands only look at a few groups, so only read
+	 * their bitmaps when they are first used.
+	 */
+	open_flags |= EXT2_FLAG_LAZY_BITMAPS;
 	retval = ext2fs_open(device, open_flags, superblock, blocksize,
-			     unix_io_manager, &current_fs);
+			     (open_flags & EXT2_FLAG_RW) ? unix_io_manager :
+			     mmap_io_manager, &current_fs);
 	if (retval) {
 		com_err(device, retval, "while opening filesystem");
 		current_fs = NULL;
 		return;
 	}
+	/* Commands like rdump and ncheck read the same inodes repeatedly */
+	ext2fs_create_inode_cache(current_fs, 256);
 
 	if (catastrophic)
 		com_err(device, 0, "catastrophic mode - not reading inode or group bitmaps");
@@ -2096,6 +2104,28 @@ void do_supported_features(int argc, char *argv[])
 	}
 }
 
+void do_io_stats(int argc, char *argv[])
+{
+	io_channel	io;
+	io_stats	stats = 0;
+
+	if (common_args_process(argc, argv, 1, 1, "io_stats", "", 0))
+		return;
+
+	io = current_fs->io;
+	if (io->manager->get_stats)
+		io->manager->get_stats(io, &stats);
+	if (!stats) {
+		com_err(argv[0], EXT2_ET_OP_NOT_SUPPORTED,
+			"while getting I/O statistics");
+		return;
+	}
+	fprintf(stdout, "I/O manager: %s\n", io->manager->name);
+	fprintf(stdout, "I/O read: %llu bytes, write: %llu bytes\n",
+		stats->bytes_read, stats->bytes_written);
+	e2p_print_io_stats(stdout, 0, stats, 0, current_fs->blocksize);
+}
+
 static int source_file(const char *cmd_file, int sci_idx)
 {
 	FILE		*f;
@@ -96,6 +96,7 @@ void do_icheck(int argc, char **argv)
 		com_err("icheck", retval, "while opening inode scan");
 		goto error_out;
 	}
+	ext2fs_inode_scan_flags(scan, EXT2_SF_PREFETCH, 0);
 
 	do {
 		retval = ext2fs_get_next_inode(scan, &ino, &inode);
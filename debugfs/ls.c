@@ -36,11 +36,87 @@ struct list_dir_struct {
 	FILE	*f;
 	int	col;
 	int	options;
+	/* Inodes read in one batch before a long listing */
+	ext2_ino_t		*inos;
+	struct ext2_inode	*inodes;
+	int			count, size, next;
 };
 
 static const char *monstr[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
 				"Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
 
+/*
+ * Collect the inode numbers of a directory so that they can be read
+ * in inode table order rather than directory order.
+ */
+static int collect_inode_proc(ext2_ino_t dir EXT2FS_ATTR((unused)),
+			      int	entry,
+			      struct ext2_dir_entry *dirent,
+			      int	offset EXT2FS_ATTR((unused)),
+			      int	blocksize EXT2FS_ATTR((unused)),
+			      char	*buf EXT2FS_ATTR((unused)),
+			      void	*private)
+{
+	struct list_dir_struct *ls = (struct list_dir_struct *) private;
+	ext2_ino_t	*new_inos;
+
+	if (entry == DIRENT_DELETED_FILE || !dirent->inode)
+		return 0;
+	if (ls->count >= ls->size) {
+		new_inos = realloc(ls->inos,
+				   sizeof(ext2_ino_t) * (ls->size + 256));
+		if (!new_inos)
+			return DIRENT_ABORT;
+		ls->inos = new_inos;
+		ls->size += 256;
+	}
+	ls->inos[ls->count++] = dirent->inode;
+	return 0;
+}
+
+static errcode_t store_inode_proc(ext2_filsys fs EXT2FS_ATTR((unused)),
+				  ext2_ino_t ino EXT2FS_ATTR((unused)),
+				  int index, struct ext2_inode *inode,
+				  void *priv_data)
+{
+	struct list_dir_struct *ls = (struct list_dir_struct *) priv_data;
+
+	ls->inodes[index] = *inode;
+	return 0;
+}
+
+static void read_dir_inodes(ext2_ino_t dir, int flags,
+			    struct list_dir_struct *ls)
+{
+	errcode_t	retval;
+
+	retval = ext2fs_dir_iterate2(current_fs, dir, flags, 0,
+				     collect_inode_proc, ls);
+	if (retval || !ls->count)
+		return;
+	ls->inodes = malloc(sizeof(struct ext2_inode) * ls->count);
+	if (!ls->inodes)
+		return;
+	retval = ext2fs_read_inodes(current_fs, ls->inos, ls->count,
+				    store_inode_proc, ls);
+	if (retval) {
+		/* Fall back to reading (and reporting) them one by one */
+		free(ls->inodes);
+		ls->inodes = 0;
+	}
+}
+
+static int ls_read_inode(struct list_dir_struct *ls, ext2_ino_t ino,
+			 struct ext2_inode *inode, const char *name)
+{
+	if (ls->inodes && ls->next < ls->count &&
+	    ls->inos[ls->next] == ino) {
+		*inode = ls->inodes[ls->next++];
+		return 0;
+	}
+	return debugfs_read_inode(ino, inode, name);
+}
+
 static int list_dir_proc(ext2_ino_t dir EXT2FS_ATTR((unused)),
 			 int	entry,
 			 struct ext2_dir_entry *dirent,
@@ -74,7 +150,7 @@ static int list_dir_proc(ext2_ino_t dir EXT2FS_ATTR((unused)),
 		lbr = rbr = ' ';
 	}
 	if (ls->options & PARSE_OPT) {
-		if (ino && debugfs_read_inode(ino, &inode, name)) return 0;
+		if (ino && ls_read_inode(ls, ino, &inode, name)) return 0;
 		fprintf(ls->f,"/%u/%06o/%d/%d/%s/",ino,inode.i_mode,inode.i_uid, inode.i_gid,name);
 		if (LINUX_S_ISDIR(inode.i_mode))
 			fprintf(ls->f, "/");
@@ -84,7 +160,7 @@ static int list_dir_proc(ext2_ino_t dir EXT2FS_ATTR((unused)),
 	}
 	else if (ls->options & LONG_OPT) {
 		if (ino) {
-			if (debugfs_read_inode(ino, &inode, name))
+			if (ls_read_inode(ls, ino, &inode, name))
 				return 0;
 			modtime = inode.i_mtime;
 			tm_p = localtime(&modtime);
@@ -129,6 +205,9 @@ void do_list_dir(int argc, char *argv[])
 	struct list_dir_struct ls;
 
 	ls.options = 0;
+	ls.inos = 0;
+	ls.inodes = 0;
+	ls.count = ls.size = ls.next = 0;
 	if (check_fs_open(argv[0]))
 		return;
 
@@ -167,6 +246,8 @@ void do_list_dir(int argc, char *argv[])
 	flags = DIRENT_FLAG_INCLUDE_EMPTY;
 	if (ls.options & DELETED_OPT)
 		flags |= DIRENT_FLAG_INCLUDE_REMOVED;
+	if (ls.options & (LONG_OPT | PARSE_OPT))
+		read_dir_inodes(inode, flags, &ls);
 
 	retval = ext2fs_dir_iterate2(current_fs, inode, flags,
 				    0, list_dir_proc, &ls);
@@ -174,6 +255,8 @@ void do_list_dir(int argc, char *argv[])
 	close_pager(ls.f);
 	if (retval)
 		com_err(argv[1], retval, 0);
+	free(ls.inodes);
+	free(ls.inos);
 
 	return;
 }
@@ -120,6 +120,7 @@ void do_lsdel(int argc, char **argv)
 			"while opening inode scan");
 		goto error_out;
 	}
+	ext2fs_inode_scan_flags(scan, EXT2_SF_PREFETCH, 0);
 
 	do {
 		retval = ext2fs_get_next_inode(scan, &ino, &inode);
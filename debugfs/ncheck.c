@@ -90,6 +90,7 @@ void do_ncheck(int argc, char **argv)
 		com_err("ncheck", retval, "while opening inode scan");
 		goto error_out;
 	}
+	ext2fs_inode_scan_flags(scan, EXT2_SF_PREFETCH, 0);
 
 	do {
 		retval = ext2fs_get_next_inode(scan, &ino, &inode);
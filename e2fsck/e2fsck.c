@@ -217,10 +217,16 @@ int e2fsck_run(e2fsck_t ctx)
 	for (i=0; (e2fsck_pass = e2fsck_passes[i]); i++) {
 		if (ctx->flags & E2F_FLAG_RUN_RETURN)
 			break;
+#ifdef CONFIG_TESTIO_DEBUG
+		test_io_trace_tag = i + 1;
+#endif
 		e2fsck_pass(ctx);
 		if (ctx->progress)
 			(void) (ctx->progress)(ctx, 0, 0, 0);
 	}
+#ifdef CONFIG_TESTIO_DEBUG
+	test_io_trace_tag = 0;
+#endif
 	ctx->flags &= ~E2F_FLAG_SETJMP_OK;
 
 	if (ctx->flags & E2F_FLAG_RUN_RETURN)
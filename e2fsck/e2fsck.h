@@ -135,8 +135,7 @@ struct resource_track {
 	struct timeval user_start;
 	struct timeval system_start;
 	void	*brk_start;
-	unsigned long long bytes_read;
-	unsigned long long bytes_written;
+	struct struct_io_stats io_start;
 };
 #endif
 
@@ -504,6 +503,12 @@ extern void *e2fsck_allocate_memory(e2fsck_t ctx, unsigned int size,
 extern int ask(e2fsck_t ctx, const char * string, int def);
 extern int ask_yn(const char * string, int def);
 extern void fatal_error(e2fsck_t ctx, const char * fmt_string);
+extern errcode_t e2fsck_allocate_inode_bitmap(ext2_filsys fs,
+					      const char *descr, int type,
+					      ext2fs_inode_bitmap *ret);
+extern errcode_t e2fsck_allocate_block_bitmap(ext2_filsys fs,
+					      const char *descr, int type,
+					      ext2fs_block_bitmap *ret);
 extern void e2fsck_read_bitmaps(e2fsck_t ctx);
 extern void e2fsck_write_bitmaps(e2fsck_t ctx);
 extern void preenhalt(e2fsck_t ctx);
@@ -105,11 +105,46 @@ void sync_blockdev(kdev_t kdev)
 	io_channel_flush(io);
 }
 
+/*
+ * Readahead is only a hint: start reading runs of contiguous blocks
+ * and leave the buffers alone, so they get read for real (hopefully
+ * from the page cache by then) when they are actually needed.
+ */
+static void ll_readahead(int nr, struct buffer_head *bhp[])
+{
+	struct buffer_head *bh;
+	io_channel io = 0;
+	unsigned long long start = 0, count = 0;
+
+	for (; nr > 0; --nr) {
+		bh = *bhp++;
+		if (bh->b_uptodate)
+			continue;
+		if (count && bh->b_io == io &&
+		    (unsigned long long) bh->b_blocknr == start + count) {
+			count++;
+			continue;
+		}
+		if (count)
+			io_channel_readahead(io, start, count);
+		io = bh->b_io;
+		start = bh->b_blocknr;
+		count = 1;
+	}
+	if (count)
+		io_channel_readahead(io, start, count);
+}
+
 void ll_rw_block(int rw, int nr, struct buffer_head *bhp[])
 {
 	int retval;
 	struct buffer_head *bh;
 
+	if (rw == READA) {
+		ll_readahead(nr, bhp);
+		return;
+	}
+
 	for (; nr > 0; --nr) {
 		bh = *bhp++;
 		if (rw == READ && !bh->b_uptodate) {
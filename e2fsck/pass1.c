@@ -75,6 +75,7 @@ static void mark_inode_bad(e2fsck_t ctx, ino_t ino);
 static void handle_fs_bad_blocks(e2fsck_t ctx);
 static void process_inodes(e2fsck_t ctx, char *block_buf);
 static EXT2_QSORT_TYPE process_inode_cmp(const void *a, const void *b);
+static void readahead_inodes(e2fsck_t ctx);
 static errcode_t scan_callback(ext2_filsys fs, ext2_inode_scan scan,
 				  dgrp_t group, void * priv_data);
 static void adjust_extattr_refcount(e2fsck_t ctx, ext2_refcount_t refcount,
@@ -603,24 +604,27 @@ void e2fsck_pass1(e2fsck_t ctx)
 	/*
 	 * Allocate bitmaps structures
 	 */
-	pctx.errcode = ext2fs_allocate_inode_bitmap(fs, _("in-use inode map"),
-					      &ctx->inode_used_map);
+	pctx.errcode = e2fsck_allocate_inode_bitmap(fs, _("in-use inode map"),
+					EXT2FS_BMAP_CONTAINER,
+					&ctx->inode_used_map);
 	if (pctx.errcode) {
 		pctx.num = 1;
 		fix_problem(ctx, PR_1_ALLOCATE_IBITMAP_ERROR, &pctx);
 		ctx->flags |= E2F_FLAG_ABORT;
 		return;
 	}
-	pctx.errcode = ext2fs_allocate_inode_bitmap(fs,
-				_("directory inode map"), &ctx->inode_dir_map);
+	pctx.errcode = e2fsck_allocate_inode_bitmap(fs,
+				_("directory inode map"), EXT2FS_BMAP_CONTAINER,
+				&ctx->inode_dir_map);
 	if (pctx.errcode) {
 		pctx.num = 2;
 		fix_problem(ctx, PR_1_ALLOCATE_IBITMAP_ERROR, &pctx);
 		ctx->flags |= E2F_FLAG_ABORT;
 		return;
 	}
-	pctx.errcode = ext2fs_allocate_inode_bitmap(fs,
-			_("regular file inode map"), &ctx->inode_reg_map);
+	pctx.errcode = e2fsck_allocate_inode_bitmap(fs,
+			_("regular file inode map"), EXT2FS_BMAP_CONTAINER,
+			&ctx->inode_reg_map);
 	if (pctx.errcode) {
 		pctx.num = 6;
 		fix_problem(ctx, PR_1_ALLOCATE_IBITMAP_ERROR, &pctx);
@@ -637,8 +641,8 @@ void e2fsck_pass1(e2fsck_t ctx)
 	}
 #ifdef EXT2FS_SNAPSHOT_EXCLUDE_BITMAP
 	if (sb->s_feature_compat & EXT2_FEATURE_COMPAT_EXCLUDE_BITMAP)
-		pctx.errcode = ext2fs_allocate_block_bitmap(fs,
-				_("excluded block map"),
+		pctx.errcode = e2fsck_allocate_block_bitmap(fs,
+				_("excluded block map"), EXT2FS_BMAP_EXTENT,
 				&ctx->block_excluded_map);
 	if (pctx.errcode) {
 		pctx.num = 1;
@@ -704,7 +708,8 @@ void e2fsck_pass1(e2fsck_t ctx)
 		ext2fs_free_mem(&inode);
 		return;
 	}
-	ext2fs_inode_scan_flags(scan, EXT2_SF_SKIP_MISSING_ITABLE, 0);
+	ext2fs_inode_scan_flags(scan, EXT2_SF_SKIP_MISSING_ITABLE |
+				EXT2_SF_PREFETCH, 0);
 	ctx->stashed_inode = inode;
 	scan_struct.ctx = ctx;
 	scan_struct.block_buf = block_buf;
@@ -1268,6 +1273,7 @@ static void process_inodes(e2fsck_t ctx, char *block_buf)
 	old_stashed_ino = ctx->stashed_ino;
 	qsort(inodes_to_process, process_inode_count,
 		      sizeof(struct process_inode_block), process_inode_cmp);
+	readahead_inodes(ctx);
 	clear_problem_context(&pctx);
 	for (i=0; i < process_inode_count; i++) {
 		pctx.inode = ctx->stashed_inode = &inodes_to_process[i].inode;
@@ -1309,6 +1315,65 @@ static EXT2_QSORT_TYPE process_inode_cmp(const void *a, const void *b)
 	return ret;
 }
 
+static EXT2_QSORT_TYPE blk_cmp(const void *a, const void *b)
+{
+	blk_t	blk_a = *(const blk_t *) a;
+	blk_t	blk_b = *(const blk_t *) b;
+
+	if (blk_a < blk_b)
+		return -1;
+	return (blk_a > blk_b);
+}
+
+/*
+ * Start reading the indirect and extended attribute blocks of every
+ * inode in the "inodes to process" list before checking any of them.
+ * The disk can then work on all of them together instead of waiting
+ * for each one in turn while check_blocks() runs.  The blocks are
+ * sorted, and consecutive ones merged into a single request.  The
+ * indirect blocks below these are read ahead by the block iterator
+ * (BLOCK_FLAG_READAHEAD) as each doubly or triply indirect block is
+ * read.
+ */
+static void readahead_inodes(e2fsck_t ctx)
+{
+	ext2_filsys	fs = ctx->fs;
+	struct ext2_inode *inode;
+	blk_t		*blocks, blk, run_start = 0, run_len = 0;
+	int		i, j, count = 0;
+
+	if (ext2fs_get_array(process_inode_count,
+			     (EXT2_N_BLOCKS - EXT2_IND_BLOCK + 1) *
+			     sizeof(blk_t), &blocks))
+		return;
+	for (i = 0; i < process_inode_count; i++) {
+		inode = &inodes_to_process[i].inode;
+		for (j = EXT2_IND_BLOCK; j < EXT2_N_BLOCKS; j++)
+			blocks[count++] = inode->i_block[j];
+		blocks[count++] = ext2fs_file_acl_block(inode);
+	}
+	qsort(blocks, count, sizeof(blk_t), blk_cmp);
+	for (i = 0; i < count; i++) {
+		blk = blocks[i];
+		if ((blk < fs->super->s_first_data_block) ||
+		    (blk >= fs->super->s_blocks_count))
+			continue;
+		if (run_len && blk < run_start + run_len)
+			continue;
+		if (run_len && blk == run_start + run_len) {
+			run_len++;
+			continue;
+		}
+		if (run_len)
+			io_channel_readahead(fs->io, run_start, run_len);
+		run_start = blk;
+		run_len = 1;
+	}
+	if (run_len)
+		io_channel_readahead(fs->io, run_start, run_len);
+	ext2fs_free_mem(&blocks);
+}
+
 /*
  * Mark an inode as being bad in some what
  */
@@ -1319,8 +1384,9 @@ static void mark_inode_bad(e2fsck_t ctx, ino_t ino)
 	if (!ctx->inode_bad_map) {
 		clear_problem_context(&pctx);
 
-		pctx.errcode = ext2fs_allocate_inode_bitmap(ctx->fs,
-			    _("bad inode map"), &ctx->inode_bad_map);
+		pctx.errcode = e2fsck_allocate_inode_bitmap(ctx->fs,
+			    _("bad inode map"), EXT2FS_BMAP_CONTAINER,
+			    &ctx->inode_bad_map);
 		if (pctx.errcode) {
 			pctx.num = 3;
 			fix_problem(ctx, PR_1_ALLOCATE_IBITMAP_ERROR, &pctx);
@@ -1341,8 +1407,9 @@ static void alloc_bb_map(e2fsck_t ctx)
 	struct		problem_context pctx;
 
 	clear_problem_context(&pctx);
-	pctx.errcode = ext2fs_allocate_inode_bitmap(ctx->fs,
+	pctx.errcode = e2fsck_allocate_inode_bitmap(ctx->fs,
 					      _("inode in bad block map"),
+					      EXT2FS_BMAP_CONTAINER,
 					      &ctx->inode_bb_map);
 	if (pctx.errcode) {
 		pctx.num = 4;
@@ -1361,8 +1428,9 @@ static void alloc_imagic_map(e2fsck_t ctx)
 	struct		problem_context pctx;
 
 	clear_problem_context(&pctx);
-	pctx.errcode = ext2fs_allocate_inode_bitmap(ctx->fs,
+	pctx.errcode = e2fsck_allocate_inode_bitmap(ctx->fs,
 					      _("imagic inode map"),
+					      EXT2FS_BMAP_CONTAINER,
 					      &ctx->inode_imagic_map);
 	if (pctx.errcode) {
 		pctx.num = 5;
@@ -1388,9 +1456,9 @@ static _INLINE_ void mark_block_used(e2fsck_t ctx, blk_t block)
 
 	if (ext2fs_fast_test_block_bitmap(ctx->block_found_map, block)) {
 		if (!ctx->block_dup_map) {
-			pctx.errcode = ext2fs_allocate_block_bitmap(ctx->fs,
+			pctx.errcode = e2fsck_allocate_block_bitmap(ctx->fs,
 			      _("multiply claimed block map"),
-			      &ctx->block_dup_map);
+			      EXT2FS_BMAP_EXTENT, &ctx->block_dup_map);
 			if (pctx.errcode) {
 				pctx.num = 3;
 				fix_problem(ctx, PR_1_ALLOCATE_BBITMAP_ERROR,
@@ -1488,8 +1556,9 @@ static int check_ext_attr(e2fsck_t ctx, struct problem_context *pctx,
 
 	/* If ea bitmap hasn't been allocated, create it */
 	if (!ctx->block_ea_map) {
-		pctx->errcode = ext2fs_allocate_block_bitmap(fs,
+		pctx->errcode = e2fsck_allocate_block_bitmap(fs,
 						      _("ext attr block map"),
+						      EXT2FS_BMAP_EXTENT,
 						      &ctx->block_ea_map);
 		if (pctx->errcode) {
 			pctx->num = 2;
@@ -1999,7 +2068,8 @@ static void check_blocks(e2fsck_t ctx, struct problem_context *pctx,
 			check_blocks_extents(ctx, pctx, &pb);
 		else
 			pctx->errcode = ext2fs_block_iterate2(fs, ino,
-						pb.is_dir ? BLOCK_FLAG_HOLE : 0,
+						BLOCK_FLAG_READAHEAD |
+						(pb.is_dir ? BLOCK_FLAG_HOLE : 0),
 						block_buf, process_block, &pb);
 	}
 	end_problem_latch(ctx, PR_LATCH_BLOCK);
@@ -2589,6 +2659,8 @@ static void new_table_block(e2fsck_t ctx, blk_t first_block, int group,
 	fix_problem(ctx, (old_block ? PR_1_RELOC_FROM_TO :
 			  PR_1_RELOC_TO), &pctx);
 	pctx.blk2 = 0;
+	/* We copy the old blocks directly, so get the inode table current */
+	ext2fs_flush_icache(fs);
 	for (i = 0; i < num; i++) {
 		pctx.blk = i;
 		ext2fs_mark_block_bitmap(ctx->block_found_map, (*new_block)+i);
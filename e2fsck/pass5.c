@@ -127,21 +127,230 @@ static void print_bitmap_problem(e2fsck_t ctx, int problem,
 	pctx->ino = pctx->ino2 = 0;
 }
 
+/*
+ * The bitmaps computed by the earlier passes are compared with the
+ * ones on disk by ext2fs_diff_generic_bitmap_range(), which skips
+ * over the (usually all but a few) words which agree, and only calls
+ * back for the runs of bits which differ.  Runs with the same problem
+ * are merged before they are reported.
+ */
+struct bitmap_diff {
+	e2fsck_t		ctx;
+	struct problem_context	*pctx;
+	int			used_problem;
+	int			unused_problem;
+	int			save_problem;
+	int			had_problem;
+	int			inodes;
+};
+
+static void report_bitmap_diff(struct bitmap_diff *bd, __u32 first,
+			       __u32 last, int problem)
+{
+	struct problem_context *pctx = bd->pctx;
+
+	if (bd->inodes) {
+		if (pctx->ino && (problem == bd->save_problem) &&
+		    (pctx->ino2 == first - 1))
+			pctx->ino2 = last;
+		else {
+			if (pctx->ino)
+				print_bitmap_problem(bd->ctx, bd->save_problem,
+						     pctx);
+			pctx->ino = first;
+			pctx->ino2 = last;
+			bd->save_problem = problem;
+		}
+	} else {
+		if ((pctx->blk != NO_BLK) && (problem == bd->save_problem) &&
+		    (pctx->blk2 == first - 1))
+			pctx->blk2 = last;
+		else {
+			if (pctx->blk != NO_BLK)
+				print_bitmap_problem(bd->ctx, bd->save_problem,
+						     pctx);
+			pctx->blk = first;
+			pctx->blk2 = last;
+			bd->save_problem = problem;
+		}
+	}
+	bd->ctx->flags |= E2F_FLAG_PROG_SUPPRESS;
+	bd->had_problem++;
+}
+
+/*
+ * bit is set if the objects are in use according to the computed
+ * bitmap, but not according to the one on disk.
+ */
+static int bitmap_diff_func(__u32 first, __u32 last, int bit, void *priv)
+{
+	struct bitmap_diff *bd = (struct bitmap_diff *) priv;
+
+	report_bitmap_diff(bd, first, last,
+			   bit ? bd->used_problem : bd->unused_problem);
+	return 0;
+}
+
+static int diff_bitmaps(struct bitmap_diff *bd, ext2fs_generic_bitmap actual,
+			ext2fs_generic_bitmap bitmap, __u32 first, __u32 last)
+{
+	errcode_t	retval;
+
+	retval = ext2fs_diff_generic_bitmap_range(actual, bitmap, first, last,
+						  bitmap_diff_func, bd);
+	if (retval) {
+		com_err(bd->ctx->program_name, retval,
+			_("while comparing bitmaps"));
+		bd->ctx->flags |= E2F_FLAG_ABORT;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Add the blocks from blk to blk + num - 1 which lie between first
+ * and last to the sorted list of ranges in meta[]
+ */
+static int add_meta_range(blk_t meta[][2], int nmeta, blk_t first,
+			  blk_t last, blk_t blk, blk_t num)
+{
+	blk_t	end = blk + num - 1;
+	int	i;
+
+	if (!num || blk > last || end < first)
+		return nmeta;
+	if (blk < first)
+		blk = first;
+	if (end > last)
+		end = last;
+	for (i = nmeta; i > 0 && meta[i-1][0] > blk; i--) {
+		meta[i][0] = meta[i-1][0];
+		meta[i][1] = meta[i-1][1];
+	}
+	meta[i][0] = blk;
+	meta[i][1] = end;
+	return nmeta + 1;
+}
+
+/*
+ * Only a group's own metadata is in use while it is flagged
+ * BLOCK_UNINIT; return its block ranges, sorted and merged.
+ */
+static int uninit_group_meta(ext2_filsys fs, dgrp_t group, blk_t first,
+			     blk_t last, blk_t meta[][2])
+{
+	blk_t	super_blk, old_desc_blk, new_desc_blk;
+	int	old_desc_blocks, i, j, n = 0;
+
+	ext2fs_super_and_bgd_loc(fs, group, &super_blk,
+				 &old_desc_blk, &new_desc_blk, 0);
+
+	if (fs->super->s_feature_incompat & EXT2_FEATURE_INCOMPAT_META_BG)
+		old_desc_blocks = fs->super->s_first_meta_bg;
+	else
+		old_desc_blocks = fs->desc_blocks +
+			fs->super->s_reserved_gdt_blocks;
+
+	n = add_meta_range(meta, n, first, last, super_blk, 1);
+	if (old_desc_blk)
+		n = add_meta_range(meta, n, first, last, old_desc_blk,
+				   old_desc_blocks);
+	if (new_desc_blk)
+		n = add_meta_range(meta, n, first, last, new_desc_blk, 1);
+	n = add_meta_range(meta, n, first, last,
+			   fs->group_desc[group].bg_block_bitmap, 1);
+	n = add_meta_range(meta, n, first, last,
+			   fs->group_desc[group].bg_inode_bitmap, 1);
+	n = add_meta_range(meta, n, first, last,
+			   fs->group_desc[group].bg_inode_table,
+			   fs->inode_blocks_per_group);
+
+	for (i = 0, j = 1; j < n; j++) {
+		if (meta[j][0] <= meta[i][1] + 1) {
+			if (meta[j][1] > meta[i][1])
+				meta[i][1] = meta[j][1];
+		} else {
+			i++;
+			meta[i][0] = meta[j][0];
+			meta[i][1] = meta[j][1];
+		}
+	}
+	return n ? i + 1 : 0;
+}
+
+/*
+ * Check a group which is flagged as uninitialized (uninit_flag), so
+ * that only the nmeta ranges in meta[] are in use.  Every other
+ * object found in use asks whether the flag should be cleared; if it
+ * is, the on-disk bitmap is valid from there on, and the next object
+ * to compare with it is returned.  Otherwise the whole group has been
+ * checked and last + 1 is returned.  The number of objects in use
+ * before the returned one is added to *used.
+ */
+static __u32 check_uninit_group(struct bitmap_diff *bd,
+				ext2fs_generic_bitmap actual, dgrp_t group,
+				__u32 first, __u32 last,
+				blk_t meta[][2], int nmeta,
+				int problem, int uninit_flag, __u32 *used)
+{
+	e2fsck_t	ctx = bd->ctx;
+	struct problem_context pctx2;
+	__u32		i = first, end, x;
+	int		m = 0;
+
+	while (i <= last) {
+		if (m < nmeta && i == meta[m][0]) {
+			end = meta[m++][1];
+			while (!ext2fs_find_first_zero_generic_bitmap(actual,
+							i, end, &i)) {
+				if (ext2fs_find_first_set_generic_bitmap(actual,
+							i, end, &x))
+					x = end + 1;
+				report_bitmap_diff(bd, i, x - 1,
+						   bd->unused_problem);
+				if (x > end)
+					break;
+				i = x;
+			}
+			*used += end - meta[m-1][0] + 1;
+			i = end + 1;
+			continue;
+		}
+		end = (m < nmeta) ? meta[m][0] - 1 : last;
+		while (!ext2fs_find_first_set_generic_bitmap(actual,
+							     i, end, &i)) {
+			clear_problem_context(&pctx2);
+			pctx2.blk = i;
+			pctx2.group = group;
+			if (fix_problem(ctx, problem, &pctx2)) {
+				ctx->fs->group_desc[group].bg_flags &=
+					~uninit_flag;
+				report_bitmap_diff(bd, i, i,
+						   bd->used_problem);
+				return i + 1;
+			}
+			report_bitmap_diff(bd, i, i, bd->used_problem);
+			if (i++ == end)
+				break;
+		}
+		i = end + 1;
+	}
+	return last + 1;
+}
+
 static void check_block_bitmaps(e2fsck_t ctx)
 {
 	ext2_filsys fs = ctx->fs;
-	blk_t	i;
+	blk_t	first, last, i, used;
+	blk_t	meta[6][2];
 	int	*free_array;
-	int	group = 0;
-	blk_t	blocks = 0;
+	dgrp_t	group;
 	blk_t	free_blocks = 0;
-	int	group_free = 0;
-	int	actual, bitmap;
 	struct problem_context	pctx;
-	int	problem, save_problem, fixit, had_problem;
+	struct bitmap_diff	bd;
+	int	nmeta, fixit;
 	errcode_t	retval;
 	int		csum_flag;
-	int		skip_group = 0;
 
 	clear_problem_context(&pctx);
 	free_array = (int *) e2fsck_allocate_memory(ctx,
@@ -179,122 +388,46 @@ static void check_block_bitmaps(e2fsck_t ctx)
 
 	csum_flag = EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
 					       EXT4_FEATURE_RO_COMPAT_GDT_CSUM);
+	memset(&bd, 0, sizeof(bd));
+	bd.ctx = ctx;
+	bd.pctx = &pctx;
+	bd.used_problem = PR_5_BLOCK_USED;
+	bd.unused_problem = PR_5_BLOCK_UNUSED;
 redo_counts:
-	had_problem = 0;
-	save_problem = 0;
+	bd.had_problem = 0;
+	bd.save_problem = 0;
 	pctx.blk = pctx.blk2 = NO_BLK;
-	if (csum_flag &&
-	    (fs->group_desc[group].bg_flags & EXT2_BG_BLOCK_UNINIT))
-		skip_group++;
-	for (i = fs->super->s_first_data_block;
-	     i < fs->super->s_blocks_count;
-	     i++) {
-		actual = ext2fs_fast_test_block_bitmap(ctx->block_found_map, i);
-
-		if (skip_group) {
-			blk_t	super_blk, old_desc_blk, new_desc_blk;
-			int	old_desc_blocks;
-
-			ext2fs_super_and_bgd_loc(fs, group, &super_blk,
-					 &old_desc_blk, &new_desc_blk, 0);
-
-			if (fs->super->s_feature_incompat &
-			    EXT2_FEATURE_INCOMPAT_META_BG)
-				old_desc_blocks = fs->super->s_first_meta_bg;
-			else
-				old_desc_blocks = fs->desc_blocks +
-					fs->super->s_reserved_gdt_blocks;
-
-			bitmap = 0;
-			if (i == super_blk)
-				bitmap = 1;
-			if (old_desc_blk && old_desc_blocks &&
-			    (i >= old_desc_blk) &&
-			    (i < old_desc_blk + old_desc_blocks))
-				bitmap = 1;
-			if (new_desc_blk &&
-			    (i == new_desc_blk))
-				bitmap = 1;
-			if (i == fs->group_desc[group].bg_block_bitmap)
-				bitmap = 1;
-			else if (i == fs->group_desc[group].bg_inode_bitmap)
-				bitmap = 1;
-			else if (i >= fs->group_desc[group].bg_inode_table &&
-				 (i < fs->group_desc[group].bg_inode_table
-				  + fs->inode_blocks_per_group))
-				bitmap = 1;
-			actual = (actual != 0);
-		} else
-			bitmap = ext2fs_fast_test_block_bitmap(fs->block_map, i);
-
-		if (actual == bitmap)
-			goto do_counts;
-
-		if (!actual && bitmap) {
-			/*
-			 * Block not used, but marked in use in the bitmap.
-			 */
-			problem = PR_5_BLOCK_UNUSED;
-		} else {
-			/*
-			 * Block used, but not marked in use in the bitmap.
-			 */
-			problem = PR_5_BLOCK_USED;
-
-			if (skip_group) {
-				struct problem_context pctx2;
-				pctx2.blk = i;
-				pctx2.group = group;
-				if (fix_problem(ctx, PR_5_BLOCK_UNINIT,&pctx2)){
-					fs->group_desc[group].bg_flags &=
-						~EXT2_BG_BLOCK_UNINIT;
-					skip_group = 0;
-				}
-			}
-		}
-		if (pctx.blk == NO_BLK) {
-			pctx.blk = pctx.blk2 = i;
-			save_problem = problem;
-		} else {
-			if ((problem == save_problem) &&
-			    (pctx.blk2 == i-1))
-				pctx.blk2++;
-			else {
-				print_bitmap_problem(ctx, save_problem, &pctx);
-				pctx.blk = pctx.blk2 = i;
-				save_problem = problem;
-			}
-		}
-		ctx->flags |= E2F_FLAG_PROG_SUPPRESS;
-		had_problem++;
-
-	do_counts:
-		if (!bitmap && (!skip_group || csum_flag)) {
-			group_free++;
-			free_blocks++;
+	for (group = 0; group < fs->group_desc_count; group++) {
+		first = ext2fs_group_first_block(fs, group);
+		last = ext2fs_group_last_block(fs, group);
+		i = first;
+		used = 0;
+		if (csum_flag &&
+		    (fs->group_desc[group].bg_flags & EXT2_BG_BLOCK_UNINIT)) {
+			nmeta = uninit_group_meta(fs, group, first, last, meta);
+			i = check_uninit_group(&bd, ctx->block_found_map,
+					       group, first, last, meta, nmeta,
+					       PR_5_BLOCK_UNINIT,
+					       EXT2_BG_BLOCK_UNINIT, &used);
 		}
-		blocks ++;
-		if ((blocks == fs->super->s_blocks_per_group) ||
-		    (i == fs->super->s_blocks_count-1)) {
-			free_array[group] = group_free;
-			group ++;
-			blocks = 0;
-			group_free = 0;
-			skip_group = 0;
-			if (ctx->progress)
-				if ((ctx->progress)(ctx, 5, group,
-						    fs->group_desc_count*2))
-					goto errout;
-			if (csum_flag &&
-			    (i != fs->super->s_blocks_count-1) &&
-			    (fs->group_desc[group].bg_flags &
-			     EXT2_BG_BLOCK_UNINIT))
-				skip_group++;
+		if (i <= last) {
+			if (diff_bitmaps(&bd, ctx->block_found_map,
+					 fs->block_map, i, last))
+				goto errout;
+			ext2fs_count_block_bitmap_range(fs->block_map, i,
+							last, &i);
+			used += i;
 		}
+		free_array[group] = last - first + 1 - used;
+		free_blocks += free_array[group];
+		if (ctx->progress)
+			if ((ctx->progress)(ctx, 5, group + 1,
+					    fs->group_desc_count*2))
+				goto errout;
 	}
 	if (pctx.blk != NO_BLK)
-		print_bitmap_problem(ctx, save_problem, &pctx);
-	if (had_problem)
+		print_bitmap_problem(ctx, bd.save_problem, &pctx);
+	if (bd.had_problem)
 		fixit = end_problem_latch(ctx, PR_LATCH_BBITMAP);
 	else
 		fixit = -1;
@@ -314,7 +447,7 @@ redo_counts:
 		ext2fs_mark_bb_dirty(fs);
 
 		/* Redo the counts */
-		blocks = 0; free_blocks = 0; group_free = 0; group = 0;
+		free_blocks = 0;
 		memset(free_array, 0, fs->group_desc_count * sizeof(int));
 		goto redo_counts;
 	} else if (fixit == 0)
@@ -355,28 +488,17 @@ errout:
 	ext2fs_free_mem(&free_array);
 }
 
-#define blk64_t blk_t
-#define ext2fs_bg_flags_test(fs, group, flag) \
-	(fs->group_desc[group].bg_flags & flag)
-#define ext2fs_bg_flags_clear(fs, group, flag) \
-	fs->group_desc[group].bg_flags &= ~flag
-#define ext2fs_blocks_count(sb) \
-	(sb)->s_blocks_count
-#define ext2fs_fast_test_block_bitmap2 ext2fs_fast_test_block_bitmap
-
 #ifdef EXT2FS_SNAPSHOT_EXCLUDE_BITMAP
 static void check_exclude_bitmaps(e2fsck_t ctx)
 {
 	ext2_filsys fs = ctx->fs;
-	blk64_t	i;
-	int	group = 0;
-	int	blocks = 0;
-	int	actual, bitmap;
+	blk_t	first, last, i, used;
+	dgrp_t	group;
 	struct problem_context	pctx;
-	int	problem, save_problem, fixit, had_problem;
+	struct bitmap_diff	bd;
+	int	fixit;
 	errcode_t	retval;
 	int		csum_flag;
-	int		skip_group = 0;
 
 	clear_problem_context(&pctx);
 
@@ -386,85 +508,34 @@ static void check_exclude_bitmaps(e2fsck_t ctx)
 
 	csum_flag = EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
 					       EXT4_FEATURE_RO_COMPAT_GDT_CSUM);
-redo_counts:
-	had_problem = 0;
-	save_problem = 0;
+	memset(&bd, 0, sizeof(bd));
+	bd.ctx = ctx;
+	bd.pctx = &pctx;
+	bd.used_problem = PR_5_BLOCK_EXCLUDED;
+	bd.unused_problem = PR_5_BLOCK_NOTEXCLUDED;
 	pctx.blk = pctx.blk2 = NO_BLK;
-	if (csum_flag &&
-	    (ext2fs_bg_flags_test(fs, group, EXT2_BG_BLOCK_UNINIT)))
-		skip_group++;
-	for (i = fs->super->s_first_data_block;
-	     i < ext2fs_blocks_count(fs->super);
-	     i++) {
-		actual = ext2fs_fast_test_block_bitmap2(ctx->block_excluded_map, i);
-
-		if (skip_group) {
-			bitmap = 0;
-			actual = (actual != 0);
-		} else
-			bitmap = ext2fs_fast_test_block_bitmap2(fs->exclude_map, i);
-
-		if (actual == bitmap)
-			goto do_counts;
-
-		if (!actual && bitmap) {
-			/*
-			 * Block not excluded, but marked in exclude bitmap.
-			 */
-			problem = PR_5_BLOCK_NOTEXCLUDED;
-		} else {
-			/*
-			 * Block excluded, but not marked in exclude bitmap.
-			 */
-			problem = PR_5_BLOCK_EXCLUDED;
-
-			if (skip_group) {
-				struct problem_context pctx2;
-				pctx2.blk = i;
-				pctx2.group = group;
-				if (fix_problem(ctx, PR_5_BLOCK_UNINIT,&pctx2)){
-					ext2fs_bg_flags_clear(fs, group, EXT2_BG_BLOCK_UNINIT);
-					skip_group = 0;
-				}
-			}
-		}
-		if (pctx.blk == NO_BLK) {
-			pctx.blk = pctx.blk2 = i;
-			save_problem = problem;
-		} else {
-			if ((problem == save_problem) &&
-			    (pctx.blk2 == i-1))
-				pctx.blk2++;
-			else {
-				print_bitmap_problem(ctx, save_problem, &pctx);
-				pctx.blk = pctx.blk2 = i;
-				save_problem = problem;
-			}
-		}
-		ctx->flags |= E2F_FLAG_PROG_SUPPRESS;
-		had_problem++;
-
-	do_counts:
-		blocks ++;
-		if ((blocks == fs->super->s_blocks_per_group) ||
-		    (i == fs->super->s_blocks_count-1)) {
-			group ++;
-			blocks = 0;
-			skip_group = 0;
-			if (ctx->progress)
-				if ((ctx->progress)(ctx, 5, group,
-						    fs->group_desc_count*2))
-					return;
-			if (csum_flag &&
-			    (i != ext2fs_blocks_count(fs->super)-1) &&
-			    ext2fs_bg_flags_test(fs, group,
-				    		EXT2_BG_BLOCK_UNINIT))
-				skip_group++;
-		}
+	for (group = 0; group < fs->group_desc_count; group++) {
+		first = ext2fs_group_first_block(fs, group);
+		last = ext2fs_group_last_block(fs, group);
+		i = first;
+		if (csum_flag &&
+		    (fs->group_desc[group].bg_flags & EXT2_BG_BLOCK_UNINIT))
+			i = check_uninit_group(&bd, ctx->block_excluded_map,
+					       group, first, last, NULL, 0,
+					       PR_5_BLOCK_UNINIT,
+					       EXT2_BG_BLOCK_UNINIT, &used);
+		if ((i <= last) &&
+		    diff_bitmaps(&bd, ctx->block_excluded_map,
+				 fs->exclude_map, i, last))
+			return;
+		if (ctx->progress)
+			if ((ctx->progress)(ctx, 5, group + 1,
+					    fs->group_desc_count*2))
+				return;
 	}
 	if (pctx.blk != NO_BLK)
-		print_bitmap_problem(ctx, save_problem, &pctx);
-	if (had_problem)
+		print_bitmap_problem(ctx, bd.save_problem, &pctx);
+	if (bd.had_problem)
 		fixit = end_problem_latch(ctx, PR_LATCH_XBITMAP);
 	else
 		fixit = -1;
@@ -494,20 +565,16 @@ redo_counts:
 static void check_inode_bitmaps(e2fsck_t ctx)
 {
 	ext2_filsys fs = ctx->fs;
-	ext2_ino_t	i;
+	ext2_ino_t	first, last, i, j, count, used;
 	unsigned int	free_inodes = 0;
-	int		group_free = 0;
-	int		dirs_count = 0;
-	int		group = 0;
-	unsigned int	inodes = 0;
+	dgrp_t		group;
 	int		*free_array;
 	int		*dir_array;
-	int		actual, bitmap;
 	errcode_t	retval;
 	struct problem_context	pctx;
-	int		problem, save_problem, fixit, had_problem;
+	struct bitmap_diff	bd;
+	int		fixit;
 	int		csum_flag;
-	int		skip_group = 0;
 
 	clear_problem_context(&pctx);
 	free_array = (int *) e2fsck_allocate_memory(ctx,
@@ -545,100 +612,67 @@ static void check_inode_bitmaps(e2fsck_t ctx)
 
 	csum_flag = EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
 					       EXT4_FEATURE_RO_COMPAT_GDT_CSUM);
+	memset(&bd, 0, sizeof(bd));
+	bd.ctx = ctx;
+	bd.pctx = &pctx;
+	bd.used_problem = PR_5_INODE_USED;
+	bd.unused_problem = PR_5_INODE_UNUSED;
+	bd.inodes = 1;
 redo_counts:
-	had_problem = 0;
-	save_problem = 0;
+	bd.had_problem = 0;
+	bd.save_problem = 0;
 	pctx.ino = pctx.ino2 = 0;
-	if (csum_flag &&
-	    (fs->group_desc[group].bg_flags & EXT2_BG_INODE_UNINIT))
-		skip_group++;
-
-	/* Protect loop from wrap-around if inodes_count is maxed */
-	for (i = 1; i <= fs->super->s_inodes_count && i > 0; i++) {
-		actual = ext2fs_fast_test_inode_bitmap(ctx->inode_used_map, i);
-		if (skip_group)
-			bitmap = 0;
-		else
-			bitmap = ext2fs_fast_test_inode_bitmap(fs->inode_map, i);
-		if (actual == bitmap)
-			goto do_counts;
-
-		if (!actual && bitmap) {
-			/*
-			 * Inode wasn't used, but marked in bitmap
-			 */
-			problem = PR_5_INODE_UNUSED;
-		} else /* if (actual && !bitmap) */ {
-			/*
-			 * Inode used, but not in bitmap
-			 */
-			problem = PR_5_INODE_USED;
-
-			/* We should never hit this, because it means that
-			 * inodes were marked in use that weren't noticed
-			 * in pass1 or pass 2. It is easier to fix the problem
-			 * than to kill e2fsck and leave the user stuck. */
-			if (skip_group) {
-				struct problem_context pctx2;
-				pctx2.blk = i;
-				pctx2.group = group;
-				if (fix_problem(ctx, PR_5_INODE_UNINIT,&pctx2)){
-					fs->group_desc[group].bg_flags &=
-						~EXT2_BG_INODE_UNINIT;
-					skip_group = 0;
-				}
+	for (group = 0; group < fs->group_desc_count; group++) {
+		first = group * fs->super->s_inodes_per_group + 1;
+		last = first + fs->super->s_inodes_per_group - 1;
+		if (last > fs->super->s_inodes_count)
+			last = fs->super->s_inodes_count;
+		i = first;
+		used = 0;
+		/*
+		 * Inodes found in use in an INODE_UNINIT group should
+		 * never happen, because it means that inodes were marked
+		 * in use that weren't noticed in pass1 or pass 2.  It is
+		 * easier to fix the problem than to kill e2fsck and
+		 * leave the user stuck.
+		 */
+		if (csum_flag &&
+		    (fs->group_desc[group].bg_flags & EXT2_BG_INODE_UNINIT))
+			i = check_uninit_group(&bd, ctx->inode_used_map,
+					       group, first, last, NULL, 0,
+					       PR_5_INODE_UNINIT,
+					       EXT2_BG_INODE_UNINIT, &used);
+		if (i <= last) {
+			if (diff_bitmaps(&bd, ctx->inode_used_map,
+					 fs->inode_map, i, last))
+				goto errout;
+			/* Count the directories among the inodes in use */
+			while (!ext2fs_find_first_set_inode_bitmap(fs->inode_map,
+							i, last, &i)) {
+				if (ext2fs_find_first_zero_inode_bitmap(
+					    fs->inode_map, i, last, &j))
+					j = last + 1;
+				used += j - i;
+				ext2fs_count_inode_bitmap_range(ctx->inode_dir_map,
+							i, j - 1, &count);
+				dir_array[group] += count;
+				if (j > last)
+					break;
+				i = j;
 			}
 		}
-		if (pctx.ino == 0) {
-			pctx.ino = pctx.ino2 = i;
-			save_problem = problem;
-		} else {
-			if ((problem == save_problem) &&
-			    (pctx.ino2 == i-1))
-				pctx.ino2++;
-			else {
-				print_bitmap_problem(ctx, save_problem, &pctx);
-				pctx.ino = pctx.ino2 = i;
-				save_problem = problem;
-			}
-		}
-		ctx->flags |= E2F_FLAG_PROG_SUPPRESS;
-		had_problem++;
-
-do_counts:
-		if (bitmap) {
-			if (ext2fs_test_inode_bitmap(ctx->inode_dir_map, i))
-				dirs_count++;
-		} else if (!skip_group || csum_flag) {
-			group_free++;
-			free_inodes++;
-		}
-		inodes++;
-		if ((inodes == fs->super->s_inodes_per_group) ||
-		    (i == fs->super->s_inodes_count)) {
-			free_array[group] = group_free;
-			dir_array[group] = dirs_count;
-			group ++;
-			inodes = 0;
-			skip_group = 0;
-			group_free = 0;
-			dirs_count = 0;
-			if (ctx->progress)
-				if ((ctx->progress)(ctx, 5,
-					    group + fs->group_desc_count,
+		free_array[group] = last - first + 1 - used;
+		free_inodes += free_array[group];
+		if (ctx->progress)
+			if ((ctx->progress)(ctx, 5,
+					    group + 1 + fs->group_desc_count,
 					    fs->group_desc_count*2))
-					goto errout;
-			if (csum_flag &&
-			    (i != fs->super->s_inodes_count) &&
-			    (fs->group_desc[group].bg_flags &
-			     EXT2_BG_INODE_UNINIT))
-				skip_group++;
-		}
+				goto errout;
 	}
 	if (pctx.ino)
-		print_bitmap_problem(ctx, save_problem, &pctx);
+		print_bitmap_problem(ctx, bd.save_problem, &pctx);
 
-	if (had_problem)
+	if (bd.had_problem)
 		fixit = end_problem_latch(ctx, PR_LATCH_IBITMAP);
 	else
 		fixit = -1;
@@ -658,8 +692,7 @@ do_counts:
 		ext2fs_mark_ib_dirty(fs);
 
 		/* redo counts */
-		inodes = 0; free_inodes = 0; group_free = 0;
-		dirs_count = 0; group = 0;
+		free_inodes = 0;
 		memset(free_array, 0, fs->group_desc_count * sizeof(int));
 		memset(dir_array, 0, fs->group_desc_count * sizeof(int));
 		goto redo_counts;
@@ -996,6 +996,7 @@ int main (int argc, char *argv[])
 	int sysval, sys_page_size = 4096;
 	__u32 features[3];
 	char *cp;
+	unsigned int icache_blocks;
 
 	clear_problem_context(&pctx);
 #ifdef MTRACE
@@ -1049,11 +1050,15 @@ int main (int argc, char *argv[])
 	ctx->superblock = ctx->use_superblock;
 restart:
 #ifdef CONFIG_TESTIO_DEBUG
-	if (getenv("TEST_IO_FLAGS") || getenv("TEST_IO_BLOCK")) {
+	if (getenv("TEST_IO_FLAGS") || getenv("TEST_IO_BLOCK") ||
+	    getenv("TEST_IO_TRACE")) {
 		io_ptr = test_io_manager;
 		test_io_backing_manager = unix_io_manager;
 	} else
 #endif
+	if (ctx->options & E2F_OPT_READONLY)
+		io_ptr = mmap_io_manager;
+	else
 		io_ptr = unix_io_manager;
 	flags = EXT2_FLAG_NOFREE_ON_ERROR;
 	if ((ctx->options & E2F_OPT_READONLY) == 0)
@@ -1198,6 +1203,9 @@ failure:
 	ctx->fs = fs;
 	fs->priv_data = ctx;
 	fs->now = ctx->now;
+	profile_get_uint(ctx->profile, "options", "inode_cache_blocks",
+			 0, 256, &icache_blocks);
+	ext2fs_create_inode_cache(fs, icache_blocks);
 	sb = fs->super;
 	if (sb->s_rev_level > E2FSCK_CURRENT_REV) {
 		com_err(ctx->program_name, EXT2_ET_REV_TOO_HIGH,
@@ -1385,6 +1393,12 @@ print_unsupp_features:
 	else
 		journal_size = -1;
 
+	/*
+	 * Now that the journal has been dealt with, let updates to
+	 * the inode tables (such as clearing thousands of bad inodes)
+	 * collect in the inode cache and be written back together.
+	 */
+	fs->flags |= EXT2_FLAG_ICACHE_WRITEBACK;
 	run_result = e2fsck_run(ctx);
 	e2fsck_clear_progbar(ctx);
 
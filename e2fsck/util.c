@@ -37,6 +37,7 @@
 #endif
 
 #include "e2fsck.h"
+#include "e2p/e2p.h"
 
 extern e2fsck_t e2fsck_global_ctx;   /* Try your very best not to use this! */
 
@@ -48,9 +49,10 @@ void fatal_error(e2fsck_t ctx, const char *msg)
 	if (msg)
 		fprintf (stderr, "e2fsck: %s\n", msg);
 	if (ctx->fs && ctx->fs->io) {
-		if (ctx->fs->io->magic == EXT2_ET_MAGIC_IO_CHANNEL)
+		if (ctx->fs->io->magic == EXT2_ET_MAGIC_IO_CHANNEL) {
+			ext2fs_write_icache(ctx->fs);
 			io_channel_flush(ctx->fs->io);
-		else
+		} else
 			fprintf(stderr, "e2fsck: io manager magic bad!\n");
 	}
 	ctx->flags |= E2F_FLAG_ABORT;
@@ -210,6 +212,36 @@ int ask (e2fsck_t ctx, const char * string, int def)
 	return ask_yn(string, def);
 }
 
+/*
+ * Allocate a bitmap stored as the given type (EXT2FS_BMAP_*).  Sparse
+ * block maps should use EXT2FS_BMAP_EXTENT; inode maps, which are
+ * often sparse but tested and set an inode at a time, should use
+ * EXT2FS_BMAP_CONTAINER.
+ */
+errcode_t e2fsck_allocate_inode_bitmap(ext2_filsys fs, const char *descr,
+				       int type, ext2fs_inode_bitmap *ret)
+{
+	errcode_t	retval;
+	int		save_type = fs->default_bitmap_type;
+
+	fs->default_bitmap_type = type;
+	retval = ext2fs_allocate_inode_bitmap(fs, descr, ret);
+	fs->default_bitmap_type = save_type;
+	return retval;
+}
+
+errcode_t e2fsck_allocate_block_bitmap(ext2_filsys fs, const char *descr,
+				       int type, ext2fs_block_bitmap *ret)
+{
+	errcode_t	retval;
+	int		save_type = fs->default_bitmap_type;
+
+	fs->default_bitmap_type = type;
+	retval = ext2fs_allocate_block_bitmap(fs, descr, ret);
+	fs->default_bitmap_type = save_type;
+	return retval;
+}
+
 void e2fsck_read_bitmaps(e2fsck_t ctx)
 {
 	ext2_filsys fs = ctx->fs;
@@ -290,14 +322,11 @@ void init_resource_track(struct resource_track *track, io_channel channel)
 	track->user_start.tv_sec = track->user_start.tv_usec = 0;
 	track->system_start.tv_sec = track->system_start.tv_usec = 0;
 #endif
-	track->bytes_read = 0;
-	track->bytes_written = 0;
+	memset(&track->io_start, 0, sizeof(track->io_start));
 	if (channel && channel->manager && channel->manager->get_stats)
 		channel->manager->get_stats(channel, &io_start);
-	if (io_start) {
-		track->bytes_read = io_start->bytes_read;
-		track->bytes_written = io_start->bytes_written;
-	}
+	if (io_start)
+		track->io_start = *io_start;
 }
 
 #ifdef __GNUC__
@@ -368,14 +397,26 @@ void print_resource_track(e2fsck_t ctx, const char *desc,
 
 		channel->manager->get_stats(channel, &delta);
 		if (delta) {
-			bytes_read = delta->bytes_read - track->bytes_read;
+			bytes_read = delta->bytes_read -
+				track->io_start.bytes_read;
 			bytes_written = delta->bytes_written -
-				track->bytes_written;
+				track->io_start.bytes_written;
 		}
 		printf("I/O read: %lluMB, write: %lluMB, rate: %.2fMB/s\n",
 		       mbytes(bytes_read), mbytes(bytes_written),
 		       (double)mbytes(bytes_read + bytes_written) /
 		       timeval_subtract(&time_end, &track->time_start));
+		/* With -t -t, show where the I/O time went as well */
+		if (delta && (ctx->options & E2F_OPT_TIME2)) {
+			char prefix[80];
+
+			prefix[0] = 0;
+			if (desc)
+				snprintf(prefix, sizeof(prefix), "%s: ", desc);
+			e2p_print_io_stats(stdout, prefix, delta,
+					   &track->io_start,
+					   channel->block_size);
+		}
 	}
 }
 #endif /* RESOURCE_TRACK */
@@ -81,3 +81,8 @@ char *e2p_os2string(int os_type);
 int e2p_string2os(char *str);
 
 unsigned int e2p_percent(int percent, unsigned int base);
+
+struct struct_io_stats;
+void e2p_print_io_stats(FILE *f, const char *prefix,
+			struct struct_io_stats *stats,
+			struct struct_io_stats *since, int blocksize);
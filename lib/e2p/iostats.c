@@ -0,0 +1,103 @@
+/*
+ * iostats.c		- Print the statistics kept by an I/O manager
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "e2p.h"
+#include <ext2fs/ext2fs.h>
+
+#define STATS_FIELDS		8	/* up to and including seek_distance */
+#define MAX_FIELDS	((sizeof(struct struct_io_stats) - \
+			  offsetof(struct struct_io_stats, bytes_read)) / \
+			 sizeof(unsigned long long))
+#define mbytes(x)		(((x) + 1048575) / 1048576)
+
+static double per_call(unsigned long long bytes, unsigned long long calls,
+		       int blocksize)
+{
+	if (!calls || !blocksize)
+		return 0.0;
+	return (double) bytes / blocksize / calls;
+}
+
+static void print_latency(FILE *f, int bucket)
+{
+	unsigned long long usec = 1ULL << bucket;
+
+	if (bucket == IO_STATS_LATENCY_BUCKETS - 1) {
+		fputs(">=", f);
+		usec >>= 1;
+	} else
+		fputc('<', f);
+	if (usec < 1000)
+		fprintf(f, "%lluus", usec);
+	else if (usec < 1000000)
+		fprintf(f, "%llums", usec / 1000);
+	else
+		fprintf(f, "%llus", usec / 1000000);
+}
+
+/*
+ * Print the I/O call counts, cache and seek statistics, and latency
+ * histogram in stats (the byte counts are left to the caller).  If
+ * since is non-NULL, only what happened after it was taken is
+ * printed.  Each line starts with prefix, which may be NULL.
+ */
+void e2p_print_io_stats(FILE *f, const char *prefix,
+			struct struct_io_stats *stats,
+			struct struct_io_stats *since, int blocksize)
+{
+	struct struct_io_stats	d;
+	unsigned long long	*p, *q;
+	int			i, n, fields;
+
+	if (!stats)
+		return;
+	if (!prefix)
+		prefix = "";
+	fields = stats->num_fields;
+	if (fields > (int) MAX_FIELDS)
+		fields = MAX_FIELDS;
+
+	memset(&d, 0, sizeof(d));
+	p = &d.bytes_read;
+	memcpy(p, &stats->bytes_read, fields * sizeof(unsigned long long));
+	if (since) {
+		q = &since->bytes_read;
+		for (i = 0; i < fields && i < since->num_fields; i++)
+			p[i] -= q[i];
+	}
+
+	if (fields < STATS_FIELDS)
+		return;
+	fprintf(f, "%sI/O calls read: %llu (%.1f blocks/call), "
+		"write: %llu (%.1f blocks/call)\n", prefix,
+		d.read_calls, per_call(d.bytes_read, d.read_calls, blocksize),
+		d.write_calls,
+		per_call(d.bytes_written, d.write_calls, blocksize));
+	fprintf(f, "%sI/O cache hits: %llu, misses: %llu, "
+		"seeks: %llu (%lluMB)\n", prefix, d.cache_hits,
+		d.cache_misses, d.seeks, mbytes(d.seek_distance));
+	if (fields < STATS_FIELDS + IO_STATS_LATENCY_BUCKETS)
+		return;
+	fprintf(f, "%sI/O latency:", prefix);
+	for (i = 0, n = 0; i < IO_STATS_LATENCY_BUCKETS; i++) {
+		if (!d.latency[i])
+			continue;
+		if (n && (n % 6) == 0)
+			fprintf(f, "\n%s            ", prefix);
+		fputc(' ', f);
+		print_latency(f, i);
+		fprintf(f, ": %llu", d.latency[i]);
+		n++;
+	}
+	fputc('\n', f);
+}
@@ -10,11 +10,13 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #if HAVE_UNISTD_H
 #include <unistd.h>
 #endif
 #include <time.h>
 #include <string.h>
+#include <errno.h>
 #if HAVE_SYS_STAT_H
 #include <sys/stat.h>
 #endif
@@ -24,11 +26,13 @@
 
 #include "ext2_fs.h"
 #include "ext2fs.h"
+#include "gen_bitmap.h"
 
 /*
- * Check for uninit block bitmaps and deal with them appropriately
+ * Check for uninit block bitmaps and deal with them appropriately;
+ * returns true if the group's bits had to be filled in
  */
-static void check_block_uninit(ext2_filsys fs, ext2fs_block_bitmap map,
+static int check_block_uninit(ext2_filsys fs, ext2fs_block_bitmap map,
 			  dgrp_t group)
 {
 	blk_t		i;
@@ -38,7 +42,7 @@ static void check_block_uninit(ext2_filsys fs, ext2fs_block_bitmap map,
 	if (!(EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
 					 EXT4_FEATURE_RO_COMPAT_GDT_CSUM)) ||
 	    !(fs->group_desc[group].bg_flags & EXT2_BG_BLOCK_UNINIT))
-		return;
+		return 0;
 
 	blk = (group * fs->super->s_blocks_per_group) +
 		fs->super->s_first_data_block;
@@ -69,6 +73,7 @@ static void check_block_uninit(ext2_filsys fs, ext2fs_block_bitmap map,
 	}
 	fs->group_desc[group].bg_flags &= ~EXT2_BG_BLOCK_UNINIT;
 	ext2fs_group_desc_csum_set(fs, group);
+	return 1;
 }
 
 /*
@@ -92,9 +97,58 @@ static void check_inode_uninit(ext2_filsys fs, ext2fs_inode_bitmap map,
 	check_block_uninit(fs, fs->block_map, group);
 }
 
+/*
+ * Search a group at a time from start_inode for a free inode,
+ * wrapping around to the first inode, until we get back to where we
+ * started.  If skip_full is set, groups whose descriptors say they
+ * have no free inodes aren't searched.
+ */
+static errcode_t find_free_inode(ext2_filsys fs, ext2fs_inode_bitmap map,
+				 ext2_ino_t start_inode, int skip_full,
+				 ext2_ino_t *ret)
+{
+	ext2_ino_t	i = start_inode, end;
+	ext2_ino_t	ipg = EXT2_INODES_PER_GROUP(fs->super);
+	dgrp_t		group;
+	int		wrapped = 0;
+	errcode_t	retval;
+
+	while (1) {
+		group = (i - 1) / ipg;
+		if (((i - 1) % ipg) == 0)
+			check_inode_uninit(fs, map, group);
+
+		end = (group + 1) * ipg;
+		if (end > fs->super->s_inodes_count)
+			end = fs->super->s_inodes_count;
+		if (wrapped && end >= start_inode)
+			end = start_inode - 1;
+
+		if (!skip_full || fs->group_desc[group].bg_free_inodes_count) {
+			retval = ext2fs_find_clear_run(map, i, end, 1, ret);
+			if (retval != ENOENT)
+				return retval;
+		}
+
+		if (end >= fs->super->s_inodes_count) {
+			if (wrapped)
+				break;
+			wrapped = 1;
+			i = EXT2_FIRST_INODE(fs->super);
+		} else
+			i = end + 1;
+		if (wrapped && i >= start_inode)
+			break;
+	}
+	return ENOENT;
+}
+
 /*
  * Right now, just search forward from the parent directory's block
- * group to find the next free inode.
+ * group to find the next free inode.  The bitmap keeps an index of
+ * where each group's first free inode is, so allocating many inodes
+ * in a row doesn't rescan the ones already handed out, and full
+ * groups are skipped.
  *
  * Should have a special policy for directories.
  */
@@ -103,8 +157,8 @@ errcode_t ext2fs_new_inode(ext2_filsys fs, ext2_ino_t dir,
 			   ext2fs_inode_bitmap map, ext2_ino_t *ret)
 {
 	ext2_ino_t	dir_group = 0;
-	ext2_ino_t	i;
 	ext2_ino_t	start_inode;
+	errcode_t	retval;
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 
@@ -121,24 +175,22 @@ errcode_t ext2fs_new_inode(ext2_filsys fs, ext2_ino_t dir,
 		start_inode = EXT2_FIRST_INODE(fs->super);
 	if (start_inode > fs->super->s_inodes_count)
 		return EXT2_ET_INODE_ALLOC_FAIL;
-	i = start_inode;
-
-	do {
-		if (((i - 1) % EXT2_INODES_PER_GROUP(fs->super)) == 0)
-			check_inode_uninit(fs, map, (i - 1) /
-					   EXT2_INODES_PER_GROUP(fs->super));
-
-		if (!ext2fs_fast_test_inode_bitmap(map, i))
-			break;
-		i++;
-		if (i > fs->super->s_inodes_count)
-			i = EXT2_FIRST_INODE(fs->super);
-	} while (i != start_inode);
-
-	if (ext2fs_test_inode_bitmap(map, i))
+	ext2fs_index_bitmap_runs(map, EXT2_INODES_PER_GROUP(fs->super));
+
+	/*
+	 * The descriptors' free counts only describe the filesystem's
+	 * own bitmap, and may be wrong if it is being repaired, so only
+	 * trust them to skip full groups the first time around.
+	 */
+	if (map == fs->inode_map) {
+		retval = find_free_inode(fs, map, start_inode, 1, ret);
+		if (retval != ENOENT)
+			return retval;
+	}
+	retval = find_free_inode(fs, map, start_inode, 0, ret);
+	if (retval == ENOENT)
 		return EXT2_ET_INODE_ALLOC_FAIL;
-	*ret = i;
-	return 0;
+	return retval;
 }
 
 /*
@@ -148,7 +200,10 @@ errcode_t ext2fs_new_inode(ext2_filsys fs, ext2_ino_t dir,
 errcode_t ext2fs_new_block(ext2_filsys fs, blk_t goal,
 			   ext2fs_block_bitmap map, blk_t *ret)
 {
-	blk_t	i;
+	blk_t		i, end, last;
+	dgrp_t		group;
+	int		wrapped = 0;
+	errcode_t	retval;
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 
@@ -158,25 +213,36 @@ errcode_t ext2fs_new_block(ext2_filsys fs, blk_t goal,
 		return EXT2_ET_NO_BLOCK_BITMAP;
 	if (!goal || (goal >= fs->super->s_blocks_count))
 		goal = fs->super->s_first_data_block;
+	last = fs->super->s_blocks_count - 1;
 	i = goal;
-	check_block_uninit(fs, map,
-			   (i - fs->super->s_first_data_block) /
-			   EXT2_BLOCKS_PER_GROUP(fs->super));
-	do {
-		if (((i - fs->super->s_first_data_block) %
-		     EXT2_BLOCKS_PER_GROUP(fs->super)) == 0)
-			check_block_uninit(fs, map,
-					   (i - fs->super->s_first_data_block) /
-					   EXT2_BLOCKS_PER_GROUP(fs->super));
-
-		if (!ext2fs_fast_test_block_bitmap(map, i)) {
-			*ret = i;
-			return 0;
-		}
-		i++;
-		if (i >= fs->super->s_blocks_count)
+
+	/*
+	 * Search a group at a time, wrapping around to the first data
+	 * block, until we get back to the goal.
+	 */
+	while (1) {
+		group = (i - fs->super->s_first_data_block) /
+			EXT2_BLOCKS_PER_GROUP(fs->super);
+		check_block_uninit(fs, map, group);
+
+		end = ext2fs_group_last_block(fs, group);
+		if (wrapped && end >= goal)
+			end = goal - 1;
+
+		retval = ext2fs_find_first_zero_block_bitmap(map, i, end, ret);
+		if (retval != ENOENT)
+			return retval;
+
+		if (end >= last) {
+			if (wrapped)
+				break;
+			wrapped = 1;
 			i = fs->super->s_first_data_block;
-	} while (i != goal);
+		} else
+			i = end + 1;
+		if (wrapped && i >= goal)
+			break;
+	}
 	return EXT2_ET_BLOCK_ALLOC_FAIL;
 }
 
@@ -231,10 +297,90 @@ fail:
 	return retval;
 }
 
+/*
+ * Find a range of free blocks, searching forward from goal and
+ * wrapping around to the first data block.  Unless
+ * EXT2_NEWRANGE_MIN_LENGTH is given, the first free run found is
+ * returned even if it is shorter than len.  The blocks are not marked
+ * as in use.  The bitmap keeps an index of the free runs in each
+ * group, so that groups too full to hold the range are skipped.
+ */
+errcode_t ext2fs_new_range(ext2_filsys fs, blk_t goal, blk_t len,
+			   int flags, ext2fs_block_bitmap map,
+			   blk_t *ret_start, blk_t *ret_len)
+{
+	blk_t		first, last, start, next, want;
+	__u64		end;
+	dgrp_t		group;
+	errcode_t	retval;
+	int		again;
+
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+
+	if (!map)
+		map = fs->block_map;
+	if (!map)
+		return EXT2_ET_NO_BLOCK_BITMAP;
+	if (!len)
+		return EXT2_ET_INVALID_ARGUMENT;
+	first = fs->super->s_first_data_block;
+	last = ext2fs_get_block_bitmap_end(map);
+	if (last >= fs->super->s_blocks_count)
+		last = fs->super->s_blocks_count - 1;
+	if ((goal < first) || (goal > last)) {
+		if (flags & EXT2_NEWRANGE_FIXED_GOAL)
+			return EXT2_ET_BLOCK_ALLOC_FAIL;
+		goal = first;
+	}
+	ext2fs_index_bitmap_runs(map, EXT2_BLOCKS_PER_GROUP(fs->super));
+	want = (flags & EXT2_NEWRANGE_MIN_LENGTH) ? len : 1;
+
+	do {
+		retval = ENOENT;
+		if ((__u64) goal + want - 1 <= last)
+			retval = ext2fs_find_clear_run(map, goal,
+				(flags & EXT2_NEWRANGE_FIXED_GOAL) ?
+				goal + want - 1 : last, want, &start);
+		if ((retval == ENOENT) && (goal > first) &&
+		    !(flags & EXT2_NEWRANGE_FIXED_GOAL)) {
+			end = (__u64) goal + want - 2;
+			retval = ext2fs_find_clear_run(map, first,
+				(end > last) ? last : end, want, &start);
+		}
+		if (retval == ENOENT)
+			return EXT2_ET_BLOCK_ALLOC_FAIL;
+		if (retval)
+			return retval;
+
+		end = (__u64) start + len - 1;
+		if (end > last)
+			end = last;
+		if (ext2fs_find_first_set_block_bitmap(map, start, end,
+						       &next) == 0)
+			end = next - 1;
+
+		/*
+		 * The blocks of uninitialized groups can only be handed
+		 * out once the groups' bitmaps have been filled in; if
+		 * that marks some of them in use, look again.
+		 */
+		again = 0;
+		for (group = ext2fs_group_of_blk(fs, start);
+		     group <= (dgrp_t) ext2fs_group_of_blk(fs, end); group++)
+			again |= check_block_uninit(fs, map, group);
+	} while (again);
+
+	*ret_start = start;
+	*ret_len = end - start + 1;
+	return 0;
+}
+
 errcode_t ext2fs_get_free_blocks(ext2_filsys fs, blk_t start, blk_t finish,
 				 int num, ext2fs_block_bitmap map, blk_t *ret)
 {
-	blk_t	b = start;
+	blk_t		b = start, last;
+	__u64		end;
+	errcode_t	retval;
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 
@@ -245,18 +391,33 @@ errcode_t ext2fs_get_free_blocks(ext2_filsys fs, blk_t start, blk_t finish,
 	if (!b)
 		b = fs->super->s_first_data_block;
 	if (!finish)
-		finish = start;
+		finish = b;
 	if (!num)
 		num = 1;
-	do {
-		if (b+num-1 > fs->super->s_blocks_count)
-			b = fs->super->s_first_data_block;
-		if (ext2fs_fast_test_block_bitmap_range(map, b, num)) {
-			*ret = b;
-			return 0;
-		}
-		b++;
-	} while (b != finish);
+	last = ext2fs_get_block_bitmap_end(map);
+	if (last >= fs->super->s_blocks_count)
+		last = fs->super->s_blocks_count - 1;
+	ext2fs_index_bitmap_runs(map, EXT2_BLOCKS_PER_GROUP(fs->super));
+
+	/*
+	 * The range may start anywhere from b up to (but not including)
+	 * finish, wrapping around to the first data block, but may not
+	 * run off the end of the filesystem.
+	 */
+	if (b >= finish) {
+		retval = ext2fs_find_clear_run(map, b, last, num, ret);
+		if (retval != ENOENT)
+			return retval;
+		b = fs->super->s_first_data_block;
+	}
+	if (b < finish) {
+		end = (__u64) finish + num - 2;
+		retval = ext2fs_find_clear_run(map, b,
+					       (end > last) ? last : end,
+					       num, ret);
+		if (retval != ENOENT)
+			return retval;
+	}
 	return EXT2_ET_BLOCK_ALLOC_FAIL;
 }
 
@@ -276,3 +437,163 @@ void ext2fs_set_alloc_block_callback(ext2_filsys fs,
 
 	fs->get_alloc_block = func;
 }
+
+#ifdef DEBUG
+/*
+ * Churn a block bitmap with its free run index, and check
+ * ext2fs_find_clear_run() and ext2fs_new_range() against a plain
+ * search of the bits.
+ */
+#define TEST_BLOCKS	20000
+#define TEST_GROUP	1024
+
+/* The first run of len clear bits from start to end, found bit by bit */
+static errcode_t slow_clear_run(ext2fs_block_bitmap map, blk_t start,
+				blk_t end, blk_t len, blk_t *out)
+{
+	__u64	p;
+	blk_t	i;
+
+	for (p = start; p + len - 1 <= end; p++) {
+		for (i = 0; i < len; i++)
+			if (ext2fs_test_block_bitmap(map, p + i))
+				break;
+		if (i == len) {
+			*out = p;
+			return 0;
+		}
+		p += i;
+	}
+	return ENOENT;
+}
+
+static errcode_t slow_new_range(ext2_filsys fs, blk_t goal, blk_t len,
+				int flags, ext2fs_block_bitmap map,
+				blk_t *ret_start, blk_t *ret_len)
+{
+	blk_t	first = fs->super->s_first_data_block;
+	blk_t	last = fs->super->s_blocks_count - 1;
+	blk_t	want = (flags & EXT2_NEWRANGE_MIN_LENGTH) ? len : 1;
+	blk_t	start, n;
+	__u64	end;
+
+	if ((goal < first) || (goal > last)) {
+		if (flags & EXT2_NEWRANGE_FIXED_GOAL)
+			return EXT2_ET_BLOCK_ALLOC_FAIL;
+		goal = first;
+	}
+	if (flags & EXT2_NEWRANGE_FIXED_GOAL) {
+		if (slow_clear_run(map, goal, last, want, &start) ||
+		    start != goal)
+			return EXT2_ET_BLOCK_ALLOC_FAIL;
+	} else if (slow_clear_run(map, goal, last, want, &start)) {
+		end = (__u64) goal + want - 2;
+		if ((goal == first) ||
+		    slow_clear_run(map, first, (end > last) ? last : end,
+				   want, &start))
+			return EXT2_ET_BLOCK_ALLOC_FAIL;
+	}
+	for (n = 0; n < len && start + n <= last; n++)
+		if (ext2fs_test_block_bitmap(map, start + n))
+			break;
+	*ret_start = start;
+	*ret_len = n;
+	return 0;
+}
+
+static int test_bitmap_type(ext2_filsys fs, int type)
+{
+	ext2fs_block_bitmap map;
+	errcode_t	retval, ret1, ret2;
+	blk_t		arg, num, end, out1, out2, len1, len2;
+	int		i, op, flags, failed = 0;
+
+	fs->default_bitmap_type = type;
+	retval = ext2fs_allocate_block_bitmap(fs, "test", &map);
+	if (!retval)
+		retval = ext2fs_index_bitmap_runs(map, TEST_GROUP);
+	if (retval) {
+		com_err("tst_alloc", retval, "while allocating bitmap");
+		exit(1);
+	}
+
+	srandom(type);
+	for (i = 0; i < 40000 && failed < 5; i++) {
+		op = random() % 100;
+		arg = 1 + random() % (TEST_BLOCKS - 1);
+		num = 1 + random() % ((op % 3) ? 40 : 1500);
+		if (arg + num > TEST_BLOCKS)
+			num = TEST_BLOCKS - arg;
+		/* Fill up and empty out again now and then */
+		if ((i / 5000) & 1 ? op < 40 : op < 25)
+			ext2fs_mark_block_bitmap_range(map, arg, num);
+		else if ((i / 5000) & 1 ? op < 45 : op < 40)
+			ext2fs_unmark_block_bitmap_range(map, arg, num);
+		else if (op < 50)
+			ext2fs_mark_block_bitmap(map, arg);
+		else if (op < 55)
+			ext2fs_unmark_block_bitmap(map, arg);
+		else if (op < 75) {
+			end = arg + random() % (TEST_BLOCKS - arg);
+			out1 = out2 = 0;
+			ret1 = slow_clear_run(map, arg, end, num, &out1);
+			ret2 = ext2fs_find_clear_run(map, arg, end, num,
+						     &out2);
+			if (ret1 != ret2 || out1 != out2) {
+				printf("find_clear_run(%u, %u, %u): "
+				       "%ld/%u, expected %ld/%u\n", arg, end,
+				       num, ret2, out2, ret1, out1);
+				failed++;
+			}
+		} else {
+			/* Goals just past the end fall back to the start */
+			if (op > 95)
+				arg = TEST_BLOCKS - 1 + (op - 95);
+			flags = random() % 4;
+			out1 = out2 = len1 = len2 = 0;
+			ret1 = slow_new_range(fs, arg, num, flags, map,
+					      &out1, &len1);
+			ret2 = ext2fs_new_range(fs, arg, num, flags, map,
+						&out2, &len2);
+			if (ret1 != ret2 || out1 != out2 || len1 != len2) {
+				printf("new_range(%u, %u, %d): %ld/%u+%u, "
+				       "expected %ld/%u+%u\n", arg, num,
+				       flags, ret2, out2, len2, ret1, out1,
+				       len1);
+				failed++;
+			}
+		}
+	}
+	ext2fs_free_block_bitmap(map);
+	return failed;
+}
+
+int main(int argc, char **argv)
+{
+	struct ext2_super_block param;
+	ext2_filsys		fs;
+	errcode_t		retval;
+	int			failed;
+
+	add_error_table(&et_ext2_error_table);
+	memset(&param, 0, sizeof(param));
+	param.s_blocks_count = TEST_BLOCKS;
+	param.s_blocks_per_group = TEST_GROUP;
+	retval = ext2fs_initialize("test fs", 0, &param,
+				   test_io_manager, &fs);
+	if (retval) {
+		com_err("tst_alloc", retval, "while initializing filesystem");
+		exit(1);
+	}
+
+	failed = test_bitmap_type(fs, EXT2FS_BMAP_BITARRAY);
+	failed += test_bitmap_type(fs, EXT2FS_BMAP_EXTENT);
+	ext2fs_free(fs);
+	if (failed) {
+		printf("Free run search test failed\n");
+		exit(1);
+	}
+	printf("Free run search test succeeded\n");
+	return 0;
+}
+#endif
@@ -101,3 +101,114 @@ void ext2fs_set_block_alloc_stats_callback(ext2_filsys fs,
 
 	fs->block_alloc_stats = func;
 }
+
+/*
+ * Count the blocks from start to start+num-1 which lie within first
+ * to last and are marked in use in the block bitmap; a start of zero
+ * means there are no such blocks.
+ */
+static blk_t count_used_in_group(ext2_filsys fs, blk_t first, blk_t last,
+				 blk_t start, blk_t num)
+{
+	blk_t	end, count;
+
+	if (!start || !num)
+		return 0;
+	end = start + num - 1;
+	if (start < first)
+		start = first;
+	if (end > last)
+		end = last;
+	if (start > end ||
+	    ext2fs_count_block_bitmap_range(fs->block_map, start, end, &count))
+		return 0;
+	return count;
+}
+
+/*
+ * Recalculate the free block and inode counts of every group, and of
+ * the filesystem, from the bitmaps.  In a group whose block bitmap is
+ * uninitialized, only the group's own metadata can be in use.
+ */
+errcode_t ext2fs_calculate_summary_stats(ext2_filsys fs)
+{
+	blk_t		first, last, used, total_free = 0;
+	blk_t		super_blk, old_desc_blk, new_desc_blk;
+	ext2_ino_t	first_ino, last_ino, used_ino, total_free_ino = 0;
+	struct ext2_group_desc *gdp;
+	int		old_desc_blocks;
+	dgrp_t		group;
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+	if (!fs->block_map)
+		return EXT2_ET_NO_BLOCK_BITMAP;
+	if (!fs->inode_map)
+		return EXT2_ET_NO_INODE_BITMAP;
+
+	if (fs->super->s_feature_incompat & EXT2_FEATURE_INCOMPAT_META_BG)
+		old_desc_blocks = fs->super->s_first_meta_bg;
+	else
+		old_desc_blocks = fs->desc_blocks +
+			fs->super->s_reserved_gdt_blocks;
+
+	for (group = 0; group < fs->group_desc_count; group++) {
+		gdp = &fs->group_desc[group];
+		first = ext2fs_group_first_block(fs, group);
+		last = ext2fs_group_last_block(fs, group);
+
+		if (gdp->bg_flags & EXT2_BG_BLOCK_UNINIT) {
+			ext2fs_super_and_bgd_loc(fs, group, &super_blk,
+						 &old_desc_blk, &new_desc_blk,
+						 0);
+			/* Group 0's superblock may be block 0 */
+			used = (group == 0 && !super_blk &&
+				ext2fs_test_block_bitmap(fs->block_map, 0)) +
+				count_used_in_group(fs, first, last,
+						    super_blk, 1) +
+				count_used_in_group(fs, first, last,
+						    old_desc_blk,
+						    old_desc_blocks) +
+				count_used_in_group(fs, first, last,
+						    new_desc_blk, 1) +
+				count_used_in_group(fs, first, last,
+						    gdp->bg_block_bitmap, 1) +
+				count_used_in_group(fs, first, last,
+						    gdp->bg_inode_bitmap, 1) +
+				count_used_in_group(fs, first, last,
+						    gdp->bg_inode_table,
+						    fs->inode_blocks_per_group);
+		} else {
+			retval = ext2fs_count_block_bitmap_range(fs->block_map,
+								 first, last,
+								 &used);
+			if (retval)
+				return retval;
+		}
+		gdp->bg_free_blocks_count = last - first + 1 - used;
+		total_free += gdp->bg_free_blocks_count;
+
+		first_ino = group * fs->super->s_inodes_per_group + 1;
+		last_ino = first_ino + fs->super->s_inodes_per_group - 1;
+		if (last_ino > fs->super->s_inodes_count)
+			last_ino = fs->super->s_inodes_count;
+		if (gdp->bg_flags & EXT2_BG_INODE_UNINIT)
+			used_ino = 0;
+		else {
+			retval = ext2fs_count_inode_bitmap_range(fs->inode_map,
+								 first_ino,
+								 last_ino,
+								 &used_ino);
+			if (retval)
+				return retval;
+		}
+		gdp->bg_free_inodes_count = last_ino - first_ino + 1 - used_ino;
+		total_free_ino += gdp->bg_free_inodes_count;
+
+		ext2fs_group_desc_csum_set(fs, group);
+	}
+	fs->super->s_free_blocks_count = total_free;
+	fs->super->s_free_inodes_count = total_free_ino;
+	ext2fs_mark_super_dirty(fs);
+	return 0;
+}
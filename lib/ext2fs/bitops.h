@@ -113,6 +113,42 @@ extern int ext2fs_test_block_bitmap_range(ext2fs_block_bitmap bitmap,
 					  blk_t block, int num);
 extern __u32 ext2fs_get_generic_bitmap_start(ext2fs_generic_bitmap bitmap);
 extern __u32 ext2fs_get_generic_bitmap_end(ext2fs_generic_bitmap bitmap);
+extern errcode_t ext2fs_find_first_zero_generic_bitmap(ext2fs_generic_bitmap bitmap,
+						       __u32 start, __u32 end,
+						       __u32 *out);
+extern errcode_t ext2fs_find_first_set_generic_bitmap(ext2fs_generic_bitmap bitmap,
+						      __u32 start, __u32 end,
+						      __u32 *out);
+extern errcode_t ext2fs_count_generic_bitmap_range(ext2fs_generic_bitmap bitmap,
+						   __u32 start, __u32 end,
+						   __u32 *out);
+extern errcode_t ext2fs_diff_generic_bitmap_range(ext2fs_generic_bitmap bm1,
+					ext2fs_generic_bitmap bm2,
+					__u32 start, __u32 end,
+					int (*func)(__u32 first, __u32 last,
+						    int bit, void *priv),
+					void *priv);
+extern errcode_t ext2fs_find_first_zero_block_bitmap(ext2fs_block_bitmap bitmap,
+						     blk_t start, blk_t end,
+						     blk_t *out);
+extern errcode_t ext2fs_find_first_set_block_bitmap(ext2fs_block_bitmap bitmap,
+						    blk_t start, blk_t end,
+						    blk_t *out);
+extern errcode_t ext2fs_count_block_bitmap_range(ext2fs_block_bitmap bitmap,
+						 blk_t start, blk_t end,
+						 blk_t *out);
+extern errcode_t ext2fs_find_first_zero_inode_bitmap(ext2fs_inode_bitmap bitmap,
+						     ext2_ino_t start,
+						     ext2_ino_t end,
+						     ext2_ino_t *out);
+extern errcode_t ext2fs_find_first_set_inode_bitmap(ext2fs_inode_bitmap bitmap,
+						    ext2_ino_t start,
+						    ext2_ino_t end,
+						    ext2_ino_t *out);
+extern errcode_t ext2fs_count_inode_bitmap_range(ext2fs_inode_bitmap bitmap,
+						 ext2_ino_t start,
+						 ext2_ino_t end,
+						 ext2_ino_t *out);
 
 /*
  * The inline routines themselves...
@@ -419,6 +455,57 @@ _INLINE_ void ext2fs_fast_unmark_block_bitmap_range(ext2fs_block_bitmap bitmap,
 {
 	ext2fs_unmark_block_bitmap_range(bitmap, block, num);
 }
+
+_INLINE_ errcode_t ext2fs_find_first_zero_block_bitmap(ext2fs_block_bitmap bitmap,
+						       blk_t start, blk_t end,
+						       blk_t *out)
+{
+	return ext2fs_find_first_zero_generic_bitmap((ext2fs_generic_bitmap)
+						     bitmap, start, end, out);
+}
+
+_INLINE_ errcode_t ext2fs_find_first_set_block_bitmap(ext2fs_block_bitmap bitmap,
+						      blk_t start, blk_t end,
+						      blk_t *out)
+{
+	return ext2fs_find_first_set_generic_bitmap((ext2fs_generic_bitmap)
+						    bitmap, start, end, out);
+}
+
+_INLINE_ errcode_t ext2fs_count_block_bitmap_range(ext2fs_block_bitmap bitmap,
+						   blk_t start, blk_t end,
+						   blk_t *out)
+{
+	return ext2fs_count_generic_bitmap_range((ext2fs_generic_bitmap)
+						 bitmap, start, end, out);
+}
+
+_INLINE_ errcode_t ext2fs_find_first_zero_inode_bitmap(ext2fs_inode_bitmap bitmap,
+						       ext2_ino_t start,
+						       ext2_ino_t end,
+						       ext2_ino_t *out)
+{
+	return ext2fs_find_first_zero_generic_bitmap((ext2fs_generic_bitmap)
+						     bitmap, start, end, out);
+}
+
+_INLINE_ errcode_t ext2fs_find_first_set_inode_bitmap(ext2fs_inode_bitmap bitmap,
+						      ext2_ino_t start,
+						      ext2_ino_t end,
+						      ext2_ino_t *out)
+{
+	return ext2fs_find_first_set_generic_bitmap((ext2fs_generic_bitmap)
+						    bitmap, start, end, out);
+}
+
+_INLINE_ errcode_t ext2fs_count_inode_bitmap_range(ext2fs_inode_bitmap bitmap,
+						   ext2_ino_t start,
+						   ext2_ino_t end,
+						   ext2_ino_t *out)
+{
+	return ext2fs_count_generic_bitmap_range((ext2fs_generic_bitmap)
+						 bitmap, start, end, out);
+}
 #undef _INLINE_
 #endif
 
@@ -0,0 +1,348 @@
+/*
+ * blkmap_ba.c --- Generic bitmaps stored as a flat bit array
+ *
+ * Copyright (C) 2001 Theodore Ts'o.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+#include "gen_bitmap.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static size_t ba_size(__u32 start, __u32 real_end)
+{
+	size_t	size;
+
+	size = (size_t) (((real_end - start) / 8) + 1);
+	/* Round up to allow for the BT x86 instruction */
+	return (size + 7) & ~3;
+}
+
+static errcode_t ba_new_bmap(ext2fs_generic_bitmap bmap, char *init_map)
+{
+	errcode_t	retval;
+	size_t		size;
+	char		*bitarray;
+
+	size = ba_size(bmap->start, bmap->real_end);
+	retval = ext2fs_get_mem(size, &bitarray);
+	if (retval)
+		return retval;
+
+	if (init_map)
+		memcpy(bitarray, init_map, size);
+	else
+		memset(bitarray, 0, size);
+	bmap->private = bitarray;
+	return 0;
+}
+
+static void ba_free_bmap(ext2fs_generic_bitmap bmap)
+{
+	if (bmap->private)
+		ext2fs_free_mem(&bmap->private);
+}
+
+static errcode_t ba_copy_bmap(ext2fs_generic_bitmap src,
+			      ext2fs_generic_bitmap dest)
+{
+	return ba_new_bmap(dest, src->private);
+}
+
+static errcode_t ba_resize_bmap(ext2fs_generic_bitmap bmap,
+				__u32 new_real_end)
+{
+	errcode_t	retval;
+	size_t		size, new_size;
+
+	size = ((bmap->real_end - bmap->start) / 8) + 1;
+	new_size = ((new_real_end - bmap->start) / 8) + 1;
+
+	if (size != new_size) {
+		retval = ext2fs_resize_mem(size, new_size, &bmap->private);
+		if (retval)
+			return retval;
+	}
+	if (new_size > size)
+		memset((char *) bmap->private + size, 0, new_size - size);
+	return 0;
+}
+
+static int ba_mark_bmap(ext2fs_generic_bitmap bmap, __u32 arg)
+{
+	return ext2fs_set_bit(arg, bmap->private);
+}
+
+static int ba_unmark_bmap(ext2fs_generic_bitmap bmap, __u32 arg)
+{
+	return ext2fs_clear_bit(arg, bmap->private);
+}
+
+static int ba_test_bmap(ext2fs_generic_bitmap bmap, __u32 arg)
+{
+	return ext2fs_test_bit(arg, bmap->private);
+}
+
+static void ba_mark_bmap_extent(ext2fs_generic_bitmap bmap, __u32 arg,
+				unsigned int num)
+{
+	unsigned int	i;
+
+	for (i = 0; i < num; i++)
+		ext2fs_fast_set_bit(arg + i, bmap->private);
+}
+
+static void ba_unmark_bmap_extent(ext2fs_generic_bitmap bmap, __u32 arg,
+				  unsigned int num)
+{
+	unsigned int	i;
+
+	for (i = 0; i < num; i++)
+		ext2fs_fast_clear_bit(arg + i, bmap->private);
+}
+
+/*
+ * Compare @mem to zero buffer by 256 bytes.
+ * Return 1 if @mem is zeroed memory, otherwise return 0.
+ */
+static int mem_is_zero(const char *mem, size_t len)
+{
+	static const char zero_buf[256];
+
+	while (len >= sizeof(zero_buf)) {
+		if (memcmp(mem, zero_buf, sizeof(zero_buf)))
+			return 0;
+		len -= sizeof(zero_buf);
+		mem += sizeof(zero_buf);
+	}
+	/* Deal with leftover bytes. */
+	if (len)
+		return !memcmp(mem, zero_buf, len);
+	return 1;
+}
+
+/*
+ * Return true if all of the bits in a specified range are clear
+ */
+static int ba_test_clear_bmap_extent(ext2fs_generic_bitmap bmap,
+				     __u32 start, unsigned int len)
+{
+	size_t start_byte, len_byte = len >> 3;
+	unsigned int start_bit, len_bit = len % 8;
+	int first_bit = 0;
+	int last_bit  = 0;
+	int mark_count = 0;
+	int mark_bit = 0;
+	int i;
+	const char *ADDR = bmap->private;
+
+	start_byte = start >> 3;
+	start_bit = start % 8;
+
+	if (start_bit != 0) {
+		/*
+		 * The compared start block number or start inode number
+		 * is not the first bit in a byte.
+		 */
+		mark_count = 8 - start_bit;
+		if (len < 8 - start_bit) {
+			mark_count = (int)len;
+			mark_bit = len + start_bit - 1;
+		} else
+			mark_bit = 7;
+
+		for (i = mark_count; i > 0; i--, mark_bit--)
+			first_bit |= 1 << mark_bit;
+
+		/*
+		 * Compare blocks or inodes in the first byte.
+		 * If there is any marked bit, this function returns 0.
+		 */
+		if (first_bit & ADDR[start_byte])
+			return 0;
+		else if (len <= 8 - start_bit)
+			return 1;
+
+		start_byte++;
+		len_bit = (len - mark_count) % 8;
+		len_byte = (len - mark_count) >> 3;
+	}
+
+	/*
+	 * The compared start block number or start inode number is
+	 * the first bit in a byte.
+	 */
+	if (len_bit != 0) {
+		/*
+		 * The compared end block number or end inode number is
+		 * not the last bit in a byte.
+		 */
+		for (mark_bit = len_bit - 1; mark_bit >= 0; mark_bit--)
+			last_bit |= 1 << mark_bit;
+
+		/*
+		 * Compare blocks or inodes in the last byte.
+		 * If there is any marked bit, this function returns 0.
+		 */
+		if (last_bit & ADDR[start_byte + len_byte])
+			return 0;
+		else if (len_byte == 0)
+			return 1;
+	}
+
+	/* Check whether all bytes are 0 */
+	return mem_is_zero(ADDR + start_byte, len_byte);
+}
+
+static void ba_set_bmap_range(ext2fs_generic_bitmap bmap, __u32 arg,
+			      size_t num, void *in)
+{
+	memcpy((char *) bmap->private + (arg >> 3), in, (num + 7) >> 3);
+}
+
+static void ba_get_bmap_range(ext2fs_generic_bitmap bmap, __u32 arg,
+			      size_t num, void *out)
+{
+	memcpy(out, (char *) bmap->private + (arg >> 3), (num + 7) >> 3);
+}
+
+static void ba_clear_bmap(ext2fs_generic_bitmap bmap)
+{
+	memset(bmap->private, 0,
+	       (size_t) (((bmap->real_end - bmap->start) / 8) + 1));
+}
+
+/*
+ * The searches and counts below work a 64-bit word at a time; see
+ * bmap_load64() in gen_bitmap.h.
+ */
+#ifdef __SSE2__
+/*
+ * Return true if the 64 bytes at p are all zero (or all ones, if
+ * ones is set).
+ */
+static int ba_block_is(const unsigned char *p, int ones)
+{
+	__m128i	a = _mm_loadu_si128((const __m128i *) p);
+	__m128i	b = _mm_loadu_si128((const __m128i *) (p + 16));
+	__m128i	c = _mm_loadu_si128((const __m128i *) (p + 32));
+	__m128i	d = _mm_loadu_si128((const __m128i *) (p + 48));
+	__m128i	v;
+
+	if (ones)
+		v = _mm_and_si128(_mm_and_si128(a, b), _mm_and_si128(c, d));
+	else
+		v = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+	v = _mm_cmpeq_epi8(v, ones ? _mm_set1_epi8(-1) : _mm_setzero_si128());
+	return _mm_movemask_epi8(v) == 0xffff;
+}
+#endif
+
+static errcode_t ba_find_first(ext2fs_generic_bitmap bmap, __u32 start,
+			       __u32 end, int want_set, __u32 *out)
+{
+	const unsigned char *bits = bmap->private;
+	__u64		pos = start, last = (__u64) end + 1, word;
+	__u64		flip = want_set ? 0 : ~((__u64) 0);
+
+	while (pos < last && (pos & 63)) {
+		if (!ext2fs_test_bit(pos, bits) == !want_set)
+			goto found;
+		pos++;
+	}
+#ifdef __SSE2__
+	while (pos + 512 <= last && ba_block_is(bits + (pos >> 3), !want_set))
+		pos += 512;
+#endif
+	while (pos + 64 <= last) {
+		word = bmap_load64(bits + (pos >> 3)) ^ flip;
+		if (word) {
+			pos += bmap_ctz64(word);
+			goto found;
+		}
+		pos += 64;
+	}
+	while (pos < last) {
+		if (!ext2fs_test_bit(pos, bits) == !want_set)
+			goto found;
+		pos++;
+	}
+	return ENOENT;
+found:
+	*out = pos;
+	return 0;
+}
+
+static errcode_t ba_find_first_zero(ext2fs_generic_bitmap bmap, __u32 start,
+				    __u32 end, __u32 *out)
+{
+	return ba_find_first(bmap, start, end, 0, out);
+}
+
+static errcode_t ba_find_first_set(ext2fs_generic_bitmap bmap, __u32 start,
+				   __u32 end, __u32 *out)
+{
+	return ba_find_first(bmap, start, end, 1, out);
+}
+
+static __u32 ba_count_range(ext2fs_generic_bitmap bmap, __u32 start,
+			    __u32 end)
+{
+	const unsigned char *bits = bmap->private;
+	__u64		pos = start, last = (__u64) end + 1;
+	__u32		count = 0;
+
+	while (pos < last && (pos & 63)) {
+		if (ext2fs_test_bit(pos, bits))
+			count++;
+		pos++;
+	}
+	while (pos + 64 <= last) {
+		count += bmap_popcount64(bmap_load64(bits + (pos >> 3)));
+		pos += 64;
+	}
+	while (pos < last) {
+		if (ext2fs_test_bit(pos, bits))
+			count++;
+		pos++;
+	}
+	return count;
+}
+
+struct ext2_bitmap_ops ext2fs_bitmap_bitarray = {
+	EXT2FS_BMAP_BITARRAY,
+	ba_new_bmap,
+	ba_free_bmap,
+	ba_copy_bmap,
+	ba_resize_bmap,
+	ba_mark_bmap,
+	ba_unmark_bmap,
+	ba_test_bmap,
+	ba_mark_bmap_extent,
+	ba_unmark_bmap_extent,
+	ba_test_clear_bmap_extent,
+	ba_set_bmap_range,
+	ba_get_bmap_range,
+	ba_clear_bmap,
+	ba_find_first_zero,
+	ba_find_first_set,
+	ba_count_range
+};
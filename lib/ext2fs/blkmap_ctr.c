@@ -0,0 +1,973 @@
+/*
+ * blkmap_ctr.c --- Generic bitmaps stored as compressed containers
+ *
+ * The bitmap is cut into ranges of 64K bits, and the bits set in each
+ * range are kept in a container of whichever kind is smallest: a
+ * sorted array of 16-bit offsets when few bits are set, a plain 8K bit
+ * array when many are, or a sorted list of runs when the set bits come
+ * in long stretches.  A range with nothing set has no container at
+ * all.  Any bit can still be found directly, so dense bitmaps cost
+ * about what a flat bit array would, while sparse ones (and ones made
+ * of a few long runs) cost a tiny fraction of that.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+#include "gen_bitmap.h"
+
+#define CTR_SHIFT	16
+#define CTR_BITS	(1U << CTR_SHIFT)
+#define CTR_MASK	(CTR_BITS - 1)
+#define CTR_BYTES	(CTR_BITS / 8)
+
+#define CTR_ARRAY	0	/* sorted offsets of the set bits */
+#define CTR_BITSET	1	/* a bit array of the whole range */
+#define CTR_RUNS	2	/* sorted runs of set bits */
+
+struct ctr_run {
+	__u16	start;
+	__u16	last;		/* inclusive; runs never overlap or touch */
+};
+
+/*
+ * Beyond these sizes an array or a list of runs would take more room
+ * than the bit array.
+ */
+#define ARRAY_MAX	(CTR_BYTES / sizeof(__u16))
+#define RUNS_MAX	(CTR_BYTES / sizeof(struct ctr_run))
+
+struct container {
+	int		type;
+	unsigned int	card;	/* number of bits set */
+	unsigned int	n;	/* array entries or runs in use */
+	unsigned int	max;	/* array entries or runs allocated */
+	union {
+		__u16		*array;
+		unsigned char	*bits;
+		struct ctr_run	*runs;
+	} u;
+};
+
+struct ctr_bmap {
+	struct container **ctrs;	/* one per 64K bits, or NULL */
+	__u32		num_ctrs;
+};
+
+/*
+ * The bitmap interface gives us no way to report running out of
+ * memory, so just like the bit array would have, we give up.
+ */
+static void *ctr_alloc_mem(unsigned long size)
+{
+	void	*p;
+
+	if (ext2fs_get_mem(size, &p))
+		abort();
+	return p;
+}
+
+static size_t entry_size(int type)
+{
+	return (type == CTR_RUNS) ? sizeof(struct ctr_run) : sizeof(__u16);
+}
+
+static struct container *ctr_new(void)
+{
+	struct container *c = ctr_alloc_mem(sizeof(struct container));
+
+	memset(c, 0, sizeof(struct container));
+	c->type = CTR_ARRAY;
+	return c;
+}
+
+static void ctr_free_data(struct container *c)
+{
+	if (c->u.bits)
+		ext2fs_free_mem(&c->u.bits);
+	c->n = c->max = 0;
+}
+
+static void ctr_free(struct container **cp)
+{
+	ctr_free_data(*cp);
+	ext2fs_free_mem(cp);
+}
+
+/* Make room for need array entries or runs */
+static void ctr_reserve(struct container *c, unsigned int need)
+{
+	unsigned int	new_max, limit;
+	size_t		size = entry_size(c->type);
+
+	if (need <= c->max)
+		return;
+	limit = (c->type == CTR_RUNS) ? RUNS_MAX : ARRAY_MAX;
+	new_max = c->max ? c->max * 2 : 4;
+	if (new_max < need)
+		new_max = need;
+	if (new_max > limit)
+		new_max = limit;
+	if (ext2fs_resize_mem(c->max * size, new_max * size, &c->u.array))
+		abort();
+	c->max = new_max;
+}
+
+/* Index of the first array entry at or after x */
+static unsigned int array_lower(struct container *c, unsigned int x)
+{
+	unsigned int	low = 0, high = c->n, mid;
+
+	while (low < high) {
+		mid = (low + high) / 2;
+		if (c->u.array[mid] < x)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+/* Index of the last run starting at or before x, or -1 */
+static int run_find(struct container *c, unsigned int x)
+{
+	int	low = 0, high = (int) c->n - 1, mid;
+
+	if (!c->n || c->u.runs[0].start > x)
+		return -1;
+	while (low < high) {
+		mid = (low + high + 1) / 2;
+		if (c->u.runs[mid].start <= x)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+	return low;
+}
+
+/*
+ * Helpers for the bit array containers; like the bit array bitmaps
+ * they work a 64-bit word at a time where they can.
+ */
+static void bits_fill(unsigned char *bits, unsigned int first,
+		      unsigned int last, int set)
+{
+	unsigned int	end = last + 1;
+
+	for (; first < end && (first & 7); first++)
+		if (set)
+			ext2fs_fast_set_bit(first, bits);
+		else
+			ext2fs_fast_clear_bit(first, bits);
+	if (end - first >= 8) {
+		memset(bits + (first >> 3), set ? 0xff : 0, (end - first) >> 3);
+		first += (end - first) & ~7;
+	}
+	for (; first < end; first++)
+		if (set)
+			ext2fs_fast_set_bit(first, bits);
+		else
+			ext2fs_fast_clear_bit(first, bits);
+}
+
+static unsigned int bits_count(const unsigned char *bits, unsigned int first,
+			       unsigned int last)
+{
+	unsigned int	w, count = 0;
+	__u64		word;
+
+	for (w = first >> 6; w <= last >> 6; w++) {
+		word = bmap_load64(bits + w * 8);
+		if (w == first >> 6)
+			word &= ~0ULL << (first & 63);
+		if (w == last >> 6)
+			word &= ~0ULL >> (63 - (last & 63));
+		count += bmap_popcount64(word);
+	}
+	return count;
+}
+
+static int bits_find(const unsigned char *bits, unsigned int first,
+		     unsigned int last, int set, unsigned int *out)
+{
+	unsigned int	w, x;
+	__u64		word;
+
+	for (w = first >> 6; w <= last >> 6; w++) {
+		word = bmap_load64(bits + w * 8);
+		if (!set)
+			word = ~word;
+		if (w == first >> 6)
+			word &= ~0ULL << (first & 63);
+		if (word) {
+			x = w * 64 + bmap_ctz64(word);
+			if (x > last)
+				return 0;
+			*out = x;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Switch a container over to a bit array */
+static void ctr_to_bitset(struct container *c)
+{
+	unsigned char	*bits;
+	unsigned int	i;
+
+	if (c->type == CTR_BITSET)
+		return;
+	bits = ctr_alloc_mem(CTR_BYTES);
+	memset(bits, 0, CTR_BYTES);
+	for (i = 0; i < c->n; i++)
+		if (c->type == CTR_ARRAY)
+			ext2fs_fast_set_bit(c->u.array[i], bits);
+		else
+			bits_fill(bits, c->u.runs[i].start,
+				  c->u.runs[i].last, 1);
+	ctr_free_data(c);
+	c->type = CTR_BITSET;
+	c->u.bits = bits;
+}
+
+/* Make a container a single run covering the whole range */
+static void ctr_fill(struct container *c)
+{
+	ctr_free_data(c);
+	c->type = CTR_RUNS;
+	ctr_reserve(c, 1);
+	c->u.runs[0].start = 0;
+	c->u.runs[0].last = CTR_MASK;
+	c->n = 1;
+	c->card = CTR_BITS;
+}
+
+/*
+ * Store a bit array container as an array or a list of runs instead,
+ * if either would be smaller.
+ */
+static void ctr_optimize(struct container *c)
+{
+	unsigned char	*bits = c->u.bits;
+	unsigned int	w, runs = 0, x, s, e;
+	__u64		word, carry = 0;
+
+	if (c->type != CTR_BITSET || !c->card)
+		return;
+	/* A run starts at each set bit whose predecessor is clear */
+	for (w = 0; w < CTR_BITS / 64; w++) {
+		word = bmap_load64(bits + w * 8);
+		runs += bmap_popcount64(word & ~((word << 1) | carry));
+		carry = word >> 63;
+	}
+
+	if (runs * sizeof(struct ctr_run) < CTR_BYTES &&
+	    runs * sizeof(struct ctr_run) <= c->card * sizeof(__u16)) {
+		c->type = CTR_RUNS;
+		c->u.bits = 0;
+		ctr_reserve(c, runs);
+		for (x = 0; bits_find(bits, x, CTR_MASK, 1, &s); x = e) {
+			if (!bits_find(bits, s, CTR_MASK, 0, &e))
+				e = CTR_BITS;
+			c->u.runs[c->n].start = s;
+			c->u.runs[c->n++].last = e - 1;
+			if (e == CTR_BITS)
+				break;
+		}
+	} else if (c->card * sizeof(__u16) < CTR_BYTES) {
+		c->type = CTR_ARRAY;
+		c->u.bits = 0;
+		ctr_reserve(c, c->card);
+		for (w = 0; w < CTR_BITS / 64; w++) {
+			word = bmap_load64(bits + w * 8);
+			while (word) {
+				c->u.array[c->n++] = w * 64 + bmap_ctz64(word);
+				word &= word - 1;
+			}
+		}
+	} else
+		return;
+	ext2fs_free_mem(&bits);
+}
+
+/*
+ * Add x just after run r (which is -1 if there is none before x).
+ * Returns 0 if that would take too many runs.
+ */
+static int run_add(struct container *c, int r, unsigned int x)
+{
+	struct ctr_run	*runs = c->u.runs;
+	int		prev, next;
+
+	prev = (r >= 0 && runs[r].last + 1U == x);
+	next = (r + 1 < (int) c->n && runs[r + 1].start == x + 1);
+	if (prev && next) {
+		runs[r].last = runs[r + 1].last;
+		c->n--;
+		memmove(runs + r + 1, runs + r + 2,
+			(c->n - r - 1) * sizeof(struct ctr_run));
+	} else if (prev)
+		runs[r].last = x;
+	else if (next)
+		runs[r + 1].start = x;
+	else {
+		if (c->n >= RUNS_MAX)
+			return 0;
+		ctr_reserve(c, c->n + 1);
+		runs = c->u.runs;
+		memmove(runs + r + 2, runs + r + 1,
+			(c->n - r - 1) * sizeof(struct ctr_run));
+		runs[r + 1].start = runs[r + 1].last = x;
+		c->n++;
+	}
+	return 1;
+}
+
+/*
+ * Take x out of run r.  Returns 0 if splitting the run would take too
+ * many runs.
+ */
+static int run_remove(struct container *c, int r, unsigned int x)
+{
+	struct ctr_run	*runs = c->u.runs;
+
+	if (runs[r].start == runs[r].last) {
+		c->n--;
+		memmove(runs + r, runs + r + 1,
+			(c->n - r) * sizeof(struct ctr_run));
+	} else if (x == runs[r].start)
+		runs[r].start++;
+	else if (x == runs[r].last)
+		runs[r].last--;
+	else {
+		if (c->n >= RUNS_MAX)
+			return 0;
+		ctr_reserve(c, c->n + 1);
+		runs = c->u.runs;
+		memmove(runs + r + 1, runs + r,
+			(c->n - r) * sizeof(struct ctr_run));
+		runs[r].last = x - 1;
+		runs[r + 1].start = x + 1;
+		c->n++;
+	}
+	return 1;
+}
+
+static int ctr_test(struct container *c, unsigned int x)
+{
+	unsigned int	i;
+	int		r;
+
+	switch (c->type) {
+	case CTR_ARRAY:
+		i = array_lower(c, x);
+		return i < c->n && c->u.array[i] == x;
+	case CTR_RUNS:
+		r = run_find(c, x);
+		return r >= 0 && x <= c->u.runs[r].last;
+	default:
+		return ext2fs_test_bit(x, c->u.bits);
+	}
+}
+
+/* These return the old value of the bit */
+static int ctr_add(struct container *c, unsigned int x)
+{
+	unsigned int	i;
+	int		r;
+
+	if (c->type == CTR_ARRAY) {
+		i = array_lower(c, x);
+		if (i < c->n && c->u.array[i] == x)
+			return 1;
+		if (c->n < ARRAY_MAX) {
+			ctr_reserve(c, c->n + 1);
+			memmove(c->u.array + i + 1, c->u.array + i,
+				(c->n - i) * sizeof(__u16));
+			c->u.array[i] = x;
+			c->n++;
+			c->card++;
+			return 0;
+		}
+		ctr_to_bitset(c);
+	} else if (c->type == CTR_RUNS) {
+		r = run_find(c, x);
+		if (r >= 0 && x <= c->u.runs[r].last)
+			return 1;
+		if (run_add(c, r, x)) {
+			c->card++;
+			return 0;
+		}
+		ctr_to_bitset(c);
+	}
+	if (ext2fs_set_bit(x, c->u.bits))
+		return 1;
+	if (++c->card == CTR_BITS)
+		ctr_fill(c);
+	return 0;
+}
+
+static int ctr_remove(struct container *c, unsigned int x)
+{
+	unsigned int	i;
+	int		r;
+
+	if (c->type == CTR_ARRAY) {
+		i = array_lower(c, x);
+		if (i >= c->n || c->u.array[i] != x)
+			return 0;
+		c->n--;
+		memmove(c->u.array + i, c->u.array + i + 1,
+			(c->n - i) * sizeof(__u16));
+		c->card--;
+		return 1;
+	} else if (c->type == CTR_RUNS) {
+		r = run_find(c, x);
+		if (r < 0 || x > c->u.runs[r].last)
+			return 0;
+		if (run_remove(c, r, x)) {
+			c->card--;
+			return 1;
+		}
+		ctr_to_bitset(c);
+	}
+	if (!ext2fs_clear_bit(x, c->u.bits))
+		return 0;
+	/* Leave some slack so that we don't flip back and forth */
+	if (--c->card <= ARRAY_MAX / 2)
+		ctr_optimize(c);
+	return 1;
+}
+
+/* Set (or clear) bits first to last of a container */
+static void ctr_fill_range(struct container *c, unsigned int first,
+			   unsigned int last, int set)
+{
+	unsigned int	lo, hi;
+
+	if (!first && last == CTR_MASK) {
+		if (set)
+			ctr_fill(c);
+		else {
+			ctr_free_data(c);
+			c->type = CTR_ARRAY;
+			c->card = 0;
+		}
+		return;
+	}
+	if (!set && c->type == CTR_ARRAY) {
+		lo = array_lower(c, first);
+		hi = array_lower(c, last + 1);
+		memmove(c->u.array + lo, c->u.array + hi,
+			(c->n - hi) * sizeof(__u16));
+		c->n -= hi - lo;
+		c->card -= hi - lo;
+		return;
+	}
+	ctr_to_bitset(c);
+	c->card -= bits_count(c->u.bits, first, last);
+	bits_fill(c->u.bits, first, last, set);
+	if (set)
+		c->card += last - first + 1;
+	ctr_optimize(c);
+}
+
+/* Find the first set (or clear) bit from first to last of a container */
+static int ctr_find(struct container *c, unsigned int first,
+		    unsigned int last, int set, unsigned int *out)
+{
+	unsigned int	i, x = first;
+	int		r;
+
+	switch (c->type) {
+	case CTR_ARRAY:
+		i = array_lower(c, first);
+		if (set) {
+			if (i >= c->n)
+				return 0;
+			x = c->u.array[i];
+		} else
+			for (; i < c->n && c->u.array[i] == x; i++)
+				x++;
+		break;
+	case CTR_RUNS:
+		r = run_find(c, first);
+		if (r >= 0 && c->u.runs[r].last >= first) {
+			/* Runs never touch, so the bit after one is clear */
+			if (!set)
+				x = c->u.runs[r].last + 1;
+		} else if (set) {
+			if (r + 1 >= (int) c->n)
+				return 0;
+			x = c->u.runs[r + 1].start;
+		}
+		break;
+	default:
+		return bits_find(c->u.bits, first, last, set, out);
+	}
+	if (x > last)
+		return 0;
+	*out = x;
+	return 1;
+}
+
+static unsigned int ctr_count(struct container *c, unsigned int first,
+			      unsigned int last)
+{
+	unsigned int	count = 0, s, e;
+	int		r;
+
+	if (!first && last == CTR_MASK)
+		return c->card;
+	switch (c->type) {
+	case CTR_ARRAY:
+		return array_lower(c, last + 1) - array_lower(c, first);
+	case CTR_RUNS:
+		r = run_find(c, first);
+		if (r < 0)
+			r = 0;
+		for (; r < (int) c->n && c->u.runs[r].start <= last; r++) {
+			s = (c->u.runs[r].start > first) ?
+				c->u.runs[r].start : first;
+			e = (c->u.runs[r].last < last) ?
+				c->u.runs[r].last : last;
+			if (s <= e)
+				count += e - s + 1;
+		}
+		return count;
+	default:
+		return bits_count(c->u.bits, first, last);
+	}
+}
+
+/*
+ * Copy bits first to last of a container out to (or in from) a bit
+ * array whose first bit is bit first; first is a multiple of 8.  The
+ * output array must already be cleared.
+ */
+static void ctr_get(struct container *c, unsigned int first,
+		    unsigned int last, unsigned char *out)
+{
+	unsigned int	i, x, s, e, len;
+	int		r;
+
+	switch (c->type) {
+	case CTR_ARRAY:
+		for (i = array_lower(c, first);
+		     i < c->n && c->u.array[i] <= last; i++)
+			ext2fs_fast_set_bit(c->u.array[i] - first, out);
+		break;
+	case CTR_RUNS:
+		r = run_find(c, first);
+		if (r < 0)
+			r = 0;
+		for (; r < (int) c->n && c->u.runs[r].start <= last; r++) {
+			s = (c->u.runs[r].start > first) ?
+				c->u.runs[r].start : first;
+			e = (c->u.runs[r].last < last) ?
+				c->u.runs[r].last : last;
+			if (s <= e)
+				bits_fill(out, s - first, e - first, 1);
+		}
+		break;
+	default:
+		len = last - first + 1;
+		memcpy(out, c->u.bits + (first >> 3), len >> 3);
+		for (x = first + (len & ~7); x <= last; x++)
+			if (ext2fs_test_bit(x, c->u.bits))
+				ext2fs_fast_set_bit(x - first, out);
+	}
+}
+
+static void ctr_set(struct container *c, unsigned int first,
+		    unsigned int last, unsigned char *in)
+{
+	unsigned int	x, len = last - first + 1;
+
+	ctr_to_bitset(c);
+	c->card -= bits_count(c->u.bits, first, last);
+	memcpy(c->u.bits + (first >> 3), in, len >> 3);
+	for (x = first + (len & ~7); x <= last; x++)
+		if (ext2fs_test_bit(x - first, in))
+			ext2fs_fast_set_bit(x, c->u.bits);
+		else
+			ext2fs_fast_clear_bit(x, c->u.bits);
+	c->card += bits_count(c->u.bits, first, last);
+	ctr_optimize(c);
+}
+
+/* Which bits of container i lie between start and end */
+static void ctr_span(__u32 i, __u32 start, __u32 end, unsigned int *first,
+		     unsigned int *last)
+{
+	*first = (i == start >> CTR_SHIFT) ? start & CTR_MASK : 0;
+	*last = (i == end >> CTR_SHIFT) ? end & CTR_MASK : CTR_MASK;
+}
+
+static int ctr_mark_bmap(ext2fs_generic_bitmap bmap, __u32 arg)
+{
+	struct ctr_bmap	*cb = bmap->private;
+	struct container **cp = &cb->ctrs[arg >> CTR_SHIFT];
+
+	if (!*cp)
+		*cp = ctr_new();
+	return ctr_add(*cp, arg & CTR_MASK);
+}
+
+static int ctr_unmark_bmap(ext2fs_generic_bitmap bmap, __u32 arg)
+{
+	struct ctr_bmap	*cb = bmap->private;
+	struct container **cp = &cb->ctrs[arg >> CTR_SHIFT];
+	int		ret;
+
+	if (!*cp)
+		return 0;
+	ret = ctr_remove(*cp, arg & CTR_MASK);
+	if (!(*cp)->card)
+		ctr_free(cp);
+	return ret;
+}
+
+static int ctr_test_bmap(ext2fs_generic_bitmap bmap, __u32 arg)
+{
+	struct ctr_bmap	*cb = bmap->private;
+	struct container *c = cb->ctrs[arg >> CTR_SHIFT];
+
+	return c ? ctr_test(c, arg & CTR_MASK) : 0;
+}
+
+static void ctr_mark_bmap_extent(ext2fs_generic_bitmap bmap, __u32 arg,
+				 unsigned int num)
+{
+	struct ctr_bmap	*cb = bmap->private;
+	unsigned int	first, last;
+	__u32		i, end;
+
+	if (!num)
+		return;
+	end = arg + num - 1;
+	for (i = arg >> CTR_SHIFT; i <= end >> CTR_SHIFT; i++) {
+		ctr_span(i, arg, end, &first, &last);
+		if (!cb->ctrs[i])
+			cb->ctrs[i] = ctr_new();
+		ctr_fill_range(cb->ctrs[i], first, last, 1);
+	}
+}
+
+static void ctr_unmark_bmap_extent(ext2fs_generic_bitmap bmap, __u32 arg,
+				   unsigned int num)
+{
+	struct ctr_bmap	*cb = bmap->private;
+	unsigned int	first, last;
+	__u32		i, end;
+
+	if (!num)
+		return;
+	end = arg + num - 1;
+	for (i = arg >> CTR_SHIFT; i <= end >> CTR_SHIFT; i++) {
+		ctr_span(i, arg, end, &first, &last);
+		if (!cb->ctrs[i])
+			continue;
+		ctr_fill_range(cb->ctrs[i], first, last, 0);
+		if (!cb->ctrs[i]->card)
+			ctr_free(&cb->ctrs[i]);
+	}
+}
+
+static errcode_t ctr_find_first(ext2fs_generic_bitmap bmap, __u32 start,
+				__u32 end, int set, __u32 *out)
+{
+	struct ctr_bmap	*cb = bmap->private;
+	struct container *c;
+	unsigned int	first, last, x;
+	__u32		i;
+
+	for (i = start >> CTR_SHIFT; i <= end >> CTR_SHIFT; i++) {
+		ctr_span(i, start, end, &first, &last);
+		c = cb->ctrs[i];
+		if (!c) {
+			if (set)
+				continue;
+			x = first;
+		} else if (!ctr_find(c, first, last, set, &x))
+			continue;
+		*out = (i << CTR_SHIFT) + x;
+		return 0;
+	}
+	return ENOENT;
+}
+
+static errcode_t ctr_find_first_zero(ext2fs_generic_bitmap bmap, __u32 start,
+				     __u32 end, __u32 *out)
+{
+	return ctr_find_first(bmap, start, end, 0, out);
+}
+
+static errcode_t ctr_find_first_set(ext2fs_generic_bitmap bmap, __u32 start,
+				    __u32 end, __u32 *out)
+{
+	return ctr_find_first(bmap, start, end, 1, out);
+}
+
+static int ctr_test_clear_bmap_extent(ext2fs_generic_bitmap bmap,
+				      __u32 arg, unsigned int num)
+{
+	__u32	out;
+
+	if (!num)
+		return 1;
+	return ctr_find_first(bmap, arg, arg + num - 1, 1, &out) == ENOENT;
+}
+
+static __u32 ctr_count_range(ext2fs_generic_bitmap bmap, __u32 start,
+			     __u32 end)
+{
+	struct ctr_bmap	*cb = bmap->private;
+	unsigned int	first, last;
+	__u32		i, count = 0;
+
+	for (i = start >> CTR_SHIFT; i <= end >> CTR_SHIFT; i++) {
+		ctr_span(i, start, end, &first, &last);
+		if (cb->ctrs[i])
+			count += ctr_count(cb->ctrs[i], first, last);
+	}
+	return count;
+}
+
+static void ctr_get_bmap_range(ext2fs_generic_bitmap bmap, __u32 arg,
+			       size_t num, void *out)
+{
+	struct ctr_bmap	*cb = bmap->private;
+	unsigned int	first, last;
+	__u32		i, end;
+
+	memset(out, 0, (num + 7) >> 3);
+	if (!num)
+		return;
+	end = arg + num - 1;
+	for (i = arg >> CTR_SHIFT; i <= end >> CTR_SHIFT; i++) {
+		ctr_span(i, arg, end, &first, &last);
+		if (cb->ctrs[i])
+			ctr_get(cb->ctrs[i], first, last, (unsigned char *) out +
+				((((__u64) i << CTR_SHIFT) + first - arg) >> 3));
+	}
+}
+
+static void ctr_set_bmap_range(ext2fs_generic_bitmap bmap, __u32 arg,
+			       size_t num, void *in)
+{
+	struct ctr_bmap	*cb = bmap->private;
+	unsigned int	first, last;
+	__u32		i, end;
+
+	if (!num)
+		return;
+	end = arg + num - 1;
+	for (i = arg >> CTR_SHIFT; i <= end >> CTR_SHIFT; i++) {
+		ctr_span(i, arg, end, &first, &last);
+		if (!cb->ctrs[i])
+			cb->ctrs[i] = ctr_new();
+		ctr_set(cb->ctrs[i], first, last, (unsigned char *) in +
+			((((__u64) i << CTR_SHIFT) + first - arg) >> 3));
+		if (!cb->ctrs[i]->card)
+			ctr_free(&cb->ctrs[i]);
+	}
+}
+
+static void ctr_clear_bmap(ext2fs_generic_bitmap bmap)
+{
+	struct ctr_bmap	*cb = bmap->private;
+	__u32		i;
+
+	for (i = 0; i < cb->num_ctrs; i++)
+		if (cb->ctrs[i])
+			ctr_free(&cb->ctrs[i]);
+}
+
+static errcode_t ctr_new_bmap(ext2fs_generic_bitmap bmap, char *init_map)
+{
+	struct ctr_bmap	*cb;
+	errcode_t	retval;
+
+	retval = ext2fs_get_mem(sizeof(struct ctr_bmap), &cb);
+	if (retval)
+		return retval;
+	cb->num_ctrs = ((bmap->real_end - bmap->start) >> CTR_SHIFT) + 1;
+	retval = ext2fs_get_array(cb->num_ctrs, sizeof(struct container *),
+				  &cb->ctrs);
+	if (retval) {
+		ext2fs_free_mem(&cb);
+		return retval;
+	}
+	memset(cb->ctrs, 0, cb->num_ctrs * sizeof(struct container *));
+	bmap->private = cb;
+	if (init_map)
+		ctr_set_bmap_range(bmap, 0,
+				   (size_t) (bmap->real_end - bmap->start) + 1,
+				   init_map);
+	return 0;
+}
+
+static void ctr_free_bmap(ext2fs_generic_bitmap bmap)
+{
+	struct ctr_bmap	*cb = bmap->private;
+
+	if (!cb)
+		return;
+	ctr_clear_bmap(bmap);
+	ext2fs_free_mem(&cb->ctrs);
+	ext2fs_free_mem(&bmap->private);
+}
+
+static errcode_t ctr_copy_bmap(ext2fs_generic_bitmap src,
+			       ext2fs_generic_bitmap dest)
+{
+	struct ctr_bmap	*src_cb = src->private, *cb;
+	struct container *c, *s;
+	size_t		size;
+	errcode_t	retval;
+	__u32		i;
+
+	retval = ctr_new_bmap(dest, 0);
+	if (retval)
+		return retval;
+	cb = dest->private;
+	for (i = 0; i < src_cb->num_ctrs; i++) {
+		s = src_cb->ctrs[i];
+		if (!s)
+			continue;
+		retval = ext2fs_get_mem(sizeof(struct container), &c);
+		if (retval)
+			goto errout;
+		*c = *s;
+		size = (s->type == CTR_BITSET) ? CTR_BYTES :
+			s->max * entry_size(s->type);
+		c->u.bits = 0;
+		if (size) {
+			retval = ext2fs_get_mem(size, &c->u.bits);
+			if (retval) {
+				ext2fs_free_mem(&c);
+				goto errout;
+			}
+			memcpy(c->u.bits, s->u.bits, size);
+		}
+		cb->ctrs[i] = c;
+	}
+	return 0;
+
+errout:
+	ctr_free_bmap(dest);
+	return retval;
+}
+
+static errcode_t ctr_resize_bmap(ext2fs_generic_bitmap bmap,
+				 __u32 new_real_end)
+{
+	struct ctr_bmap	*cb = bmap->private;
+	__u32		new_num;
+	errcode_t	retval;
+
+	/* Drop anything beyond the new end */
+	if (new_real_end < bmap->real_end)
+		ctr_unmark_bmap_extent(bmap, new_real_end - bmap->start + 1,
+				       bmap->real_end - new_real_end);
+	new_num = ((new_real_end - bmap->start) >> CTR_SHIFT) + 1;
+	if (new_num == cb->num_ctrs)
+		return 0;
+	retval = ext2fs_resize_mem(cb->num_ctrs * sizeof(struct container *),
+				   new_num * sizeof(struct container *),
+				   &cb->ctrs);
+	if (retval)
+		return retval;
+	if (new_num > cb->num_ctrs)
+		memset(cb->ctrs + cb->num_ctrs, 0,
+		       (new_num - cb->num_ctrs) * sizeof(struct container *));
+	cb->num_ctrs = new_num;
+	return 0;
+}
+
+struct ext2_bitmap_ops ext2fs_bitmap_container = {
+	EXT2FS_BMAP_CONTAINER,
+	ctr_new_bmap,
+	ctr_free_bmap,
+	ctr_copy_bmap,
+	ctr_resize_bmap,
+	ctr_mark_bmap,
+	ctr_unmark_bmap,
+	ctr_test_bmap,
+	ctr_mark_bmap_extent,
+	ctr_unmark_bmap_extent,
+	ctr_test_clear_bmap_extent,
+	ctr_set_bmap_range,
+	ctr_get_bmap_range,
+	ctr_clear_bmap,
+	ctr_find_first_zero,
+	ctr_find_first_set,
+	ctr_count_range
+};
+
+#ifdef DEBUG
+/*
+ * Make sure each container is in order, holds the number of bits it
+ * says it does, and isn't empty.  For tst_bmap, shapes[] counts the
+ * containers seen of each kind.
+ */
+int ext2fs_check_container_bitmap(ext2fs_generic_bitmap bmap, int *shapes)
+{
+	struct ctr_bmap	*cb = bmap->private;
+	struct container *c;
+	unsigned int	i, card;
+	__u32		n;
+
+	for (n = 0; n < cb->num_ctrs; n++) {
+		c = cb->ctrs[n];
+		if (!c)
+			continue;
+		shapes[c->type]++;
+		card = 0;
+		switch (c->type) {
+		case CTR_ARRAY:
+			for (i = 0; i < c->n; i++)
+				if (i && c->u.array[i - 1] >= c->u.array[i])
+					goto bad;
+			card = c->n;
+			break;
+		case CTR_RUNS:
+			for (i = 0; i < c->n; i++) {
+				if (c->u.runs[i].start > c->u.runs[i].last ||
+				    (i && c->u.runs[i - 1].last + 1U >=
+				     c->u.runs[i].start))
+					goto bad;
+				card += c->u.runs[i].last -
+					c->u.runs[i].start + 1;
+			}
+			break;
+		default:
+			card = bits_count(c->u.bits, 0, CTR_MASK);
+		}
+		if (!card || card != c->card)
+			goto bad;
+		continue;
+	bad:
+		printf("Container %u (type %d) is corrupt\n", n, c->type);
+		return 1;
+	}
+	return 0;
+}
+#endif
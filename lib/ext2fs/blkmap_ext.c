@@ -0,0 +1,593 @@
+/*
+ * blkmap_ext.c --- Generic bitmaps stored as a list of extents
+ *
+ * Each run of set bits is kept as a (start, count) extent.  The
+ * extents are sorted, and never overlap or touch; they are kept in
+ * leaves of up to EXTENTS_PER_LEAF entries, and the leaves are kept in
+ * a sorted array, so that any bit can be found with two binary
+ * searches.  This makes sparse bitmaps (and ones made of a few long
+ * runs) cost a tiny fraction of a flat bit array.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+#include "gen_bitmap.h"
+
+#define EXTENTS_PER_LEAF	128
+
+struct bmap_extent {
+	__u32	start;
+	__u32	count;
+};
+
+struct ext_leaf {
+	int			count;
+	struct bmap_extent	ext[EXTENTS_PER_LEAF];
+};
+
+struct ext_bmap {
+	struct ext_leaf	**leaves;
+	int		num_leaves;
+	int		max_leaves;
+	int		hint;		/* leaf of the last lookup */
+};
+
+struct ext_pos {
+	int	leaf;
+	int	idx;
+};
+
+#define ext_end(e)	((__u64) (e)->start + (e)->count)
+
+static struct bmap_extent *ext_at(struct ext_bmap *eb, struct ext_pos *pos)
+{
+	return &eb->leaves[pos->leaf]->ext[pos->idx];
+}
+
+static int pos_valid(struct ext_bmap *eb, struct ext_pos *pos)
+{
+	return pos->leaf >= 0 && pos->leaf < eb->num_leaves;
+}
+
+/* Make pos point at a real extent if it has run off the end of a leaf */
+static void pos_normalize(struct ext_bmap *eb, struct ext_pos *pos)
+{
+	if (pos->leaf >= 0 && pos->leaf < eb->num_leaves &&
+	    pos->idx >= eb->leaves[pos->leaf]->count) {
+		pos->leaf++;
+		pos->idx = 0;
+	}
+}
+
+static void pos_next(struct ext_bmap *eb, struct ext_pos *pos)
+{
+	if (pos->leaf < 0) {
+		pos->leaf = 0;
+		pos->idx = 0;
+		return;
+	}
+	pos->idx++;
+	pos_normalize(eb, pos);
+}
+
+/*
+ * Find the last extent starting at or before arg.  Returns 0 (with
+ * pos->leaf set to -1) if there isn't one.
+ */
+static int find_extent(struct ext_bmap *eb, __u32 arg, struct ext_pos *pos)
+{
+	struct ext_leaf	*leaf;
+	int		low, high, mid;
+
+	pos->leaf = pos->idx = -1;
+	if (!eb->num_leaves || eb->leaves[0]->ext[0].start > arg)
+		return 0;
+
+	low = eb->hint;
+	if (low >= eb->num_leaves || eb->leaves[low]->ext[0].start > arg ||
+	    (low + 1 < eb->num_leaves &&
+	     eb->leaves[low + 1]->ext[0].start <= arg)) {
+		low = 0;
+		high = eb->num_leaves - 1;
+		while (low < high) {
+			mid = (low + high + 1) / 2;
+			if (eb->leaves[mid]->ext[0].start <= arg)
+				low = mid;
+			else
+				high = mid - 1;
+		}
+		eb->hint = low;
+	}
+	leaf = eb->leaves[low];
+
+	pos->leaf = low;
+	low = 0;
+	high = leaf->count - 1;
+	while (low < high) {
+		mid = (low + high + 1) / 2;
+		if (leaf->ext[mid].start <= arg)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+	pos->idx = low;
+	return 1;
+}
+
+static errcode_t new_leaf(struct ext_bmap *eb, int where)
+{
+	struct ext_leaf	*leaf;
+	errcode_t	retval;
+	int		new_max;
+
+	if (eb->num_leaves >= eb->max_leaves) {
+		new_max = eb->max_leaves ? eb->max_leaves * 2 : 16;
+		retval = ext2fs_resize_mem(eb->max_leaves *
+					   sizeof(struct ext_leaf *),
+					   new_max * sizeof(struct ext_leaf *),
+					   &eb->leaves);
+		if (retval)
+			return retval;
+		eb->max_leaves = new_max;
+	}
+	retval = ext2fs_get_mem(sizeof(struct ext_leaf), &leaf);
+	if (retval)
+		return retval;
+	leaf->count = 0;
+	memmove(eb->leaves + where + 1, eb->leaves + where,
+		(eb->num_leaves - where) * sizeof(struct ext_leaf *));
+	eb->leaves[where] = leaf;
+	eb->num_leaves++;
+	return 0;
+}
+
+/*
+ * Insert a new extent just after pos (or at the very beginning if
+ * pos->leaf is -1), and leave pos pointing at it.  The bitmap
+ * interface gives us no way to report running out of memory, so
+ * just like the bit array would have, we give up.
+ */
+static void insert_extent(struct ext_bmap *eb, struct ext_pos *pos,
+			  __u32 start, __u32 count)
+{
+	struct ext_leaf	*leaf;
+	int		l, idx, half;
+
+	if (pos->leaf < 0) {
+		l = 0;
+		idx = 0;
+		if (!eb->num_leaves && new_leaf(eb, 0))
+			abort();
+	} else {
+		l = pos->leaf;
+		idx = pos->idx + 1;
+	}
+	leaf = eb->leaves[l];
+	if (leaf->count == EXTENTS_PER_LEAF) {
+		if (new_leaf(eb, l + 1))
+			abort();
+		half = EXTENTS_PER_LEAF / 2;
+		memcpy(eb->leaves[l + 1]->ext, leaf->ext + half,
+		       (leaf->count - half) * sizeof(struct bmap_extent));
+		eb->leaves[l + 1]->count = leaf->count - half;
+		leaf->count = half;
+		if (idx > half) {
+			l++;
+			idx -= half;
+			leaf = eb->leaves[l];
+		}
+	}
+	memmove(leaf->ext + idx + 1, leaf->ext + idx,
+		(leaf->count - idx) * sizeof(struct bmap_extent));
+	leaf->ext[idx].start = start;
+	leaf->ext[idx].count = count;
+	leaf->count++;
+	pos->leaf = l;
+	pos->idx = idx;
+}
+
+/* Remove the extent at pos, and leave pos pointing at the next one */
+static void delete_extent(struct ext_bmap *eb, struct ext_pos *pos)
+{
+	struct ext_leaf	*leaf = eb->leaves[pos->leaf];
+
+	leaf->count--;
+	memmove(leaf->ext + pos->idx, leaf->ext + pos->idx + 1,
+		(leaf->count - pos->idx) * sizeof(struct bmap_extent));
+	if (leaf->count == 0) {
+		ext2fs_free_mem(&leaf);
+		eb->num_leaves--;
+		memmove(eb->leaves + pos->leaf, eb->leaves + pos->leaf + 1,
+			(eb->num_leaves - pos->leaf) *
+			sizeof(struct ext_leaf *));
+		pos->idx = 0;
+		if (eb->hint >= eb->num_leaves)
+			eb->hint = 0;
+		return;
+	}
+	pos_normalize(eb, pos);
+}
+
+static void ext_mark_bmap_extent(ext2fs_generic_bitmap bmap, __u32 arg,
+				 unsigned int num)
+{
+	struct ext_bmap		*eb = bmap->private;
+	struct bmap_extent	*cur, *next;
+	struct ext_pos		pos, npos;
+	__u64			end = (__u64) arg + num;
+
+	if (!num)
+		return;
+	if (find_extent(eb, arg, &pos) && ext_end(ext_at(eb, &pos)) >= arg) {
+		cur = ext_at(eb, &pos);
+		if (ext_end(cur) >= end)
+			return;
+		cur->count = end - cur->start;
+	} else {
+		insert_extent(eb, &pos, arg, num);
+		cur = ext_at(eb, &pos);
+	}
+
+	/* Swallow any extents which now overlap or touch this one */
+	npos = pos;
+	pos_next(eb, &npos);
+	while (pos_valid(eb, &npos)) {
+		next = ext_at(eb, &npos);
+		if (next->start > ext_end(cur))
+			break;
+		if (ext_end(next) > ext_end(cur))
+			cur->count = ext_end(next) - cur->start;
+		delete_extent(eb, &npos);
+	}
+}
+
+static void ext_unmark_bmap_extent(ext2fs_generic_bitmap bmap, __u32 arg,
+				   unsigned int num)
+{
+	struct ext_bmap		*eb = bmap->private;
+	struct bmap_extent	*cur;
+	struct ext_pos		pos;
+	__u64			end = (__u64) arg + num, cur_end;
+
+	if (!num)
+		return;
+	if (find_extent(eb, arg, &pos)) {
+		cur = ext_at(eb, &pos);
+		cur_end = ext_end(cur);
+		if (cur_end > arg && cur->start < arg) {
+			/* Keep the part before arg... */
+			cur->count = arg - cur->start;
+			/* ... and the part after end, if any */
+			if (cur_end > end) {
+				insert_extent(eb, &pos, end, cur_end - end);
+				return;
+			}
+		}
+		if (cur->start < arg || cur_end <= arg)
+			pos_next(eb, &pos);
+	} else
+		pos_next(eb, &pos);
+
+	while (pos_valid(eb, &pos)) {
+		cur = ext_at(eb, &pos);
+		if (cur->start >= end)
+			break;
+		cur_end = ext_end(cur);
+		if (cur_end > end) {
+			cur->start = end;
+			cur->count = cur_end - end;
+			break;
+		}
+		delete_extent(eb, &pos);
+	}
+}
+
+static int ext_test_bmap(ext2fs_generic_bitmap bmap, __u32 arg)
+{
+	struct ext_bmap	*eb = bmap->private;
+	struct ext_pos	pos;
+
+	return find_extent(eb, arg, &pos) && ext_end(ext_at(eb, &pos)) > arg;
+}
+
+static int ext_mark_bmap(ext2fs_generic_bitmap bmap, __u32 arg)
+{
+	if (ext_test_bmap(bmap, arg))
+		return 1;
+	ext_mark_bmap_extent(bmap, arg, 1);
+	return 0;
+}
+
+static int ext_unmark_bmap(ext2fs_generic_bitmap bmap, __u32 arg)
+{
+	if (!ext_test_bmap(bmap, arg))
+		return 0;
+	ext_unmark_bmap_extent(bmap, arg, 1);
+	return 1;
+}
+
+static int ext_test_clear_bmap_extent(ext2fs_generic_bitmap bmap,
+				      __u32 arg, unsigned int num)
+{
+	struct ext_bmap	*eb = bmap->private;
+	struct ext_pos	pos;
+
+	if (find_extent(eb, arg, &pos) && ext_end(ext_at(eb, &pos)) > arg)
+		return 0;
+	pos_next(eb, &pos);
+	if (pos_valid(eb, &pos) &&
+	    ext_at(eb, &pos)->start < (__u64) arg + num)
+		return 0;
+	return 1;
+}
+
+static void ext_clear_bmap(ext2fs_generic_bitmap bmap)
+{
+	struct ext_bmap	*eb = bmap->private;
+	int		i;
+
+	for (i = 0; i < eb->num_leaves; i++)
+		ext2fs_free_mem(&eb->leaves[i]);
+	eb->num_leaves = 0;
+	eb->hint = 0;
+}
+
+/* Set bits first through last - 1 of the bit array out */
+static void set_bits(unsigned char *out, __u32 first, __u32 last)
+{
+	while (first < last && (first & 7))
+		ext2fs_fast_set_bit(first++, out);
+	if (last - first >= 8) {
+		memset(out + (first >> 3), 0xff, (last - first) >> 3);
+		first += (last - first) & ~7;
+	}
+	while (first < last)
+		ext2fs_fast_set_bit(first++, out);
+}
+
+static void ext_get_bmap_range(ext2fs_generic_bitmap bmap, __u32 arg,
+			       size_t num, void *out)
+{
+	struct ext_bmap		*eb = bmap->private;
+	struct bmap_extent	*cur;
+	struct ext_pos		pos;
+	__u64			first, last, end = (__u64) arg + num;
+
+	memset(out, 0, (num + 7) >> 3);
+	if (!find_extent(eb, arg, &pos) || ext_end(ext_at(eb, &pos)) <= arg)
+		pos_next(eb, &pos);
+	for (; pos_valid(eb, &pos); pos_next(eb, &pos)) {
+		cur = ext_at(eb, &pos);
+		if (cur->start >= end)
+			break;
+		first = (cur->start > arg) ? cur->start : arg;
+		last = (ext_end(cur) < end) ? ext_end(cur) : end;
+		set_bits(out, first - arg, last - arg);
+	}
+}
+
+static void ext_set_bmap_range(ext2fs_generic_bitmap bmap, __u32 arg,
+			       size_t num, void *in)
+{
+	unsigned char	*cp = in;
+	size_t		i = 0, run;
+
+	ext_unmark_bmap_extent(bmap, arg, num);
+	while (i < num) {
+		/* Skip over clear bytes quickly */
+		if (!(i & 7) && !cp[i >> 3]) {
+			i += 8;
+			continue;
+		}
+		if (!ext2fs_test_bit(i, cp)) {
+			i++;
+			continue;
+		}
+		for (run = 1; i + run < num; run++) {
+			if (!((i + run) & 7) && i + run + 8 <= num &&
+			    cp[(i + run) >> 3] == 0xff) {
+				run += 7;
+				continue;
+			}
+			if (!ext2fs_test_bit(i + run, cp))
+				break;
+		}
+		ext_mark_bmap_extent(bmap, arg + i, run);
+		i += run;
+	}
+}
+
+static errcode_t ext_find_first_zero(ext2fs_generic_bitmap bmap, __u32 start,
+				     __u32 end, __u32 *out)
+{
+	struct ext_bmap	*eb = bmap->private;
+	struct ext_pos	pos;
+	__u64		first = start;
+
+	/* Extents never touch, so the bit after one is always clear */
+	if (find_extent(eb, start, &pos) && ext_end(ext_at(eb, &pos)) > start)
+		first = ext_end(ext_at(eb, &pos));
+	if (first > end)
+		return ENOENT;
+	*out = first;
+	return 0;
+}
+
+static errcode_t ext_find_first_set(ext2fs_generic_bitmap bmap, __u32 start,
+				    __u32 end, __u32 *out)
+{
+	struct ext_bmap	*eb = bmap->private;
+	struct ext_pos	pos;
+
+	if (find_extent(eb, start, &pos) &&
+	    ext_end(ext_at(eb, &pos)) > start) {
+		*out = start;
+		return 0;
+	}
+	pos_next(eb, &pos);
+	if (!pos_valid(eb, &pos) || ext_at(eb, &pos)->start > end)
+		return ENOENT;
+	*out = ext_at(eb, &pos)->start;
+	return 0;
+}
+
+static __u32 ext_count_range(ext2fs_generic_bitmap bmap, __u32 start,
+			     __u32 end)
+{
+	struct ext_bmap		*eb = bmap->private;
+	struct bmap_extent	*cur;
+	struct ext_pos		pos;
+	__u64			first, last;
+	__u32			count = 0;
+
+	if (!find_extent(eb, start, &pos) ||
+	    ext_end(ext_at(eb, &pos)) <= start)
+		pos_next(eb, &pos);
+	for (; pos_valid(eb, &pos); pos_next(eb, &pos)) {
+		cur = ext_at(eb, &pos);
+		if (cur->start > end)
+			break;
+		first = (cur->start > start) ? cur->start : start;
+		last = (ext_end(cur) <= end) ? ext_end(cur) : (__u64) end + 1;
+		count += last - first;
+	}
+	return count;
+}
+
+static errcode_t ext_new_bmap(ext2fs_generic_bitmap bmap, char *init_map)
+{
+	struct ext_bmap	*eb;
+	errcode_t	retval;
+
+	retval = ext2fs_get_mem(sizeof(struct ext_bmap), &eb);
+	if (retval)
+		return retval;
+	memset(eb, 0, sizeof(struct ext_bmap));
+	bmap->private = eb;
+	if (init_map)
+		ext_set_bmap_range(bmap, 0,
+				   (size_t) (bmap->real_end - bmap->start) + 1,
+				   init_map);
+	return 0;
+}
+
+static void ext_free_bmap(ext2fs_generic_bitmap bmap)
+{
+	struct ext_bmap	*eb = bmap->private;
+
+	if (!eb)
+		return;
+	ext_clear_bmap(bmap);
+	if (eb->leaves)
+		ext2fs_free_mem(&eb->leaves);
+	ext2fs_free_mem(&bmap->private);
+}
+
+static errcode_t ext_copy_bmap(ext2fs_generic_bitmap src,
+			       ext2fs_generic_bitmap dest)
+{
+	struct ext_bmap	*src_eb = src->private, *eb;
+	errcode_t	retval;
+	int		i;
+
+	retval = ext_new_bmap(dest, 0);
+	if (retval)
+		return retval;
+	eb = dest->private;
+	for (i = 0; i < src_eb->num_leaves; i++) {
+		retval = new_leaf(eb, i);
+		if (retval) {
+			ext_free_bmap(dest);
+			return retval;
+		}
+		memcpy(eb->leaves[i], src_eb->leaves[i],
+		       sizeof(struct ext_leaf));
+	}
+	return 0;
+}
+
+static errcode_t ext_resize_bmap(ext2fs_generic_bitmap bmap,
+				 __u32 new_real_end)
+{
+	/* Drop anything beyond the new end */
+	if (new_real_end < bmap->real_end)
+		ext_unmark_bmap_extent(bmap, new_real_end - bmap->start + 1,
+				       bmap->real_end - new_real_end);
+	return 0;
+}
+
+struct ext2_bitmap_ops ext2fs_bitmap_extent = {
+	EXT2FS_BMAP_EXTENT,
+	ext_new_bmap,
+	ext_free_bmap,
+	ext_copy_bmap,
+	ext_resize_bmap,
+	ext_mark_bmap,
+	ext_unmark_bmap,
+	ext_test_bmap,
+	ext_mark_bmap_extent,
+	ext_unmark_bmap_extent,
+	ext_test_clear_bmap_extent,
+	ext_set_bmap_range,
+	ext_get_bmap_range,
+	ext_clear_bmap,
+	ext_find_first_zero,
+	ext_find_first_set,
+	ext_count_range
+};
+
+#ifdef DEBUG
+/*
+ * Make sure the extents are sorted, don't overlap or touch, and lie
+ * inside the bitmap, and that no leaf is empty or overfull.  For
+ * tst_bmap, shapes[] counts the leaves seen, the checks which found
+ * more than one leaf, and the full leaves seen.
+ */
+int ext2fs_check_extent_bitmap(ext2fs_generic_bitmap bmap, int *shapes)
+{
+	struct ext_bmap	*eb = bmap->private;
+	struct ext_leaf	*leaf;
+	__u64		prev_end = 0;
+	int		l, i, first = 1;
+
+	for (l = 0; l < eb->num_leaves; l++) {
+		leaf = eb->leaves[l];
+		if (leaf->count <= 0 || leaf->count > EXTENTS_PER_LEAF)
+			goto bad;
+		for (i = 0; i < leaf->count; i++) {
+			if (!leaf->ext[i].count ||
+			    (!first && leaf->ext[i].start <= prev_end) ||
+			    ext_end(&leaf->ext[i]) >
+			    (__u64) bmap->real_end - bmap->start + 1)
+				goto bad;
+			prev_end = ext_end(&leaf->ext[i]);
+			first = 0;
+		}
+		shapes[0]++;
+		if (leaf->count == EXTENTS_PER_LEAF)
+			shapes[2]++;
+	}
+	if (eb->num_leaves > 1)
+		shapes[1]++;
+	return 0;
+bad:
+	printf("Extent leaf %d of %d is corrupt\n", l, eb->num_leaves);
+	return 1;
+}
+#endif
@@ -56,6 +56,35 @@ struct block_context {
 		}							\
 	} while (0)
 
+/*
+ * Start reading the indirect blocks listed in a doubly or triply
+ * indirect block before descending into the first of them.
+ * Consecutive blocks are merged into a single request.
+ */
+static void readahead_ind_blocks(struct block_context *ctx, blk_t *blocks)
+{
+	blk_t	blk, run_start = 0, run_len = 0;
+	int	i, limit;
+
+	limit = ctx->fs->blocksize >> 2;
+	for (i = 0; i < limit; i++) {
+		blk = blocks[i];
+		if (!blk || blk >= ctx->fs->super->s_blocks_count ||
+		    blk < ctx->fs->super->s_first_data_block)
+			continue;
+		if (run_len && blk == run_start + run_len) {
+			run_len++;
+			continue;
+		}
+		if (run_len)
+			io_channel_readahead(ctx->fs->io, run_start, run_len);
+		run_start = blk;
+		run_len = 1;
+	}
+	if (run_len)
+		io_channel_readahead(ctx->fs->io, run_start, run_len);
+}
+
 static int block_iterate_ind(blk_t *ind_block, blk_t ref_block,
 			     int ref_offset, struct block_context *ctx)
 {
@@ -164,6 +193,8 @@ static int block_iterate_dind(blk_t *dind_block, blk_t ref_block,
 		ret |= BLOCK_ERROR;
 		return ret;
 	}
+	if (ctx->flags & BLOCK_FLAG_READAHEAD)
+		readahead_ind_blocks(ctx, (blk_t *) ctx->dind_buf);
 
 	block_nr = (blk_t *) ctx->dind_buf;
 	offset = 0;
@@ -243,6 +274,8 @@ static int block_iterate_tind(blk_t *tind_block, blk_t ref_block,
 		ret |= BLOCK_ERROR;
 		return ret;
 	}
+	if (ctx->flags & BLOCK_FLAG_READAHEAD)
+		readahead_ind_blocks(ctx, (blk_t *) ctx->tind_buf);
 
 	block_nr = (blk_t *) ctx->tind_buf;
 	offset = 0;
@@ -234,6 +234,10 @@ errcode_t ext2fs_flush(ext2_filsys fs)
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 
+	retval = ext2fs_write_icache(fs);
+	if (retval)
+		return retval;
+
 	fs_state = fs->super->s_state;
 	feature_incompat = fs->super->s_feature_incompat;
 
@@ -378,6 +382,9 @@ errcode_t ext2fs_close(ext2_filsys fs)
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 
+	retval = ext2fs_write_icache(fs);
+	if (retval)
+		return retval;
 	if (fs->write_bitmaps) {
 		retval = fs->write_bitmaps(fs);
 		if (retval)
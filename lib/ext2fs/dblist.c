@@ -217,6 +217,42 @@ void ext2fs_dblist_sort(ext2_dblist dblist,
 /*
  * This function iterates over the directory block list
  */
+/*
+ * Number of directory blocks for which we issue readahead at a time
+ * while iterating over a dblist.
+ */
+#define DBLIST_READAHEAD	64
+
+/*
+ * Issue readahead for the next DBLIST_READAHEAD entries starting at
+ * index start, merging runs of consecutive blocks into one request.
+ */
+static void dblist_readahead(ext2_dblist dblist, ext2_ino_t start)
+{
+	ext2_ino_t	i, end;
+	blk_t		blk, run_start = 0, run_len = 0;
+
+	end = start + DBLIST_READAHEAD;
+	if (end > dblist->count)
+		end = dblist->count;
+	for (i = start; i < end; i++) {
+		blk = dblist->list[(int)i].blk;
+		if (!blk)
+			continue;
+		if (run_len && blk == run_start + run_len) {
+			run_len++;
+			continue;
+		}
+		if (run_len)
+			io_channel_readahead(dblist->fs->io, run_start,
+					     run_len);
+		run_start = blk;
+		run_len = 1;
+	}
+	if (run_len)
+		io_channel_readahead(dblist->fs->io, run_start, run_len);
+}
+
 errcode_t ext2fs_dblist_iterate(ext2_dblist dblist,
 				int (*func)(ext2_filsys fs,
 					    struct ext2_db_entry *db_info,
@@ -231,6 +267,8 @@ errcode_t ext2fs_dblist_iterate(ext2_dblist dblist,
 	if (!dblist->sorted)
 		ext2fs_dblist_sort(dblist, 0);
 	for (i=0; i < dblist->count; i++) {
+		if ((i % DBLIST_READAHEAD) == 0)
+			dblist_readahead(dblist, i);
 		ret = (*func)(dblist->fs, &dblist->list[(int)i], priv_data);
 		if (ret & DBLIST_ABORT)
 			return 0;
@@ -27,6 +27,7 @@ ext2_loff_t ext2fs_llseek (int, ext2_loff_t, int);
 typedef struct struct_io_manager *io_manager;
 typedef struct struct_io_channel *io_channel;
 typedef struct struct_io_stats *io_stats;
+typedef struct struct_io_request *io_request;
 
 #define CHANNEL_FLAGS_WRITETHROUGH	0x01
 
@@ -56,13 +57,41 @@ struct struct_io_channel {
 	void		*app_data;
 };
 
+/*
+ * latency[n] counts the read and write calls which took less than
+ * 2^n microseconds (and at least 2^(n-1)); the last bucket also
+ * counts anything slower.
+ */
+#define IO_STATS_LATENCY_BUCKETS	32
+
 struct struct_io_stats {
 	int			num_fields;
 	int			reserved;
 	unsigned long long	bytes_read;
 	unsigned long long	bytes_written;
+	unsigned long long	cache_hits;
+	unsigned long long	cache_misses;
+	unsigned long long	read_calls;
+	unsigned long long	write_calls;
+	unsigned long long	seeks;
+	unsigned long long	seek_distance;	/* in bytes */
+	unsigned long long	latency[IO_STATS_LATENCY_BUCKETS];
 };
 
+/*
+ * A single request passed to io_channel_read_batch() and
+ * io_channel_write_batch(); a negative count is a byte count, as for
+ * read_blk and write_blk.
+ */
+struct struct_io_request {
+	unsigned long long	block;
+	int			count;
+	void			*buf;
+	errcode_t		error;
+};
+
+#define IO_BATCH_WRITE		0x0001
+
 struct struct_io_manager {
 	errcode_t magic;
 	const char *name;
@@ -83,7 +112,11 @@ struct struct_io_manager {
 					int count, void *data);
 	errcode_t (*write_blk64)(io_channel channel, unsigned long long block,
 					int count, const void *data);
-	long	reserved[16];
+	errcode_t (*readahead)(io_channel channel, unsigned long long block,
+			       unsigned long long count);
+	errcode_t (*rw_batch)(io_channel channel, int flags, io_request reqs,
+			      int count);
+	long	reserved[14];
 };
 
 #define IO_FLAG_RW		0x0001
@@ -112,15 +145,58 @@ extern errcode_t io_channel_read_blk64(io_channel channel,
 extern errcode_t io_channel_write_blk64(io_channel channel,
 					unsigned long long block,
 					int count, const void *data);
+extern errcode_t io_channel_readahead(io_channel channel,
+				      unsigned long long block,
+				      unsigned long long count);
+extern errcode_t io_channel_read_batch(io_channel channel, io_request reqs,
+				       int count);
+extern errcode_t io_channel_write_batch(io_channel channel, io_request reqs,
+					int count);
 
 /* unix_io.c */
 extern io_manager unix_io_manager;
+extern io_manager io_uring_io_manager;
+extern io_manager mmap_io_manager;
 
 /* undo_io.c */
 extern io_manager undo_io_manager;
 extern errcode_t set_undo_io_backing_manager(io_manager manager);
 extern errcode_t set_undo_io_backup_file(char *file_name);
 
+/*
+ * Undo log format.  The header sits at the start of the file and is
+ * rewritten when the channel is closed.  It is followed by the saved
+ * blocks, each preceded by its own entry, appended in the order the
+ * blocks were first written; the compact index of all entries is
+ * written after the last block.  A log with no index (index_offset
+ * of zero) was not closed cleanly, but can still be replayed by
+ * scanning the records; the checksum in each record header marks
+ * where the last complete record ends.  All fields are
+ * little-endian; fs_mtime and fs_uuid are copied as-is from the
+ * superblock.
+ */
+#define E2UNDO_LOG_MAGIC	"E2UNDOLG"
+#define E2UNDO_LOG_VERSION	1
+#define E2UNDO_LOG_HDR_SIZE	1024
+
+struct undo_log_header {
+	char			magic[8];
+	unsigned int		version;
+	unsigned int		block_size;	/* size of each saved block */
+	unsigned long long	index_offset;
+	unsigned long long	num_entries;
+	unsigned int		fs_mtime;
+	unsigned char		fs_uuid[16];
+	unsigned int		reserved[3];
+};
+
+struct undo_log_entry {
+	unsigned long long	block;		/* in units of block_size */
+	unsigned long long	offset;		/* of the data in the log */
+	unsigned int		size;		/* less for a short read */
+	unsigned int		csum;		/* crc16 of the saved data */
+};
+
 /* test_io.c */
 extern io_manager test_io_manager, test_io_backing_manager;
 extern void (*test_io_cb_read_blk)
@@ -129,6 +205,40 @@ extern void (*test_io_cb_write_blk)
 	(unsigned long block, int count, errcode_t err);
 extern void (*test_io_cb_set_blksize)
 	(int blksize, errcode_t err);
+extern int test_io_trace_tag;
+
+/*
+ * If TEST_IO_TRACE names a file, the test I/O manager appends a
+ * binary record of every operation to it: a header (written only
+ * when the file is empty), followed by one record per operation.
+ * All fields are little-endian.  The tag is whatever the application
+ * last put in test_io_trace_tag (e2fsck uses the pass number).
+ */
+#define TEST_IO_TRACE_MAGIC	0x45325452	/* "E2TR" */
+#define TEST_IO_TRACE_VERSION	1
+
+struct test_io_trace_hdr {
+	unsigned int		magic;
+	unsigned int		version;
+	unsigned int		rec_size;
+	unsigned int		reserved;
+};
+
+struct test_io_trace_rec {
+	unsigned long long	block;
+	int			count;	/* negative for a byte count */
+	unsigned short		op;
+	unsigned short		tag;
+	unsigned long long	usec;	/* since the channel was opened */
+	unsigned int		block_size;
+	unsigned int		error;
+};
+
+#define TEST_IO_TRACE_READ		1
+#define TEST_IO_TRACE_WRITE		2
+#define TEST_IO_TRACE_FLUSH		3
+#define TEST_IO_TRACE_READAHEAD		4
+#define TEST_IO_TRACE_WRITE_BYTE	5
 
 #endif /* _EXT2FS_EXT2_IO_H */
 
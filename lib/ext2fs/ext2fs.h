@@ -109,6 +109,13 @@ typedef struct ext2fs_struct_generic_bitmap *ext2fs_generic_bitmap;
 typedef struct ext2fs_struct_generic_bitmap *ext2fs_inode_bitmap;
 typedef struct ext2fs_struct_generic_bitmap *ext2fs_block_bitmap;
 
+/*
+ * How the bits of a bitmap are stored; see fs->default_bitmap_type
+ */
+#define EXT2FS_BMAP_BITARRAY	1	/* a flat bit array (the default) */
+#define EXT2FS_BMAP_EXTENT	2	/* a sorted list of set runs */
+#define EXT2FS_BMAP_CONTAINER	3	/* compressed containers of 64K bits */
+
 #define EXT2_FIRST_INODE(s)	EXT2_FIRST_INO(s)
 
 
@@ -185,6 +192,8 @@ typedef struct ext2_file *ext2_file_t;
 #ifdef EXT2FS_SNAPSHOT_EXCLUDE_BITMAP
 #define EXT2_FLAG_EXCLUDE_DIRTY		0x100000
 #endif
+#define EXT2_FLAG_LAZY_BITMAPS		0x200000
+#define EXT2_FLAG_ICACHE_WRITEBACK	0x400000
 
 /*
  * Special flag in the ext2 inode i_flag field that means that this is
@@ -199,6 +208,15 @@ typedef struct ext2_file *ext2_file_t;
  */
 #define EXT2_MKJOURNAL_V1_SUPER	0x0000001
 
+/*
+ * Flags for ext2fs_new_range
+ *
+ * EXT2_NEWRANGE_FIXED_GOAL	The range must start at the goal
+ * EXT2_NEWRANGE_MIN_LENGTH	The range must be the full length asked for
+ */
+#define EXT2_NEWRANGE_FIXED_GOAL	0x0001
+#define EXT2_NEWRANGE_MIN_LENGTH	0x0002
+
 #define opaque_ext2_group_desc ext2_group_desc
 
 struct struct_ext2_filsys {
@@ -233,10 +251,11 @@ struct struct_ext2_filsys {
 	struct ext2_image_hdr *		image_header;
 	__u32				umask;
 	time_t				now;
+	int				default_bitmap_type;
 	/*
 	 * Reserved for future expansion
 	 */
-	__u32				reserved[7];
+	__u32				reserved[6];
 
 	/*
 	 * Reserved for the use of the calling application.
@@ -291,6 +310,10 @@ struct struct_ext2_filsys {
  * BLOCK_FLAG_READ_ONLY is a promise by the caller that it will not
  * modify returned block number.
  *
+ * BLOCK_FLAG_READAHEAD asks the iterator to start reading all of the
+ * indirect blocks listed in a doubly or triply indirect block as soon
+ * as that block has been read.
+ *
  * BLOCK_FLAG_NO_LARGE is for internal use only.  It informs
  * ext2fs_block_iterate2 that large files won't be accepted.
  */
@@ -299,6 +322,7 @@ struct struct_ext2_filsys {
 #define BLOCK_FLAG_DEPTH_TRAVERSE	2
 #define BLOCK_FLAG_DATA_ONLY	4
 #define BLOCK_FLAG_READ_ONLY	8
+#define BLOCK_FLAG_READAHEAD	16
 
 #define BLOCK_FLAG_NO_LARGE	0x1000
 
@@ -424,6 +448,7 @@ typedef struct ext2_struct_inode_scan *ext2_inode_scan;
 #define EXT2_SF_BAD_EXTRA_BYTES	0x0004
 #define EXT2_SF_SKIP_MISSING_ITABLE	0x0008
 #define EXT2_SF_DO_LAZY		0x0010
+#define EXT2_SF_PREFETCH	0x0020
 
 /*
  * ext2fs_check_if_mounted flags
@@ -598,6 +623,9 @@ extern errcode_t ext2fs_get_free_blocks(ext2_filsys fs, blk_t start,
 					blk_t finish, int num,
 					ext2fs_block_bitmap map,
 					blk_t *ret);
+extern errcode_t ext2fs_new_range(ext2_filsys fs, blk_t goal, blk_t len,
+				  int flags, ext2fs_block_bitmap map,
+				  blk_t *ret_start, blk_t *ret_len);
 extern errcode_t ext2fs_alloc_block(ext2_filsys fs, blk_t goal,
 				    char *block_buf, blk_t *ret);
 extern void ext2fs_set_alloc_block_callback(ext2_filsys fs,
@@ -625,6 +653,7 @@ void ext2fs_inode_alloc_stats(ext2_filsys fs, ext2_ino_t ino, int inuse);
 void ext2fs_inode_alloc_stats2(ext2_filsys fs, ext2_ino_t ino,
 			       int inuse, int isdir);
 void ext2fs_block_alloc_stats(ext2_filsys fs, blk_t blk, int inuse);
+errcode_t ext2fs_calculate_summary_stats(ext2_filsys fs);
 
 /* alloc_tables.c */
 extern errcode_t ext2fs_allocate_tables(ext2_filsys fs);
@@ -940,6 +969,7 @@ extern errcode_t ext2fs_sync_device(int fd, int flushb);
 /* freefs.c */
 extern void ext2fs_free(ext2_filsys fs);
 extern void ext2fs_free_dblist(ext2_dblist dblist);
+extern void ext2fs_free_inode_cache(struct ext2_inode_cache *icache);
 extern void ext2fs_badblocks_list_free(ext2_badblocks_list bb);
 extern void ext2fs_u32_list_free(ext2_u32_list bb);
 
@@ -1037,6 +1067,9 @@ errcode_t ext2fs_icount_validate(ext2_icount_t icount, FILE *);
 
 /* inode.c */
 extern errcode_t ext2fs_flush_icache(ext2_filsys fs);
+extern errcode_t ext2fs_write_icache(ext2_filsys fs);
+extern errcode_t ext2fs_create_inode_cache(ext2_filsys fs,
+					   unsigned int cache_size);
 extern errcode_t ext2fs_get_next_inode_full(ext2_inode_scan scan,
 					    ext2_ino_t *ino,
 					    struct ext2_inode *inode,
@@ -1062,6 +1095,14 @@ extern errcode_t ext2fs_read_inode_full(ext2_filsys fs, ext2_ino_t ino,
 					int bufsize);
 extern errcode_t ext2fs_read_inode (ext2_filsys fs, ext2_ino_t ino,
 			    struct ext2_inode * inode);
+extern errcode_t ext2fs_read_inodes(ext2_filsys fs, ext2_ino_t *inos,
+				    int count,
+				    errcode_t (*func)(ext2_filsys fs,
+						      ext2_ino_t ino,
+						      int index,
+						      struct ext2_inode *inode,
+						      void *priv_data),
+				    void *priv_data);
 extern errcode_t ext2fs_write_inode_full(ext2_filsys fs, ext2_ino_t ino,
 					 struct ext2_inode * inode,
 					 int bufsize);
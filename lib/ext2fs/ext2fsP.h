@@ -62,18 +62,28 @@ struct dir_context {
 /*
  * Inode cache structure
  */
+/*
+ * The inode cache holds whole blocks of the inode tables.  Its entries
+ * are kept on an LRU list, most recently used first, and the ones in
+ * use are also chained into a hash table indexed by block number.
+ */
 struct ext2_inode_cache {
-	void *				buffer;
-	blk_t				buffer_blk;
-	int				cache_last;
-	int				cache_size;
+	int				cache_size;	/* in blocks */
+	int				hash_size;	/* a power of two */
 	int				refcount;
+	int				dirty_count;
 	struct ext2_inode_cache_ent	*cache;
+	struct ext2_inode_cache_ent	**hash;
+	struct ext2_inode_cache_ent	*lru_head, *lru_tail;
+	char				*buffers;
 };
 
 struct ext2_inode_cache_ent {
-	ext2_ino_t		ino;
-	struct ext2_inode	inode;
+	blk_t				blk;	/* zero if not in use */
+	int				dirty;
+	char				*buf;
+	struct ext2_inode_cache_ent	*hash_next;
+	struct ext2_inode_cache_ent	*lru_prev, *lru_next;
 };
 
 /* Function prototypes */
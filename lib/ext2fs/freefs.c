@@ -17,8 +17,6 @@
 #include "ext2_fs.h"
 #include "ext2fsP.h"
 
-static void ext2fs_free_inode_cache(struct ext2_inode_cache *icache);
-
 void ext2fs_free(ext2_filsys fs)
 {
 	if (!fs || (fs->magic != EXT2_ET_MAGIC_EXT2FS_FILSYS))
@@ -65,15 +63,16 @@ void ext2fs_free(ext2_filsys fs)
 /*
  * Free the inode cache structure
  */
-static void ext2fs_free_inode_cache(struct ext2_inode_cache *icache)
+void ext2fs_free_inode_cache(struct ext2_inode_cache *icache)
 {
 	if (--icache->refcount)
 		return;
-	if (icache->buffer)
-		ext2fs_free_mem(&icache->buffer);
+	if (icache->buffers)
+		ext2fs_free_mem(&icache->buffers);
+	if (icache->hash)
+		ext2fs_free_mem(&icache->hash);
 	if (icache->cache)
 		ext2fs_free_mem(&icache->cache);
-	icache->buffer_blk = 0;
 	ext2fs_free_mem(&icache);
 }
 
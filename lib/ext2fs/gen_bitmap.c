@@ -26,17 +26,7 @@
 
 #include "ext2_fs.h"
 #include "ext2fs.h"
-
-struct ext2fs_struct_generic_bitmap {
-	errcode_t	magic;
-	ext2_filsys 	fs;
-	__u32		start, end;
-	__u32		real_end;
-	char	*	description;
-	char	*	bitmap;
-	errcode_t	base_error_code;
-	__u32		reserved[7];
-};
+#include "gen_bitmap.h"
 
 /*
  * Used by previously inlined function, so we have to export this and
@@ -63,6 +53,73 @@ static errcode_t check_magic(ext2fs_generic_bitmap bitmap)
 	return 0;
 }
 
+/*
+ * Note that bits start to num bits later (relative to the start of
+ * the bitmap) may have been changed
+ */
+static void mark_dirty(ext2fs_generic_bitmap bmap, __u32 start, __u32 num)
+{
+	__u32	i;
+
+	if (!bmap->dirty_map || !num)
+		return;
+	for (i = start >> bmap->dirty_shift;
+	     i <= (start + num - 1) >> bmap->dirty_shift; i++)
+		ext2fs_fast_set_bit(i, bmap->dirty_map);
+}
+
+/*
+ * Note that bits start to num bits later (relative to the start of
+ * the bitmap) may have been cleared, so the free run index can no
+ * longer be trusted for their groups.  Setting bits only shortens
+ * runs, so that doesn't need to be noted.
+ */
+static void runs_stale(ext2fs_generic_bitmap bmap, __u32 start, __u32 num)
+{
+	__u32	i;
+
+	if (!bmap->run_sums || !num)
+		return;
+	for (i = start / bmap->run_group_bits;
+	     i <= (start + num - 1) / bmap->run_group_bits; i++)
+		bmap->run_sums[i].max = ~0U;
+}
+
+/*
+ * Make sure that the groups holding bits start to end (relative to
+ * the start of the bitmap) have been loaded
+ */
+static void load_groups(ext2fs_generic_bitmap bmap, __u32 start, __u32 end)
+{
+	errcode_t	retval;
+	dgrp_t		group;
+
+	if (!bmap->unloaded)
+		return;
+	for (group = start / bmap->group_bits;
+	     group <= end / bmap->group_bits; group++) {
+		if (!ext2fs_test_bit(group, bmap->unloaded))
+			continue;
+		ext2fs_clear_bit(group, bmap->unloaded);
+		retval = (bmap->load_group)(bmap, group);
+#ifndef OMIT_COM_ERR
+		if (retval)
+			com_err(0, retval, "while loading group %u of %s",
+				group, bmap->description ? bmap->description :
+				"bitmap");
+#endif
+		if (--bmap->unloaded_count == 0) {
+			ext2fs_free_mem(&bmap->unloaded);
+			break;
+		}
+	}
+}
+
+static void load_all_groups(ext2fs_generic_bitmap bmap)
+{
+	load_groups(bmap, 0, bmap->real_end - bmap->start);
+}
+
 errcode_t ext2fs_make_generic_bitmap(errcode_t magic, ext2_filsys fs,
 				     __u32 start, __u32 end, __u32 real_end,
 				     const char *descr, char *init_map,
@@ -70,7 +127,6 @@ errcode_t ext2fs_make_generic_bitmap(errcode_t magic, ext2_filsys fs,
 {
 	ext2fs_generic_bitmap	bitmap;
 	errcode_t		retval;
-	size_t			size;
 
 	retval = ext2fs_get_mem(sizeof(struct ext2fs_struct_generic_bitmap),
 				&bitmap);
@@ -82,6 +138,12 @@ errcode_t ext2fs_make_generic_bitmap(errcode_t magic, ext2_filsys fs,
 	bitmap->start = start;
 	bitmap->end = end;
 	bitmap->real_end = real_end;
+	bitmap->private = 0;
+	bitmap->dirty_map = 0;
+	bitmap->dirty_shift = 0;
+	bitmap->group_loc = 0;
+	bitmap->unloaded = 0;
+	bitmap->run_sums = 0;
 	switch (magic) {
 	case EXT2_ET_MAGIC_INODE_BITMAP:
 		bitmap->base_error_code = EXT2_ET_BAD_INODE_MARK;
@@ -102,20 +164,20 @@ errcode_t ext2fs_make_generic_bitmap(errcode_t magic, ext2_filsys fs,
 	} else
 		bitmap->description = 0;
 
-	size = (size_t) (((bitmap->real_end - bitmap->start) / 8) + 1);
-	/* Round up to allow for the BT x86 instruction */
-	size = (size + 7) & ~3;
-	retval = ext2fs_get_mem(size, &bitmap->bitmap);
+	if (fs && fs->default_bitmap_type == EXT2FS_BMAP_EXTENT)
+		bitmap->bitmap_ops = &ext2fs_bitmap_extent;
+	else if (fs && fs->default_bitmap_type == EXT2FS_BMAP_CONTAINER)
+		bitmap->bitmap_ops = &ext2fs_bitmap_container;
+	else
+		bitmap->bitmap_ops = &ext2fs_bitmap_bitarray;
+
+	retval = bitmap->bitmap_ops->new_bmap(bitmap, init_map);
 	if (retval) {
-		ext2fs_free_mem(&bitmap->description);
+		if (bitmap->description)
+			ext2fs_free_mem(&bitmap->description);
 		ext2fs_free_mem(&bitmap);
 		return retval;
 	}
-
-	if (init_map)
-		memcpy(bitmap->bitmap, init_map, size);
-	else
-		memset(bitmap->bitmap, 0, size);
 	*ret = bitmap;
 	return 0;
 }
@@ -133,11 +195,38 @@ errcode_t ext2fs_allocate_generic_bitmap(__u32 start,
 errcode_t ext2fs_copy_generic_bitmap(ext2fs_generic_bitmap src,
 				     ext2fs_generic_bitmap *dest)
 {
-	return (ext2fs_make_generic_bitmap(src->magic, src->fs,
-					   src->start, src->end,
-					   src->real_end,
-					   src->description, src->bitmap,
-					   dest));
+	ext2fs_generic_bitmap	bitmap;
+	errcode_t		retval;
+
+	load_all_groups(src);
+	retval = ext2fs_get_mem(sizeof(struct ext2fs_struct_generic_bitmap),
+				&bitmap);
+	if (retval)
+		return retval;
+	*bitmap = *src;
+	bitmap->private = 0;
+	bitmap->dirty_map = 0;
+	bitmap->group_loc = 0;
+	bitmap->run_sums = 0;
+	if (src->description) {
+		retval = ext2fs_get_mem(strlen(src->description)+1,
+					&bitmap->description);
+		if (retval) {
+			ext2fs_free_mem(&bitmap);
+			return retval;
+		}
+		strcpy(bitmap->description, src->description);
+	}
+	/* The copy is stored the same way as the original */
+	retval = src->bitmap_ops->copy_bmap(src, bitmap);
+	if (retval) {
+		if (bitmap->description)
+			ext2fs_free_mem(&bitmap->description);
+		ext2fs_free_mem(&bitmap);
+		return retval;
+	}
+	*dest = bitmap;
+	return 0;
 }
 
 void ext2fs_free_generic_bitmap(ext2fs_inode_bitmap bitmap)
@@ -150,10 +239,12 @@ void ext2fs_free_generic_bitmap(ext2fs_inode_bitmap bitmap)
 		ext2fs_free_mem(&bitmap->description);
 		bitmap->description = 0;
 	}
-	if (bitmap->bitmap) {
-		ext2fs_free_mem(&bitmap->bitmap);
-		bitmap->bitmap = 0;
-	}
+	ext2fs_untrack_bitmap_groups(bitmap);
+	ext2fs_unindex_bitmap_runs(bitmap);
+	if (bitmap->unloaded)
+		ext2fs_free_mem(&bitmap->unloaded);
+	bitmap->bitmap_ops->free_bmap(bitmap);
+	bitmap->private = 0;
 	ext2fs_free_mem(&bitmap);
 }
 
@@ -164,27 +255,45 @@ int ext2fs_test_generic_bitmap(ext2fs_generic_bitmap bitmap,
 		ext2fs_warn_bitmap2(bitmap, EXT2FS_TEST_ERROR, bitno);
 		return 0;
 	}
-	return ext2fs_test_bit(bitno - bitmap->start, bitmap->bitmap);
+	bitno -= bitmap->start;
+	load_groups(bitmap, bitno, bitno);
+	return bitmap->bitmap_ops->test_bmap(bitmap, bitno);
 }
 
 int ext2fs_mark_generic_bitmap(ext2fs_generic_bitmap bitmap,
 					 __u32 bitno)
 {
+	int	retval;
+
 	if ((bitno < bitmap->start) || (bitno > bitmap->end)) {
 		ext2fs_warn_bitmap2(bitmap, EXT2FS_MARK_ERROR, bitno);
 		return 0;
 	}
-	return ext2fs_set_bit(bitno - bitmap->start, bitmap->bitmap);
+	bitno -= bitmap->start;
+	load_groups(bitmap, bitno, bitno);
+	retval = bitmap->bitmap_ops->mark_bmap(bitmap, bitno);
+	if (!retval)
+		mark_dirty(bitmap, bitno, 1);
+	return retval;
 }
 
 int ext2fs_unmark_generic_bitmap(ext2fs_generic_bitmap bitmap,
 					   blk_t bitno)
 {
+	int	retval;
+
 	if ((bitno < bitmap->start) || (bitno > bitmap->end)) {
 		ext2fs_warn_bitmap2(bitmap, EXT2FS_UNMARK_ERROR, bitno);
 		return 0;
 	}
-	return ext2fs_clear_bit(bitno - bitmap->start, bitmap->bitmap);
+	bitno -= bitmap->start;
+	load_groups(bitmap, bitno, bitno);
+	retval = bitmap->bitmap_ops->unmark_bmap(bitmap, bitno);
+	if (retval) {
+		mark_dirty(bitmap, bitno, 1);
+		runs_stale(bitmap, bitno, 1);
+	}
+	return retval;
 }
 
 __u32 ext2fs_get_generic_bitmap_start(ext2fs_generic_bitmap bitmap)
@@ -202,8 +311,12 @@ void ext2fs_clear_generic_bitmap(ext2fs_generic_bitmap bitmap)
 	if (check_magic(bitmap))
 		return;
 
-	memset(bitmap->bitmap, 0,
-	       (size_t) (((bitmap->real_end - bitmap->start) / 8) + 1));
+	/* Nothing that is on disk matters any more */
+	if (bitmap->unloaded)
+		ext2fs_free_mem(&bitmap->unloaded);
+	bitmap->bitmap_ops->clear_bmap(bitmap);
+	mark_dirty(bitmap, 0, bitmap->real_end - bitmap->start + 1);
+	runs_stale(bitmap, 0, bitmap->real_end - bitmap->start + 1);
 }
 
 errcode_t ext2fs_fudge_generic_bitmap_end(ext2fs_inode_bitmap bitmap,
@@ -217,6 +330,7 @@ errcode_t ext2fs_fudge_generic_bitmap_end(ext2fs_inode_bitmap bitmap,
 	if (oend)
 		*oend = bitmap->end;
 	bitmap->end = end;
+	ext2fs_unindex_bitmap_runs(bitmap);
 	return 0;
 }
 
@@ -225,12 +339,13 @@ errcode_t ext2fs_resize_generic_bitmap(errcode_t magic,
 				       ext2fs_generic_bitmap bmap)
 {
 	errcode_t	retval;
-	size_t		size, new_size;
 	__u32		bitno;
 
 	if (!bmap || (bmap->magic != magic))
 		return magic;
 
+	load_all_groups(bmap);
+	ext2fs_unindex_bitmap_runs(bmap);
 	/*
 	 * If we're expanding the bitmap, make sure all of the new
 	 * parts of the bitmap are zero.
@@ -239,24 +354,24 @@ errcode_t ext2fs_resize_generic_bitmap(errcode_t magic,
 		bitno = bmap->real_end;
 		if (bitno > new_end)
 			bitno = new_end;
-		for (; bitno > bmap->end; bitno--)
-			ext2fs_clear_bit(bitno - bmap->start, bmap->bitmap);
+		if (bitno > bmap->end) {
+			bmap->bitmap_ops->unmark_bmap_extent(bmap,
+					bmap->end + 1 - bmap->start,
+					bitno - bmap->end);
+			mark_dirty(bmap, bmap->end + 1 - bmap->start,
+				   bitno - bmap->end);
+		}
 	}
 	if (new_real_end == bmap->real_end) {
 		bmap->end = new_end;
 		return 0;
 	}
 
-	size = ((bmap->real_end - bmap->start) / 8) + 1;
-	new_size = ((new_real_end - bmap->start) / 8) + 1;
-
-	if (size != new_size) {
-		retval = ext2fs_resize_mem(size, new_size, &bmap->bitmap);
-		if (retval)
-			return retval;
-	}
-	if (new_size > size)
-		memset(bmap->bitmap + size, 0, new_size - size);
+	/* The groups no longer line up with what was read or written */
+	ext2fs_untrack_bitmap_groups(bmap);
+	retval = bmap->bitmap_ops->resize_bmap(bmap, new_real_end);
+	if (retval)
+		return retval;
 
 	bmap->end = new_end;
 	bmap->real_end = new_real_end;
@@ -267,7 +382,9 @@ errcode_t ext2fs_compare_generic_bitmap(errcode_t magic, errcode_t neq,
 					ext2fs_generic_bitmap bm1,
 					ext2fs_generic_bitmap bm2)
 {
-	blk_t	i;
+	char	buf1[1024], buf2[1024];
+	__u32	i, num, len = sizeof(buf1) * 8;
+	blk_t	j;
 
 	if (!bm1 || bm1->magic != magic)
 		return magic;
@@ -275,14 +392,34 @@ errcode_t ext2fs_compare_generic_bitmap(errcode_t magic, errcode_t neq,
 		return magic;
 
 	if ((bm1->start != bm2->start) ||
-	    (bm1->end != bm2->end) ||
-	    (memcmp(bm1->bitmap, bm2->bitmap,
-		    (size_t) (bm1->end - bm1->start)/8)))
+	    (bm1->end != bm2->end))
 		return neq;
 
-	for (i = bm1->end - ((bm1->end - bm1->start) % 8); i <= bm1->end; i++)
-		if (ext2fs_fast_test_block_bitmap(bm1, i) !=
-		    ext2fs_fast_test_block_bitmap(bm2, i))
+	load_all_groups(bm1);
+	load_all_groups(bm2);
+	/* Both are bit arrays; compare them directly */
+	if (bm1->bitmap_ops->type == EXT2FS_BMAP_BITARRAY &&
+	    bm2->bitmap_ops->type == EXT2FS_BMAP_BITARRAY) {
+		if (memcmp(bm1->private, bm2->private,
+			   (size_t) (bm1->end - bm1->start)/8))
+			return neq;
+		goto tail;
+	}
+
+	num = ((bm1->end - bm1->start) / 8) * 8;
+	for (i = 0; i < num; i += len) {
+		if (len > num - i)
+			len = num - i;
+		bm1->bitmap_ops->get_bmap_range(bm1, i, len, buf1);
+		bm2->bitmap_ops->get_bmap_range(bm2, i, len, buf2);
+		if (memcmp(buf1, buf2, len >> 3))
+			return neq;
+	}
+
+tail:
+	for (j = bm1->end - ((bm1->end - bm1->start) % 8); j <= bm1->end; j++)
+		if (!ext2fs_fast_test_block_bitmap(bm1, j) !=
+		    !ext2fs_fast_test_block_bitmap(bm2, j))
 			return neq;
 
 	return 0;
@@ -290,13 +427,16 @@ errcode_t ext2fs_compare_generic_bitmap(errcode_t magic, errcode_t neq,
 
 void ext2fs_set_generic_bitmap_padding(ext2fs_generic_bitmap map)
 {
-	__u32	i, j;
-
-	/* Protect loop from wrap-around if map->real_end is maxed */
-	for (i=map->end+1, j = i - map->start;
-	     i <= map->real_end && i > map->end;
-	     i++, j++)
-		ext2fs_set_bit(j, map->bitmap);
+	/* Protect from wrap-around if map->end is maxed */
+	if (map->end < map->real_end) {
+		load_groups(map, map->end + 1 - map->start,
+			    map->real_end - map->start);
+		map->bitmap_ops->mark_bmap_extent(map,
+						  map->end + 1 - map->start,
+						  map->real_end - map->end);
+		mark_dirty(map, map->end + 1 - map->start,
+			   map->real_end - map->end);
+	}
 }
 
 errcode_t ext2fs_get_generic_bitmap_range(ext2fs_generic_bitmap bmap,
@@ -310,7 +450,8 @@ errcode_t ext2fs_get_generic_bitmap_range(ext2fs_generic_bitmap bmap,
 	if ((start < bmap->start) || (start+num-1 > bmap->real_end))
 		return EXT2_ET_INVALID_ARGUMENT;
 
-	memcpy(out, bmap->bitmap + (start >> 3), (num+7) >> 3);
+	load_groups(bmap, start - bmap->start, start + num - 1 - bmap->start);
+	bmap->bitmap_ops->get_bmap_range(bmap, start - bmap->start, num, out);
 	return 0;
 }
 
@@ -325,103 +466,180 @@ errcode_t ext2fs_set_generic_bitmap_range(ext2fs_generic_bitmap bmap,
 	if ((start < bmap->start) || (start+num-1 > bmap->real_end))
 		return EXT2_ET_INVALID_ARGUMENT;
 
-	memcpy(bmap->bitmap + (start >> 3), in, (num+7) >> 3);
+	load_groups(bmap, start - bmap->start, start + num - 1 - bmap->start);
+	bmap->bitmap_ops->set_bmap_range(bmap, start - bmap->start, num, in);
+	mark_dirty(bmap, start - bmap->start, num);
+	runs_stale(bmap, start - bmap->start, num);
 	return 0;
 }
 
 /*
- * Compare @mem to zero buffer by 256 bytes.
- * Return 1 if @mem is zeroed memory, otherwise return 0.
+ * Find the first clear (or set) bit from start to end inclusive;
+ * returns ENOENT if there isn't one.
  */
-static int mem_is_zero(const char *mem, size_t len)
+static errcode_t find_first(ext2fs_generic_bitmap bitmap,
+			    __u32 start, __u32 end, int want_set, __u32 *out)
 {
-	static const char zero_buf[256];
+	errcode_t	retval;
+	__u32		bit, last;
 
-	while (len >= sizeof(zero_buf)) {
-		if (memcmp(mem, zero_buf, sizeof(zero_buf)))
-			return 0;
-		len -= sizeof(zero_buf);
-		mem += sizeof(zero_buf);
-	}
-	/* Deal with leftover bytes. */
-	if (len)
-		return !memcmp(mem, zero_buf, len);
-	return 1;
+	retval = check_magic(bitmap);
+	if (retval)
+		return retval;
+	if ((start < bitmap->start) || (end > bitmap->real_end) ||
+	    (start > end))
+		return EXT2_ET_INVALID_ARGUMENT;
+
+	/*
+	 * A bitmap which is being loaded lazily is searched a group at
+	 * a time, so that only the groups up to the match get loaded.
+	 */
+	start -= bitmap->start;
+	end -= bitmap->start;
+	do {
+		last = end;
+		if (bitmap->unloaded) {
+			last = start - (start % bitmap->group_bits) +
+				bitmap->group_bits - 1;
+			if ((last > end) || (last < start))
+				last = end;
+			load_groups(bitmap, start, last);
+		}
+		if (want_set)
+			retval = bitmap->bitmap_ops->find_first_set(bitmap,
+							start, last, &bit);
+		else
+			retval = bitmap->bitmap_ops->find_first_zero(bitmap,
+							start, last, &bit);
+		start = last + 1;
+	} while ((retval == ENOENT) && (last < end));
+	if (retval)
+		return retval;
+	*out = bit + bitmap->start;
+	return 0;
+}
+
+errcode_t ext2fs_find_first_zero_generic_bitmap(ext2fs_generic_bitmap bitmap,
+						__u32 start, __u32 end,
+						__u32 *out)
+{
+	return find_first(bitmap, start, end, 0, out);
+}
+
+errcode_t ext2fs_find_first_set_generic_bitmap(ext2fs_generic_bitmap bitmap,
+					       __u32 start, __u32 end,
+					       __u32 *out)
+{
+	return find_first(bitmap, start, end, 1, out);
 }
 
 /*
- * Return true if all of the bits in a specified range are clear
+ * Count the set bits from start to end inclusive
  */
-static int ext2fs_test_clear_generic_bitmap_range(ext2fs_generic_bitmap bitmap,
-						  unsigned int start,
-						  unsigned int len)
-{
-	size_t start_byte, len_byte = len >> 3;
-	unsigned int start_bit, len_bit = len % 8;
-	int first_bit = 0;
-	int last_bit  = 0;
-	int mark_count = 0;
-	int mark_bit = 0;
-	int i;
-	const char *ADDR = bitmap->bitmap;
+errcode_t ext2fs_count_generic_bitmap_range(ext2fs_generic_bitmap bitmap,
+					    __u32 start, __u32 end,
+					    __u32 *out)
+{
+	errcode_t	retval;
 
-	start -= bitmap->start;
-	start_byte = start >> 3;
-	start_bit = start % 8;
-
-	if (start_bit != 0) {
-		/*
-		 * The compared start block number or start inode number
-		 * is not the first bit in a byte.
-		 */
-		mark_count = 8 - start_bit;
-		if (len < 8 - start_bit) {
-			mark_count = (int)len;
-			mark_bit = len + start_bit - 1;
-		} else
-			mark_bit = 7;
-
-		for (i = mark_count; i > 0; i--, mark_bit--)
-			first_bit |= 1 << mark_bit;
-
-		/*
-		 * Compare blocks or inodes in the first byte.
-		 * If there is any marked bit, this function returns 0.
-		 */
-		if (first_bit & ADDR[start_byte])
-			return 0;
-		else if (len <= 8 - start_bit)
-			return 1;
+	retval = check_magic(bitmap);
+	if (retval)
+		return retval;
+	if ((start < bitmap->start) || (end > bitmap->real_end) ||
+	    (start > end))
+		return EXT2_ET_INVALID_ARGUMENT;
 
-		start_byte++;
-		len_bit = (len - mark_count) % 8;
-		len_byte = (len - mark_count) >> 3;
-	}
+	load_groups(bitmap, start - bitmap->start, end - bitmap->start);
+	*out = bitmap->bitmap_ops->count_range(bitmap, start - bitmap->start,
+					       end - bitmap->start);
+	return 0;
+}
 
-	/*
-	 * The compared start block number or start inode number is
-	 * the first bit in a byte.
-	 */
-	if (len_bit != 0) {
-		/*
-		 * The compared end block number or end inode number is
-		 * not the last bit in a byte.
-		 */
-		for (mark_bit = len_bit - 1; mark_bit >= 0; mark_bit--)
-			last_bit |= 1 << mark_bit;
-
-		/*
-		 * Compare blocks or inodes in the last byte.
-		 * If there is any marked bit, this function returns 0.
-		 */
-		if (last_bit & ADDR[start_byte + len_byte])
-			return 0;
-		else if (len_byte == 0)
-			return 1;
-	}
+#define DIFF_CHUNK_BYTES	4096
+
+/*
+ * Call func(first, last, bit, priv) for each run of bits from start
+ * to end which differ between bm1 and bm2; bit is the value of the
+ * run's bits in bm1.  Identical stretches are skipped a chunk (and
+ * then a word) at a time.  If func returns non-zero, stop and return
+ * that value.
+ */
+errcode_t ext2fs_diff_generic_bitmap_range(ext2fs_generic_bitmap bm1,
+					   ext2fs_generic_bitmap bm2,
+					   __u32 start, __u32 end,
+					   int (*func)(__u32 first, __u32 last,
+						       int bit, void *priv),
+					   void *priv)
+{
+	unsigned char	buf1[DIFF_CHUNK_BYTES], buf2[DIFF_CHUNK_BYTES];
+	__u64		base, rel, rel_end, n, pos, run_first = 0, run_last = 0;
+	__u64		diff, mask;
+	unsigned int	k, b;
+	int		bit, run_bit = 0, have_run = 0, ret;
+	errcode_t	retval;
+
+	retval = check_magic(bm1);
+	if (retval)
+		return retval;
+	retval = check_magic(bm2);
+	if (retval)
+		return retval;
+	if ((bm1->start != bm2->start) || (start < bm1->start) ||
+	    (end > bm1->real_end) || (end > bm2->real_end) || (start > end))
+		return EXT2_ET_INVALID_ARGUMENT;
 
-	/* Check whether all bytes are 0 */
-	return mem_is_zero(ADDR + start_byte, len_byte);
+	rel = start - bm1->start;
+	rel_end = end - bm1->start;
+	load_groups(bm1, rel, rel_end);
+	load_groups(bm2, rel, rel_end);
+	for (base = rel & ~63ULL; base <= rel_end; base += n) {
+		n = rel_end - base + 1;
+		if (n > DIFF_CHUNK_BYTES * 8)
+			n = DIFF_CHUNK_BYTES * 8;
+		else {
+			memset(buf1, 0, sizeof(buf1));
+			memset(buf2, 0, sizeof(buf2));
+		}
+		bm1->bitmap_ops->get_bmap_range(bm1, base, n, buf1);
+		bm2->bitmap_ops->get_bmap_range(bm2, base, n, buf2);
+		/* Let memcmp skip identical chunks as fast as it can */
+		k = memcmp(buf1, buf2, (n + 7) >> 3) ? 0 : n;
+		for (; k < n; k += 64) {
+			diff = bmap_load64(buf1 + (k >> 3)) ^
+				bmap_load64(buf2 + (k >> 3));
+			pos = base + k;
+			mask = ~0ULL;
+			if (pos < rel)
+				mask <<= rel - pos;
+			if (pos + 63 > rel_end)
+				mask &= ~0ULL >> (pos + 63 - rel_end);
+			diff &= mask;
+			while (diff) {
+				b = bmap_ctz64(diff);
+				diff &= diff - 1;
+				bit = (bmap_load64(buf1 + (k >> 3)) >> b) & 1;
+				if (have_run && run_last + 1 == pos + b &&
+				    run_bit == bit) {
+					run_last++;
+					continue;
+				}
+				if (have_run) {
+					ret = (func)(run_first + bm1->start,
+						     run_last + bm1->start,
+						     run_bit, priv);
+					if (ret)
+						return ret;
+				}
+				have_run = 1;
+				run_first = run_last = pos + b;
+				run_bit = bit;
+			}
+		}
+	}
+	if (have_run)
+		return (func)(run_first + bm1->start, run_last + bm1->start,
+			      run_bit, priv);
+	return 0;
 }
 
 int ext2fs_test_block_bitmap_range(ext2fs_block_bitmap bitmap,
@@ -433,8 +651,10 @@ int ext2fs_test_block_bitmap_range(ext2fs_block_bitmap bitmap,
 				   block, bitmap->description);
 		return 0;
 	}
-	return ext2fs_test_clear_generic_bitmap_range((ext2fs_generic_bitmap)
-						      bitmap, block, num);
+	load_groups(bitmap, block - bitmap->start,
+		    block + num - 1 - bitmap->start);
+	return bitmap->bitmap_ops->test_clear_bmap_extent(bitmap,
+					block - bitmap->start, num);
 }
 
 int ext2fs_test_inode_bitmap_range(ext2fs_inode_bitmap bitmap,
@@ -446,35 +666,313 @@ int ext2fs_test_inode_bitmap_range(ext2fs_inode_bitmap bitmap,
 				   inode, bitmap->description);
 		return 0;
 	}
-	return ext2fs_test_clear_generic_bitmap_range((ext2fs_generic_bitmap)
-						      bitmap, inode, num);
+	load_groups(bitmap, inode - bitmap->start,
+		    inode + num - 1 - bitmap->start);
+	return bitmap->bitmap_ops->test_clear_bmap_extent(bitmap,
+					inode - bitmap->start, num);
 }
 
 void ext2fs_mark_block_bitmap_range(ext2fs_block_bitmap bitmap,
 				    blk_t block, int num)
 {
-	int	i;
-
 	if ((block < bitmap->start) || (block+num-1 > bitmap->end)) {
 		ext2fs_warn_bitmap(EXT2_ET_BAD_BLOCK_MARK, block,
 				   bitmap->description);
 		return;
 	}
-	for (i=0; i < num; i++)
-		ext2fs_fast_set_bit(block + i - bitmap->start, bitmap->bitmap);
+	if (num > 0) {
+		load_groups(bitmap, block - bitmap->start,
+			    block + num - 1 - bitmap->start);
+		bitmap->bitmap_ops->mark_bmap_extent(bitmap,
+					block - bitmap->start, num);
+		mark_dirty(bitmap, block - bitmap->start, num);
+	}
 }
 
 void ext2fs_unmark_block_bitmap_range(ext2fs_block_bitmap bitmap,
 					       blk_t block, int num)
 {
-	int	i;
-
 	if ((block < bitmap->start) || (block+num-1 > bitmap->end)) {
 		ext2fs_warn_bitmap(EXT2_ET_BAD_BLOCK_UNMARK, block,
 				   bitmap->description);
 		return;
 	}
-	for (i=0; i < num; i++)
-		ext2fs_fast_clear_bit(block + i - bitmap->start,
-				      bitmap->bitmap);
+	if (num > 0) {
+		load_groups(bitmap, block - bitmap->start,
+			    block + num - 1 - bitmap->start);
+		bitmap->bitmap_ops->unmark_bmap_extent(bitmap,
+					block - bitmap->start, num);
+		mark_dirty(bitmap, block - bitmap->start, num);
+		runs_stale(bitmap, block - bitmap->start, num);
+	}
+}
+
+/*
+ * Keep track of which parts of a bitmap have changed since it was
+ * last read from or written to disk, group_bits bits per group, so
+ * that only the groups which changed need to be written back.  Each
+ * group's entry in group_loc is where that group was last read from
+ * or written to, or zero if the copy there may not match.  A bitmap
+ * which isn't tracked (such as a new or copied one) has to be
+ * written out in full.
+ */
+errcode_t ext2fs_track_bitmap_groups(ext2fs_generic_bitmap bmap,
+				     __u32 group_bits, dgrp_t groups)
+{
+	errcode_t	retval;
+	size_t		size;
+	int		shift = 0;
+
+	if (bmap->dirty_map)
+		return 0;
+	if (!group_bits)
+		return EXT2_ET_INVALID_ARGUMENT;
+	while ((2U << shift) <= group_bits && shift < 31)
+		shift++;
+
+	size = (((bmap->real_end - bmap->start) >> shift) / 8) + 1;
+	retval = ext2fs_get_mem(size, &bmap->dirty_map);
+	if (retval)
+		return retval;
+	memset(bmap->dirty_map, 0, size);
+	retval = ext2fs_get_array(groups, sizeof(blk_t), &bmap->group_loc);
+	if (retval) {
+		ext2fs_free_mem(&bmap->dirty_map);
+		return retval;
+	}
+	memset(bmap->group_loc, 0, groups * sizeof(blk_t));
+	bmap->dirty_shift = shift;
+	return 0;
+}
+
+void ext2fs_untrack_bitmap_groups(ext2fs_generic_bitmap bmap)
+{
+	if (bmap->dirty_map)
+		ext2fs_free_mem(&bmap->dirty_map);
+	if (bmap->group_loc)
+		ext2fs_free_mem(&bmap->group_loc);
+}
+
+/*
+ * Return true if any of the num bits from start may have changed
+ * since the bitmap was last synced
+ */
+int ext2fs_bitmap_range_dirty(ext2fs_generic_bitmap bmap,
+			      __u32 start, __u32 num)
+{
+	__u32	i;
+
+	if (!bmap->dirty_map)
+		return 1;
+	start -= bmap->start;
+	for (i = start >> bmap->dirty_shift;
+	     i <= (start + num - 1) >> bmap->dirty_shift; i++)
+		if (ext2fs_test_bit(i, bmap->dirty_map))
+			return 1;
+	return 0;
+}
+
+void ext2fs_clear_bitmap_dirty(ext2fs_generic_bitmap bmap)
+{
+	if (bmap->dirty_map)
+		memset(bmap->dirty_map, 0,
+		       (((bmap->real_end - bmap->start) >>
+			 bmap->dirty_shift) / 8) + 1);
+}
+
+/*
+ * Load the bitmap lazily, a group of group_bits bits at a time: the
+ * first time any of a group's bits are used, load_group() is called
+ * to fill them in through the backend's set_bmap_range.  Until then
+ * they are clear.
+ */
+errcode_t ext2fs_lazy_bitmap_groups(ext2fs_generic_bitmap bmap,
+			__u32 group_bits, dgrp_t groups,
+			errcode_t (*load_group)(ext2fs_generic_bitmap bmap,
+						dgrp_t group))
+{
+	errcode_t	retval;
+	size_t		size;
+
+	if (!group_bits || !groups)
+		return EXT2_ET_INVALID_ARGUMENT;
+	size = (groups + 7) / 8;
+	retval = ext2fs_get_mem(size, &bmap->unloaded);
+	if (retval)
+		return retval;
+	memset(bmap->unloaded, 0xff, size);
+	bmap->unloaded_count = groups;
+	bmap->group_bits = group_bits;
+	bmap->load_group = load_group;
+	return 0;
+}
+
+/*
+ * Keep an index of the runs of clear bits in each group of group_bits
+ * bits: the longest one, and the ones at either end of the group.
+ * ext2fs_find_clear_run() uses it to skip over the groups which can't
+ * hold the run it is looking for, and to start searching a group at
+ * its first clear bit.  A group's entry is worked out the first time
+ * it is needed, and again after any of its bits have been cleared;
+ * setting bits only shortens the runs and moves the first clear bit
+ * later, so in between the entries are bounds, which is all that
+ * skipping needs.  The index is only an aid: if it can't be
+ * allocated, ext2fs_find_clear_run() just searches more slowly, so
+ * callers may ignore the error.
+ */
+errcode_t ext2fs_index_bitmap_runs(ext2fs_generic_bitmap bmap,
+				   __u32 group_bits)
+{
+	errcode_t	retval;
+	dgrp_t		groups, i;
+
+	if (bmap->run_sums)
+		return 0;
+	if (!group_bits)
+		return EXT2_ET_INVALID_ARGUMENT;
+	groups = (bmap->real_end - bmap->start) / group_bits + 1;
+	retval = ext2fs_get_array(groups, sizeof(struct bmap_run_sum),
+				  &bmap->run_sums);
+	if (retval)
+		return retval;
+	for (i = 0; i < groups; i++)
+		bmap->run_sums[i].max = ~0U;
+	bmap->run_group_bits = group_bits;
+	return 0;
+}
+
+void ext2fs_unindex_bitmap_runs(ext2fs_generic_bitmap bmap)
+{
+	if (bmap->run_sums)
+		ext2fs_free_mem(&bmap->run_sums);
+}
+
+/* Return the index entry for a group, working it out if need be */
+static struct bmap_run_sum *group_runs(ext2fs_generic_bitmap bmap,
+				       dgrp_t group)
+{
+	struct bmap_run_sum *sum = &bmap->run_sums[group];
+	__u32		first, last, pos, zero, set, run;
+
+	if (sum->max != ~0U)
+		return sum;
+	sum->max = sum->head = sum->tail = 0;
+	sum->next = bmap->run_group_bits;
+	first = bmap->start + group * bmap->run_group_bits;
+	last = first + bmap->run_group_bits - 1;
+	if ((last > bmap->end) || (last < first))
+		last = bmap->end;
+	for (pos = first; pos <= last; pos = set + 1) {
+		if (find_first(bmap, pos, last, 0, &zero))
+			break;
+		if (find_first(bmap, zero, last, 1, &set))
+			set = last + 1;
+		run = set - zero;
+		if (pos == first)
+			sum->next = zero - first;
+		if (zero == first)
+			sum->head = run;
+		if (run > sum->max)
+			sum->max = run;
+		if (set > last) {
+			sum->tail = run;
+			break;
+		}
+	}
+	return sum;
+}
+
+/*
+ * Could a run of len clear bits start at or after bit (an absolute
+ * bit number) in its group?
+ */
+static int run_may_start(ext2fs_generic_bitmap bmap, __u32 bit, __u32 len)
+{
+	struct bmap_run_sum *sum;
+	dgrp_t		group, groups;
+	__u32		total, size;
+
+	group = (bit - bmap->start) / bmap->run_group_bits;
+	groups = (bmap->real_end - bmap->start) / bmap->run_group_bits + 1;
+	sum = group_runs(bmap, group);
+	if (sum->max >= len)
+		return 1;
+	/* A longer run has to carry on through the groups after this one */
+	total = sum->tail;
+	while (total && total < len && ++group < groups) {
+		sum = group_runs(bmap, group);
+		total += sum->head;
+		size = bmap->end - bmap->start + 1 -
+			group * bmap->run_group_bits;
+		if (size > bmap->run_group_bits)
+			size = bmap->run_group_bits;
+		if (sum->head < size)
+			break;
+	}
+	return total >= len;
+}
+
+/*
+ * Find the first run of len clear bits which starts at or after start
+ * and ends at or before end; returns ENOENT if there isn't one.
+ */
+errcode_t ext2fs_find_clear_run(ext2fs_generic_bitmap bmap, __u32 start,
+				__u32 end, __u32 len, __u32 *out)
+{
+	struct bmap_run_sum *sum = 0;
+	errcode_t	retval;
+	__u32		pos, last, zero, set, group_start = 0;
+
+	retval = check_magic(bmap);
+	if (retval)
+		return retval;
+	if (!len || (start < bmap->start) || (end > bmap->end))
+		return EXT2_ET_INVALID_ARGUMENT;
+
+	for (pos = start; (pos <= end) && (end - pos + 1 >= len);
+	     pos = set + 1) {
+		last = end - len + 1;
+		if (bmap->run_sums) {
+			/* Only look at one group at a time */
+			group_start = pos - (pos - bmap->start) %
+				bmap->run_group_bits;
+			set = group_start + bmap->run_group_bits - 1;
+			if ((set < pos) || (set >= end))
+				set = end;
+			if (!run_may_start(bmap, pos, len))
+				continue;
+			if (set < last)
+				last = set;
+			sum = &bmap->run_sums[(pos - bmap->start) /
+					      bmap->run_group_bits];
+			if (pos < group_start + sum->next)
+				pos = group_start + sum->next;
+			if (pos > last)
+				continue;
+		}
+		retval = find_first(bmap, pos, last, 0, &zero);
+		/* Searches from the first clear bit move it along */
+		if (sum && (pos == group_start + sum->next)) {
+			if (!retval)
+				sum->next = zero - group_start;
+			else if (retval == ENOENT)
+				sum->next = last + 1 - group_start;
+		}
+		if (retval == ENOENT) {
+			set = last;
+			continue;
+		}
+		if (retval)
+			return retval;
+		retval = find_first(bmap, zero, zero + len - 1, 1, &set);
+		if (retval == ENOENT) {
+			*out = zero;
+			return 0;
+		}
+		if (retval)
+			return retval;
+		if (set == end)
+			break;
+	}
+	return ENOENT;
 }
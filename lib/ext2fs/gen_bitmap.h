@@ -0,0 +1,170 @@
+/*
+ * gen_bitmap.h --- Private header for the generic bitmap routines and
+ * 	the backends which store the bits.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+struct ext2_bitmap_ops;
+
+/* The runs of clear bits in one group of an indexed bitmap */
+struct bmap_run_sum {
+	__u32	max;		/* the longest run, or ~0 if not known */
+	__u32	head;		/* clear bits at the start of the group */
+	__u32	tail;		/* clear bits at the end of the group */
+	__u32	next;		/* no bits before this one are clear */
+};
+
+struct ext2fs_struct_generic_bitmap {
+	errcode_t	magic;
+	ext2_filsys 	fs;
+	__u32		start, end;
+	__u32		real_end;
+	char	*	description;
+	void	*	private;	/* owned by the backend */
+	errcode_t	base_error_code;
+	struct ext2_bitmap_ops *bitmap_ops;
+	/* Write-back state; see ext2fs_track_bitmap_groups() */
+	unsigned char	*dirty_map;
+	int		dirty_shift;
+	blk_t		*group_loc;
+	/* Lazy loading; see ext2fs_lazy_bitmap_groups() */
+	unsigned char	*unloaded;	/* one bit per group */
+	dgrp_t		unloaded_count;
+	__u32		group_bits;
+	errcode_t	(*load_group)(ext2fs_generic_bitmap bmap,
+				      dgrp_t group);
+	/* Free run index; see ext2fs_index_bitmap_runs() */
+	struct bmap_run_sum *run_sums;
+	__u32		run_group_bits;
+	__u32		reserved[5];
+};
+
+/*
+ * Each backend stores the bits from start to real_end of a bitmap its
+ * own way.  All bit numbers passed to the backend are relative to the
+ * start of the bitmap, and have already been range checked.
+ */
+struct ext2_bitmap_ops {
+	int	type;
+	/* Allocate the backend's data; init_map is a bit array or NULL */
+	errcode_t (*new_bmap)(ext2fs_generic_bitmap bmap, char *init_map);
+	void	(*free_bmap)(ext2fs_generic_bitmap bmap);
+	errcode_t (*copy_bmap)(ext2fs_generic_bitmap src,
+			       ext2fs_generic_bitmap dest);
+	/* Called before bmap->real_end is changed to new_real_end */
+	errcode_t (*resize_bmap)(ext2fs_generic_bitmap bmap,
+				 __u32 new_real_end);
+	/* These return the old value of the bit */
+	int	(*mark_bmap)(ext2fs_generic_bitmap bmap, __u32 arg);
+	int	(*unmark_bmap)(ext2fs_generic_bitmap bmap, __u32 arg);
+	int	(*test_bmap)(ext2fs_generic_bitmap bmap, __u32 arg);
+	void	(*mark_bmap_extent)(ext2fs_generic_bitmap bmap, __u32 arg,
+				    unsigned int num);
+	void	(*unmark_bmap_extent)(ext2fs_generic_bitmap bmap, __u32 arg,
+				      unsigned int num);
+	/* Returns true if none of the bits are set */
+	int	(*test_clear_bmap_extent)(ext2fs_generic_bitmap bmap,
+					  __u32 arg, unsigned int num);
+	/* Copy num bits starting at arg, which is a multiple of 8 */
+	void	(*set_bmap_range)(ext2fs_generic_bitmap bmap, __u32 arg,
+				  size_t num, void *in);
+	void	(*get_bmap_range)(ext2fs_generic_bitmap bmap, __u32 arg,
+				  size_t num, void *out);
+	void	(*clear_bmap)(ext2fs_generic_bitmap bmap);
+	/*
+	 * Find the first clear (or set) bit from start to end
+	 * inclusive; returns ENOENT if there isn't one.
+	 */
+	errcode_t (*find_first_zero)(ext2fs_generic_bitmap bmap, __u32 start,
+				     __u32 end, __u32 *out);
+	errcode_t (*find_first_set)(ext2fs_generic_bitmap bmap, __u32 start,
+				    __u32 end, __u32 *out);
+	/* Count the set bits from start to end inclusive */
+	__u32	(*count_range)(ext2fs_generic_bitmap bmap, __u32 start,
+			       __u32 end);
+};
+
+/*
+ * Word-at-a-time helpers for bit arrays.  Bit n of an array is bit
+ * (n & 7) of byte (n >> 3), so loading eight bytes as a little-endian
+ * word puts bit n at bit (n & 63) of the word.
+ */
+#ifdef __GNUC__
+#define _BMAP_INLINE_ static __inline__
+#else
+#define _BMAP_INLINE_ static inline
+#endif
+
+_BMAP_INLINE_ __u64 bmap_load64(const unsigned char *p)
+{
+	__u64	w;
+
+	memcpy(&w, p, sizeof(w));
+	return ext2fs_le64_to_cpu(w);
+}
+
+_BMAP_INLINE_ int bmap_ctz64(__u64 w)
+{
+#ifdef __GNUC__
+	return __builtin_ctzll(w);
+#else
+	int	n = 0;
+
+	while (!(w & 1)) {
+		w >>= 1;
+		n++;
+	}
+	return n;
+#endif
+}
+
+_BMAP_INLINE_ unsigned int bmap_popcount64(__u64 w)
+{
+#ifdef __GNUC__
+	return __builtin_popcountll(w);
+#else
+	w = w - ((w >> 1) & 0x5555555555555555ULL);
+	w = (w & 0x3333333333333333ULL) + ((w >> 2) & 0x3333333333333333ULL);
+	w = (w + (w >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return (w * 0x0101010101010101ULL) >> 56;
+#endif
+}
+
+/* gen_bitmap.c */
+extern errcode_t ext2fs_track_bitmap_groups(ext2fs_generic_bitmap bmap,
+					    __u32 group_bits, dgrp_t groups);
+extern void ext2fs_untrack_bitmap_groups(ext2fs_generic_bitmap bmap);
+extern int ext2fs_bitmap_range_dirty(ext2fs_generic_bitmap bmap,
+				     __u32 start, __u32 num);
+extern void ext2fs_clear_bitmap_dirty(ext2fs_generic_bitmap bmap);
+extern errcode_t ext2fs_lazy_bitmap_groups(ext2fs_generic_bitmap bmap,
+			__u32 group_bits, dgrp_t groups,
+			errcode_t (*load_group)(ext2fs_generic_bitmap bmap,
+						dgrp_t group));
+extern errcode_t ext2fs_index_bitmap_runs(ext2fs_generic_bitmap bmap,
+					  __u32 group_bits);
+extern void ext2fs_unindex_bitmap_runs(ext2fs_generic_bitmap bmap);
+extern errcode_t ext2fs_find_clear_run(ext2fs_generic_bitmap bmap,
+				       __u32 start, __u32 end, __u32 len,
+				       __u32 *out);
+
+/* blkmap_ba.c */
+extern struct ext2_bitmap_ops ext2fs_bitmap_bitarray;
+
+/* blkmap_ext.c */
+extern struct ext2_bitmap_ops ext2fs_bitmap_extent;
+#ifdef DEBUG
+extern int ext2fs_check_extent_bitmap(ext2fs_generic_bitmap bmap,
+				      int *shapes);
+#endif
+
+/* blkmap_ctr.c */
+extern struct ext2_bitmap_ops ext2fs_bitmap_container;
+#ifdef DEBUG
+extern int ext2fs_check_container_bitmap(ext2fs_generic_bitmap bmap,
+					 int *shapes);
+#endif
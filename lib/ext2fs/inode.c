@@ -51,56 +51,371 @@ struct ext2_struct_inode_scan {
 	void *			done_group_data;
 	int			bad_block_ptr;
 	int			scan_flags;
+	/* Read ahead state for EXT2_SF_PREFETCH */
+	blk_t			prefetch_left;	/* blocks read ahead of ptr */
+	dgrp_t			prefetch_group;	/* where to read ahead next */
+	blk_t			prefetch_block;
 	int			reserved[6];
 };
 
+/* How many inode buffers' worth of blocks EXT2_SF_PREFETCH reads ahead */
+#define INODE_SCAN_PREFETCH_BUFFERS	64
+
+/* Number of inode table blocks cached unless the caller asks for more */
+#define ICACHE_SIZE	8
+/* Most dirty inode table blocks written back with a single write */
+#define ICACHE_WRITE_RUN	64
+
+static EXT2_QSORT_TYPE icache_blk_cmp(const void *a, const void *b)
+{
+	const struct ext2_inode_cache_ent *ea =
+		*(const struct ext2_inode_cache_ent * const *) a;
+	const struct ext2_inode_cache_ent *eb =
+		*(const struct ext2_inode_cache_ent * const *) b;
+
+	if (ea->blk < eb->blk)
+		return -1;
+	return (ea->blk > eb->blk);
+}
+
+/*
+ * Write back the inode table blocks which EXT2_FLAG_ICACHE_WRITEBACK
+ * left dirty in the icache.  They are written in block number order,
+ * and runs of consecutive blocks are merged into a single write.
+ */
+errcode_t ext2fs_write_icache(ext2_filsys fs)
+{
+	struct ext2_inode_cache *icache = fs->icache;
+	struct ext2_inode_cache_ent **list, *ent;
+	char		*run_buf = 0;
+	errcode_t	retval, retval2 = 0;
+	int		i, j, n = 0, run;
+
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+
+	if (!icache || !icache->dirty_count)
+		return 0;
+	retval = ext2fs_get_array(icache->dirty_count,
+				  sizeof(struct ext2_inode_cache_ent *),
+				  &list);
+	if (retval)
+		return retval;
+	for (i = 0, ent = icache->cache; i < icache->cache_size; i++, ent++)
+		if (ent->dirty)
+			list[n++] = ent;
+	qsort(list, n, sizeof(struct ext2_inode_cache_ent *), icache_blk_cmp);
+
+	for (i = 0; i < n; i += run) {
+		for (run = 1; (i + run < n) && (run < ICACHE_WRITE_RUN); run++)
+			if (list[i + run]->blk != list[i]->blk + run)
+				break;
+		if ((run > 1) && !run_buf &&
+		    ext2fs_get_array(ICACHE_WRITE_RUN, fs->blocksize,
+				     &run_buf))
+			run = 1;
+		if (run > 1) {
+			for (j = 0; j < run; j++)
+				memcpy(run_buf + (unsigned long) j *
+				       fs->blocksize, list[i + j]->buf,
+				       fs->blocksize);
+			retval = io_channel_write_blk(fs->io, list[i]->blk,
+						      run, run_buf);
+		} else
+			retval = io_channel_write_blk(fs->io, list[i]->blk,
+						      1, list[i]->buf);
+		if (retval) {
+			retval2 = retval;
+			continue;
+		}
+		for (j = 0; j < run; j++)
+			list[i + j]->dirty = 0;
+		icache->dirty_count -= run;
+	}
+	if (run_buf)
+		ext2fs_free_mem(&run_buf);
+	ext2fs_free_mem(&list);
+	return retval2;
+}
+
 /*
- * This routine flushes the icache, if it exists.
+ * This routine flushes the icache, if it exists, writing back any
+ * dirty blocks first.
  */
 errcode_t ext2fs_flush_icache(ext2_filsys fs)
 {
+	struct ext2_inode_cache *icache = fs->icache;
+	errcode_t	retval;
 	int	i;
 
-	if (!fs->icache)
+	if (!icache)
 		return 0;
 
-	for (i=0; i < fs->icache->cache_size; i++)
-		fs->icache->cache[i].ino = 0;
-
-	fs->icache->buffer_blk = 0;
+	retval = ext2fs_write_icache(fs);
+	if (retval)
+		return retval;
+	for (i=0; i < icache->cache_size; i++)
+		icache->cache[i].blk = 0;
+	memset(icache->hash, 0,
+	       icache->hash_size * sizeof(struct ext2_inode_cache_ent *));
 	return 0;
 }
 
-static errcode_t create_icache(ext2_filsys fs)
+/*
+ * Set up an inode cache holding cache_size blocks of the inode tables
+ * (or a small default number if cache_size is zero), replacing the
+ * one the filesystem had before.
+ */
+errcode_t ext2fs_create_inode_cache(ext2_filsys fs, unsigned int cache_size)
 {
+	struct ext2_inode_cache *icache;
+	struct ext2_inode_cache_ent *ent;
 	errcode_t	retval;
+	unsigned int	i;
 
-	if (fs->icache)
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+
+	if (!cache_size)
+		cache_size = ICACHE_SIZE;
+	if (fs->icache && (fs->icache->cache_size == (int) cache_size))
 		return 0;
-	retval = ext2fs_get_mem(sizeof(struct ext2_inode_cache), &fs->icache);
+	retval = ext2fs_write_icache(fs);
 	if (retval)
 		return retval;
-
-	memset(fs->icache, 0, sizeof(struct ext2_inode_cache));
-	retval = ext2fs_get_mem(fs->blocksize, &fs->icache->buffer);
-	if (retval) {
-		ext2fs_free_mem(&fs->icache);
+	retval = ext2fs_get_mem(sizeof(struct ext2_inode_cache), &icache);
+	if (retval)
 		return retval;
-	}
-	fs->icache->buffer_blk = 0;
-	fs->icache->cache_last = -1;
-	fs->icache->cache_size = 4;
-	fs->icache->refcount = 1;
-	retval = ext2fs_get_array(fs->icache->cache_size,
+	memset(icache, 0, sizeof(struct ext2_inode_cache));
+	icache->refcount = 1;
+	icache->cache_size = cache_size;
+	for (icache->hash_size = 1; icache->hash_size < (int) cache_size;
+	     icache->hash_size <<= 1)
+		;
+	retval = ext2fs_get_array(cache_size,
 				  sizeof(struct ext2_inode_cache_ent),
-				  &fs->icache->cache);
-	if (retval) {
-		ext2fs_free_mem(&fs->icache->buffer);
-		ext2fs_free_mem(&fs->icache);
-		return retval;
+				  &icache->cache);
+	if (retval)
+		goto errout;
+	retval = ext2fs_get_array(icache->hash_size,
+				  sizeof(struct ext2_inode_cache_ent *),
+				  &icache->hash);
+	if (retval)
+		goto errout;
+	retval = ext2fs_get_array(cache_size, fs->blocksize,
+				  &icache->buffers);
+	if (retval)
+		goto errout;
+	for (i = 0, ent = icache->cache; i < cache_size; i++, ent++) {
+		ent->buf = icache->buffers + (unsigned long) i * fs->blocksize;
+		ent->dirty = 0;
+		ent->hash_next = 0;
+		ent->lru_prev = (i > 0) ? ent - 1 : 0;
+		ent->lru_next = (i < cache_size - 1) ? ent + 1 : 0;
 	}
+	icache->lru_head = icache->cache;
+	icache->lru_tail = icache->cache + cache_size - 1;
+
+	if (fs->icache)
+		ext2fs_free_inode_cache(fs->icache);
+	fs->icache = icache;
 	ext2fs_flush_icache(fs);
 	return 0;
+
+errout:
+	ext2fs_free_inode_cache(icache);
+	return retval;
+}
+
+static inline unsigned int icache_hash(struct ext2_inode_cache *icache,
+				       blk_t blk)
+{
+	return (blk ^ (blk >> 20)) & (icache->hash_size - 1);
+}
+
+/* Make an entry the most recently used one */
+static void icache_touch(struct ext2_inode_cache *icache,
+			 struct ext2_inode_cache_ent *ent)
+{
+	if (icache->lru_head == ent)
+		return;
+	ent->lru_prev->lru_next = ent->lru_next;
+	if (ent->lru_next)
+		ent->lru_next->lru_prev = ent->lru_prev;
+	else
+		icache->lru_tail = ent->lru_prev;
+	ent->lru_prev = 0;
+	ent->lru_next = icache->lru_head;
+	icache->lru_head->lru_prev = ent;
+	icache->lru_head = ent;
+}
+
+static void icache_unhash(struct ext2_inode_cache *icache,
+			  struct ext2_inode_cache_ent *ent)
+{
+	struct ext2_inode_cache_ent **pp;
+
+	for (pp = &icache->hash[icache_hash(icache, ent->blk)]; *pp;
+	     pp = &(*pp)->hash_next) {
+		if (*pp == ent) {
+			*pp = ent->hash_next;
+			break;
+		}
+	}
+	ent->blk = 0;
+}
+
+/*
+ * Return the cache entry for an inode table block, reading it in from
+ * io (replacing the least recently used block in the cache) if need
+ * be.  If that block is dirty, all of the dirty blocks are written
+ * back together.
+ */
+static errcode_t icache_get_block(ext2_filsys fs, io_channel io, blk_t blk,
+				  struct ext2_inode_cache_ent **ret)
+{
+	struct ext2_inode_cache *icache = fs->icache;
+	struct ext2_inode_cache_ent *ent;
+	unsigned int	h = icache_hash(icache, blk);
+	errcode_t	retval;
+
+	for (ent = icache->hash[h]; ent; ent = ent->hash_next) {
+		if (ent->blk == blk)
+			goto found;
+	}
+	ent = icache->lru_tail;
+	if (ent->dirty) {
+		retval = ext2fs_write_icache(fs);
+		if (retval)
+			return retval;
+	}
+	if (ent->blk)
+		icache_unhash(icache, ent);
+	retval = io_channel_read_blk(io, blk, 1, ent->buf);
+	if (retval)
+		return retval;
+	ent->blk = blk;
+	ent->hash_next = icache->hash[h];
+	icache->hash[h] = ent;
+found:
+	icache_touch(icache, ent);
+	*ret = ent;
+	return 0;
+}
+
+/*
+ * Ask the I/O manager to start reading in the (used part of the)
+ * inode table of a block group, so that the disk stays busy while
+ * the caller is still processing the group before it.
+ */
+static void readahead_inode_table(ext2_inode_scan scan, dgrp_t group)
+{
+	ext2_filsys	fs = scan->fs;
+	blk_t		blk, num_blocks;
+	ext2_ino_t	inodes;
+
+	if (group >= fs->group_desc_count)
+		return;
+	blk = fs->group_desc[group].bg_inode_table;
+	if (!blk)
+		return;
+	num_blocks = fs->inode_blocks_per_group;
+	if (scan->scan_flags & EXT2_SF_DO_LAZY) {
+		if (fs->group_desc[group].bg_flags & EXT2_BG_INODE_UNINIT)
+			return;
+		inodes = EXT2_INODES_PER_GROUP(fs->super) -
+			fs->group_desc[group].bg_itable_unused;
+		num_blocks = (inodes + (fs->blocksize / scan->inode_size - 1)) *
+			scan->inode_size / fs->blocksize;
+	}
+	if (num_blocks)
+		io_channel_readahead(fs->io, blk, num_blocks);
+}
+
+/*
+ * Return how many blocks of a group's inode table the scan reads.
+ */
+static blk_t itable_scan_blocks(ext2_inode_scan scan, dgrp_t group)
+{
+	ext2_filsys	fs = scan->fs;
+	ext2_ino_t	inodes;
+	blk_t		num_blocks;
+
+	if (!fs->group_desc[group].bg_inode_table)
+		return 0;
+	if ((scan->scan_flags & EXT2_SF_DO_LAZY) &&
+	    (fs->group_desc[group].bg_flags & EXT2_BG_INODE_UNINIT))
+		return 0;
+	num_blocks = fs->inode_blocks_per_group;
+	if (EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
+				       EXT4_FEATURE_RO_COMPAT_GDT_CSUM)) {
+		inodes = EXT2_INODES_PER_GROUP(fs->super) -
+			fs->group_desc[group].bg_itable_unused;
+		num_blocks = (inodes + (fs->blocksize / scan->inode_size - 1)) *
+			scan->inode_size / fs->blocksize;
+		if (num_blocks > fs->inode_blocks_per_group)
+			num_blocks = fs->inode_blocks_per_group;
+	}
+	return num_blocks;
+}
+
+/*
+ * With EXT2_SF_PREFETCH, keep INODE_SCAN_PREFETCH_BUFFERS inode
+ * buffers' worth of the inode tables read ahead of the scan, carrying
+ * on into the tables of the following groups.  The window is topped up
+ * once half of it has been used, and tables which follow each other
+ * on disk (as with flex_bg) are asked for in a single request.
+ */
+static void prefetch_inode_tables(ext2_inode_scan scan, blk_t used)
+{
+	ext2_filsys	fs = scan->fs;
+	blk_t		window, blk, num_blocks, start = 0, len = 0, pos;
+
+	/* Catch up with the blocks the scan has just read */
+	if (scan->prefetch_left > used)
+		scan->prefetch_left -= used;
+	else
+		scan->prefetch_left = 0;
+	if (scan->current_block) {
+		pos = scan->current_block -
+			fs->group_desc[scan->current_group].bg_inode_table;
+		if ((scan->prefetch_group < scan->current_group) ||
+		    ((scan->prefetch_group == scan->current_group) &&
+		     (scan->prefetch_block < pos))) {
+			scan->prefetch_group = scan->current_group;
+			scan->prefetch_block = pos;
+			scan->prefetch_left = 0;
+		} else if (scan->prefetch_group == scan->current_group)
+			scan->prefetch_left = scan->prefetch_block - pos;
+	}
+
+	window = scan->inode_buffer_blocks * INODE_SCAN_PREFETCH_BUFFERS;
+	if (scan->prefetch_left > window / 2)
+		return;
+	while ((scan->prefetch_left < window) &&
+	       (scan->prefetch_group < fs->group_desc_count)) {
+		num_blocks = itable_scan_blocks(scan, scan->prefetch_group);
+		if (scan->prefetch_block >= num_blocks) {
+			scan->prefetch_group++;
+			scan->prefetch_block = 0;
+			continue;
+		}
+		blk = fs->group_desc[scan->prefetch_group].bg_inode_table +
+			scan->prefetch_block;
+		num_blocks -= scan->prefetch_block;
+		if (num_blocks > window - scan->prefetch_left)
+			num_blocks = window - scan->prefetch_left;
+		if (len && (blk == start + len))
+			len += num_blocks;
+		else {
+			if (len)
+				io_channel_readahead(fs->io, start, len);
+			start = blk;
+			len = num_blocks;
+		}
+		scan->prefetch_block += num_blocks;
+		scan->prefetch_left += num_blocks;
+	}
+	if (len)
+		io_channel_readahead(fs->io, start, len);
 }
 
 errcode_t ext2fs_open_inode_scan(ext2_filsys fs, int buffer_blocks,
@@ -176,6 +491,8 @@ errcode_t ext2fs_open_inode_scan(ext2_filsys fs, int buffer_blocks,
 	if (EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
 				       EXT4_FEATURE_RO_COMPAT_GDT_CSUM))
 		scan->scan_flags |= EXT2_SF_DO_LAZY;
+	readahead_inode_table(scan, 0);
+	readahead_inode_table(scan, 1);
 	*ret_scan = scan;
 	return 0;
 }
@@ -249,6 +566,8 @@ static errcode_t get_next_blockgroup(ext2_inode_scan scan)
 			 (fs->blocksize / scan->inode_size - 1)) *
 			scan->inode_size / fs->blocksize;
 	}
+	if (!(scan->scan_flags & EXT2_SF_PREFETCH))
+		readahead_inode_table(scan, scan->current_group + 1);
 
 	return 0;
 }
@@ -256,6 +575,9 @@ static errcode_t get_next_blockgroup(ext2_inode_scan scan)
 errcode_t ext2fs_inode_scan_goto_blockgroup(ext2_inode_scan scan,
 					    int	group)
 {
+	scan->prefetch_group = group;
+	scan->prefetch_block = 0;
+	scan->prefetch_left = 0;
 	scan->current_group = group - 1;
 	scan->groups_left = scan->fs->group_desc_count - group;
 	return get_next_blockgroup(scan);
@@ -364,6 +686,12 @@ static errcode_t get_next_blocks(ext2_inode_scan scan)
 		memset(scan->inode_buffer, 0,
 		       (size_t) num_blocks * scan->fs->blocksize);
 	} else {
+		/* The scan reads the tables directly, so write back first */
+		if (scan->fs->icache && scan->fs->icache->dirty_count) {
+			retval = ext2fs_write_icache(scan->fs);
+			if (retval)
+				return retval;
+		}
 		retval = io_channel_read_blk(scan->fs->io,
 					     scan->current_block,
 					     (int) num_blocks,
@@ -377,6 +705,8 @@ static errcode_t get_next_blocks(ext2_inode_scan scan)
 	scan->blocks_left -= num_blocks;
 	if (scan->current_block)
 		scan->current_block += num_blocks;
+	if (scan->scan_flags & EXT2_SF_PREFETCH)
+		prefetch_inode_tables(scan, num_blocks);
 	return 0;
 }
 
@@ -523,9 +853,10 @@ errcode_t ext2fs_read_inode_full(ext2_filsys fs, ext2_ino_t ino,
 				 struct ext2_inode * inode, int bufsize)
 {
 	unsigned long 	group, block, block_nr, offset;
+	struct ext2_inode_cache_ent *ent;
 	char 		*ptr;
 	errcode_t	retval;
-	int 		clen, i, inodes_per_block, length;
+	int 		clen, inodes_per_block, length;
 	io_channel	io;
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
@@ -540,20 +871,10 @@ errcode_t ext2fs_read_inode_full(ext2_filsys fs, ext2_ino_t ino,
 		return EXT2_ET_BAD_INODE_NUM;
 	/* Create inode cache if not present */
 	if (!fs->icache) {
-		retval = create_icache(fs);
+		retval = ext2fs_create_inode_cache(fs, 0);
 		if (retval)
 			return retval;
 	}
-	/* Check to see if it's in the inode cache */
-	if (bufsize == sizeof(struct ext2_inode)) {
-		/* only old good inode can be retrieved from the cache */
-		for (i=0; i < fs->icache->cache_size; i++) {
-			if (fs->icache->cache[i].ino == ino) {
-				*inode = fs->icache->cache[i].inode;
-				return 0;
-			}
-		}
-	}
 	if (fs->flags & EXT2_FLAG_IMAGE_FILE) {
 		inodes_per_block = fs->blocksize / EXT2_INODE_SIZE(fs->super);
 		block_nr = fs->image_header->offset_inode / fs->blocksize;
@@ -586,16 +907,10 @@ errcode_t ext2fs_read_inode_full(ext2_filsys fs, ext2_ino_t ino,
 		if ((offset + length) > fs->blocksize)
 			clen = fs->blocksize - offset;
 
-		if (block_nr != fs->icache->buffer_blk) {
-			retval = io_channel_read_blk(io, block_nr, 1,
-						     fs->icache->buffer);
-			if (retval)
-				return retval;
-			fs->icache->buffer_blk = block_nr;
-		}
-
-		memcpy(ptr, ((char *) fs->icache->buffer) + (unsigned) offset,
-		       clen);
+		retval = icache_get_block(fs, io, block_nr, &ent);
+		if (retval)
+			return retval;
+		memcpy(ptr, ent->buf + (unsigned) offset, clen);
 
 		offset = 0;
 		length -= clen;
@@ -608,13 +923,6 @@ errcode_t ext2fs_read_inode_full(ext2_filsys fs, ext2_ino_t ino,
 			       (struct ext2_inode_large *) inode,
 			       0, bufsize);
 #endif
-
-	/* Update the inode cache */
-	fs->icache->cache_last = (fs->icache->cache_last + 1) %
-		fs->icache->cache_size;
-	fs->icache->cache[fs->icache->cache_last].ino = ino;
-	fs->icache->cache[fs->icache->cache_last].inode = *inode;
-
 	return 0;
 }
 
@@ -625,14 +933,155 @@ errcode_t ext2fs_read_inode(ext2_filsys fs, ext2_ino_t ino,
 					sizeof(struct ext2_inode));
 }
 
+/*
+ * Read a batch of inodes, in the order of their inode table blocks
+ * rather than the order given, so that a set of scattered lookups
+ * turns into a few sequential reads.  The callback is passed each
+ * inode number, its index in the inos array, and the full on-disk
+ * inode; a non-zero return stops the batch and is returned.
+ */
+#define READ_INODES_RUN		64
+
+struct read_inodes_ent {
+	blk_t		blk;
+	unsigned int	offset;
+	int		index;
+};
+
+static EXT2_QSORT_TYPE read_inodes_cmp(const void *a, const void *b)
+{
+	const struct read_inodes_ent *ea = (const struct read_inodes_ent *) a;
+	const struct read_inodes_ent *eb = (const struct read_inodes_ent *) b;
+
+	if (ea->blk != eb->blk)
+		return (ea->blk < eb->blk) ? -1 : 1;
+	if (ea->offset != eb->offset)
+		return (ea->offset < eb->offset) ? -1 : 1;
+	return ea->index - eb->index;
+}
+
+errcode_t ext2fs_read_inodes(ext2_filsys fs, ext2_ino_t *inos, int count,
+			     errcode_t (*func)(ext2_filsys fs,
+					       ext2_ino_t ino,
+					       int index,
+					       struct ext2_inode *inode,
+					       void *priv_data),
+			     void *priv_data)
+{
+	struct read_inodes_ent	*list = 0;
+	struct ext2_inode	*inode = 0;
+	char			*buf = 0;
+	unsigned long		group, offset;
+	errcode_t		retval;
+	blk_t			start;
+	int			i, j, run, length;
+
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+
+	length = EXT2_INODE_SIZE(fs->super);
+	if (count <= 0)
+		return 0;
+	retval = ext2fs_get_mem(length, &inode);
+	if (retval)
+		return retval;
+
+	/*
+	 * Override functions and image files don't map inodes onto
+	 * the inode tables, so just read them one at a time.
+	 */
+	if (fs->read_inode || (fs->flags & EXT2_FLAG_IMAGE_FILE)) {
+		for (i = 0; i < count; i++) {
+			retval = ext2fs_read_inode_full(fs, inos[i], inode,
+							length);
+			if (!retval)
+				retval = (func)(fs, inos[i], i, inode,
+						priv_data);
+			if (retval)
+				break;
+		}
+		goto errout;
+	}
+
+	retval = ext2fs_get_array(count, sizeof(struct read_inodes_ent),
+				  &list);
+	if (retval)
+		goto errout;
+	for (i = 0; i < count; i++) {
+		if ((inos[i] == 0) || (inos[i] > fs->super->s_inodes_count)) {
+			retval = EXT2_ET_BAD_INODE_NUM;
+			goto errout;
+		}
+		group = (inos[i] - 1) / EXT2_INODES_PER_GROUP(fs->super);
+		if (!fs->group_desc[(unsigned) group].bg_inode_table) {
+			retval = EXT2_ET_MISSING_INODE_TABLE;
+			goto errout;
+		}
+		offset = ((inos[i] - 1) % EXT2_INODES_PER_GROUP(fs->super)) *
+			length;
+		list[i].blk = fs->group_desc[(unsigned) group].bg_inode_table +
+			(offset >> EXT2_BLOCK_SIZE_BITS(fs->super));
+		list[i].offset = offset & (fs->blocksize - 1);
+		list[i].index = i;
+	}
+	qsort(list, count, sizeof(struct read_inodes_ent), read_inodes_cmp);
+
+	/* The tables are read directly, so write back any cached changes */
+	if (fs->icache && fs->icache->dirty_count) {
+		retval = ext2fs_write_icache(fs);
+		if (retval)
+			goto errout;
+	}
+
+	retval = ext2fs_get_array(READ_INODES_RUN, fs->blocksize, &buf);
+	if (retval)
+		goto errout;
+
+	for (i = 0; i < count; i = j) {
+		/* Coalesce the following blocks while they are adjacent */
+		start = list[i].blk;
+		for (j = i + 1; j < count; j++)
+			if ((list[j].blk > list[j-1].blk + 1) ||
+			    (list[j].blk - start >= READ_INODES_RUN))
+				break;
+		run = list[j-1].blk - start + 1;
+		retval = io_channel_read_blk(fs->io, start, run, buf);
+		if (retval)
+			goto errout;
+
+		for (; i < j; i++) {
+			memcpy(inode, buf + (list[i].blk - start) *
+			       fs->blocksize + list[i].offset, length);
+#ifdef WORDS_BIGENDIAN
+			ext2fs_swap_inode_full(fs,
+					(struct ext2_inode_large *) inode,
+					(struct ext2_inode_large *) inode,
+					0, length);
+#endif
+			retval = (func)(fs, inos[list[i].index],
+					list[i].index, inode, priv_data);
+			if (retval)
+				goto errout;
+		}
+	}
+
+errout:
+	if (buf)
+		ext2fs_free_mem(&buf);
+	if (list)
+		ext2fs_free_mem(&list);
+	ext2fs_free_mem(&inode);
+	return retval;
+}
+
 errcode_t ext2fs_write_inode_full(ext2_filsys fs, ext2_ino_t ino,
 				  struct ext2_inode * inode, int bufsize)
 {
 	unsigned long group, block, block_nr, offset;
 	errcode_t retval = 0;
 	struct ext2_inode_large temp_inode, *w_inode;
+	struct ext2_inode_cache_ent *ent;
 	char *ptr;
-	int clen, i, length;
+	int clen, length;
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 
@@ -643,23 +1092,16 @@ errcode_t ext2fs_write_inode_full(ext2_filsys fs, ext2_ino_t ino,
 			return retval;
 	}
 
-	/* Check to see if the inode cache needs to be updated */
-	if (fs->icache) {
-		for (i=0; i < fs->icache->cache_size; i++) {
-			if (fs->icache->cache[i].ino == ino) {
-				fs->icache->cache[i].inode = *inode;
-				break;
-			}
-		}
-	} else {
-		retval = create_icache(fs);
+	if (!(fs->flags & EXT2_FLAG_RW))
+		return EXT2_ET_RO_FILSYS;
+
+	/* Create inode cache if not present */
+	if (!fs->icache) {
+		retval = ext2fs_create_inode_cache(fs, 0);
 		if (retval)
 			return retval;
 	}
 
-	if (!(fs->flags & EXT2_FLAG_RW))
-		return EXT2_ET_RO_FILSYS;
-
 	if ((ino == 0) || (ino > fs->super->s_inodes_count))
 		return EXT2_ET_BAD_INODE_NUM;
 
@@ -706,23 +1148,30 @@ errcode_t ext2fs_write_inode_full(ext2_filsys fs, ext2_ino_t ino,
 		if ((offset + length) > fs->blocksize)
 			clen = fs->blocksize - offset;
 
-		if (fs->icache->buffer_blk != block_nr) {
-			retval = io_channel_read_blk(fs->io, block_nr, 1,
-						     fs->icache->buffer);
+		/*
+		 * The cached block is updated, and either written
+		 * through or left to be written back later.
+		 */
+		retval = icache_get_block(fs, fs->io, block_nr, &ent);
+		if (retval)
+			goto errout;
+		memcpy(ent->buf + (unsigned) offset, ptr, clen);
+		if (fs->flags & EXT2_FLAG_ICACHE_WRITEBACK) {
+			if (!ent->dirty) {
+				ent->dirty = 1;
+				fs->icache->dirty_count++;
+			}
+		} else {
+			retval = io_channel_write_blk(fs->io, block_nr, 1,
+						      ent->buf);
 			if (retval)
 				goto errout;
-			fs->icache->buffer_blk = block_nr;
+			if (ent->dirty) {
+				ent->dirty = 0;
+				fs->icache->dirty_count--;
+			}
 		}
 
-
-		memcpy((char *) fs->icache->buffer + (unsigned) offset,
-		       ptr, clen);
-
-		retval = io_channel_write_blk(fs->io, block_nr, 1,
-					      fs->icache->buffer);
-		if (retval)
-			goto errout;
-
 		offset = 0;
 		ptr += clen;
 		length -= clen;
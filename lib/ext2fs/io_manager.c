@@ -99,3 +99,65 @@ errcode_t io_channel_write_blk64(io_channel channel, unsigned long long block,
 	return (channel->manager->write_blk)(channel, (unsigned long) block,
 					     count, data);
 }
+
+/*
+ * Hint to the I/O manager that the given blocks will be read soon.
+ * This never reads any data itself, and managers which can't do
+ * anything useful with the hint simply don't implement it.
+ */
+errcode_t io_channel_readahead(io_channel channel, unsigned long long block,
+			       unsigned long long count)
+{
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+
+	if (!channel->manager->readahead)
+		return EXT2_ET_OP_NOT_SUPPORTED;
+
+	return (channel->manager->readahead)(channel, block, count);
+}
+
+/*
+ * Perform a set of independent block reads or writes.  I/O managers
+ * which can keep several requests in flight at once (such as the
+ * io_uring one) do so; for the others we just issue the requests one
+ * after another.  The status of each request is stored in its error
+ * field, and the first error encountered is returned.
+ */
+static errcode_t rw_batch(io_channel channel, int flags, io_request reqs,
+			  int count)
+{
+	errcode_t	retval = 0;
+	int		i;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+
+	if (channel->manager->rw_batch)
+		return (channel->manager->rw_batch)(channel, flags,
+						    reqs, count);
+
+	for (i = 0; i < count; i++) {
+		if (flags & IO_BATCH_WRITE)
+			reqs[i].error = io_channel_write_blk64(channel,
+					reqs[i].block, reqs[i].count,
+					reqs[i].buf);
+		else
+			reqs[i].error = io_channel_read_blk64(channel,
+					reqs[i].block, reqs[i].count,
+					reqs[i].buf);
+		if (reqs[i].error && !retval)
+			retval = reqs[i].error;
+	}
+	return retval;
+}
+
+errcode_t io_channel_read_batch(io_channel channel, io_request reqs,
+				int count)
+{
+	return rw_batch(channel, 0, reqs, count);
+}
+
+errcode_t io_channel_write_batch(io_channel channel, io_request reqs,
+				 int count)
+{
+	return rw_batch(channel, IO_BATCH_WRITE, reqs, count);
+}
@@ -14,6 +14,7 @@
 
 #define READ 0
 #define WRITE 1
+#define READA 2
 
 #define cpu_to_be32(n) htonl(n)
 #define be32_to_cpu(n) ntohl(n)
@@ -25,6 +25,7 @@
 
 #include "ext2_fs.h"
 #include "ext2fs.h"
+#include "gen_bitmap.h"
 
 #define blk64_t blk_t
 #define __u64 __u32 
@@ -46,6 +47,35 @@
 #include "ext2fs.h"
 #include "e2image.h"
 
+/* How much of each kind of bitmap to read with one batch */
+#define BITMAP_READ_BYTES	(1024 * 1024)
+
+/* The group_loc of a lazily loaded group which couldn't be read */
+#define BITMAP_LOC_UNREADABLE	((blk_t) ~0U)
+
+/*
+ * Return true if a group's part of a bitmap, num bits from first,
+ * has to be written to blk; see ext2fs_track_bitmap_groups().
+ */
+static int group_needs_write(ext2fs_generic_bitmap bmap, dgrp_t group,
+			     blk_t blk, __u32 first, __u32 num)
+{
+	/* Don't overwrite what is on disk with a made-up group */
+	if (bmap->group_loc &&
+	    (bmap->group_loc[group] == BITMAP_LOC_UNREADABLE))
+		return 0;
+	if (!bmap->group_loc || (bmap->group_loc[group] != blk))
+		return 1;
+	return ext2fs_bitmap_range_dirty(bmap, first, num);
+}
+
+static void set_group_loc(ext2fs_generic_bitmap bmap, dgrp_t group,
+			  blk_t blk)
+{
+	if (bmap->group_loc)
+		bmap->group_loc[group] = blk;
+}
+
 #ifdef EXT2FS_SNAPSHOT_EXCLUDE_BITMAP
 static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block,
 		int do_exclude)
@@ -83,6 +113,11 @@ static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 				       EXT4_FEATURE_RO_COMPAT_GDT_CSUM))
 		csum_flag = 1;
 
+	/*
+	 * Only the groups which changed since the bitmaps were last
+	 * read or written need to be written.  If the tracking can't
+	 * be started, everything is written, as before.
+	 */
 	inode_nbytes = block_nbytes = 0;
 	if (do_block) {
 		block_nbytes = EXT2_BLOCKS_PER_GROUP(fs->super) / 8;
@@ -91,6 +126,9 @@ static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 		if (retval)
 			return retval;
 		memset(block_buf, 0xff, fs->blocksize);
+		ext2fs_track_bitmap_groups(fs->block_map,
+					   block_nbytes << 3,
+					   fs->group_desc_count);
 	}
 #ifdef EXT2FS_SNAPSHOT_EXCLUDE_BITMAP
 	if (do_exclude) {
@@ -100,6 +138,9 @@ static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 		if (retval)
 			return retval;
 		memset(exclude_buf, 0xff, fs->blocksize);
+		ext2fs_track_bitmap_groups(fs->exclude_map,
+					   block_nbytes << 3,
+					   fs->group_desc_count);
 	}
 #endif
 	if (do_inode) {
@@ -110,6 +151,9 @@ static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 		if (retval)
 			return retval;
 		memset(inode_buf, 0xff, fs->blocksize);
+		ext2fs_track_bitmap_groups(fs->inode_map,
+					   EXT2_INODES_PER_GROUP(fs->super),
+					   fs->group_desc_count);
 	}
 
 	for (i = 0; i < fs->group_desc_count; i++) {
@@ -121,57 +165,55 @@ static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 			goto skip_block_bitmap;
 
 		if (csum_flag && ext2fs_bg_flags_test(fs, i, EXT2_BG_BLOCK_UNINIT)
-		    )
-			goto skip_this_block_bitmap;
-
-#ifdef EXT2FS_SNAPSHOT_EXCLUDE_BITMAP
-		if (do_block)
-			retval = ext2fs_get_block_bitmap_range2(fs->block_map,
-					blk_itr, block_nbytes << 3, block_buf);
-		if (retval)
-			return retval;
-
-		if (do_exclude)
-			retval = ext2fs_get_block_bitmap_range2(fs->exclude_map,
-					blk_itr, block_nbytes << 3, exclude_buf);
-#else
-		retval = ext2fs_get_block_bitmap_range2(fs->block_map,
-				blk_itr, block_nbytes << 3, block_buf);
-#endif
-		if (retval)
-			return retval;
-
+		    ) {
+			/* Whatever is on disk is stale if the flag is cleared */
+			if (do_block)
+				set_group_loc(fs->block_map, i, 0);
 #ifdef EXT2FS_SNAPSHOT_EXCLUDE_BITMAP
-		if (do_block && i == fs->group_desc_count - 1) {
-#else
-		if (i == fs->group_desc_count - 1) {
+			if (do_exclude)
+				set_group_loc(fs->exclude_map, i, 0);
 #endif
-			/* Force bitmap padding for the last group */
-			nbits = ((ext2fs_blocks_count(fs->super)
-				  - (__u64) fs->super->s_first_data_block)
-				 % (__u64) EXT2_BLOCKS_PER_GROUP(fs->super));
-			if (nbits)
-				for (j = nbits; j < fs->blocksize * 8; j++)
-					ext2fs_set_bit(j, block_buf);
+			goto skip_this_block_bitmap;
 		}
+
 		blk = ext2fs_block_bitmap_loc(fs, i);
-#ifdef EXT2FS_SNAPSHOT_EXCLUDE_BITMAP
-		if (do_block && blk) {
-#else
-		if (blk) {
-#endif
+		if (do_block && blk &&
+		    group_needs_write(fs->block_map, i, blk, blk_itr,
+				      block_nbytes << 3)) {
+			retval = ext2fs_get_block_bitmap_range2(fs->block_map,
+					blk_itr, block_nbytes << 3, block_buf);
+			if (retval)
+				return retval;
+
+			if (i == fs->group_desc_count - 1) {
+				/* Force bitmap padding for the last group */
+				nbits = ((ext2fs_blocks_count(fs->super)
+					  - (__u64) fs->super->s_first_data_block)
+					 % (__u64) EXT2_BLOCKS_PER_GROUP(fs->super));
+				if (nbits)
+					for (j = nbits; j < fs->blocksize * 8; j++)
+						ext2fs_set_bit(j, block_buf);
+			}
 			retval = io_channel_write_blk64(fs->io, blk, 1,
 							block_buf);
 			if (retval)
 				return EXT2_ET_BLOCK_BITMAP_WRITE;
+			set_group_loc(fs->block_map, i, blk);
 		}
 #ifdef EXT2FS_SNAPSHOT_EXCLUDE_BITMAP
 		blk = ext2fs_exclude_bitmap_loc(fs, i);
-		if (do_exclude && blk) {
+		if (do_exclude && blk &&
+		    group_needs_write(fs->exclude_map, i, blk, blk_itr,
+				      block_nbytes << 3)) {
+			retval = ext2fs_get_block_bitmap_range2(fs->exclude_map,
+					blk_itr, block_nbytes << 3, exclude_buf);
+			if (retval)
+				return retval;
 			retval = io_channel_write_blk64(fs->io, blk, 1,
 						      exclude_buf);
 			if (retval)
 				return EXT2_ET_BLOCK_BITMAP_WRITE;
+			set_group_loc(fs->exclude_map, i, blk);
 		}
 #endif
 	skip_this_block_bitmap:
@@ -182,20 +224,24 @@ static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 			continue;
 
 		if (csum_flag && ext2fs_bg_flags_test(fs, i, EXT2_BG_BLOCK_UNINIT)
-		    )
+		    ) {
+			set_group_loc(fs->inode_map, i, 0);
 			goto skip_this_inode_bitmap;
-
-		retval = ext2fs_get_inode_bitmap_range(fs->inode_map,
-				ino_itr, inode_nbytes << 3, inode_buf);
-		if (retval)
-			return retval;
+		}
 
 		blk = ext2fs_inode_bitmap_loc(fs, i);
-		if (blk) {
+		if (blk && group_needs_write(fs->inode_map, i, blk, ino_itr,
+					     inode_nbytes << 3)) {
+			retval = ext2fs_get_inode_bitmap_range(fs->inode_map,
+					ino_itr, inode_nbytes << 3, inode_buf);
+			if (retval)
+				return retval;
+
 			retval = io_channel_write_blk64(fs->io, blk, 1,
 						      inode_buf);
 			if (retval)
 				return EXT2_ET_INODE_BITMAP_WRITE;
+			set_group_loc(fs->inode_map, i, blk);
 		}
 	skip_this_inode_bitmap:
 		ino_itr += inode_nbytes << 3;
@@ -203,15 +249,125 @@ static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 	}
 	if (do_block) {
 		fs->flags &= ~EXT2_FLAG_BB_DIRTY;
+		ext2fs_clear_bitmap_dirty(fs->block_map);
 		ext2fs_free_mem(&block_buf);
 	}
+#ifdef EXT2FS_SNAPSHOT_EXCLUDE_BITMAP
+	if (do_exclude) {
+		ext2fs_clear_bitmap_dirty(fs->exclude_map);
+		ext2fs_free_mem(&exclude_buf);
+	}
+#endif
 	if (do_inode) {
 		fs->flags &= ~EXT2_FLAG_IB_DIRTY;
+		ext2fs_clear_bitmap_dirty(fs->inode_map);
 		ext2fs_free_mem(&inode_buf);
 	}
 	return 0;
 }
 
+/*
+ * Return the block a group's part of a bitmap is read from, or zero
+ * if it is taken to be clear
+ */
+static blk_t bitmap_group_loc(ext2_filsys fs, ext2fs_generic_bitmap bmap,
+			      dgrp_t group)
+{
+	blk_t	blk;
+	int	uninit_flag = EXT2_BG_BLOCK_UNINIT;
+
+	if (bmap->magic == EXT2_ET_MAGIC_INODE_BITMAP) {
+		blk = ext2fs_inode_bitmap_loc(fs, group);
+		uninit_flag = EXT2_BG_INODE_UNINIT;
+#ifdef EXT2FS_SNAPSHOT_EXCLUDE_BITMAP
+	} else if (bmap == fs->exclude_map) {
+		blk = ext2fs_exclude_bitmap_loc(fs, group);
+#endif
+	} else
+		blk = ext2fs_block_bitmap_loc(fs, group);
+
+	if (EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
+				       EXT4_FEATURE_RO_COMPAT_GDT_CSUM) &&
+	    (ext2fs_bg_flags_test(fs, group, uninit_flag)) &&
+	    ext2fs_group_desc_csum_verify(fs, group))
+		blk = 0;
+	return blk;
+}
+
+/*
+ * Called the first time a group of a lazily loaded bitmap is used.
+ * If the group can't be read, all of its bits are set, so that
+ * nothing in it is taken to be free, and it is never written back.
+ */
+static errcode_t load_bitmap_group(ext2fs_generic_bitmap bmap, dgrp_t group)
+{
+	ext2_filsys	fs = bmap->fs;
+	blk_t		blk;
+	char		*buf;
+	errcode_t	retval;
+
+	blk = bitmap_group_loc(fs, bmap, group);
+	if (!blk)
+		return 0;
+	retval = ext2fs_get_memalign(fs->blocksize, fs->blocksize, &buf);
+	if (retval)
+		return retval;
+	retval = io_channel_read_blk64(fs->io, blk, 1, buf);
+	if (retval) {
+		memset(buf, 0xff, fs->blocksize);
+		set_group_loc(bmap, group, BITMAP_LOC_UNREADABLE);
+		retval = (bmap->magic == EXT2_ET_MAGIC_INODE_BITMAP) ?
+			EXT2_ET_INODE_BITMAP_READ : EXT2_ET_BLOCK_BITMAP_READ;
+	}
+	bmap->bitmap_ops->set_bmap_range(bmap, group * bmap->group_bits,
+					 bmap->group_bits, buf);
+	ext2fs_free_mem(&buf);
+	return retval;
+}
+
+/*
+ * State for reading one kind of bitmap, a batch of groups at a time
+ */
+struct bitmap_read {
+	ext2fs_generic_bitmap	map;
+	char			*buf;	/* one block per group in the batch */
+	blk_t			*loc;	/* zero if the group isn't read */
+	int			nbytes;	/* of the bitmap per group */
+	__u32			itr;	/* first bit of the next group */
+	errcode_t		read_error;
+	int			first_req;
+};
+
+/*
+ * Add requests to read the bitmap blocks of the n groups in a batch,
+ * one per run of consecutive blocks, and zero the buffers of the
+ * groups which aren't read.
+ */
+static int add_bitmap_reqs(ext2_filsys fs, struct bitmap_read *br, int n,
+			   io_request reqs, int nreqs)
+{
+	io_request	req = 0;
+	int		i;
+
+	for (i = 0; i < n; i++) {
+		if (!br->loc[i]) {
+			memset(br->buf + i * fs->blocksize, 0, fs->blocksize);
+			req = 0;
+			continue;
+		}
+		if (req && (br->loc[i] == req->block + req->count)) {
+			req->count++;
+			continue;
+		}
+		req = &reqs[nreqs++];
+		req->block = br->loc[i];
+		req->count = 1;
+		req->buf = br->buf + i * fs->blocksize;
+		req->error = 0;
+	}
+	return nreqs;
+}
+
 #ifdef EXT2FS_SNAPSHOT_EXCLUDE_BITMAP
 static errcode_t read_bitmaps(ext2_filsys fs, int do_inode, int do_block,
 		int do_exclude)
@@ -229,7 +385,6 @@ static errcode_t read_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 	errcode_t retval;
 	int block_nbytes = EXT2_BLOCKS_PER_GROUP(fs->super) / 8;
 	int inode_nbytes = EXT2_INODES_PER_GROUP(fs->super) / 8;
-	int csum_flag = 0;
 	int do_image = fs->flags & EXT2_FLAG_IMAGE_FILE;
 	unsigned int	cnt;
 	blk64_t	blk;
@@ -237,6 +392,11 @@ static errcode_t read_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 	blk64_t   blk_cnt;
 	ext2_ino_t ino_itr = 1;
 	ext2_ino_t ino_cnt;
+	struct bitmap_read rd[3];
+	blk_t	*locs = 0;
+	io_request reqs = 0;
+	dgrp_t	first, batch;
+	int	j, k, n, nrd, nreqs, lazy;
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 
@@ -248,9 +408,11 @@ static errcode_t read_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 		do_exclude = 0;
 
 #endif
-	if (EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
-				       EXT4_FEATURE_RO_COMPAT_GDT_CSUM))
-		csum_flag = 1;
+	batch = BITMAP_READ_BYTES / fs->blocksize;
+	if (batch > fs->group_desc_count)
+		batch = fs->group_desc_count;
+	if (!batch)
+		batch = 1;
 
 	retval = ext2fs_get_mem(strlen(fs->device_name) + 80, &buf);
 	if (retval)
@@ -266,7 +428,7 @@ static errcode_t read_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 		if (do_image)
 			retval = ext2fs_get_mem(fs->blocksize, &block_bitmap);
 		else
-			retval = ext2fs_get_memalign((unsigned) block_nbytes,
+			retval = ext2fs_get_memalign(batch * fs->blocksize,
 						     fs->blocksize,
 						     &block_bitmap);
 			
@@ -285,7 +447,7 @@ static errcode_t read_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 		if (do_image)
 			retval = ext2fs_get_mem(fs->blocksize, &exclude_bitmap);
 		else
-			retval = ext2fs_get_memalign((unsigned) block_nbytes,
+			retval = ext2fs_get_memalign(batch * fs->blocksize,
 						     fs->blocksize,
 						     &exclude_bitmap);	
 		if (retval)
@@ -304,8 +466,12 @@ static errcode_t read_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 		retval = ext2fs_allocate_inode_bitmap(fs, buf, &fs->inode_map);
 		if (retval)
 			goto cleanup;
-		retval = ext2fs_get_mem(do_image ? fs->blocksize :
-					(unsigned) inode_nbytes, &inode_bitmap);
+		if (do_image)
+			retval = ext2fs_get_mem(fs->blocksize, &inode_bitmap);
+		else
+			retval = ext2fs_get_memalign(batch * fs->blocksize,
+						     fs->blocksize,
+						     &inode_bitmap);
 		if (retval)
 			goto cleanup;
 	} else
@@ -361,79 +527,118 @@ static errcode_t read_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 		goto success_cleanup;
 	}
 
-	for (i = 0; i < fs->group_desc_count; i++) {
-		if (block_bitmap) {
-			blk = ext2fs_block_bitmap_loc(fs, i);
-			if (csum_flag &&
-			    ext2fs_bg_flags_test(fs, i, EXT2_BG_BLOCK_UNINIT) &&
-			    ext2fs_group_desc_csum_verify(fs, i))
-				blk = 0;
-			if (blk) {
-				retval = io_channel_read_blk64(fs->io, blk,
-					     -block_nbytes, block_bitmap);
-				if (retval) {
-					retval = EXT2_ET_BLOCK_BITMAP_READ;
-					goto cleanup;
-				}
-			} else
-				memset(block_bitmap, 0, block_nbytes);
-			cnt = block_nbytes << 3;
-			retval = ext2fs_set_block_bitmap_range2(fs->block_map,
-					       blk_itr, cnt, block_bitmap);
-			if (retval)
-				goto cleanup;
+	/*
+	 * Read the bitmaps a batch of groups at a time, with one
+	 * request per run of consecutive bitmap blocks (as laid out
+	 * by flex_bg), all submitted together so that the I/O manager
+	 * can keep several of them in flight.
+	 */
+	nrd = 0;
+	if (block_bitmap) {
+		rd[nrd].map = fs->block_map;
+		rd[nrd].buf = block_bitmap;
+		rd[nrd].nbytes = block_nbytes;
+		rd[nrd].itr = blk_itr;
+		rd[nrd].read_error = EXT2_ET_BLOCK_BITMAP_READ;
+		nrd++;
+	}
 #ifdef EXT2FS_SNAPSHOT_EXCLUDE_BITMAP
-		}
-		if (exclude_bitmap) {
-			blk = ext2fs_exclude_bitmap_loc(fs, i);
-			if (csum_flag &&
-			    ext2fs_bg_flags_test(fs, i, EXT2_BG_BLOCK_UNINIT) &&
-			    ext2fs_group_desc_csum_verify(fs, i))
-				blk = 0;
-			if (blk) {
-				retval = io_channel_read_blk64(fs->io, blk,
-					     -block_nbytes, exclude_bitmap);
-				if (retval) {
-					retval = EXT2_ET_BLOCK_BITMAP_READ;
-					goto cleanup;
-				}
-			} else
-				memset(exclude_bitmap, 0, block_nbytes);
-			cnt = block_nbytes << 3;
-			retval = ext2fs_set_block_bitmap_range2(fs->exclude_map,
-					       blk_itr, cnt, exclude_bitmap);
+	if (exclude_bitmap) {
+		rd[nrd].map = fs->exclude_map;
+		rd[nrd].buf = exclude_bitmap;
+		rd[nrd].nbytes = block_nbytes;
+		rd[nrd].itr = blk_itr;
+		rd[nrd].read_error = EXT2_ET_BLOCK_BITMAP_READ;
+		nrd++;
+	}
+#endif
+	if (inode_bitmap) {
+		rd[nrd].map = fs->inode_map;
+		rd[nrd].buf = inode_bitmap;
+		rd[nrd].nbytes = inode_nbytes;
+		rd[nrd].itr = ino_itr;
+		rd[nrd].read_error = EXT2_ET_INODE_BITMAP_READ;
+		nrd++;
+	}
+	retval = ext2fs_get_array(nrd * batch, sizeof(blk_t), &locs);
+	if (retval)
+		goto cleanup;
+	retval = ext2fs_get_array(nrd * batch, sizeof(struct struct_io_request),
+				  &reqs);
+	if (retval)
+		goto cleanup;
+	for (k = 0; k < nrd; k++) {
+		rd[k].loc = locs + k * batch;
+		ext2fs_track_bitmap_groups(rd[k].map, rd[k].nbytes << 3,
+					   fs->group_desc_count);
+	}
+
+	/*
+	 * Loading groups lazily relies on group_loc to remember which
+	 * groups couldn't be read, so fall back to reading everything
+	 * now if the groups aren't being tracked.
+	 */
+	lazy = fs->flags & EXT2_FLAG_LAZY_BITMAPS;
+	for (k = 0; k < nrd; k++)
+		if (!rd[k].map->group_loc)
+			lazy = 0;
+
+	first = 0;
+	if (lazy) {
+		for (k = 0; k < nrd; k++) {
+			retval = ext2fs_lazy_bitmap_groups(rd[k].map,
+					rd[k].nbytes << 3,
+					fs->group_desc_count,
+					load_bitmap_group);
 			if (retval)
 				goto cleanup;
+			/* Until it is loaded, a group matches the disk */
+			for (i = 0; i < fs->group_desc_count; i++)
+				set_group_loc(rd[k].map, i,
+					      bitmap_group_loc(fs, rd[k].map, i));
 		}
-		if (block_nbytes)
-			blk_itr += block_nbytes << 3;
-#else
-			blk_itr += block_nbytes << 3;
+		first = fs->group_desc_count;
+	}
+
+	for (; first < fs->group_desc_count; first += n) {
+		n = fs->group_desc_count - first;
+		if (n > batch)
+			n = batch;
+		nreqs = 0;
+		for (k = 0; k < nrd; k++) {
+			for (j = 0; j < n; j++)
+				rd[k].loc[j] = bitmap_group_loc(fs, rd[k].map,
+								first + j);
+			rd[k].first_req = nreqs;
+			nreqs = add_bitmap_reqs(fs, &rd[k], n, reqs, nreqs);
 		}
-#endif
-		if (inode_bitmap) {
-			blk = ext2fs_inode_bitmap_loc(fs, i);
-			if (csum_flag &&
-			    ext2fs_bg_flags_test(fs, i, EXT2_BG_INODE_UNINIT) &&
-			    ext2fs_group_desc_csum_verify(fs, i))
-				blk = 0;
-			if (blk) {
-				retval = io_channel_read_blk64(fs->io, blk,
-					     -inode_nbytes, inode_bitmap);
-				if (retval) {
-					retval = EXT2_ET_INODE_BITMAP_READ;
+		if (nreqs && io_channel_read_batch(fs->io, reqs, nreqs)) {
+			for (j = 0; j < nreqs && !reqs[j].error; j++)
+				;
+			for (k = nrd - 1; k > 0 && rd[k].first_req > j; k--)
+				;
+			retval = rd[k].read_error;
+			goto cleanup;
+		}
+		for (k = 0; k < nrd; k++) {
+			for (j = 0; j < n; j++) {
+				retval = ext2fs_set_generic_bitmap_range(
+					rd[k].map, rd[k].map->magic,
+					rd[k].itr, rd[k].nbytes << 3,
+					rd[k].buf + j * fs->blocksize);
+				if (retval)
 					goto cleanup;
-				}
-			} else
-				memset(inode_bitmap, 0, inode_nbytes);
-			cnt = inode_nbytes << 3;
-			retval = ext2fs_set_inode_bitmap_range(fs->inode_map,
-					       ino_itr, cnt, inode_bitmap);
-			if (retval)
-				goto cleanup;
-			ino_itr += inode_nbytes << 3;
+				set_group_loc(rd[k].map, first + j,
+					      rd[k].loc[j]);
+				rd[k].itr += rd[k].nbytes << 3;
+			}
 		}
 	}
+	/* What was just read matches the disk */
+	for (k = 0; k < nrd; k++)
+		ext2fs_clear_bitmap_dirty(rd[k].map);
+	ext2fs_free_mem(&locs);
+	ext2fs_free_mem(&reqs);
 success_cleanup:
 	if (inode_bitmap)
 		ext2fs_free_mem(&inode_bitmap);
@@ -462,6 +667,10 @@ cleanup:
 	if (exclude_bitmap)
 		ext2fs_free_mem(&exclude_bitmap);
 #endif
+	if (locs)
+		ext2fs_free_mem(&locs);
+	if (reqs)
+		ext2fs_free_mem(&reqs);
 	if (buf)
 		ext2fs_free_mem(&buf);
 	return retval;
@@ -11,11 +11,15 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
 #if HAVE_UNISTD_H
 #include <unistd.h>
 #endif
 #include <fcntl.h>
 #include <time.h>
+#if HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
 #if HAVE_SYS_STAT_H
 #include <sys/stat.h>
 #endif
@@ -46,6 +50,8 @@ struct test_private_data {
 	io_channel real;
 	int flags;
 	FILE *outfile;
+	FILE *tracefile;
+	struct timeval trace_start;
 	unsigned long block;
 	int read_abort_count, write_abort_count;
 	void (*read_blk)(unsigned long block, int count, errcode_t err);
@@ -73,6 +79,8 @@ static errcode_t test_write_byte(io_channel channel, unsigned long offset,
 static errcode_t test_set_option(io_channel channel, const char *option,
 				 const char *arg);
 static errcode_t test_get_stats(io_channel channel, io_stats *stats);
+static errcode_t test_readahead(io_channel channel, unsigned long long block,
+				unsigned long long count);
 
 
 static struct struct_io_manager struct_test_manager = {
@@ -89,6 +97,7 @@ static struct struct_io_manager struct_test_manager = {
 	test_get_stats,
 	test_read_blk64,
 	test_write_blk64,
+	test_readahead,
 };
 
 io_manager test_io_manager = &struct_test_manager;
@@ -110,6 +119,7 @@ void (*test_io_cb_set_blksize)
 	(int blksize, errcode_t err) = 0;
 void (*test_io_cb_write_byte)
 	(unsigned long block, int count, errcode_t err) = 0;
+int test_io_trace_tag = 0;
 
 /*
  * Test flags
@@ -141,6 +151,33 @@ static void test_dump_block(io_channel channel,
 	}
 }
 
+/*
+ * Append a record of an operation to the binary trace file
+ */
+static void test_trace(io_channel channel, struct test_private_data *data,
+		       int op, unsigned long long block, int count,
+		       errcode_t err)
+{
+	struct test_io_trace_rec rec;
+	struct timeval	now;
+
+	if (!data->tracefile)
+		return;
+	gettimeofday(&now, 0);
+	memset(&rec, 0, sizeof(rec));
+	rec.block = ext2fs_cpu_to_le64(block);
+	rec.count = ext2fs_cpu_to_le32(count);
+	rec.op = ext2fs_cpu_to_le16(op);
+	rec.tag = ext2fs_cpu_to_le16(test_io_trace_tag);
+	rec.usec = ext2fs_cpu_to_le64((__u64) (now.tv_sec -
+					       data->trace_start.tv_sec) *
+				      1000000 + now.tv_usec -
+				      data->trace_start.tv_usec);
+	rec.block_size = ext2fs_cpu_to_le32(channel->block_size);
+	rec.error = ext2fs_cpu_to_le32(err);
+	fwrite(&rec, sizeof(rec), 1, data->tracefile);
+}
+
 static void test_abort(io_channel channel, unsigned long block)
 {
 	struct test_private_data *data;
@@ -229,6 +266,22 @@ static errcode_t test_open(const char *name, int flags, io_channel *channel)
 	if (!data->outfile)
 		data->outfile = stderr;
 
+	data->tracefile = NULL;
+	if ((value = safe_getenv("TEST_IO_TRACE")) != NULL)
+		data->tracefile = fopen(value, "a");
+	if (data->tracefile && fseek(data->tracefile, 0, SEEK_END) == 0 &&
+	    ftell(data->tracefile) == 0) {
+		struct test_io_trace_hdr hdr;
+
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.magic = ext2fs_cpu_to_le32(TEST_IO_TRACE_MAGIC);
+		hdr.version = ext2fs_cpu_to_le32(TEST_IO_TRACE_VERSION);
+		hdr.rec_size = ext2fs_cpu_to_le32(sizeof(struct
+							 test_io_trace_rec));
+		fwrite(&hdr, sizeof(hdr), 1, data->tracefile);
+	}
+	gettimeofday(&data->trace_start, 0);
+
 	data->flags = 0;
 	if ((value = safe_getenv("TEST_IO_FLAGS")) != NULL)
 		data->flags = strtoul(value, NULL, 0);
@@ -273,6 +326,8 @@ static errcode_t test_close(io_channel channel)
 
 	if (data->outfile && data->outfile != stderr)
 		fclose(data->outfile);
+	if (data->tracefile)
+		fclose(data->tracefile);
 
 	ext2fs_free_mem(&channel->private_data);
 	if (channel->name)
@@ -315,6 +370,7 @@ static errcode_t test_read_blk(io_channel channel, unsigned long block,
 
 	if (data->real)
 		retval = io_channel_read_blk(data->real, block, count, buf);
+	test_trace(channel, data, TEST_IO_TRACE_READ, block, count, retval);
 	if (data->read_blk)
 		data->read_blk(block, count, retval);
 	if (data->flags & TEST_FLAG_READ)
@@ -342,6 +398,7 @@ static errcode_t test_write_blk(io_channel channel, unsigned long block,
 
 	if (data->real)
 		retval = io_channel_write_blk(data->real, block, count, buf);
+	test_trace(channel, data, TEST_IO_TRACE_WRITE, block, count, retval);
 	if (data->write_blk)
 		data->write_blk(block, count, retval);
 	if (data->flags & TEST_FLAG_WRITE)
@@ -369,6 +426,7 @@ static errcode_t test_read_blk64(io_channel channel, unsigned long long block,
 
 	if (data->real)
 		retval = io_channel_read_blk64(data->real, block, count, buf);
+	test_trace(channel, data, TEST_IO_TRACE_READ, block, count, retval);
 	if (data->read_blk64)
 		data->read_blk64(block, count, retval);
 	if (data->flags & TEST_FLAG_READ)
@@ -396,6 +454,7 @@ static errcode_t test_write_blk64(io_channel channel, unsigned long long block,
 
 	if (data->real)
 		retval = io_channel_write_blk64(data->real, block, count, buf);
+	test_trace(channel, data, TEST_IO_TRACE_WRITE, block, count, retval);
 	if (data->write_blk64)
 		data->write_blk64(block, count, retval);
 	if (data->flags & TEST_FLAG_WRITE)
@@ -423,6 +482,8 @@ static errcode_t test_write_byte(io_channel channel, unsigned long offset,
 
 	if (data->real && data->real->manager->write_byte)
 		retval = io_channel_write_byte(data->real, offset, count, buf);
+	test_trace(channel, data, TEST_IO_TRACE_WRITE_BYTE, offset, count,
+		   retval);
 	if (data->write_byte)
 		data->write_byte(offset, count, retval);
 	if (data->flags & TEST_FLAG_WRITE)
@@ -446,6 +507,9 @@ static errcode_t test_flush(io_channel channel)
 
 	if (data->real)
 		retval = io_channel_flush(data->real);
+	test_trace(channel, data, TEST_IO_TRACE_FLUSH, 0, 0, retval);
+	if (data->tracefile)
+		fflush(data->tracefile);
 
 	if (data->flags & TEST_FLAG_FLUSH)
 		fprintf(data->outfile, "Test_io: flush() returned %s\n",
@@ -495,3 +559,24 @@ static errcode_t test_get_stats(io_channel channel, io_stats *stats)
 	}
 	return retval;
 }
+
+static errcode_t test_readahead(io_channel channel, unsigned long long block,
+				unsigned long long count)
+{
+	struct test_private_data *data;
+	errcode_t	retval = 0;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct test_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_TEST_IO_CHANNEL);
+
+	if (data->real)
+		retval = io_channel_readahead(data->real, block, count);
+	test_trace(channel, data, TEST_IO_TRACE_READAHEAD, block,
+		   (count > INT_MAX) ? INT_MAX : count, retval);
+	if (data->flags & TEST_FLAG_READ)
+		fprintf(data->outfile,
+			"Test_io: readahead(%llu, %llu) returned %s\n",
+			block, count, retval ? error_message(retval) : "OK");
+	return retval;
+}
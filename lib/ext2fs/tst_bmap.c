@@ -0,0 +1,516 @@
+/*
+ * This testing program makes sure the extent and container bitmap
+ * backends always agree with a plain bit array, both for a set of
+ * cases at the points where the backends change how they store the
+ * bits, and for a long run of random operations.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <sys/types.h>
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+#include "gen_bitmap.h"
+
+/* The bitmap spans a few containers, the last one partly */
+#define CTR_BITS	65536
+#define TEST_START	1
+#define TEST_END	(3 * CTR_BITS + 1000)
+
+/*
+ * The shapes counted by the backends' check functions: for extents,
+ * the leaves seen, the bitmaps with more than one leaf, and the full
+ * leaves; for containers, the array, bit array and run containers.
+ */
+#define EXT_SPLIT	1
+#define EXT_FULL	2
+#define CTR_ARRAY	0
+#define CTR_BITSET	1
+#define CTR_RUNS	2
+#define NUM_SHAPES	3
+
+struct backend {
+	int		type;
+	const char	*name;
+	int		(*check)(ext2fs_generic_bitmap bmap, int *shapes);
+	const char	*shapes[NUM_SHAPES];
+};
+
+static struct backend backends[] = {
+	{ EXT2FS_BMAP_EXTENT, "extent", ext2fs_check_extent_bitmap,
+	  { "leaves", "split leaves", "full leaves" } },
+	{ EXT2FS_BMAP_CONTAINER, "container", ext2fs_check_container_bitmap,
+	  { "array containers", "bit array containers", "run containers" } },
+};
+#define NUM_BACKENDS	(sizeof(backends) / sizeof(backends[0]))
+
+/*
+ * Each case marks or unmarks num ranges of len bits, stride bits
+ * apart, and then expects each backend to have stored the bitmap in
+ * the given shape (or -1 for don't care).
+ */
+#define OP_CLEAR	0
+#define OP_MARK		1
+#define OP_UNMARK	2
+
+/* The start of extent n of a leaf full of three bit extents */
+#define LEAF_EXT(n)	(TEST_START + 4 * (n))
+#define CTR(n)		(TEST_START + (n) * CTR_BITS)
+
+struct edge_case {
+	const char	*what;
+	int		op;
+	__u32		start, num, stride, len;
+	int		expect[NUM_BACKENDS];
+};
+
+static struct edge_case edge_cases[] = {
+	/* Extent leaves */
+	{ "fill a leaf", OP_MARK, LEAF_EXT(0), 128, 4, 3,
+	  { EXT_FULL, -1 } },
+	{ "split the first extent of a full leaf", OP_UNMARK,
+	  LEAF_EXT(0) + 1, 1, 1, 1, { EXT_SPLIT, -1 } },
+	{ "clear", OP_CLEAR, 0, 0, 0, 0, { -1, -1 } },
+	{ "fill a leaf", OP_MARK, LEAF_EXT(0), 128, 4, 3,
+	  { EXT_FULL, -1 } },
+	{ "split the last extent of a full leaf", OP_UNMARK,
+	  LEAF_EXT(127) + 1, 1, 1, 1, { EXT_SPLIT, -1 } },
+	{ "clear", OP_CLEAR, 0, 0, 0, 0, { -1, -1 } },
+	{ "fill a leaf", OP_MARK, LEAF_EXT(0), 128, 4, 3,
+	  { EXT_FULL, -1 } },
+	{ "split the extent before the middle of a full leaf", OP_UNMARK,
+	  LEAF_EXT(63) + 1, 1, 1, 1, { EXT_SPLIT, -1 } },
+	{ "clear", OP_CLEAR, 0, 0, 0, 0, { -1, -1 } },
+	{ "fill a leaf", OP_MARK, LEAF_EXT(0), 128, 4, 3,
+	  { EXT_FULL, -1 } },
+	{ "split the extent after the middle of a full leaf", OP_UNMARK,
+	  LEAF_EXT(64) + 1, 1, 1, 1, { EXT_SPLIT, -1 } },
+	{ "join extents across the split", OP_MARK, LEAF_EXT(63) + 3,
+	  1, 1, 1, { -1, -1 } },
+	{ "join every extent", OP_MARK, LEAF_EXT(0), 1, 1, 4 * 128,
+	  { -1, CTR_RUNS } },
+	{ "clear", OP_CLEAR, 0, 0, 0, 0, { -1, -1 } },
+	{ "add one bit more than a leaf holds", OP_MARK, TEST_START,
+	  129, 2, 1, { EXT_SPLIT, CTR_ARRAY } },
+	{ "remove them again", OP_UNMARK, TEST_START, 129, 2, 1,
+	  { -1, -1 } },
+
+	/* Container conversions */
+	{ "fill an array container", OP_MARK, CTR(1), 4096, 3, 1,
+	  { EXT_SPLIT, CTR_ARRAY } },
+	{ "overflow an array container", OP_MARK, CTR(1) + 1, 1, 1, 1,
+	  { -1, CTR_BITSET } },
+	{ "shrink a bit array container", OP_UNMARK, CTR(1), 2049, 3, 1,
+	  { -1, CTR_ARRAY } },
+	{ "clear", OP_CLEAR, 0, 0, 0, 0, { -1, -1 } },
+	{ "fill a container", OP_MARK, CTR(1), 1, 1, CTR_BITS,
+	  { -1, CTR_RUNS } },
+	{ "split a full container", OP_UNMARK, CTR(1) + CTR_BITS / 2,
+	  1, 1, 1, { -1, CTR_RUNS } },
+	{ "clear", OP_CLEAR, 0, 0, 0, 0, { -1, -1 } },
+	{ "add one run more than a container holds", OP_MARK, CTR(1),
+	  2049, 4, 2, { EXT_SPLIT, CTR_BITSET } },
+	{ "remove half the runs", OP_UNMARK, CTR(1) + 4 * 1024, 1025,
+	  4, 2, { -1, CTR_RUNS } },
+
+	/* Boundaries */
+	{ "clear", OP_CLEAR, 0, 0, 0, 0, { -1, -1 } },
+	{ "mark across a container boundary", OP_MARK, CTR(1) - 10, 1, 1,
+	  20, { -1, -1 } },
+	{ "unmark across a container boundary", OP_UNMARK, CTR(1) - 1, 1,
+	  1, 2, { -1, -1 } },
+	{ "mark a container and a bit on each side", OP_MARK, CTR(2) - 1,
+	  1, 1, CTR_BITS + 2, { -1, CTR_RUNS } },
+	{ "mark the first bit", OP_MARK, TEST_START, 1, 1, 1,
+	  { -1, -1 } },
+	{ "mark the last bits", OP_MARK, TEST_END - 9, 1, 1, 10,
+	  { -1, -1 } },
+	{ "unmark the first bit", OP_UNMARK, TEST_START, 1, 1, 1,
+	  { -1, -1 } },
+	{ "unmark the last bit", OP_UNMARK, TEST_END, 1, 1, 1,
+	  { -1, -1 } },
+};
+#define NUM_EDGE_CASES	(sizeof(edge_cases) / sizeof(edge_cases[0]))
+
+/*
+ * Make sure the bitmap matches the bit array and is stored properly,
+ * and count the shapes it is stored in.
+ */
+static int check_bmap(struct backend *b, ext2fs_generic_bitmap ba,
+		      ext2fs_generic_bitmap bmap, int *shapes)
+{
+	__u32	i;
+
+	if (ext2fs_compare_generic_bitmap(EXT2_ET_MAGIC_BLOCK_BITMAP,
+					  EXT2_ET_NEQ_BLOCK_BITMAP, ba, bmap) ||
+	    ext2fs_compare_generic_bitmap(EXT2_ET_MAGIC_BLOCK_BITMAP,
+					  EXT2_ET_NEQ_BLOCK_BITMAP, bmap, ba)) {
+		for (i = ba->start; i <= ba->end; i++)
+			if (!ext2fs_test_generic_bitmap(ba, i) !=
+			    !ext2fs_test_generic_bitmap(bmap, i))
+				break;
+		printf("Bitmaps differ at bit %u\n", i);
+		return 1;
+	}
+	return (b->check)(bmap, shapes);
+}
+
+static void apply_edge_case(struct edge_case *ec, ext2fs_generic_bitmap bmap)
+{
+	__u32	i, arg;
+
+	if (ec->op == OP_CLEAR) {
+		ext2fs_clear_generic_bitmap(bmap);
+		return;
+	}
+	for (i = 0; i < ec->num; i++) {
+		arg = ec->start + i * ec->stride;
+		/* Single bits go through the single bit operations */
+		if (ec->len == 1 && ec->op == OP_MARK)
+			ext2fs_mark_generic_bitmap(bmap, arg);
+		else if (ec->len == 1)
+			ext2fs_unmark_generic_bitmap(bmap, arg);
+		else if (ec->op == OP_MARK)
+			ext2fs_mark_block_bitmap_range(bmap, arg, ec->len);
+		else
+			ext2fs_unmark_block_bitmap_range(bmap, arg, ec->len);
+	}
+}
+
+static int test_edge_cases(struct backend *b, ext2fs_generic_bitmap ba,
+			   ext2fs_generic_bitmap bmap, int *seen)
+{
+	struct edge_case *ec;
+	int		shapes[NUM_SHAPES];
+	unsigned int	i, j;
+
+	for (i = 0; i < NUM_EDGE_CASES; i++) {
+		ec = &edge_cases[i];
+		apply_edge_case(ec, ba);
+		apply_edge_case(ec, bmap);
+		memset(shapes, 0, sizeof(shapes));
+		if (check_bmap(b, ba, bmap, shapes)) {
+			printf("Case %u (%s) failed\n", i, ec->what);
+			return 1;
+		}
+		j = b - backends;
+		if (ec->expect[j] >= 0 && !shapes[ec->expect[j]]) {
+			printf("Case %u (%s): no %s\n", i, ec->what,
+			       b->shapes[ec->expect[j]]);
+			return 1;
+		}
+		for (j = 0; j < NUM_SHAPES; j++)
+			seen[j] += shapes[j];
+	}
+	return 0;
+}
+
+/*
+ * Apply the same random operations to both bitmaps, and make sure
+ * they always agree.  The operations are bunched up now and then so
+ * that the bitmap gets stored every way it can be.
+ */
+static int test_random(struct backend *b, ext2fs_generic_bitmap ba,
+		       ext2fs_generic_bitmap *bmp, int *seen)
+{
+	ext2fs_generic_bitmap	bmap = *bmp, copy;
+	static char		buf[TEST_END / 8 + 8], buf2[TEST_END / 8 + 8];
+	__u32			arg, num, base, span;
+	int			i, op, ret1, ret2, failed = 0;
+	errcode_t		retval;
+
+	srandom(42);
+	base = TEST_START;
+	span = TEST_END - TEST_START + 1;
+	for (i = 0; i < 400000 && !failed; i++) {
+		/* Every so often, work on a different part of the bitmap */
+		if ((i % 20000) == 0) {
+			span = (i % 40000) ? TEST_END - TEST_START + 1 :
+				8192 + random() % 8192;
+			base = TEST_START + random() %
+				(TEST_END - TEST_START + 2 - span);
+		}
+		op = random() % 100;
+		arg = base + random() % span;
+		num = 1 + random() % ((op % 3 || span < CTR_BITS) ? 16 :
+				      (op % 2) ? 600 : 70000);
+		if (arg + num - 1 > TEST_END)
+			num = TEST_END - arg + 1;
+		if (op < 35) {
+			ret1 = !!ext2fs_mark_generic_bitmap(ba, arg);
+			ret2 = !!ext2fs_mark_generic_bitmap(bmap, arg);
+		} else if (op < 55) {
+			ret1 = !!ext2fs_unmark_generic_bitmap(ba, arg);
+			ret2 = !!ext2fs_unmark_generic_bitmap(bmap, arg);
+		} else if (op < 65) {
+			ext2fs_mark_block_bitmap_range(ba, arg, num);
+			ext2fs_mark_block_bitmap_range(bmap, arg, num);
+			ret1 = ret2 = 0;
+		} else if (op < 75) {
+			ext2fs_unmark_block_bitmap_range(ba, arg, num);
+			ext2fs_unmark_block_bitmap_range(bmap, arg, num);
+			ret1 = ret2 = 0;
+		} else if (op < 85) {
+			ret1 = !!ext2fs_test_generic_bitmap(ba, arg);
+			ret2 = !!ext2fs_test_generic_bitmap(bmap, arg);
+		} else if (op < 88) {
+			ret1 = ext2fs_test_block_bitmap_range(ba, arg, num);
+			ret2 = ext2fs_test_block_bitmap_range(bmap, arg, num);
+		} else if (op < 94) {
+			__u32	out1 = 0, out2 = 0, end;
+
+			end = arg + num * 8 - 1;
+			if (end > TEST_END)
+				end = TEST_END;
+			if (op < 90) {
+				ret1 = ext2fs_find_first_zero_generic_bitmap(ba,
+						arg, end, &out1);
+				ret2 = ext2fs_find_first_zero_generic_bitmap(bmap,
+						arg, end, &out2);
+			} else if (op < 92) {
+				ret1 = ext2fs_find_first_set_generic_bitmap(ba,
+						arg, end, &out1);
+				ret2 = ext2fs_find_first_set_generic_bitmap(bmap,
+						arg, end, &out2);
+			} else {
+				ret1 = ext2fs_count_generic_bitmap_range(ba,
+						arg, end, &out1);
+				ret2 = ext2fs_count_generic_bitmap_range(bmap,
+						arg, end, &out2);
+			}
+			if (out1 != out2)
+				ret1 = -1;
+		} else if (op < 99) {
+			/* Copy a range across through the byte interface */
+			arg = TEST_START + (arg - TEST_START) / 8 * 8;
+			num = (num + 7) / 8 * 8;
+			if (arg + num - 1 > TEST_END)
+				continue;
+			ext2fs_get_generic_bitmap_range(ba,
+				EXT2_ET_MAGIC_BLOCK_BITMAP, arg, num, buf);
+			ext2fs_get_generic_bitmap_range(bmap,
+				EXT2_ET_MAGIC_BLOCK_BITMAP, arg, num, buf2);
+			ret1 = memcmp(buf, buf2, num / 8);
+			ret2 = 0;
+			buf[random() % (num / 8)] ^= 0x5a;
+			ext2fs_set_generic_bitmap_range(ba,
+				EXT2_ET_MAGIC_BLOCK_BITMAP, arg, num, buf);
+			ext2fs_set_generic_bitmap_range(bmap,
+				EXT2_ET_MAGIC_BLOCK_BITMAP, arg, num, buf);
+		} else {
+			retval = ext2fs_copy_generic_bitmap(bmap, &copy);
+			if (retval) {
+				com_err("tst_bmap", retval,
+					"while copying bitmap");
+				exit(1);
+			}
+			ext2fs_free_generic_bitmap(bmap);
+			*bmp = bmap = copy;
+			ret1 = ret2 = 0;
+		}
+		if (ret1 != ret2) {
+			printf("Iteration %d: op %d at %u+%u returned %d "
+			       "vs %d\n", i, op, arg, num, ret1, ret2);
+			failed++;
+		}
+		if ((i % 1000) == 0 && check_bmap(b, ba, bmap, seen)) {
+			printf("Iteration %d failed\n", i);
+			failed++;
+		}
+	}
+	if (!failed && check_bmap(b, ba, bmap, seen))
+		failed++;
+	return failed;
+}
+
+struct diff_check {
+	ext2fs_generic_bitmap	bm1, seen;
+	__u32			last;
+	int			last_bit, bad;
+};
+
+static int diff_func(__u32 first, __u32 last, int bit, void *priv)
+{
+	struct diff_check *dc = priv;
+	__u32	i;
+
+	if (dc->last != ~0U && dc->last + 1 == first && dc->last_bit == bit)
+		dc->bad++;		/* should have been one run */
+	for (i = first; i <= last; i++) {
+		if (!ext2fs_test_generic_bitmap(dc->bm1, i) != !bit)
+			dc->bad++;
+		ext2fs_mark_generic_bitmap(dc->seen, i);
+	}
+	dc->last = last;
+	dc->last_bit = bit;
+	return 0;
+}
+
+/* Check that the diff of the two bitmaps finds exactly the bits which differ */
+static int check_diff(ext2fs_generic_bitmap bm1, ext2fs_generic_bitmap bm2,
+		      __u32 start, __u32 end)
+{
+	struct diff_check dc;
+	errcode_t	retval;
+	__u32		i;
+
+	retval = ext2fs_make_generic_bitmap(EXT2_ET_MAGIC_BLOCK_BITMAP, 0,
+					    TEST_START, TEST_END, TEST_END,
+					    "seen", 0, &dc.seen);
+	if (retval) {
+		com_err("tst_bmap", retval, "while allocating bitmap");
+		exit(1);
+	}
+	dc.bm1 = bm1;
+	dc.last = ~0U;
+	dc.last_bit = 0;
+	dc.bad = 0;
+	retval = ext2fs_diff_generic_bitmap_range(bm1, bm2, start, end,
+						  diff_func, &dc);
+	for (i = TEST_START; i <= TEST_END; i++)
+		if (!ext2fs_test_generic_bitmap(dc.seen, i) !=
+		    !(i >= start && i <= end &&
+		      !ext2fs_test_generic_bitmap(bm1, i) !=
+		      !ext2fs_test_generic_bitmap(bm2, i)))
+			dc.bad++;
+	ext2fs_free_generic_bitmap(dc.seen);
+	if (retval || dc.bad) {
+		printf("Diff of %u-%u failed\n", start, end);
+		return 1;
+	}
+	return 0;
+}
+
+/* Make the two bitmaps differ here and there, then diff them */
+static int test_diff(ext2fs_generic_bitmap ba, ext2fs_generic_bitmap bmap)
+{
+	static char	buf[TEST_END / 8 + 8];
+	__u32		arg, num;
+	int		i, failed;
+
+	for (i = 0; i < 300; i++) {
+		arg = TEST_START + random() % (TEST_END - TEST_START + 1);
+		num = 1 + random() % 100;
+		if (arg + num - 1 > TEST_END)
+			num = TEST_END - arg + 1;
+		if (i & 1)
+			ext2fs_mark_block_bitmap_range(bmap, arg, num);
+		else
+			ext2fs_unmark_block_bitmap_range(bmap, arg, num);
+	}
+	failed = check_diff(ba, bmap, TEST_START, TEST_END);
+	for (i = 0; i < 100 && !failed; i++) {
+		arg = TEST_START + random() % (TEST_END - TEST_START + 1);
+		num = random() % (TEST_END - arg + 1);
+		failed += check_diff(bmap, ba, arg, arg + num);
+	}
+
+	/* Put the bitmap back the way it was */
+	ext2fs_get_generic_bitmap_range(ba, EXT2_ET_MAGIC_BLOCK_BITMAP,
+					TEST_START, TEST_END - TEST_START + 1,
+					buf);
+	ext2fs_set_generic_bitmap_range(bmap, EXT2_ET_MAGIC_BLOCK_BITMAP,
+					TEST_START, TEST_END - TEST_START + 1,
+					buf);
+	return failed;
+}
+
+/* Shrink, then grow again; the new bits must come back clear */
+static int test_resize(struct backend *b, ext2fs_generic_bitmap ba,
+		       ext2fs_generic_bitmap bmap, int *seen)
+{
+	ext2fs_mark_block_bitmap_range(bmap, TEST_END / 2, TEST_END / 2);
+	/* (the bit array keeps the tail of its last byte when it shrinks) */
+	ext2fs_mark_block_bitmap_range(ba, TEST_END / 2, 1);
+	ext2fs_unmark_block_bitmap_range(ba, TEST_END / 2 + 1, TEST_END / 2);
+	ext2fs_resize_generic_bitmap(EXT2_ET_MAGIC_BLOCK_BITMAP,
+				     TEST_END / 2, TEST_END / 2, ba);
+	ext2fs_resize_generic_bitmap(EXT2_ET_MAGIC_BLOCK_BITMAP,
+				     TEST_END / 2, TEST_END / 2, bmap);
+	ext2fs_resize_generic_bitmap(EXT2_ET_MAGIC_BLOCK_BITMAP,
+				     TEST_END, TEST_END, ba);
+	ext2fs_resize_generic_bitmap(EXT2_ET_MAGIC_BLOCK_BITMAP,
+				     TEST_END, TEST_END, bmap);
+	if (check_bmap(b, ba, bmap, seen))
+		return 1;
+	if (!ext2fs_test_block_bitmap_range(bmap, TEST_END / 2 + 1,
+					    TEST_END / 2)) {
+		printf("Resized bitmap not cleared\n");
+		return 1;
+	}
+	return 0;
+}
+
+static int test_backend(struct backend *b)
+{
+	struct struct_ext2_filsys fs;
+	ext2fs_generic_bitmap	ba, bmap;
+	int			i, failed, seen[NUM_SHAPES];
+	errcode_t		retval;
+
+	memset(&fs, 0, sizeof(fs));
+	fs.default_bitmap_type = EXT2FS_BMAP_BITARRAY;
+	retval = ext2fs_make_generic_bitmap(EXT2_ET_MAGIC_BLOCK_BITMAP, &fs,
+					    TEST_START, TEST_END, TEST_END,
+					    "bit array", 0, &ba);
+	if (retval) {
+		com_err("tst_bmap", retval, "while allocating bit array");
+		exit(1);
+	}
+	fs.default_bitmap_type = b->type;
+	retval = ext2fs_make_generic_bitmap(EXT2_ET_MAGIC_BLOCK_BITMAP, &fs,
+					    TEST_START, TEST_END, TEST_END,
+					    b->name, 0, &bmap);
+	if (retval) {
+		com_err("tst_bmap", retval, "while allocating %s bitmap",
+			b->name);
+		exit(1);
+	}
+
+	memset(seen, 0, sizeof(seen));
+	failed = test_edge_cases(b, ba, bmap, seen);
+	if (!failed)
+		failed = test_random(b, ba, &bmap, seen);
+	if (!failed)
+		failed = test_diff(ba, bmap);
+	if (!failed)
+		failed = test_resize(b, ba, bmap, seen);
+	for (i = 0; i < NUM_SHAPES && !failed; i++) {
+		if (!seen[i]) {
+			printf("No %s were seen\n", b->shapes[i]);
+			failed++;
+		}
+	}
+
+	ext2fs_free_generic_bitmap(ba);
+	ext2fs_free_generic_bitmap(bmap);
+	printf("%s bitmap test %s\n", b->name,
+	       failed ? "failed" : "succeeded");
+	return failed;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int	i;
+	int		failed = 0;
+
+	add_error_table(&et_ext2_error_table);
+	for (i = 0; i < NUM_BACKENDS; i++)
+		failed += test_backend(&backends[i]);
+	if (failed) {
+		printf("Bitmap backend tests failed\n");
+		exit(1);
+	}
+	printf("Bitmap backend tests succeeded\n");
+	return 0;
+}
@@ -0,0 +1,100 @@
+/*
+ * This testing program makes sure that reading a file through the
+ * mmap I/O manager doesn't crash when the file is truncated while it
+ * is mapped; the read should be reported as short instead.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <fcntl.h>
+#include <sys/types.h>
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+
+#define TEST_FILE	"tst_mmap.img"
+#define BLOCK_SIZE	1024
+#define TEST_BLOCKS	64
+#define SHORT_BLOCKS	8
+
+static int check_block(io_channel io, unsigned long block,
+		       errcode_t expect)
+{
+	char		buf[BLOCK_SIZE], cmp[BLOCK_SIZE];
+	errcode_t	retval;
+
+	retval = io_channel_read_blk(io, block, 1, buf);
+	if (retval != expect) {
+		printf("Reading block %lu returned %s, expected %s\n", block,
+		       retval ? error_message(retval) : "OK",
+		       expect ? error_message(expect) : "OK");
+		return 1;
+	}
+	memset(cmp, block, BLOCK_SIZE);
+	if (!retval && memcmp(buf, cmp, BLOCK_SIZE)) {
+		printf("Block %lu has the wrong contents\n", block);
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	io_channel	io;
+	errcode_t	retval;
+	char		buf[BLOCK_SIZE];
+	int		fd, i, failed = 0;
+
+	add_error_table(&et_ext2_error_table);
+	fd = open(TEST_FILE, O_CREAT | O_TRUNC | O_RDWR, 0600);
+	if (fd < 0) {
+		perror(TEST_FILE);
+		exit(1);
+	}
+	for (i = 0; i < TEST_BLOCKS; i++) {
+		memset(buf, i, BLOCK_SIZE);
+		if (write(fd, buf, BLOCK_SIZE) != BLOCK_SIZE) {
+			perror(TEST_FILE);
+			exit(1);
+		}
+	}
+
+	retval = mmap_io_manager->open(TEST_FILE, 0, &io);
+	if (retval) {
+		com_err("tst_mmap", retval, "while opening %s", TEST_FILE);
+		exit(1);
+	}
+	io_channel_set_blksize(io, BLOCK_SIZE);
+	failed += check_block(io, 2, 0);
+	failed += check_block(io, TEST_BLOCKS - 1, 0);
+
+	/* Now pull the rest of the file out from under the mapping */
+	if (ftruncate(fd, SHORT_BLOCKS * BLOCK_SIZE) < 0) {
+		perror(TEST_FILE);
+		exit(1);
+	}
+	failed += check_block(io, 2, 0);
+	failed += check_block(io, SHORT_BLOCKS - 1, 0);
+	failed += check_block(io, SHORT_BLOCKS, EXT2_ET_SHORT_READ);
+	failed += check_block(io, TEST_BLOCKS - 1, EXT2_ET_SHORT_READ);
+	failed += check_block(io, 3, 0);
+
+	io_channel_close(io);
+	close(fd);
+	unlink(TEST_FILE);
+	if (failed) {
+		printf("mmap truncation test failed\n");
+		exit(1);
+	}
+	printf("mmap truncation test succeeded\n");
+	return 0;
+}
@@ -0,0 +1,199 @@
+/*
+ * This testing program makes sure that io_uring being unavailable
+ * doesn't stop a file system from being opened with the io_uring
+ * options; I/O should just carry on through pread/pwrite.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#include <stddef.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#if defined(__linux__) && defined(HAVE_SYS_PRCTL_H) && \
+	defined(HAVE_SYS_SYSCALL_H)
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#if defined(__NR_io_uring_setup) && defined(SECCOMP_MODE_FILTER)
+#define USE_SECCOMP
+#endif
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+
+#define TEST_FILE	"tst_uring.img"
+#define TEST_BLOCKS	1024
+#define BATCH		8
+
+#ifdef USE_SECCOMP
+/*
+ * Make io_uring_setup() fail with the given errno, the way it does
+ * on a kernel without io_uring or where it has been blocked.
+ */
+static int block_io_uring(int err)
+{
+	struct sock_filter filter[] = {
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+			 offsetof(struct seccomp_data, nr)),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_io_uring_setup, 0, 1),
+		BPF_STMT(BPF_RET | BPF_K,
+			 SECCOMP_RET_ERRNO | (err & SECCOMP_RET_DATA)),
+		BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+	};
+	struct sock_fprog prog = {
+		sizeof(filter) / sizeof(filter[0]), filter
+	};
+
+	if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) < 0)
+		return -1;
+	if (prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog) < 0)
+		return -1;
+	if (syscall(__NR_io_uring_setup, 1, NULL) >= 0 || errno != err)
+		return -1;
+	return 0;
+}
+
+/*
+ * Open the test file with io_uring blocked and read the same blocks
+ * with a batch and one at a time.
+ */
+static int test_fallback(int err)
+{
+	struct struct_io_request reqs[BATCH];
+	ext2_filsys	fs;
+	errcode_t	retval;
+	char		*buf, *cmp;
+	int		i, failed = 0;
+
+	if (block_io_uring(err) < 0) {
+		printf("Couldn't block io_uring_setup; skipped\n");
+		return 0;
+	}
+	retval = ext2fs_open(TEST_FILE "?io_uring", EXT2_FLAG_RW, 0, 0,
+			     unix_io_manager, &fs);
+	if (retval) {
+		com_err("tst_uring", retval, "while opening %s?io_uring "
+			"with io_uring_setup failing with %s", TEST_FILE,
+			strerror(err));
+		return 1;
+	}
+	retval = io_channel_set_options(fs->io, "queue_depth=16");
+	if (retval) {
+		com_err("tst_uring", retval, "while setting queue_depth "
+			"with io_uring_setup failing with %s", strerror(err));
+		failed++;
+	}
+	retval = ext2fs_get_array(2 * BATCH, fs->blocksize, &buf);
+	if (retval) {
+		com_err("tst_uring", retval, "while allocating buffers");
+		exit(1);
+	}
+	cmp = buf + BATCH * fs->blocksize;
+	for (i = 0; i < BATCH; i++) {
+		reqs[i].block = i * 3 + 1;
+		reqs[i].count = 1;
+		reqs[i].buf = buf + i * fs->blocksize;
+		reqs[i].error = 0;
+	}
+	retval = io_channel_read_batch(fs->io, reqs, BATCH);
+	for (i = 0; !retval && i < BATCH; i++) {
+		retval = io_channel_read_blk(fs->io, reqs[i].block, 1,
+					     cmp + i * fs->blocksize);
+		if (!retval && memcmp(reqs[i].buf, cmp + i * fs->blocksize,
+				      fs->blocksize)) {
+			printf("Batched read of block %llu differs\n",
+			       reqs[i].block);
+			failed++;
+		}
+	}
+	if (retval) {
+		com_err("tst_uring", retval, "while reading blocks "
+			"with io_uring_setup failing with %s", strerror(err));
+		failed++;
+	}
+	ext2fs_free_mem(&buf);
+	retval = ext2fs_close(fs);
+	if (retval) {
+		com_err("tst_uring", retval, "while closing %s", TEST_FILE);
+		failed++;
+	}
+	return failed != 0;
+}
+#endif
+
+int main(int argc, char **argv)
+{
+#ifdef USE_SECCOMP
+	struct ext2_super_block param;
+	ext2_filsys	fs;
+	errcode_t	retval;
+	int		errs[] = { ENOSYS, EPERM, EINVAL };
+	int		i, status, failed = 0;
+	pid_t		pid;
+
+	add_error_table(&et_ext2_error_table);
+	i = open(TEST_FILE, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+	if (i < 0 || ftruncate(i, TEST_BLOCKS * 1024) < 0) {
+		perror(TEST_FILE);
+		exit(1);
+	}
+	close(i);
+	memset(&param, 0, sizeof(param));
+	param.s_blocks_count = TEST_BLOCKS;
+	retval = ext2fs_initialize(TEST_FILE, EXT2_FLAG_RW, &param,
+				   unix_io_manager, &fs);
+	if (!retval) {
+		retval = ext2fs_allocate_tables(fs);
+		if (!retval)
+			retval = ext2fs_close(fs);
+	}
+	if (retval) {
+		com_err("tst_uring", retval, "while creating %s", TEST_FILE);
+		unlink(TEST_FILE);
+		exit(1);
+	}
+
+	for (i = 0; i < (int) (sizeof(errs) / sizeof(errs[0])); i++) {
+		fflush(stdout);
+		pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			failed++;
+			break;
+		}
+		if (pid == 0)
+			exit(test_fallback(errs[i]));
+		if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status)) {
+			printf("io_uring fallback failed with "
+			       "io_uring_setup failing with %s\n",
+			       strerror(errs[i]));
+			failed++;
+		}
+	}
+	unlink(TEST_FILE);
+	if (failed) {
+		printf("io_uring fallback test failed\n");
+		exit(1);
+	}
+	printf("io_uring fallback test succeeded\n");
+#else
+	printf("io_uring fallback test skipped\n");
+#endif
+	return 0;
+}
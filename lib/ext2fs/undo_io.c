@@ -1,6 +1,6 @@
 /*
- * undo_io.c --- This is the undo io manager that copies the old data that
- * copies the old data being overwritten into a tdb database
+ * undo_io.c --- This is the undo io manager that copies the old data
+ * being overwritten into an append-only undo log
  *
  * Copyright IBM Corporation, 2007
  * Author Aneesh Kumar K.V <aneesh.kumar@linux.vnet.ibm.com>
@@ -37,10 +37,9 @@
 #include <sys/resource.h>
 #endif
 
-#include "tdb.h"
-
 #include "ext2_fs.h"
 #include "ext2fs.h"
+#include "crc16.h"
 
 #ifdef __GNUC__
 #define ATTR(x) __attribute__(x)
@@ -55,10 +54,18 @@
 #define EXT2_CHECK_MAGIC(struct, code) \
 	  if ((struct)->magic != (code)) return (code)
 
+/*
+ * Saved blocks are gathered in a buffer of this size and appended
+ * to the undo log with a single write, which is made durable before
+ * the new contents are passed on to the backing channel.
+ */
+#define UNDO_LOG_BUFSIZE	(1024 * 1024)
+#define UNDO_HASH_SIZE		1024
+
 struct undo_private_data {
 	int	magic;
-	TDB_CONTEXT *tdb;
-	char *tdb_file;
+	int	undo_fd;
+	char	*undo_file;
 
 	/* The backing io channel */
 	io_channel real;
@@ -68,6 +75,21 @@ struct undo_private_data {
 
 	/* to support offset in unix I/O manager */
 	ext2_loff_t offset;
+
+	/* Records not yet written to the undo log */
+	char	*log_buf;
+	int	log_buf_size;
+	int	log_used;
+	ext2_loff_t log_end;		/* where log_buf will be written */
+	int	log_unsynced;		/* records appended since last fsync */
+	int	log_hdr_written;	/* header has the fs identity */
+
+	/* Every block saved so far, hashed by block number */
+	struct undo_log_entry *entries;
+	long	*hash_next;
+	long	*hash;
+	unsigned long num_entries, max_entries;
+	unsigned long hash_size;
 };
 
 static errcode_t undo_open(const char *name, int flags, io_channel *channel);
@@ -98,13 +120,9 @@ static struct struct_io_manager struct_undo_manager = {
 
 io_manager undo_io_manager = &struct_undo_manager;
 static io_manager undo_io_backing_manager ;
-static char *tdb_file;
+static char *undo_file;
 static int actual_size;
 
-static unsigned char mtime_key[] = "filesystem MTIME";
-static unsigned char blksize_key[] = "filesystem BLKSIZE";
-static unsigned char uuid_key[] = "filesystem UUID";
-
 errcode_t set_undo_io_backing_manager(io_manager manager)
 {
 	/*
@@ -116,80 +134,292 @@ errcode_t set_undo_io_backing_manager(io_manager manager)
 
 errcode_t set_undo_io_backup_file(char *file_name)
 {
-	tdb_file = strdup(file_name);
+	undo_file = strdup(file_name);
 
-	if (tdb_file == NULL) {
+	if (undo_file == NULL) {
 		return EXT2_ET_NO_MEMORY;
 	}
 
 	return 0;
 }
 
-static errcode_t write_file_system_identity(io_channel undo_channel,
-							TDB_CONTEXT *tdb)
+static errcode_t write_at(int fd, ext2_loff_t offset, const void *buf,
+			  size_t size)
+{
+	ssize_t	actual;
+
+	if (ext2fs_llseek(fd, offset, SEEK_SET) != offset)
+		return errno ? errno : EXT2_ET_LLSEEK_FAILED;
+	actual = write(fd, buf, size);
+	if (actual < 0)
+		return errno;
+	if ((size_t) actual != size)
+		return EXT2_ET_SHORT_WRITE;
+	return 0;
+}
+
+/*
+ * Write out the records gathered in the log buffer
+ */
+static errcode_t flush_log_buf(struct undo_private_data *data)
+{
+	errcode_t	retval;
+
+	if (!data->log_used)
+		return 0;
+	retval = write_at(data->undo_fd, data->log_end, data->log_buf,
+			  data->log_used);
+	if (retval)
+		return retval;
+	data->log_end += data->log_used;
+	data->log_used = 0;
+	return 0;
+}
+
+static errcode_t write_log_header(struct undo_private_data *data,
+				  struct ext2_super_block *super,
+				  ext2_loff_t index_offset)
+{
+	char	buf[E2UNDO_LOG_HDR_SIZE];
+	struct undo_log_header *hdr = (struct undo_log_header *) buf;
+
+	memset(buf, 0, sizeof(buf));
+	memcpy(hdr->magic, E2UNDO_LOG_MAGIC, sizeof(hdr->magic));
+	hdr->version = ext2fs_cpu_to_le32(E2UNDO_LOG_VERSION);
+	hdr->block_size = ext2fs_cpu_to_le32(data->tdb_data_size);
+	if (index_offset) {
+		hdr->index_offset = ext2fs_cpu_to_le64(index_offset);
+		hdr->num_entries = ext2fs_cpu_to_le64(data->num_entries);
+	}
+	if (super) {
+		/* Kept in the file system byte order */
+		hdr->fs_mtime = super->s_mtime;
+		memcpy(hdr->fs_uuid, super->s_uuid, sizeof(hdr->fs_uuid));
+	}
+	return write_at(data->undo_fd, 0, buf, sizeof(buf));
+}
+
+static errcode_t read_fs_super(struct undo_private_data *data,
+			       struct ext2_super_block *super)
+{
+	io_channel	channel = data->real;
+	int		block_size = channel->block_size;
+	errcode_t	retval;
+
+	io_channel_set_blksize(channel, SUPERBLOCK_OFFSET);
+	retval = io_channel_read_blk(channel, 1, -SUPERBLOCK_SIZE, super);
+	io_channel_set_blksize(channel, block_size);
+	return retval;
+}
+
+/*
+ * Make the records appended so far durable before the blocks they
+ * save are overwritten.  The first time around the header is
+ * rewritten with the block size and the identity of the file system
+ * as it was before any change, so that e2undo can replay the log by
+ * scanning the records if we never get as far as writing the index.
+ */
+static errcode_t sync_undo_log(struct undo_private_data *data)
 {
-	errcode_t retval;
 	struct ext2_super_block super;
-	TDB_DATA tdb_key, tdb_data;
+	errcode_t	retval;
+
+	if (!data->log_unsynced)
+		return 0;
+	if (!data->log_hdr_written) {
+		retval = read_fs_super(data, &super);
+		if (retval)
+			return retval;
+		retval = write_log_header(data, &super, 0);
+		if (retval)
+			return retval;
+		data->log_hdr_written = 1;
+	}
+	retval = flush_log_buf(data);
+	if (retval)
+		return retval;
+	if (fsync(data->undo_fd) < 0)
+		return errno;
+	data->log_unsynced = 0;
+	return 0;
+}
+
+/*
+ * Write the remaining records, the index, and finally the header
+ * carrying the file system identity, so that a log is only marked
+ * complete once everything it refers to is on disk.
+ */
+static errcode_t write_log_index(io_channel undo_channel)
+{
 	struct undo_private_data *data;
-	io_channel channel;
-	int block_size ;
+	struct ext2_super_block super;
+	struct undo_log_entry *index = NULL;
+	ext2_loff_t	index_offset;
+	errcode_t	retval;
+	unsigned long	i;
 
 	data = (struct undo_private_data *) undo_channel->private_data;
-	channel = data->real;
-	block_size = channel->block_size;
 
-	io_channel_set_blksize(channel, SUPERBLOCK_OFFSET);
-	retval = io_channel_read_blk(channel, 1, -SUPERBLOCK_SIZE, &super);
+	retval = read_fs_super(data, &super);
+	if (retval)
+		return retval;
+
+	retval = flush_log_buf(data);
 	if (retval)
-		goto err_out;
-
-	/* Write to tdb file in the file system byte order */
-	tdb_key.dptr = mtime_key;
-	tdb_key.dsize = sizeof(mtime_key);
-	tdb_data.dptr = (unsigned char *) &(super.s_mtime);
-	tdb_data.dsize = sizeof(super.s_mtime);
-
-	retval = tdb_store(tdb, tdb_key, tdb_data, TDB_INSERT);
-	if (retval == -1) {
-		retval = EXT2_ET_TDB_SUCCESS + tdb_error(tdb);
-		goto err_out;
+		return retval;
+	index_offset = data->log_end;
+	if (data->num_entries) {
+		retval = ext2fs_get_array(data->num_entries,
+					  sizeof(struct undo_log_entry),
+					  &index);
+		if (retval)
+			return retval;
+		for (i = 0; i < data->num_entries; i++) {
+			index[i].block =
+				ext2fs_cpu_to_le64(data->entries[i].block);
+			index[i].offset =
+				ext2fs_cpu_to_le64(data->entries[i].offset);
+			index[i].size =
+				ext2fs_cpu_to_le32(data->entries[i].size);
+			index[i].csum =
+				ext2fs_cpu_to_le32(data->entries[i].csum);
+		}
+		retval = write_at(data->undo_fd, index_offset, index,
+				  data->num_entries *
+				  sizeof(struct undo_log_entry));
+		ext2fs_free_mem(&index);
+		if (retval)
+			return retval;
 	}
+	if (fsync(data->undo_fd) < 0)
+		return errno;
+	retval = write_log_header(data, &super, index_offset);
+	if (retval)
+		return retval;
+	if (fsync(data->undo_fd) < 0)
+		return errno;
+	return 0;
+}
 
-	tdb_key.dptr = uuid_key;
-	tdb_key.dsize = sizeof(uuid_key);
-	tdb_data.dptr = (unsigned char *)&(super.s_uuid);
-	tdb_data.dsize = sizeof(super.s_uuid);
+static unsigned long hash_undo_block(struct undo_private_data *data,
+				     unsigned long long block)
+{
+	return (unsigned long) ((block ^ (block >> 20)) &
+				(data->hash_size - 1));
+}
 
-	retval = tdb_store(tdb, tdb_key, tdb_data, TDB_INSERT);
-	if (retval == -1) {
-		retval = EXT2_ET_TDB_SUCCESS + tdb_error(tdb);
-	}
+static int undo_block_saved(struct undo_private_data *data,
+			    unsigned long long block)
+{
+	long	i;
 
-err_out:
-	io_channel_set_blksize(channel, block_size);
-	return retval;
+	if (!data->hash_size)
+		return 0;
+	for (i = data->hash[hash_undo_block(data, block)]; i >= 0;
+	     i = data->hash_next[i])
+		if (data->entries[i].block == block)
+			return 1;
+	return 0;
 }
 
-static errcode_t write_block_size(TDB_CONTEXT *tdb, int block_size)
+static errcode_t grow_undo_hash(struct undo_private_data *data)
 {
-	errcode_t retval;
-	TDB_DATA tdb_key, tdb_data;
+	unsigned long	i, h, new_max;
+	errcode_t	retval;
+
+	new_max = data->max_entries ? data->max_entries * 2 : UNDO_HASH_SIZE;
+	retval = ext2fs_resize_mem(data->max_entries *
+				   sizeof(struct undo_log_entry),
+				   new_max * sizeof(struct undo_log_entry),
+				   &data->entries);
+	if (retval)
+		return retval;
+	retval = ext2fs_resize_mem(data->max_entries * sizeof(long),
+				   new_max * sizeof(long), &data->hash_next);
+	if (retval)
+		return retval;
+	ext2fs_free_mem(&data->hash);
+	retval = ext2fs_get_array(new_max, sizeof(long), &data->hash);
+	if (retval)
+		return retval;
+	data->max_entries = new_max;
+	data->hash_size = new_max;
+	for (i = 0; i < data->hash_size; i++)
+		data->hash[i] = -1;
+	for (i = 0; i < data->num_entries; i++) {
+		h = hash_undo_block(data, data->entries[i].block);
+		data->hash_next[i] = data->hash[h];
+		data->hash[h] = i;
+	}
+	return 0;
+}
 
-	tdb_key.dptr = blksize_key;
-	tdb_key.dsize = sizeof(blksize_key);
-	tdb_data.dptr = (unsigned char *)&(block_size);
-	tdb_data.dsize = sizeof(block_size);
+/*
+ * Append a saved block to the log buffer, and remember that it has
+ * been saved.  Each record is padded out to tdb_data_size so that
+ * records are easy to step over when the index is missing.
+ */
+static errcode_t append_undo_record(struct undo_private_data *data,
+				    unsigned long long block,
+				    const void *buf, int size)
+{
+	struct undo_log_entry *entry;
+	unsigned long	h;
+	errcode_t	retval;
+	int		rec_size;
+	char		*p;
 
-	retval = tdb_store(tdb, tdb_key, tdb_data, TDB_INSERT);
-	if (retval == -1) {
-		retval = EXT2_ET_TDB_SUCCESS + tdb_error(tdb);
+	rec_size = sizeof(struct undo_log_entry) + data->tdb_data_size;
+	if (data->log_buf_size < rec_size) {
+		retval = flush_log_buf(data);
+		if (retval)
+			return retval;
+		ext2fs_free_mem(&data->log_buf);
+		data->log_buf_size = rec_size > UNDO_LOG_BUFSIZE ?
+			rec_size : UNDO_LOG_BUFSIZE;
+		retval = ext2fs_get_mem(data->log_buf_size, &data->log_buf);
+		if (retval) {
+			data->log_buf_size = 0;
+			return retval;
+		}
+	}
+	if (data->log_used + rec_size > data->log_buf_size) {
+		retval = flush_log_buf(data);
+		if (retval)
+			return retval;
+	}
+	if (data->num_entries >= data->max_entries) {
+		retval = grow_undo_hash(data);
+		if (retval)
+			return retval;
 	}
 
-	return retval;
+	entry = data->entries + data->num_entries;
+	entry->block = block;
+	entry->offset = data->log_end + data->log_used +
+		sizeof(struct undo_log_entry);
+	entry->size = size;
+	entry->csum = ext2fs_crc16(~0, buf, size);
+
+	p = data->log_buf + data->log_used;
+	((struct undo_log_entry *) p)->block = ext2fs_cpu_to_le64(block);
+	((struct undo_log_entry *) p)->offset =
+		ext2fs_cpu_to_le64(entry->offset);
+	((struct undo_log_entry *) p)->size = ext2fs_cpu_to_le32(size);
+	((struct undo_log_entry *) p)->csum = ext2fs_cpu_to_le32(entry->csum);
+	p += sizeof(struct undo_log_entry);
+	memcpy(p, buf, size);
+	memset(p + size, 0, data->tdb_data_size - size);
+	data->log_used += rec_size;
+	data->log_unsynced = 1;
+
+	h = hash_undo_block(data, block);
+	data->hash_next[data->num_entries] = data->hash[h];
+	data->hash[h] = data->num_entries++;
+	return 0;
 }
 
-static errcode_t undo_write_tdb(io_channel channel,
+static errcode_t undo_write_log(io_channel channel,
 				unsigned long block, int count)
 
 {
@@ -198,15 +428,15 @@ static errcode_t undo_write_tdb(io_channel channel,
 	errcode_t retval = 0;
 	ext2_loff_t offset;
 	struct undo_private_data *data;
-	TDB_DATA tdb_key, tdb_data;
-	unsigned char *read_ptr;
+	unsigned char *read_ptr = NULL;
+	int read_size = 0, data_size;
 	unsigned long end_block;
 
 	data = (struct undo_private_data *) channel->private_data;
 
-	if (data->tdb == NULL) {
+	if (data->undo_fd < 0) {
 		/*
-		 * Transaction database not initialized
+		 * Undo log not initialized
 		 */
 		return 0;
 	}
@@ -220,8 +450,8 @@ static errcode_t undo_write_tdb(io_channel channel,
 			size = count * channel->block_size;
 	}
 	/*
-	 * Data is stored in tdb database as blocks of tdb_data_size size
-	 * This helps in efficient lookup further.
+	 * Data is stored in the undo log as blocks of tdb_data_size
+	 * size.  This helps in efficient lookup further.
 	 *
 	 * We divide the disk to blocks of tdb_data_size.
 	 */
@@ -229,15 +459,11 @@ static errcode_t undo_write_tdb(io_channel channel,
 	block_num = offset / data->tdb_data_size;
 	end_block = (offset + size) / data->tdb_data_size;
 
-	tdb_transaction_start(data->tdb);
 	while (block_num <= end_block ) {
-
-		tdb_key.dptr = (unsigned char *)&block_num;
-		tdb_key.dsize = sizeof(block_num);
 		/*
 		 * Check if we have the record already
 		 */
-		if (tdb_exists(data->tdb, tdb_key)) {
+		if (undo_block_saved(data, block_num)) {
 			/* Try the next block */
 			block_num++;
 			continue;
@@ -254,10 +480,12 @@ static errcode_t undo_write_tdb(io_channel channel,
 
 		count = data->tdb_data_size +
 				((offset - data->offset) % channel->block_size);
-		retval = ext2fs_get_mem(count, &read_ptr);
-		if (retval) {
-			tdb_transaction_cancel(data->tdb);
-			return retval;
+		if (count > read_size) {
+			ext2fs_free_mem(&read_ptr);
+			retval = ext2fs_get_mem(count, &read_ptr);
+			if (retval)
+				return retval;
+			read_size = count;
 		}
 
 		memset(read_ptr, 0, count);
@@ -269,55 +497,34 @@ static errcode_t undo_write_tdb(io_channel channel,
 		retval = io_channel_read_blk(data->real, backing_blk_num,
 					     sz, read_ptr);
 		if (retval) {
-			if (retval != EXT2_ET_SHORT_READ) {
-				free(read_ptr);
-				tdb_transaction_cancel(data->tdb);
-				return retval;
-			}
+			if (retval != EXT2_ET_SHORT_READ)
+				break;
 			/*
 			 * short read so update the record size
 			 * accordingly
 			 */
-			tdb_data.dsize = actual_size;
+			data_size = actual_size -
+				((offset - data->offset) % channel->block_size);
+			if (data_size < 0)
+				data_size = 0;
+			if (data_size > data->tdb_data_size)
+				data_size = data->tdb_data_size;
 		} else {
-			tdb_data.dsize = data->tdb_data_size;
+			data_size = data->tdb_data_size;
 		}
-		tdb_data.dptr = read_ptr +
-				((offset - data->offset) % channel->block_size);
 #ifdef DEBUG
-		printf("Printing with key %ld data %x and size %d\n",
-		       block_num,
-		       tdb_data.dptr,
-		       tdb_data.dsize);
+		printf("Saving block %ld size %d\n", block_num, data_size);
 #endif
-		if (!data->tdb_written) {
-			data->tdb_written = 1;
-			/* Write the blocksize to tdb file */
-			retval = write_block_size(data->tdb,
-						  data->tdb_data_size);
-			if (retval) {
-				tdb_transaction_cancel(data->tdb);
-				retval = EXT2_ET_TDB_ERR_IO;
-				free(read_ptr);
-				return retval;
-			}
-		}
-		retval = tdb_store(data->tdb, tdb_key, tdb_data, TDB_INSERT);
-		if (retval == -1) {
-			/*
-			 * TDB_ERR_EXISTS cannot happen because we
-			 * have already verified it doesn't exist
-			 */
-			tdb_transaction_cancel(data->tdb);
-			retval = EXT2_ET_TDB_ERR_IO;
-			free(read_ptr);
-			return retval;
-		}
-		free(read_ptr);
+		data->tdb_written = 1;
+		retval = append_undo_record(data, block_num, read_ptr +
+				((offset - data->offset) % channel->block_size),
+				data_size);
+		if (retval)
+			break;
 		/* Next block */
 		block_num++;
 	}
-	tdb_transaction_commit(data->tdb);
+	ext2fs_free_mem(&read_ptr);
 
 	return retval;
 }
@@ -370,6 +577,7 @@ static errcode_t undo_open(const char *name, int flags, io_channel *channel)
 
 	memset(data, 0, sizeof(struct undo_private_data));
 	data->magic = EXT2_ET_MAGIC_UNIX_IO_CHANNEL;
+	data->undo_fd = -1;
 
 	if (undo_io_backing_manager) {
 		retval = undo_io_backing_manager->open(name, flags,
@@ -380,13 +588,17 @@ static errcode_t undo_open(const char *name, int flags, io_channel *channel)
 		data->real = 0;
 	}
 
-	/* setup the tdb file */
-	data->tdb = tdb_open(tdb_file, 0, TDB_CLEAR_IF_FIRST,
-			     O_RDWR | O_CREAT | O_TRUNC | O_EXCL, 0600);
-	if (!data->tdb) {
+	/* setup the undo log */
+	data->undo_fd = open(undo_file, O_RDWR | O_CREAT | O_TRUNC | O_EXCL,
+			     0600);
+	if (data->undo_fd < 0) {
 		retval = errno;
 		goto cleanup;
 	}
+	data->log_end = E2UNDO_LOG_HDR_SIZE;
+	retval = write_log_header(data, NULL, 0);
+	if (retval)
+		goto cleanup;
 
 	/*
 	 * setup err handler for read so that we know
@@ -398,7 +610,9 @@ static errcode_t undo_open(const char *name, int flags, io_channel *channel)
 	return 0;
 
 cleanup:
-	if (data->real)
+	if (data && data->undo_fd >= 0)
+		close(data->undo_fd);
+	if (data && data->real)
 		io_channel_close(data->real);
 	if (data)
 		ext2fs_free_mem(&data);
@@ -418,14 +632,18 @@ static errcode_t undo_close(io_channel channel)
 
 	if (--channel->refcount > 0)
 		return 0;
-	/* Before closing write the file system identity */
-	retval = write_file_system_identity(channel, data->tdb);
+	/* Before closing write the index and file system identity */
+	retval = write_log_index(channel);
 	if (retval)
 		return retval;
 	if (data->real)
 		retval = io_channel_close(data->real);
-	if (data->tdb)
-		tdb_close(data->tdb);
+	if (data->undo_fd >= 0)
+		close(data->undo_fd);
+	ext2fs_free_mem(&data->log_buf);
+	ext2fs_free_mem(&data->entries);
+	ext2fs_free_mem(&data->hash_next);
+	ext2fs_free_mem(&data->hash);
 	ext2fs_free_mem(&channel->private_data);
 	if (channel->name)
 		ext2fs_free_mem(&channel->name);
@@ -446,7 +664,7 @@ static errcode_t undo_set_blksize(io_channel channel, int blksize)
 	if (data->real)
 		retval = io_channel_set_blksize(data->real, blksize);
 	/*
-	 * Set the block size used for tdb
+	 * Set the block size used for the undo log
 	 */
 	if (!data->tdb_data_size) {
 		data->tdb_data_size = blksize;
@@ -483,9 +701,12 @@ static errcode_t undo_write_blk(io_channel channel, unsigned long block,
 	/*
 	 * First write the existing content into database
 	 */
-	retval = undo_write_tdb(channel, block, count);
+	retval = undo_write_log(channel, block, count);
 	if (retval)
 		 return retval;
+	retval = sync_undo_log(data);
+	if (retval)
+		return retval;
 	if (data->real)
 		retval = io_channel_write_blk(data->real, block, count, buf);
 
@@ -509,12 +730,15 @@ static errcode_t undo_write_byte(io_channel channel, unsigned long offset,
 	/*
 	 * the size specified may spread across multiple blocks
 	 * also make sure we account for the fact that block start
-	 * offset for tdb is different from the backing I/O manager
+	 * offset for the undo log is different from the backing I/O manager
 	 * due to possible different block size
 	 */
 	count = (size + (location % channel->block_size) +
 			channel->block_size  -1)/channel->block_size;
-	retval = undo_write_tdb(channel, blk_num, count);
+	retval = undo_write_log(channel, blk_num, count);
+	if (retval)
+		return retval;
+	retval = sync_undo_log(data);
 	if (retval)
 		return retval;
 	if (data->real && data->real->manager->write_byte)
@@ -535,7 +759,13 @@ static errcode_t undo_flush(io_channel channel)
 	data = (struct undo_private_data *) channel->private_data;
 	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
 
-	if (data->real)
+	/*
+	 * Make sure the old contents are safely in the undo log
+	 * before the new contents reach the disk.
+	 */
+	if (data->undo_fd >= 0)
+		retval = sync_undo_log(data);
+	if (!retval && data->real)
 		retval = io_channel_flush(data->real);
 
 	return retval;
@@ -2,7 +2,8 @@
  * unix_io.c --- This is the Unix (well, really POSIX) implementation
  * 	of the I/O manager.
  *
- * Implements a one-block write-through cache.
+ * Implements a hashed, LRU-managed block cache whose size can be
+ * set with the "cache_size" I/O option.
  *
  * Includes support for Windows NT support under Cygwin.
  *
@@ -29,6 +30,9 @@
 #endif
 #include <fcntl.h>
 #include <time.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
 #ifdef __linux__
 #include <sys/utsname.h>
 #endif
@@ -47,6 +51,27 @@
 #if HAVE_SYS_RESOURCE_H
 #include <sys/resource.h>
 #endif
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#include <limits.h>
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H) && \
+	defined(HAVE_SETJMP_H) && defined(HAVE_SIGNAL_H)
+#include <setjmp.h>
+#include <signal.h>
+#define USE_MMAP
+#endif
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_SYS_UIO_H) && \
+	defined(HAVE_SYS_MMAN_H) && defined(HAVE_SYS_SYSCALL_H)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define USE_IO_URING
+#endif
+#endif
 
 #if defined(__linux__) && defined(_IO) && !defined(BLKROGET)
 #define BLKROGET   _IO(0x12, 94) /* Get read-only status (0 = read_write).  */
@@ -70,25 +95,91 @@
 
 struct unix_cache {
 	char		*buf;
-	unsigned long	block;
-	int		access_time;
+	unsigned long long	block;
+	struct unix_cache	*hash_next;
+	struct unix_cache	*lru_prev, *lru_next;
 	unsigned	dirty:1;
 	unsigned	in_use:1;
 };
 
-#define CACHE_SIZE 8
+#define CACHE_SIZE 8		/* Default (and minimum) number of blocks */
 #define WRITE_DIRECT_SIZE 4	/* Must be smaller than CACHE_SIZE */
 #define READ_DIRECT_SIZE 4	/* Should be smaller than CACHE_SIZE */
 
+#define QUEUE_DEPTH 64		/* Default io_uring queue depth */
+#define MAP_TREND 16		/* Reads before changing the madvise() hint */
+
+#define STREAM_BUFS 4		/* Bounce buffers used in streaming mode */
+#define STREAM_BUF_SIZE (1024 * 1024)	/* ... and the size of each */
+#define STREAM_ALIGN 4096	/* Satisfies O_DIRECT on any device */
+
+#define STREAM_DIRECT	1	/* Large O_DIRECT reads into bounce buffers */
+#define STREAM_FADVISE	2	/* Buffered reads, then POSIX_FADV_DONTNEED */
+
+/* Maximum number of cache blocks written by a single writev() */
+#if defined(IOV_MAX) && (IOV_MAX < 256)
+#define WRITE_RUN_MAX IOV_MAX
+#else
+#define WRITE_RUN_MAX 256
+#endif
+
+#ifdef USE_IO_URING
+struct unix_uring {
+	int		fd;
+	unsigned	entries;
+	unsigned	*sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned	*cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void		*sq_ring, *cq_ring;
+	size_t		sq_ring_size, cq_ring_size;
+};
+#else
+struct unix_uring;
+#endif
+
+/*
+ * In streaming mode, reads go through a small pool of large aligned
+ * buffers, each holding a STREAM_BUF_SIZE aligned chunk of the device
+ * read with O_DIRECT, so that a scan of the whole device neither
+ * pollutes the page cache nor pays for one O_DIRECT read per block.
+ */
+struct unix_stream_buf {
+	char		*buf;
+	ext2_loff_t	start;
+	int		len;		/* 0 if it holds nothing */
+	unsigned long	used;		/* for picking the LRU buffer */
+};
+
 struct unix_private_data {
 	int	magic;
 	int	dev;
 	int	flags;
 	int	align;
-	int	access_time;
 	ext2_loff_t offset;
-	struct unix_cache cache[CACHE_SIZE];
+	unsigned long long cache_bytes;	/* requested size, 0 = default */
+	int	cache_size;		/* number of cache entries */
+	int	hash_size;		/* always a power of two */
+	struct unix_cache *cache;
+	struct unix_cache **hash;
+	struct unix_cache *lru_head;	/* most recently used */
+	struct unix_cache *lru_tail;	/* least recently used */
+	struct unix_cache **dirty_list;	/* scratch space for flushing */
+	int	dirty_count;
+	int	write_behind;		/* flush when this many are dirty */
+	char	*cache_mem;
 	void	*bounce;
+	struct unix_uring *ring;
+	char	*map;			/* read-only mapping of the file */
+	ext2_loff_t map_size;
+	unsigned long long map_next;	/* block after the last mapped read */
+	int	map_trend;		/* > 0 sequential, < 0 random */
+	int	map_advice;
+	int	stream;			/* STREAM_DIRECT or STREAM_FADVISE */
+	int	stream_fd;		/* O_DIRECT descriptor for reads */
+	unsigned long stream_clock;
+	struct unix_stream_buf stream_bufs[STREAM_BUFS];
+	ext2_loff_t io_pos;		/* where the last I/O ended */
 	struct struct_io_stats io_stats;
 };
 
@@ -109,12 +200,16 @@ static errcode_t unix_set_option(io_channel channel, const char *option,
 				 const char *arg);
 static errcode_t unix_get_stats(io_channel channel, io_stats *stats)
 ;
-static void reuse_cache(io_channel channel, struct unix_private_data *data,
-		 struct unix_cache *cache, unsigned long long block);
 static errcode_t unix_read_blk64(io_channel channel, unsigned long long block,
 			       int count, void *data);
 static errcode_t unix_write_blk64(io_channel channel, unsigned long long block,
 				int count, const void *data);
+static errcode_t unix_readahead(io_channel channel, unsigned long long block,
+				unsigned long long count);
+static errcode_t unix_rw_batch(io_channel channel, int flags, io_request reqs,
+			       int count);
+static errcode_t uring_open(const char *name, int flags, io_channel *channel);
+static errcode_t mmap_open(const char *name, int flags, io_channel *channel);
 
 static struct struct_io_manager struct_unix_manager = {
 	EXT2_ET_MAGIC_IO_MANAGER,
@@ -130,10 +225,67 @@ static struct struct_io_manager struct_unix_manager = {
 	unix_get_stats,
 	unix_read_blk64,
 	unix_write_blk64,
+	unix_readahead,
+	unix_rw_batch,
 };
 
 io_manager unix_io_manager = &struct_unix_manager;
 
+/*
+ * The io_uring I/O manager is the Unix I/O manager with an io_uring
+ * set up at open time, so that batched requests are kept in flight
+ * together.  If io_uring isn't available it behaves exactly like the
+ * Unix I/O manager.
+ */
+static struct struct_io_manager struct_uring_manager = {
+	EXT2_ET_MAGIC_IO_MANAGER,
+	"io_uring I/O Manager",
+	uring_open,
+	unix_close,
+	unix_set_blksize,
+	unix_read_blk,
+	unix_write_blk,
+	unix_flush,
+	unix_write_byte,
+	unix_set_option,
+	unix_get_stats,
+	unix_read_blk64,
+	unix_write_blk64,
+	unix_readahead,
+	unix_rw_batch,
+};
+
+io_manager io_uring_io_manager = &struct_uring_manager;
+
+/*
+ * The mmap I/O manager is the Unix I/O manager with the file mapped
+ * into memory at open time, so that reads are copied straight out of
+ * the page cache.  This is only done for read-only opens of regular
+ * files; anything else behaves exactly like the Unix I/O manager.
+ * If the file is truncated while it is mapped, a read which runs into
+ * the missing part catches the SIGBUS and is retried with pread(),
+ * which reports the short read.
+ */
+static struct struct_io_manager struct_mmap_manager = {
+	EXT2_ET_MAGIC_IO_MANAGER,
+	"mmap I/O Manager",
+	mmap_open,
+	unix_close,
+	unix_set_blksize,
+	unix_read_blk,
+	unix_write_blk,
+	unix_flush,
+	unix_write_byte,
+	unix_set_option,
+	unix_get_stats,
+	unix_read_blk64,
+	unix_write_blk64,
+	unix_readahead,
+	unix_rw_batch,
+};
+
+io_manager mmap_io_manager = &struct_mmap_manager;
+
 static errcode_t unix_get_stats(io_channel channel, io_stats *stats)
 {
 	errcode_t 	retval = 0;
@@ -150,6 +302,201 @@ static errcode_t unix_get_stats(io_channel channel, io_stats *stats)
 	return retval;
 }
 
+/*
+ * Account for a single read or write system call in the channel's
+ * statistics: the distance we had to seek to get to it, and how long
+ * it took, rounded up to a power of two microseconds.
+ */
+static void account_io(struct unix_private_data *data, int write,
+		       ext2_loff_t location, ssize_t size,
+		       struct timeval *start)
+{
+	struct timeval		now;
+	long long		usec;
+	int			bucket = 0;
+
+	if (write)
+		data->io_stats.write_calls++;
+	else
+		data->io_stats.read_calls++;
+	if (location != data->io_pos) {
+		data->io_stats.seeks++;
+		data->io_stats.seek_distance += (location > data->io_pos) ?
+			location - data->io_pos : data->io_pos - location;
+	}
+	data->io_pos = location + size;
+
+	gettimeofday(&now, 0);
+	usec = (long long) (now.tv_sec - start->tv_sec) * 1000000 +
+		(now.tv_usec - start->tv_usec);
+	while (usec > 0 && bucket < IO_STATS_LATENCY_BUCKETS - 1) {
+		usec >>= 1;
+		bucket++;
+	}
+	data->io_stats.latency[bucket]++;
+}
+
+/*
+ * Here we implement the streaming mode
+ */
+static errcode_t raw_read_blk(io_channel channel,
+			      struct unix_private_data *data,
+			      unsigned long long block,
+			      int count, void *buf);
+
+static void stream_free(struct unix_private_data *data)
+{
+	int	i;
+
+	if (data->stream == STREAM_DIRECT)
+		close(data->stream_fd);
+	for (i = 0; i < STREAM_BUFS; i++)
+		if (data->stream_bufs[i].buf)
+			ext2fs_free_mem(&data->stream_bufs[i].buf);
+	data->stream = 0;
+}
+
+/* Forget what the bounce buffers hold after anything is written */
+static void stream_invalidate(struct unix_private_data *data)
+{
+	int	i;
+
+	if (data->stream != STREAM_DIRECT)
+		return;
+	for (i = 0; i < STREAM_BUFS; i++)
+		data->stream_bufs[i].len = 0;
+}
+
+static errcode_t stream_setup(io_channel channel,
+			      struct unix_private_data *data)
+{
+#ifdef O_DIRECT
+	errcode_t	retval;
+	int		i;
+#endif
+
+	if (data->stream)
+		return 0;
+#ifdef O_DIRECT
+#ifdef HAVE_OPEN64
+	data->stream_fd = open64(channel->name, O_RDONLY | O_DIRECT);
+#else
+	data->stream_fd = open(channel->name, O_RDONLY | O_DIRECT);
+#endif
+	if (data->stream_fd >= 0) {
+		data->stream = STREAM_DIRECT;
+		for (i = 0; i < STREAM_BUFS; i++) {
+			data->stream_bufs[i].len = 0;
+			retval = ext2fs_get_memalign(STREAM_BUF_SIZE,
+						STREAM_ALIGN,
+						&data->stream_bufs[i].buf);
+			if (retval) {
+				stream_free(data);
+				return retval;
+			}
+		}
+		return 0;
+	}
+#endif
+#ifdef POSIX_FADV_DONTNEED
+	/* O_DIRECT isn't available; at least don't keep what we read */
+	data->stream = STREAM_FADVISE;
+	return 0;
+#else
+	return EXT2_ET_OP_NOT_SUPPORTED;
+#endif
+}
+
+/*
+ * Find the bounce buffer holding the chunk containing location,
+ * reading the chunk in if necessary.
+ */
+static errcode_t stream_fill(struct unix_private_data *data,
+			     ext2_loff_t location,
+			     struct unix_stream_buf **ret)
+{
+	struct unix_stream_buf *sb, *victim = 0;
+	ext2_loff_t	start;
+	ssize_t		actual;
+	struct timeval	tv;
+	int		i;
+
+	start = location & ~((ext2_loff_t) STREAM_BUF_SIZE - 1);
+	for (i = 0, sb = data->stream_bufs; i < STREAM_BUFS; i++, sb++) {
+		if (sb->len && sb->start == start)
+			goto found;
+		if (!victim || !sb->len ||
+		    (victim->len && sb->used < victim->used))
+			victim = sb;
+	}
+
+	sb = victim;
+	sb->len = 0;
+	gettimeofday(&tv, 0);
+	if (ext2fs_llseek(data->stream_fd, start, SEEK_SET) != start)
+		return errno ? errno : EXT2_ET_LLSEEK_FAILED;
+	actual = read(data->stream_fd, sb->buf, STREAM_BUF_SIZE);
+	if (actual < 0)
+		return errno;
+	account_io(data, 0, start, actual, &tv);
+	sb->start = start;
+	sb->len = actual;
+found:
+	sb->used = ++data->stream_clock;
+	*ret = sb;
+	return 0;
+}
+
+static errcode_t stream_read_blk(io_channel channel,
+				 struct unix_private_data *data,
+				 unsigned long long block,
+				 int count, void *buf)
+{
+	struct unix_stream_buf *sb = 0;
+	errcode_t	retval;
+	ssize_t		size;
+	ext2_loff_t	location;
+	int		actual = 0, n;
+	char		*cp = buf;
+
+	size = (count < 0) ? -count : count * channel->block_size;
+	data->io_stats.bytes_read += size;
+	location = ((ext2_loff_t) block * channel->block_size) + data->offset;
+	while (actual < size) {
+		retval = stream_fill(data, location + actual, &sb);
+		if (retval == EINVAL && !actual) {
+			/*
+			 * The device accepted O_DIRECT at open time but
+			 * not for reads; use buffered reads instead.
+			 */
+			stream_free(data);
+			data->stream = STREAM_FADVISE;
+			data->io_stats.bytes_read -= size;
+			return raw_read_blk(channel, data, block, count, buf);
+		}
+		if (retval)
+			goto error_out;
+		n = sb->len - (location + actual - sb->start);
+		if (n <= 0) {
+			retval = EXT2_ET_SHORT_READ;
+			goto error_out;
+		}
+		if (n > size - actual)
+			n = size - actual;
+		memcpy(cp + actual, sb->buf + (location + actual - sb->start),
+		       n);
+		actual += n;
+	}
+	return 0;
+
+error_out:
+	memset(cp + actual, 0, size - actual);
+	if (channel->read_error)
+		retval = (channel->read_error)(channel, block, count, buf,
+					       size, actual, retval);
+	return retval;
+}
+
 /*
  * Here are the raw I/O functions
  */
@@ -162,10 +509,15 @@ static errcode_t raw_read_blk(io_channel channel,
 	ssize_t		size;
 	ext2_loff_t	location;
 	int		actual = 0;
+	struct timeval	start;
+
+	if (data->stream == STREAM_DIRECT)
+		return stream_read_blk(channel, data, block, count, buf);
 
 	size = (count < 0) ? -count : count * channel->block_size;
 	data->io_stats.bytes_read += size;
 	location = ((ext2_loff_t) block * channel->block_size) + data->offset;
+	gettimeofday(&start, 0);
 	if (ext2fs_llseek(data->dev, location, SEEK_SET) != location) {
 		retval = errno ? errno : EXT2_ET_LLSEEK_FAILED;
 		goto error_out;
@@ -180,6 +532,12 @@ static errcode_t raw_read_blk(io_channel channel,
 			retval = EXT2_ET_SHORT_READ;
 			goto error_out;
 		}
+		account_io(data, 0, location, size, &start);
+#ifdef POSIX_FADV_DONTNEED
+		if (data->stream == STREAM_FADVISE)
+			posix_fadvise(data->dev, location, size,
+				      POSIX_FADV_DONTNEED);
+#endif
 		return 0;
 	}
 
@@ -203,9 +561,12 @@ static errcode_t raw_read_blk(io_channel channel,
 		size -= actual;
 		buf += actual;
 	}
+	account_io(data, 0, location, (count < 0) ? -count :
+		   count * channel->block_size, &start);
 	return 0;
 
 error_out:
+	account_io(data, 0, location, actual, &start);
 	memset((char *) buf+actual, 0, size-actual);
 	if (channel->read_error)
 		retval = (channel->read_error)(channel, block, count, buf,
@@ -222,6 +583,7 @@ static errcode_t raw_write_blk(io_channel channel,
 	ext2_loff_t	location;
 	int		actual = 0;
 	errcode_t	retval;
+	struct timeval	start;
 
 	if (count == 1)
 		size = channel->block_size;
@@ -232,8 +594,10 @@ static errcode_t raw_write_blk(io_channel channel,
 			size = count * channel->block_size;
 	}
 	data->io_stats.bytes_written += size;
+	stream_invalidate(data);
 
 	location = ((ext2_loff_t) block * channel->block_size) + data->offset;
+	gettimeofday(&start, 0);
 	if (ext2fs_llseek(data->dev, location, SEEK_SET) != location) {
 		retval = errno ? errno : EXT2_ET_LLSEEK_FAILED;
 		goto error_out;
@@ -247,6 +611,7 @@ static errcode_t raw_write_blk(io_channel channel,
 			retval = EXT2_ET_SHORT_WRITE;
 			goto error_out;
 		}
+		account_io(data, 1, location, size, &start);
 		return 0;
 	}
 
@@ -277,9 +642,12 @@ static errcode_t raw_write_blk(io_channel channel,
 		size -= actual;
 		buf += actual;
 	}
+	account_io(data, 1, location, (count < 0) ? -count :
+		   count * channel->block_size, &start);
 	return 0;
 
 error_out:
+	account_io(data, 1, location, (actual > 0) ? actual : 0, &start);
 	if (channel->write_error)
 		retval = (channel->write_error)(channel, block, count, buf,
 						size, actual, retval);
@@ -289,107 +657,344 @@ error_out:
 
 /*
  * Here we implement the cache functions
+ *
+ * Cache entries live on a doubly linked LRU list, most recently used
+ * first; entries which are not in use are kept at the tail so they
+ * are the first to be recycled.  Entries which are in use are also
+ * chained into a hash table indexed by block number.
  */
 
-/* Allocate the cache buffers */
+static int cache_entries(io_channel channel, struct unix_private_data *data)
+{
+	unsigned long long	n;
+
+	if (!data->cache_bytes)
+		return CACHE_SIZE;
+	n = data->cache_bytes / channel->block_size;
+	if (n < CACHE_SIZE)
+		return CACHE_SIZE;
+	if (n > (1 << 30))
+		return 1 << 30;
+	return (int) n;
+}
+
+static inline unsigned int hash_block(struct unix_private_data *data,
+				      unsigned long long block)
+{
+	return (unsigned int) ((block ^ (block >> 20)) &
+			       (data->hash_size - 1));
+}
+
+static void lru_unlink(struct unix_private_data *data,
+		       struct unix_cache *cache)
+{
+	if (cache->lru_prev)
+		cache->lru_prev->lru_next = cache->lru_next;
+	else
+		data->lru_head = cache->lru_next;
+	if (cache->lru_next)
+		cache->lru_next->lru_prev = cache->lru_prev;
+	else
+		data->lru_tail = cache->lru_prev;
+	cache->lru_prev = cache->lru_next = 0;
+}
+
+static void lru_add_head(struct unix_private_data *data,
+			 struct unix_cache *cache)
+{
+	cache->lru_prev = 0;
+	cache->lru_next = data->lru_head;
+	if (data->lru_head)
+		data->lru_head->lru_prev = cache;
+	else
+		data->lru_tail = cache;
+	data->lru_head = cache;
+}
+
+static void lru_add_tail(struct unix_private_data *data,
+			 struct unix_cache *cache)
+{
+	cache->lru_next = 0;
+	cache->lru_prev = data->lru_tail;
+	if (data->lru_tail)
+		data->lru_tail->lru_next = cache;
+	else
+		data->lru_head = cache;
+	data->lru_tail = cache;
+}
+
+static void hash_insert(struct unix_private_data *data,
+			struct unix_cache *cache)
+{
+	unsigned int	h = hash_block(data, cache->block);
+
+	cache->hash_next = data->hash[h];
+	data->hash[h] = cache;
+}
+
+static void hash_remove(struct unix_private_data *data,
+			struct unix_cache *cache)
+{
+	struct unix_cache	**pp;
+
+	pp = &data->hash[hash_block(data, cache->block)];
+	while (*pp) {
+		if (*pp == cache) {
+			*pp = cache->hash_next;
+			break;
+		}
+		pp = &(*pp)->hash_next;
+	}
+	cache->hash_next = 0;
+}
+
+/* Free the cache buffers */
+static void free_cache(struct unix_private_data *data)
+{
+	if (data->cache)
+		ext2fs_free_mem(&data->cache);
+	if (data->hash)
+		ext2fs_free_mem(&data->hash);
+	if (data->dirty_list)
+		ext2fs_free_mem(&data->dirty_list);
+	if (data->cache_mem)
+		ext2fs_free_mem(&data->cache_mem);
+	if (data->bounce)
+		ext2fs_free_mem(&data->bounce);
+	data->cache_size = 0;
+	data->hash_size = 0;
+	data->dirty_count = 0;
+	data->lru_head = data->lru_tail = 0;
+}
+
+/* Hand the cache buffers over from one private data to another */
+static void move_cache(struct unix_private_data *to,
+		       struct unix_private_data *from)
+{
+	to->cache = from->cache;
+	to->hash = from->hash;
+	to->dirty_list = from->dirty_list;
+	to->cache_mem = from->cache_mem;
+	to->bounce = from->bounce;
+	to->cache_size = from->cache_size;
+	to->hash_size = from->hash_size;
+	to->dirty_count = from->dirty_count;
+	to->lru_head = from->lru_head;
+	to->lru_tail = from->lru_tail;
+
+	from->cache = 0;
+	from->hash = 0;
+	from->dirty_list = 0;
+	from->cache_mem = 0;
+	from->bounce = 0;
+	from->cache_size = 0;
+	from->hash_size = 0;
+	from->dirty_count = 0;
+	from->lru_head = from->lru_tail = 0;
+}
+
+/*
+ * Allocate the cache buffers.  The old cache is only released once
+ * the new one has been set up; if that fails, it is left in place.
+ */
 static errcode_t alloc_cache(io_channel channel,
 			     struct unix_private_data *data)
 {
+	struct unix_private_data old;
 	errcode_t		retval;
 	struct unix_cache	*cache;
-	int			i;
-
-	data->access_time = 0;
-	for (i=0, cache = data->cache; i < CACHE_SIZE; i++, cache++) {
-		cache->block = 0;
-		cache->access_time = 0;
-		cache->dirty = 0;
-		cache->in_use = 0;
-		if (cache->buf)
-			ext2fs_free_mem(&cache->buf);
-		retval = ext2fs_get_memalign(channel->block_size,
-					     data->align, &cache->buf);
-		if (retval)
-			return retval;
+	int			i, n;
+
+	move_cache(&old, data);
+
+	n = cache_entries(channel, data);
+	retval = ext2fs_get_array(n, sizeof(struct unix_cache), &data->cache);
+	if (retval)
+		goto errout;
+	memset(data->cache, 0, n * sizeof(struct unix_cache));
+
+	for (data->hash_size = 1; data->hash_size < n; data->hash_size <<= 1)
+		;
+	retval = ext2fs_get_array(data->hash_size, sizeof(struct unix_cache *),
+				  &data->hash);
+	if (retval)
+		goto errout;
+	memset(data->hash, 0, data->hash_size * sizeof(struct unix_cache *));
+
+	retval = ext2fs_get_array(n, sizeof(struct unix_cache *),
+				  &data->dirty_list);
+	if (retval)
+		goto errout;
+
+	retval = ext2fs_get_memalign((unsigned long) n * channel->block_size,
+				     data->align, &data->cache_mem);
+	if (retval)
+		goto errout;
+
+	data->cache_size = n;
+	for (i=0, cache = data->cache; i < n; i++, cache++) {
+		cache->buf = data->cache_mem +
+			(unsigned long) i * channel->block_size;
+		lru_add_tail(data, cache);
 	}
+
 	if (data->align) {
-		if (data->bounce)
-			ext2fs_free_mem(&data->bounce);
 		retval = ext2fs_get_memalign(channel->block_size, data->align,
 					     &data->bounce);
+		if (retval)
+			goto errout;
 	}
-	return retval;
-}
-
-/* Free the cache buffers */
-static void free_cache(struct unix_private_data *data)
-{
-	struct unix_cache	*cache;
-	int			i;
+	free_cache(&old);
+	return 0;
 
-	data->access_time = 0;
-	for (i=0, cache = data->cache; i < CACHE_SIZE; i++, cache++) {
-		cache->block = 0;
-		cache->access_time = 0;
-		cache->dirty = 0;
-		cache->in_use = 0;
-		if (cache->buf)
-			ext2fs_free_mem(&cache->buf);
-	}
-	if (data->bounce)
-		ext2fs_free_mem(&data->bounce);
+errout:
+	free_cache(data);
+	move_cache(data, &old);
+	return retval;
 }
 
 #ifndef NO_IO_CACHE
 /*
- * Try to find a block in the cache.  If the block is not found, and
- * eldest is a non-zero pointer, then fill in eldest with the cache
- * entry to that should be reused.
+ * Try to find a block in the cache, and mark it as the most recently
+ * used entry if it is found.
  */
 static struct unix_cache *find_cached_block(struct unix_private_data *data,
-					    unsigned long long block,
-					    struct unix_cache **eldest)
+					    unsigned long long block)
 {
-	struct unix_cache	*cache, *unused_cache, *oldest_cache;
-	int			i;
+	struct unix_cache	*cache;
 
-	unused_cache = oldest_cache = 0;
-	for (i=0, cache = data->cache; i < CACHE_SIZE; i++, cache++) {
-		if (!cache->in_use) {
-			if (!unused_cache)
-				unused_cache = cache;
-			continue;
-		}
+	for (cache = data->hash[hash_block(data, block)]; cache;
+	     cache = cache->hash_next) {
 		if (cache->block == block) {
-			cache->access_time = ++data->access_time;
+			lru_unlink(data, cache);
+			lru_add_head(data, cache);
 			return cache;
 		}
-		if (!oldest_cache ||
-		    (cache->access_time < oldest_cache->access_time))
-			oldest_cache = cache;
 	}
-	if (eldest)
-		*eldest = (unused_cache) ? unused_cache : oldest_cache;
 	return 0;
 }
 
+static errcode_t flush_cached_blocks(io_channel channel,
+				     struct unix_private_data *data,
+				     int invalidate);
+
 /*
- * Reuse a particular cache entry for another block.
+ * Recycle the least recently used cache entry for another block.  If
+ * that entry is dirty, take the opportunity to write back all of the
+ * dirty blocks in the cache in one sorted pass.
  */
-static void reuse_cache(io_channel channel, struct unix_private_data *data,
-		 struct unix_cache *cache, unsigned long long block)
+static struct unix_cache *reuse_cache(io_channel channel,
+				      struct unix_private_data *data,
+				      unsigned long long block)
 {
-	if (cache->dirty && cache->in_use)
-		raw_write_blk(channel, data, cache->block, 1, cache->buf);
+	struct unix_cache	*cache = data->lru_tail;
+
+	if (cache->in_use) {
+		if (cache->dirty) {
+			flush_cached_blocks(channel, data, 0);
+			if (cache->dirty) {
+				cache->dirty = 0;
+				data->dirty_count--;
+			}
+		}
+		hash_remove(data, cache);
+	}
+	lru_unlink(data, cache);
+	lru_add_head(data, cache);
 
 	cache->in_use = 1;
 	cache->dirty = 0;
 	cache->block = block;
-	cache->access_time = ++data->access_time;
+	hash_insert(data, cache);
+	return cache;
+}
+
+/*
+ * Drop a cache entry, moving it to the end of the LRU list.
+ */
+static void invalidate_cache(struct unix_private_data *data,
+			     struct unix_cache *cache)
+{
+	if (!cache->in_use)
+		return;
+	hash_remove(data, cache);
+	if (cache->dirty)
+		data->dirty_count--;
+	cache->in_use = 0;
+	cache->dirty = 0;
+	lru_unlink(data, cache);
+	lru_add_tail(data, cache);
+}
+
+static int cache_block_cmp(const void *a, const void *b)
+{
+	const struct unix_cache *ca = *(const struct unix_cache * const *) a;
+	const struct unix_cache *cb = *(const struct unix_cache * const *) b;
+
+	if (ca->block < cb->block)
+		return -1;
+	return (ca->block > cb->block);
+}
+
+/*
+ * Write out a run of dirty cache entries covering consecutive blocks
+ * with a single system call.  If that fails for any reason, fall back
+ * to writing the blocks one at a time, so that errors get reported
+ * through the usual write_error path against the right block.
+ */
+static errcode_t write_cached_run(io_channel channel,
+				  struct unix_private_data *data,
+				  struct unix_cache **list, int count)
+{
+	errcode_t	retval, retval2 = 0;
+	int		i;
+#ifdef HAVE_SYS_UIO_H
+	struct iovec	iov[WRITE_RUN_MAX];
+	ext2_loff_t	location;
+	ssize_t		size, actual;
+	struct timeval	start;
+
+	if (count > 1 &&
+	    (!data->align || IS_ALIGNED(channel->block_size, data->align))) {
+		size = (ssize_t) count * channel->block_size;
+		for (i = 0; i < count; i++) {
+			iov[i].iov_base = list[i]->buf;
+			iov[i].iov_len = channel->block_size;
+		}
+		location = ((ext2_loff_t) list[0]->block * channel->block_size)
+			+ data->offset;
+		stream_invalidate(data);
+		gettimeofday(&start, 0);
+		if (ext2fs_llseek(data->dev, location, SEEK_SET) == location) {
+			actual = writev(data->dev, iov, count);
+			if (actual == size) {
+				data->io_stats.bytes_written += size;
+				account_io(data, 1, location, size, &start);
+				for (i = 0; i < count; i++)
+					list[i]->dirty = 0;
+				data->dirty_count -= count;
+				return 0;
+			}
+		}
+	}
+#endif
+	for (i = 0; i < count; i++) {
+		retval = raw_write_blk(channel, data, list[i]->block, 1,
+				       list[i]->buf);
+		if (retval) {
+			retval2 = retval;
+			continue;
+		}
+		list[i]->dirty = 0;
+		data->dirty_count--;
+	}
+	return retval2;
 }
 
 /*
- * Flush all of the blocks in the cache
+ * Flush all of the blocks in the cache.  Dirty blocks are written in
+ * block number order, and runs of consecutive blocks are merged into
+ * a single write.
  */
 static errcode_t flush_cached_blocks(io_channel channel,
 				     struct unix_private_data *data,
@@ -398,30 +1003,439 @@ static errcode_t flush_cached_blocks(io_channel channel,
 {
 	struct unix_cache	*cache;
 	errcode_t		retval, retval2;
-	int			i;
+	int			i, n, run;
 
 	retval2 = 0;
-	for (i=0, cache = data->cache; i < CACHE_SIZE; i++, cache++) {
-		if (!cache->in_use)
-			continue;
-
-		if (invalidate)
-			cache->in_use = 0;
-
-		if (!cache->dirty)
-			continue;
-
-		retval = raw_write_blk(channel, data,
-				       cache->block, 1, cache->buf);
+	n = 0;
+	for (i=0, cache = data->cache; i < data->cache_size; i++, cache++)
+		if (cache->in_use && cache->dirty)
+			data->dirty_list[n++] = cache;
+
+	if (n > 1)
+		qsort(data->dirty_list, n, sizeof(struct unix_cache *),
+		      cache_block_cmp);
+
+	for (i = 0; i < n; i += run) {
+		for (run = 1; (i + run < n) && (run < WRITE_RUN_MAX); run++)
+			if (data->dirty_list[i + run]->block !=
+			    data->dirty_list[i]->block + run)
+				break;
+		retval = write_cached_run(channel, data,
+					  data->dirty_list + i, run);
 		if (retval)
 			retval2 = retval;
-		else
-			cache->dirty = 0;
+	}
+
+	if (invalidate) {
+		for (i=0, cache = data->cache; i < data->cache_size;
+		     i++, cache++)
+			invalidate_cache(data, cache);
 	}
 	return retval2;
 }
 #endif /* NO_IO_CACHE */
 
+/*
+ * Here we implement the io_uring support used for batched requests
+ */
+#ifdef USE_IO_URING
+static void uring_free(struct unix_private_data *data)
+{
+	struct unix_uring	*ring = data->ring;
+
+	if (!ring)
+		return;
+	if (ring->sqes)
+		munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	if (ring->fd >= 0)
+		close(ring->fd);
+	ext2fs_free_mem(&data->ring);
+}
+
+static errcode_t uring_setup(struct unix_private_data *data, unsigned depth)
+{
+	struct unix_uring	*ring;
+	struct io_uring_params	p;
+	char			*sq, *cq;
+	errcode_t		retval;
+
+	uring_free(data);
+	if (!depth)
+		return 0;
+
+	retval = ext2fs_get_mem(sizeof(struct unix_uring), &ring);
+	if (retval)
+		return retval;
+	memset(ring, 0, sizeof(struct unix_uring));
+	data->ring = ring;
+
+	memset(&p, 0, sizeof(p));
+	ring->fd = syscall(__NR_io_uring_setup, depth, &p);
+	if (ring->fd < 0) {
+		retval = errno;
+		goto errout;
+	}
+	ring->entries = p.sq_entries;
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+	ring->sq_ring = mmap(0, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		ring->sq_ring = 0;
+		retval = errno;
+		goto errout;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ring = ring->sq_ring;
+	else {
+		ring->cq_ring = mmap(0, ring->cq_ring_size,
+				     PROT_READ | PROT_WRITE, MAP_SHARED,
+				     ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			ring->cq_ring = 0;
+			retval = errno;
+			goto errout;
+		}
+	}
+	ring->sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe),
+			  PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd,
+			  IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = 0;
+		retval = errno;
+		goto errout;
+	}
+
+	sq = ring->sq_ring;
+	ring->sq_head = (unsigned *) (sq + p.sq_off.head);
+	ring->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+	cq = ring->cq_ring;
+	ring->cq_head = (unsigned *) (cq + p.cq_off.head);
+	ring->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+	return 0;
+
+errout:
+	uring_free(data);
+	return retval;
+}
+
+static ssize_t request_size(io_channel channel, io_request req)
+{
+	return (req->count < 0) ? -req->count :
+		(ssize_t) req->count * channel->block_size;
+}
+
+/*
+ * Complete a request synchronously; this is also used to redo
+ * requests which the kernel only partially completed, so that short
+ * reads and errors are handled exactly as for the normal read and
+ * write paths.
+ */
+static errcode_t sync_request(io_channel channel,
+			      struct unix_private_data *data,
+			      int flags, io_request req)
+{
+	if (flags & IO_BATCH_WRITE)
+		req->error = raw_write_blk(channel, data, req->block,
+					   req->count, req->buf);
+	else
+		req->error = raw_read_blk(channel, data, req->block,
+					  req->count, req->buf);
+	return req->error;
+}
+
+/*
+ * Submit up to ring->entries requests at a time, and wait for all of
+ * them to complete before queueing the next lot.  The result of each
+ * request is left in its error field; the return value only reports
+ * whether we could run the batch at all.
+ */
+static errcode_t uring_rw_batch(io_channel channel,
+				struct unix_private_data *data,
+				int flags, io_request reqs, int count)
+{
+	struct unix_uring	*ring = data->ring;
+	struct io_uring_sqe	*sqe;
+	struct io_uring_cqe	*cqe;
+	struct iovec		*iov;
+	io_request		req;
+	errcode_t		retval;
+	unsigned		tail, head, idx;
+	int			i, j, n, done, to_submit, ret;
+	struct timeval		start;
+
+	retval = ext2fs_get_array(ring->entries, sizeof(struct iovec), &iov);
+	if (retval)
+		return retval;
+
+	for (i = 0; i < count; i += n) {
+		n = count - i;
+		if (n > (int) ring->entries)
+			n = ring->entries;
+
+		tail = *ring->sq_tail;
+		for (j = 0; j < n; j++) {
+			req = &reqs[i + j];
+			iov[j].iov_base = req->buf;
+			iov[j].iov_len = request_size(channel, req);
+			idx = tail & *ring->sq_mask;
+			sqe = &ring->sqes[idx];
+			memset(sqe, 0, sizeof(struct io_uring_sqe));
+			sqe->opcode = (flags & IO_BATCH_WRITE) ?
+				IORING_OP_WRITEV : IORING_OP_READV;
+			sqe->fd = data->dev;
+			sqe->off = (req->block * channel->block_size) +
+				data->offset;
+			sqe->addr = (unsigned long) &iov[j];
+			sqe->len = 1;
+			sqe->user_data = j;
+			ring->sq_array[idx] = idx;
+			tail++;
+		}
+		__sync_synchronize();
+		*ring->sq_tail = tail;
+		__sync_synchronize();
+		gettimeofday(&start, 0);
+
+		to_submit = n;
+		done = 0;
+		while (done < n) {
+			ret = syscall(__NR_io_uring_enter, ring->fd, to_submit,
+				      n - done, IORING_ENTER_GETEVENTS,
+				      NULL, 0);
+			if (ret < 0) {
+				if (errno == EINTR || errno == EAGAIN)
+					continue;
+				/*
+				 * The ring is unusable; tear it down
+				 * (which cancels anything still in
+				 * flight) and redo whatever hasn't
+				 * completed the slow way.
+				 */
+				uring_free(data);
+				for (j = 0; j < n; j++)
+					if (iov[j].iov_base)
+						sync_request(channel, data,
+							     flags,
+							     &reqs[i + j]);
+				for (j = i + n; j < count; j++)
+					sync_request(channel, data, flags,
+						     &reqs[j]);
+				goto out;
+			}
+			to_submit -= ret;
+			if (to_submit < 0)
+				to_submit = 0;
+
+			head = *ring->cq_head;
+			__sync_synchronize();
+			while (head != *ring->cq_tail) {
+				cqe = &ring->cqes[head & *ring->cq_mask];
+				req = &reqs[i + cqe->user_data];
+				iov[cqe->user_data].iov_base = 0;
+				if (cqe->res == request_size(channel, req)) {
+					req->error = 0;
+					account_io(data,
+						   flags & IO_BATCH_WRITE,
+						   (req->block *
+						    channel->block_size) +
+						   data->offset,
+						   cqe->res, &start);
+					if (flags & IO_BATCH_WRITE)
+						data->io_stats.bytes_written +=
+							cqe->res;
+					else
+						data->io_stats.bytes_read +=
+							cqe->res;
+				} else
+					sync_request(channel, data, flags,
+						     req);
+				head++;
+				done++;
+			}
+			__sync_synchronize();
+			*ring->cq_head = head;
+		}
+	}
+out:
+	ext2fs_free_mem(&iov);
+	return 0;
+}
+#else
+static void uring_free(struct unix_private_data *data)
+{
+}
+
+static errcode_t uring_setup(struct unix_private_data *data, unsigned depth)
+{
+	return depth ? EXT2_ET_OP_NOT_SUPPORTED : 0;
+}
+#endif /* USE_IO_URING */
+
+/*
+ * Routines to read blocks directly out of a read-only mapping of the
+ * file, used instead of the block cache when the "mmap" option is set.
+ */
+#ifdef USE_MMAP
+/*
+ * Touching a page of the mapping past the end of the file raises
+ * SIGBUS.  While any file is mapped we catch it, and if it happened
+ * while map_read_blk() was copying out of a mapping, jump back there.
+ */
+static sigjmp_buf map_jmp;
+static volatile sig_atomic_t map_copying;
+static struct sigaction map_old_sigbus;
+static int map_users;
+
+static void map_sigbus(int sig)
+{
+	if (map_copying)
+		siglongjmp(map_jmp, 1);
+	/* Not ours; let the old handler see it when the access is retried */
+	sigaction(SIGBUS, &map_old_sigbus, 0);
+}
+
+static void map_free(struct unix_private_data *data)
+{
+	if (!data->map)
+		return;
+	munmap(data->map, data->map_size);
+	data->map = 0;
+	if (--map_users == 0)
+		sigaction(SIGBUS, &map_old_sigbus, 0);
+}
+
+static errcode_t map_setup(io_channel channel, struct unix_private_data *data)
+{
+	struct stat	st;
+	void		*map;
+
+	if ((data->flags & (IO_FLAG_RW | IO_FLAG_DIRECT_IO)) ||
+	    (fstat(data->dev, &st) < 0) || !S_ISREG(st.st_mode) ||
+	    (st.st_size == 0) || ((size_t) st.st_size != st.st_size))
+		return EXT2_ET_OP_NOT_SUPPORTED;
+	if (data->map)
+		return 0;
+	map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, data->dev, 0);
+	if (map == MAP_FAILED)
+		return errno;
+	if (map_users++ == 0) {
+		struct sigaction sa;
+
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = map_sigbus;
+		sigemptyset(&sa.sa_mask);
+		/* We leave the handler with siglongjmp() and no mask */
+		sa.sa_flags = SA_NODEFER;
+		sigaction(SIGBUS, &sa, &map_old_sigbus);
+	}
+#ifndef NO_IO_CACHE
+	/* Reads no longer go through the cache, so drop what's there */
+	flush_cached_blocks(channel, data, 1);
+#endif
+	data->map = map;
+	data->map_size = st.st_size;
+	data->map_trend = 0;
+	data->map_advice = MADV_NORMAL;
+	return 0;
+}
+
+/*
+ * Tell the kernel whether we are reading the file sequentially or
+ * jumping around, so it can size its readahead to match.  The hint
+ * only changes after MAP_TREND reads in a row go the other way.
+ */
+static void map_advise(io_channel channel, struct unix_private_data *data,
+		       unsigned long long block, int count)
+{
+	int	advice = data->map_advice;
+
+	if (block == data->map_next) {
+		if (data->map_trend < MAP_TREND)
+			data->map_trend++;
+	} else if (data->map_trend > -MAP_TREND)
+		data->map_trend--;
+	if (count < 0)
+		count = (-count + channel->block_size - 1) /
+			channel->block_size;
+	data->map_next = block + count;
+
+	if (data->map_trend == MAP_TREND)
+		advice = MADV_SEQUENTIAL;
+	else if (data->map_trend == -MAP_TREND)
+		advice = MADV_RANDOM;
+	if (advice != data->map_advice &&
+	    madvise(data->map, data->map_size, advice) == 0)
+		data->map_advice = advice;
+}
+
+static errcode_t map_read_blk(io_channel channel,
+			      struct unix_private_data *data,
+			      unsigned long long block,
+			      int count, void *buf)
+{
+	ssize_t		size;
+	ext2_loff_t	location;
+	struct timeval	start;
+
+	size = (count < 0) ? -count : count * channel->block_size;
+	location = ((ext2_loff_t) block * channel->block_size) + data->offset;
+
+	/*
+	 * Reads past the mapping, or into a part of the file which
+	 * has been truncated since it was mapped, are left to pread()
+	 * so that it can report the short read.
+	 */
+	if (location + size > data->map_size)
+		return raw_read_blk(channel, data, block, count, buf);
+	if (sigsetjmp(map_jmp, 0)) {
+		map_copying = 0;
+		return raw_read_blk(channel, data, block, count, buf);
+	}
+
+	map_advise(channel, data, block, count);
+	gettimeofday(&start, 0);
+	map_copying = 1;
+	memcpy(buf, data->map + location, size);
+	map_copying = 0;
+	data->io_stats.bytes_read += size;
+	account_io(data, 0, location, size, &start);
+	return 0;
+}
+#else
+static void map_free(struct unix_private_data *data)
+{
+}
+
+static errcode_t map_setup(io_channel channel, struct unix_private_data *data)
+{
+	return EXT2_ET_OP_NOT_SUPPORTED;
+}
+
+static errcode_t map_read_blk(io_channel channel,
+			      struct unix_private_data *data,
+			      unsigned long long block,
+			      int count, void *buf)
+{
+	return EXT2_ET_OP_NOT_SUPPORTED;
+}
+#endif /* USE_MMAP */
+
 static errcode_t unix_open(const char *name, int flags, io_channel *channel)
 {
 	io_channel	io = NULL;
@@ -458,7 +1472,7 @@ static errcode_t unix_open(const char *name, int flags, io_channel *channel)
 
 	memset(data, 0, sizeof(struct unix_private_data));
 	data->magic = EXT2_ET_MAGIC_UNIX_IO_CHANNEL;
-	data->io_stats.num_fields = 2;
+	data->io_stats.num_fields = 8 + IO_STATS_LATENCY_BUCKETS;
 
 	open_flags = (flags & IO_FLAG_RW) ? O_RDWR : O_RDONLY;
 	if (flags & IO_FLAG_EXCLUSIVE)
@@ -551,6 +1565,8 @@ static errcode_t unix_open(const char *name, int flags, io_channel *channel)
 cleanup:
 	if (data) {
 		free_cache(data);
+		uring_free(data);
+		map_free(data);
 		ext2fs_free_mem(&data);
 	}
 	if (io)
@@ -558,6 +1574,47 @@ cleanup:
 	return retval;
 }
 
+/*
+ * Set up an io_uring if the kernel lets us.  If it doesn't support
+ * io_uring, or it has been disabled or is blocked, carry on without
+ * one; batched requests are then done with pread/pwrite.
+ */
+static errcode_t uring_try_setup(struct unix_private_data *data,
+				 unsigned depth)
+{
+	errcode_t	retval;
+
+	retval = uring_setup(data, depth);
+	if (retval == ENOSYS || retval == EPERM || retval == EINVAL)
+		return 0;
+	return retval;
+}
+
+static errcode_t uring_open(const char *name, int flags, io_channel *channel)
+{
+	errcode_t	retval;
+
+	retval = unix_open(name, flags, channel);
+	if (retval)
+		return retval;
+	(*channel)->manager = io_uring_io_manager;
+	uring_try_setup((*channel)->private_data, QUEUE_DEPTH);
+	return 0;
+}
+
+static errcode_t mmap_open(const char *name, int flags, io_channel *channel)
+{
+	errcode_t	retval;
+
+	retval = unix_open(name, flags, channel);
+	if (retval)
+		return retval;
+	(*channel)->manager = mmap_io_manager;
+	/* Block devices and read-write opens just use the cache */
+	map_setup(*channel, (*channel)->private_data);
+	return 0;
+}
+
 static errcode_t unix_close(io_channel channel)
 {
 	struct unix_private_data *data;
@@ -577,6 +1634,9 @@ static errcode_t unix_close(io_channel channel)
 	if (close(data->dev) < 0)
 		retval = errno;
 	free_cache(data);
+	uring_free(data);
+	map_free(data);
+	stream_free(data);
 
 	ext2fs_free_mem(&channel->private_data);
 	if (channel->name)
@@ -595,15 +1655,18 @@ static errcode_t unix_set_blksize(io_channel channel, int blksize)
 	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
 
 	if (channel->block_size != blksize) {
+		int	old_blksize = channel->block_size;
+
 #ifndef NO_IO_CACHE
 		if ((retval = flush_cached_blocks(channel, data, 0)))
 			return retval;
 #endif
 
 		channel->block_size = blksize;
-		free_cache(data);
-		if ((retval = alloc_cache(channel, data)))
+		if ((retval = alloc_cache(channel, data))) {
+			channel->block_size = old_blksize;
 			return retval;
+		}
 	}
 	return 0;
 }
@@ -613,7 +1676,7 @@ static errcode_t unix_read_blk64(io_channel channel, unsigned long long block,
 			       int count, void *buf)
 {
 	struct unix_private_data *data;
-	struct unix_cache *cache, *reuse[READ_DIRECT_SIZE];
+	struct unix_cache *cache;
 	errcode_t	retval;
 	char		*cp;
 	int		i, j;
@@ -622,6 +1685,9 @@ static errcode_t unix_read_blk64(io_channel channel, unsigned long long block,
 	data = (struct unix_private_data *) channel->private_data;
 	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
 
+	if (data->map)
+		return map_read_blk(channel, data, block, count, buf);
+
 #ifdef NO_IO_CACHE
 	return raw_read_blk(channel, data, block, count, buf);
 #else
@@ -629,7 +1695,7 @@ static errcode_t unix_read_blk64(io_channel channel, unsigned long long block,
 	 * If we're doing an odd-sized read or a very large read,
 	 * flush out the cache and then do a direct read.
 	 */
-	if (count < 0 || count > WRITE_DIRECT_SIZE) {
+	if (count < 0 || count > READ_DIRECT_SIZE) {
 		if ((retval = flush_cached_blocks(channel, data, 0)))
 			return retval;
 		return raw_read_blk(channel, data, block, count, buf);
@@ -638,10 +1704,11 @@ static errcode_t unix_read_blk64(io_channel channel, unsigned long long block,
 	cp = buf;
 	while (count > 0) {
 		/* If it's in the cache, use it! */
-		if ((cache = find_cached_block(data, block, &reuse[0]))) {
+		if ((cache = find_cached_block(data, block))) {
 #ifdef DEBUG
-			printf("Using cached block %lu\n", block);
+			printf("Using cached block %llu\n", block);
 #endif
+			data->io_stats.cache_hits++;
 			memcpy(cp, cache->buf, channel->block_size);
 			count--;
 			block++;
@@ -653,11 +1720,11 @@ static errcode_t unix_read_blk64(io_channel channel, unsigned long long block,
 			 * Special case where we read directly into the
 			 * cache buffer; important in the O_DIRECT case
 			 */
-			cache = reuse[0];
-			reuse_cache(channel, data, cache, block);
+			data->io_stats.cache_misses++;
+			cache = reuse_cache(channel, data, block);
 			if ((retval = raw_read_blk(channel, data, block, 1,
 						   cache->buf))) {
-				cache->in_use = 0;
+				invalidate_cache(data, cache);
 				return retval;
 			}
 			memcpy(cp, cache->buf, channel->block_size);
@@ -669,19 +1736,19 @@ static errcode_t unix_read_blk64(io_channel channel, unsigned long long block,
 		 * single read request
 		 */
 		for (i=1; i < count; i++)
-			if (find_cached_block(data, block+i, &reuse[i]))
+			if (find_cached_block(data, block+i))
 				break;
 #ifdef DEBUG
-		printf("Reading %d blocks starting at %lu\n", i, block);
+		printf("Reading %d blocks starting at %llu\n", i, block);
 #endif
+		data->io_stats.cache_misses += i;
 		if ((retval = raw_read_blk(channel, data, block, i, cp)))
 			return retval;
 
 		/* Save the results in the cache */
 		for (j=0; j < i; j++) {
 			count--;
-			cache = reuse[j];
-			reuse_cache(channel, data, cache, block++);
+			cache = reuse_cache(channel, data, block++);
 			memcpy(cache->buf, cp, channel->block_size);
 			cp += channel->block_size;
 		}
@@ -700,7 +1767,7 @@ static errcode_t unix_write_blk64(io_channel channel, unsigned long long block,
 				int count, const void *buf)
 {
 	struct unix_private_data *data;
-	struct unix_cache *cache, *reuse;
+	struct unix_cache *cache;
 	errcode_t	retval = 0;
 	const char	*cp;
 	int		writethrough;
@@ -709,6 +1776,10 @@ static errcode_t unix_write_blk64(io_channel channel, unsigned long long block,
 	data = (struct unix_private_data *) channel->private_data;
 	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
 
+	/* Writes must not land in a cache that reads no longer look at */
+	if (data->map)
+		return raw_write_blk(channel, data, block, count, buf);
+
 #ifdef NO_IO_CACHE
 	return raw_write_blk(channel, data, block, count, buf);
 #else
@@ -733,17 +1804,26 @@ static errcode_t unix_write_blk64(io_channel channel, unsigned long long block,
 
 	cp = buf;
 	while (count > 0) {
-		cache = find_cached_block(data, block, &reuse);
-		if (!cache) {
-			cache = reuse;
-			reuse_cache(channel, data, cache, block);
-		}
+		cache = find_cached_block(data, block);
+		if (!cache)
+			cache = reuse_cache(channel, data, block);
 		memcpy(cache->buf, cp, channel->block_size);
-		cache->dirty = !writethrough;
+		if (cache->dirty != !writethrough) {
+			cache->dirty = !writethrough;
+			data->dirty_count += cache->dirty ? 1 : -1;
+		}
 		count--;
 		block++;
 		cp += channel->block_size;
 	}
+
+	/*
+	 * Start writing back once enough blocks have been dirtied,
+	 * rather than waiting for dirty blocks to fall off the end
+	 * of the LRU list.
+	 */
+	if (data->write_behind && data->dirty_count >= data->write_behind)
+		retval = flush_cached_blocks(channel, data, 0);
 	return retval;
 #endif /* NO_IO_CACHE */
 }
@@ -780,6 +1860,7 @@ static errcode_t unix_write_byte(io_channel channel, unsigned long offset,
 		return retval;
 #endif
 
+	stream_invalidate(data);
 	if (lseek(data->dev, offset + data->offset, SEEK_SET) < 0)
 		return errno;
 
@@ -790,6 +1871,141 @@ static errcode_t unix_write_byte(io_channel channel, unsigned long offset,
 	return 0;
 }
 
+/*
+ * Start reading blocks into the page cache in the background, so
+ * that a later unix_read_blk64() doesn't have to wait for the disk.
+ */
+static errcode_t unix_readahead(io_channel channel, unsigned long long block,
+				unsigned long long count)
+{
+	struct unix_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct unix_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+#if defined(USE_MMAP) && defined(MADV_WILLNEED)
+	if (data->map) {
+		ext2_loff_t	start, end;
+		long		pagesize = sysconf(_SC_PAGESIZE);
+
+		start = (ext2_loff_t) block * channel->block_size +
+			data->offset;
+		end = start + (ext2_loff_t) count * channel->block_size;
+		if (end > data->map_size)
+			end = data->map_size;
+		start &= ~((ext2_loff_t) pagesize - 1);
+		if (start >= end)
+			return 0;
+		if (madvise(data->map + start, end - start,
+			    MADV_WILLNEED) != 0)
+			return EXT2_ET_OP_NOT_SUPPORTED;
+		return 0;
+	}
+#endif
+#ifdef POSIX_FADV_WILLNEED
+	/* O_DIRECT reads bypass the page cache, so this would be useless */
+	if ((data->flags & IO_FLAG_DIRECT_IO) ||
+	    data->stream == STREAM_DIRECT)
+		return EXT2_ET_OP_NOT_SUPPORTED;
+	if (posix_fadvise(data->dev,
+			  (ext2_loff_t) block * channel->block_size +
+			  data->offset,
+			  (ext2_loff_t) count * channel->block_size,
+			  POSIX_FADV_WILLNEED) != 0)
+		return EXT2_ET_OP_NOT_SUPPORTED;
+	return 0;
+#else
+	return EXT2_ET_OP_NOT_SUPPORTED;
+#endif
+}
+
+static errcode_t unix_rw_batch(io_channel channel, int flags, io_request reqs,
+			       int count)
+{
+	struct unix_private_data *data;
+	struct unix_cache *cache;
+	errcode_t	retval = 0;
+	int		i, j;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct unix_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (data->map && !(flags & IO_BATCH_WRITE)) {
+		for (i = 0; i < count; i++)
+			reqs[i].error = map_read_blk(channel, data,
+						     reqs[i].block,
+						     reqs[i].count,
+						     reqs[i].buf);
+		goto out;
+	}
+
+#ifndef NO_IO_CACHE
+	/*
+	 * Batched requests bypass the cache: make sure reads see any
+	 * dirty blocks, and that writes don't leave stale copies of
+	 * the blocks they overwrite behind in the cache.
+	 */
+	if (flags & IO_BATCH_WRITE) {
+		for (i = 0; i < count; i++) {
+			if (reqs[i].count < 0) {
+				retval = flush_cached_blocks(channel, data, 1);
+				if (retval)
+					return retval;
+				break;
+			}
+			for (j = 0; j < reqs[i].count; j++) {
+				cache = find_cached_block(data,
+							  reqs[i].block + j);
+				if (cache)
+					invalidate_cache(data, cache);
+			}
+		}
+	} else if (data->dirty_count) {
+		retval = flush_cached_blocks(channel, data, 0);
+		if (retval)
+			return retval;
+	}
+#endif
+
+	if (flags & IO_BATCH_WRITE)
+		stream_invalidate(data);
+#ifdef USE_IO_URING
+	/* In streaming mode, reads go through the bounce buffers */
+	if (data->ring && count > 1 &&
+	    (!data->stream || (flags & IO_BATCH_WRITE))) {
+		for (i = 0; i < count; i++) {
+			if (data->align &&
+			    (!IS_ALIGNED(reqs[i].buf, data->align) ||
+			     !IS_ALIGNED(request_size(channel, &reqs[i]),
+					 data->align)))
+				break;
+		}
+		if ((i == count) &&
+		    !uring_rw_batch(channel, data, flags, reqs, count))
+			goto out;
+	}
+#endif
+	for (i = 0; i < count; i++) {
+		if (flags & IO_BATCH_WRITE)
+			reqs[i].error = raw_write_blk(channel, data,
+						      reqs[i].block,
+						      reqs[i].count,
+						      reqs[i].buf);
+		else
+			reqs[i].error = raw_read_blk(channel, data,
+						     reqs[i].block,
+						     reqs[i].count,
+						     reqs[i].buf);
+	}
+out:
+	for (i = 0; i < count; i++)
+		if (reqs[i].error)
+			return reqs[i].error;
+	return 0;
+}
+
 /*
  * Flush data buffers to disk.
  */
@@ -813,7 +2029,8 @@ static errcode_t unix_set_option(io_channel channel, const char *option,
 				 const char *arg)
 {
 	struct unix_private_data *data;
-	unsigned long long tmp;
+	unsigned long long tmp, old_bytes;
+	errcode_t retval;
 	char *end;
 
 	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
@@ -832,5 +2049,89 @@ static errcode_t unix_set_option(io_channel channel, const char *option,
 			return EXT2_ET_INVALID_ARGUMENT;
 		return 0;
 	}
+	/*
+	 * cache_size=<bytes>[K|M|G] sets the amount of memory used
+	 * for the block cache; it is never made smaller than
+	 * CACHE_SIZE blocks.
+	 */
+	if (!strcmp(option, "cache_size")) {
+		if (!arg)
+			return EXT2_ET_INVALID_ARGUMENT;
+
+		tmp = strtoull(arg, &end, 0);
+		switch (*end) {
+		case 'g': case 'G':
+			tmp <<= 10;
+			/* fallthrough */
+		case 'm': case 'M':
+			tmp <<= 10;
+			/* fallthrough */
+		case 'k': case 'K':
+			tmp <<= 10;
+			end++;
+		}
+		if (*end)
+			return EXT2_ET_INVALID_ARGUMENT;
+#ifndef NO_IO_CACHE
+		if ((retval = flush_cached_blocks(channel, data, 0)))
+			return retval;
+#endif
+		old_bytes = data->cache_bytes;
+		data->cache_bytes = tmp;
+		retval = alloc_cache(channel, data);
+		if (retval)
+			data->cache_bytes = old_bytes;
+		return retval;
+	}
+	/*
+	 * io_uring (or queue_depth=<n>, with 0 to turn it off again)
+	 * sets up an io_uring used for batched requests.
+	 */
+	if (!strcmp(option, "io_uring"))
+		return uring_try_setup(data, QUEUE_DEPTH);
+	/*
+	 * mmap reads a read-only regular file through a mapping of
+	 * it instead of the block cache.
+	 */
+	if (!strcmp(option, "mmap"))
+		return map_setup(channel, data);
+	/*
+	 * streaming reads the device with large O_DIRECT transfers (or
+	 * drops what was read from the page cache if O_DIRECT can't
+	 * be used), so that scanning a whole device doesn't evict
+	 * everything else from the page cache.
+	 */
+	if (!strcmp(option, "streaming")) {
+		if (!arg || !strcmp(arg, "1") || !strcmp(arg, "on"))
+			return stream_setup(channel, data);
+		if (strcmp(arg, "0") && strcmp(arg, "off"))
+			return EXT2_ET_INVALID_ARGUMENT;
+		stream_free(data);
+		return 0;
+	}
+	if (!strcmp(option, "queue_depth")) {
+		if (!arg)
+			return EXT2_ET_INVALID_ARGUMENT;
+
+		tmp = strtoul(arg, &end, 0);
+		if (*end || tmp > 4096)
+			return EXT2_ET_INVALID_ARGUMENT;
+		return uring_try_setup(data, tmp);
+	}
+	/*
+	 * write_behind=<blocks> starts writing back dirty blocks as
+	 * soon as that many are dirty; 0 (the default) waits until
+	 * a dirty block needs to be evicted.
+	 */
+	if (!strcmp(option, "write_behind")) {
+		if (!arg)
+			return EXT2_ET_INVALID_ARGUMENT;
+
+		tmp = strtoul(arg, &end, 0);
+		if (*end || tmp > INT_MAX)
+			return EXT2_ET_INVALID_ARGUMENT;
+		data->write_behind = tmp;
+		return 0;
+	}
 	return EXT2_ET_INVALID_ARGUMENT;
 }
@@ -42,8 +42,6 @@ extern int optind;
 #include "../version.h"
 #include "nls-enable.h"
 
-#define in_use(m, x)	(ext2fs_test_bit ((x), (m)))
-
 const char * program_name = "dumpe2fs";
 char * device_name = NULL;
 int hex_format = 0;
@@ -71,29 +69,28 @@ static void print_range(unsigned long a, unsigned long b)
 		printf("%lu-%lu", a, b);
 }
 
-static void print_free (unsigned long group, char * bitmap,
-			unsigned long nbytes, unsigned long offset)
+static void print_free(ext2fs_generic_bitmap map, unsigned long first,
+		       unsigned long num)
 {
 	int p = 0;
-	unsigned long i;
-	unsigned long j;
-
-	offset += group * nbytes;
-	for (i = 0; i < nbytes; i++)
-		if (!in_use (bitmap, i))
-		{
-			if (p)
-				printf (", ");
-			print_number(i + offset);
-			for (j = i; j < nbytes && !in_use (bitmap, j); j++)
-				;
-			if (--j != i) {
-				fputc('-', stdout);
-				print_number(j + offset);
-				i = j;
-			}
-			p = 1;
+	__u32 i = first, j, last = first + num - 1;
+
+	while (i <= last &&
+	       !ext2fs_find_first_zero_generic_bitmap(map, i, last, &i)) {
+		if (p)
+			printf (", ");
+		print_number(i);
+		/* j is the next block in use, or one past the end */
+		if (i == last ||
+		    ext2fs_find_first_set_generic_bitmap(map, i + 1, last, &j))
+			j = last + 1;
+		if (j - 1 != i) {
+			fputc('-', stdout);
+			print_number(j - 1);
 		}
+		p = 1;
+		i = j + 1;
+	}
 }
 
 static void print_bg_opt(int bg_flags, int mask,
@@ -146,21 +143,11 @@ static void list_desc (ext2_filsys fs)
 	unsigned long i;
 	blk_t	first_block, last_block;
 	blk_t	super_blk, old_desc_blk, new_desc_blk;
-	char *block_bitmap=NULL, *inode_bitmap=NULL;
 	int inode_blocks_per_group, old_desc_blocks, reserved_gdt;
-	int		block_nbytes, inode_nbytes;
 	int has_super;
 	blk_t		blk_itr = fs->super->s_first_data_block;
 	ext2_ino_t	ino_itr = 1;
 
-	block_nbytes = EXT2_BLOCKS_PER_GROUP(fs->super) / 8;
-	inode_nbytes = EXT2_INODES_PER_GROUP(fs->super) / 8;
-
-	if (fs->block_map)
-		block_bitmap = malloc(block_nbytes);
-	if (fs->inode_map)
-		inode_bitmap = malloc(inode_nbytes);
-
 	inode_blocks_per_group = ((fs->super->s_inodes_per_group *
 				   EXT2_INODE_SIZE(fs->super)) +
 				  EXT2_BLOCK_SIZE(fs->super) - 1) /
@@ -248,30 +235,21 @@ static void list_desc (ext2_filsys fs)
 		if (fs->group_desc[i].bg_itable_unused)
 			printf (_(", %u unused inodes\n"),
 				fs->group_desc[i].bg_itable_unused);
-		if (block_bitmap) {
+		if (fs->block_map) {
 			fputs(_("  Free blocks: "), stdout);
-			ext2fs_get_block_bitmap_range(fs->block_map,
-				 blk_itr, block_nbytes << 3, block_bitmap);
-			print_free (i, block_bitmap,
-				    fs->super->s_blocks_per_group,
-				    fs->super->s_first_data_block);
+			print_free(fs->block_map, blk_itr,
+				   fs->super->s_blocks_per_group);
 			fputc('\n', stdout);
 			blk_itr += fs->super->s_blocks_per_group;
 		}
-		if (inode_bitmap) {
+		if (fs->inode_map) {
 			fputs(_("  Free inodes: "), stdout);
-			ext2fs_get_inode_bitmap_range(fs->inode_map,
-				 ino_itr, inode_nbytes << 3, inode_bitmap);
-			print_free (i, inode_bitmap,
-				    fs->super->s_inodes_per_group, 1);
+			print_free(fs->inode_map, ino_itr,
+				   fs->super->s_inodes_per_group);
 			fputc('\n', stdout);
 			ino_itr += fs->super->s_inodes_per_group;
 		}
 	}
-	if (block_bitmap)
-		free(block_bitmap);
-	if (inode_bitmap)
-		free(inode_bitmap);
 }
 
 static void list_bad_blocks(ext2_filsys fs, int dump)
@@ -565,14 +543,14 @@ int main (int argc, char ** argv)
 		     use_blocksize *= 2) {
 			retval = ext2fs_open (device_name, flags,
 					      use_superblock,
-					      use_blocksize, unix_io_manager,
+					      use_blocksize, mmap_io_manager,
 					      &fs);
 			if (!retval)
 				break;
 		}
 	} else
 		retval = ext2fs_open (device_name, flags, use_superblock,
-				      use_blocksize, unix_io_manager, &fs);
+				      use_blocksize, mmap_io_manager, &fs);
 	if (retval) {
 		com_err (program_name, retval, _("while trying to open %s"),
 			 device_name);
@@ -403,14 +403,20 @@ static void scramble_dir_block(ext2_filsys fs, blk_t blk, char *buf)
 	}
 }
 
+/*
+ * Number of blocks whose metadata we read in one batch
+ */
+#define META_BATCH_BLOCKS	64
+
 static void output_meta_data_blocks(ext2_filsys fs, int fd)
 {
-	errcode_t	retval;
-	blk_t		blk;
-	char		*buf, *zero_buf;
+	blk_t		blk, start, end;
+	char		*buf, *cp, *zero_buf;
 	int		sparse = 0;
+	int		i, n;
+	struct struct_io_request reqs[META_BATCH_BLOCKS];
 
-	buf = malloc(fs->blocksize);
+	buf = malloc(fs->blocksize * META_BATCH_BLOCKS);
 	if (!buf) {
 		com_err(program_name, ENOMEM, "while allocating buffer");
 		exit(1);
@@ -421,32 +427,64 @@ static void output_meta_data_blocks(ext2_filsys fs, int fd)
 		exit(1);
 	}
 	memset(zero_buf, 0, fs->blocksize);
-	for (blk = 0; blk < fs->super->s_blocks_count; blk++) {
-		if ((blk >= fs->super->s_first_data_block) &&
-		    ext2fs_test_block_bitmap(meta_block_map, blk)) {
-			retval = io_channel_read_blk(fs->io, blk, 1, buf);
-			if (retval) {
-				com_err(program_name, retval,
-					"error reading block %u", blk);
-			}
-			if (scramble_block_map &&
-			    ext2fs_test_block_bitmap(scramble_block_map, blk))
-				scramble_dir_block(fs, blk, buf);
-			if ((fd != 1) && check_zero_block(buf, fs->blocksize))
-				goto sparse_write;
-			write_block(fd, buf, sparse, fs->blocksize, blk);
-			sparse = 0;
-		} else {
-		sparse_write:
-			if (fd == 1) {
-				write_block(fd, zero_buf, 0,
-					    fs->blocksize, blk);
+	for (start = 0; start < fs->super->s_blocks_count;
+	     start += META_BATCH_BLOCKS) {
+		end = start + META_BATCH_BLOCKS;
+		if (end > fs->super->s_blocks_count)
+			end = fs->super->s_blocks_count;
+
+		/*
+		 * Read all of the metadata blocks in this window at
+		 * once, one request per run of consecutive blocks.
+		 */
+		n = 0;
+		for (blk = start; blk < end; blk++) {
+			if ((blk < fs->super->s_first_data_block) ||
+			    !ext2fs_test_block_bitmap(meta_block_map, blk))
+				continue;
+			if (n && reqs[n-1].block + reqs[n-1].count == blk) {
+				reqs[n-1].count++;
 				continue;
 			}
-			sparse += fs->blocksize;
-			if (sparse >= 1024*1024) {
-				write_block(fd, 0, sparse, 0, 0);
+			reqs[n].block = blk;
+			reqs[n].count = 1;
+			reqs[n].buf = buf + (blk - start) * fs->blocksize;
+			n++;
+		}
+		if (n && io_channel_read_batch(fs->io, reqs, n)) {
+			for (i = 0; i < n; i++)
+				if (reqs[i].error)
+					com_err(program_name, reqs[i].error,
+						"error reading block %llu",
+						reqs[i].block);
+		}
+
+		for (blk = start; blk < end; blk++) {
+			cp = buf + (blk - start) * fs->blocksize;
+			if ((blk >= fs->super->s_first_data_block) &&
+			    ext2fs_test_block_bitmap(meta_block_map, blk)) {
+				if (scramble_block_map &&
+				    ext2fs_test_block_bitmap(scramble_block_map,
+							     blk))
+					scramble_dir_block(fs, blk, cp);
+				if ((fd != 1) &&
+				    check_zero_block(cp, fs->blocksize))
+					goto sparse_write;
+				write_block(fd, cp, sparse, fs->blocksize,
+					    blk);
 				sparse = 0;
+			} else {
+			sparse_write:
+				if (fd == 1) {
+					write_block(fd, zero_buf, 0,
+						    fs->blocksize, blk);
+					continue;
+				}
+				sparse += fs->blocksize;
+				if (sparse >= 1024*1024) {
+					write_block(fd, 0, sparse, 0, 0);
+					sparse = 0;
+				}
 			}
 		}
 	}
@@ -489,6 +527,7 @@ static void write_raw_image_file(ext2_filsys fs, int fd, int scramble_flag)
 		com_err(program_name, retval, _("while opening inode scan"));
 		exit(1);
 	}
+	ext2fs_inode_scan_flags(scan, EXT2_SF_PREFETCH, 0);
 
 	block_buf = malloc(fs->blocksize * 3);
 	if (!block_buf) {
@@ -573,7 +612,8 @@ static void install_image(char *device, char *image_fn, int raw_flag)
 	}
 
 #ifdef CONFIG_TESTIO_DEBUG
-	if (getenv("TEST_IO_FLAGS") || getenv("TEST_IO_BLOCK")) {
+	if (getenv("TEST_IO_FLAGS") || getenv("TEST_IO_BLOCK") ||
+	    getenv("TEST_IO_TRACE")) {
 		io_ptr = test_io_manager;
 		test_io_backing_manager = unix_io_manager;
 	} else
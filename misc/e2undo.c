@@ -19,8 +19,12 @@
 #if HAVE_ERRNO_H
 #include <errno.h>
 #endif
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 #include "ext2fs/tdb.h"
 #include "ext2fs/ext2fs.h"
+#include "ext2fs/crc16.h"
 #include "nls-enable.h"
 
 unsigned char mtime_key[] = "filesystem MTIME";
@@ -29,14 +33,50 @@ unsigned char blksize_key[] = "filesystem BLKSIZE";
 
 char *prg_name;
 
+/*
+ * Records for consecutive blocks are merged into writes of up to
+ * REPLAY_RUN_SIZE bytes, and up to queue_depth of those writes are
+ * handed to the I/O manager at once.
+ */
+#define REPLAY_RUN_SIZE		(1024 * 1024)
+#define MAX_QUEUE_DEPTH		256
+
+struct undo_replay {
+	io_channel	channel;
+	int		block_size;
+	int		fd;		/* the undo log, or -1 */
+	TDB_CONTEXT	*tdb;		/* or the old TDB undo file */
+	struct undo_log_entry *entries;
+	unsigned long	num_entries;
+	int		queue_depth;
+	struct struct_io_request reqs[MAX_QUEUE_DEPTH];
+	char		*bufs[MAX_QUEUE_DEPTH];
+};
+
 static void usage(char *prg_name)
 {
 	fprintf(stderr,
-		_("Usage: %s <transaction file> <filesystem>\n"), prg_name);
+		_("Usage: %s [-f] [-j queue_depth] <transaction file> "
+		  "<filesystem>\n"), prg_name);
 	exit(1);
 
 }
 
+static int is_undo_log(const char *file)
+{
+	char	magic[8];
+	int	fd, ret = 0;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	if (read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+	    !memcmp(magic, E2UNDO_LOG_MAGIC, sizeof(magic)))
+		ret = 1;
+	close(fd);
+	return ret;
+}
+
 static int check_filesystem(TDB_CONTEXT *tdb, io_channel channel)
 {
 	__u32   s_mtime;
@@ -93,7 +133,8 @@ static int check_filesystem(TDB_CONTEXT *tdb, io_channel channel)
 	return 0;
 }
 
-static int set_blk_size(TDB_CONTEXT *tdb, io_channel channel)
+static int set_blk_size(TDB_CONTEXT *tdb, io_channel channel,
+			int *ret_size)
 {
 	int block_size;
 	errcode_t retval;
@@ -114,21 +155,373 @@ static int set_blk_size(TDB_CONTEXT *tdb, io_channel channel)
 	printf("Block size %d\n", block_size);
 #endif
 	io_channel_set_blksize(channel, block_size);
+	*ret_size = block_size;
 
 	return 0;
 }
 
-int main(int argc, char *argv[])
+static errcode_t read_at(int fd, ext2_loff_t offset, void *buf, size_t size)
+{
+	ssize_t	actual;
+
+	if (ext2fs_llseek(fd, offset, SEEK_SET) != offset)
+		return errno ? errno : EXT2_ET_LLSEEK_FAILED;
+	actual = read(fd, buf, size);
+	if (actual < 0)
+		return errno;
+	if ((size_t) actual != size)
+		return EXT2_ET_SHORT_READ;
+	return 0;
+}
+
+/*
+ * Recover the entries of an undo log which was never closed by
+ * stepping over its records one by one.  The scan stops at the first
+ * record which is not complete.
+ */
+static errcode_t scan_undo_log(int fd, int block_size,
+			       struct undo_log_entry **ret_entries,
+			       unsigned long *ret_num)
+{
+	struct undo_log_entry *entries = 0, e;
+	unsigned long	num = 0, max = 0;
+	ext2_loff_t	pos = E2UNDO_LOG_HDR_SIZE;
+	errcode_t	retval;
+	char		*buf;
+
+	retval = ext2fs_get_mem(block_size, &buf);
+	if (retval)
+		return retval;
+	while (read_at(fd, pos, &e, sizeof(e)) == 0) {
+		e.block = ext2fs_le64_to_cpu(e.block);
+		e.offset = ext2fs_le64_to_cpu(e.offset);
+		e.size = ext2fs_le32_to_cpu(e.size);
+		e.csum = ext2fs_le32_to_cpu(e.csum);
+		if (e.offset != pos + sizeof(e) ||
+		    e.size > (unsigned) block_size)
+			break;
+		if (read_at(fd, e.offset, buf, e.size) ||
+		    ext2fs_crc16(~0, buf, e.size) != e.csum)
+			break;
+		if (num >= max) {
+			retval = ext2fs_resize_mem(max * sizeof(e),
+					(max + 1024) * sizeof(e), &entries);
+			if (retval) {
+				ext2fs_free_mem(&entries);
+				break;
+			}
+			max += 1024;
+		}
+		entries[num++] = e;
+		pos = e.offset + block_size;
+	}
+	ext2fs_free_mem(&buf);
+	*ret_entries = entries;
+	*ret_num = num;
+	return retval;
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+	const struct undo_log_entry *ea = a, *eb = b;
+
+	if (ea->block != eb->block)
+		return (ea->block < eb->block) ? -1 : 1;
+	/* For the same block, the oldest contents win */
+	if (ea->offset != eb->offset)
+		return (ea->offset < eb->offset) ? -1 : 1;
+	return 0;
+}
+
+static errcode_t fetch_block(struct undo_replay *r,
+			     struct undo_log_entry *entry, char *buf)
+{
+	TDB_DATA	key, data;
+	unsigned long	blk_num;
+
+	if (r->fd >= 0)
+		return read_at(r->fd, entry->offset, buf, entry->size);
+
+	blk_num = entry->block;
+	key.dptr = (unsigned char *) &blk_num;
+	key.dsize = sizeof(blk_num);
+	data = tdb_fetch(r->tdb, key);
+	if (!data.dptr) {
+		com_err(prg_name, 0,
+			_("Failed tdb_fetch %s\n"), tdb_errorstr(r->tdb));
+		exit(1);
+	}
+	memcpy(buf, data.dptr, entry->size);
+	free(data.dptr);
+	return 0;
+}
+
+static void write_runs(struct undo_replay *r, int count)
+{
+	errcode_t	retval;
+	int		i;
+
+	if (!count)
+		return;
+	retval = io_channel_write_batch(r->channel, r->reqs, count);
+	for (i = 0; i < count; i++) {
+		if (r->reqs[i].error) {
+			com_err(prg_name, r->reqs[i].error,
+				_("Failed write at location %llu\n"),
+				r->reqs[i].block);
+			exit(1);
+		}
+	}
+	if (retval) {
+		com_err(prg_name, retval, _("Failed write\n"));
+		exit(1);
+	}
+}
+
+/*
+ * Write the saved blocks back in block order, merging records for
+ * consecutive blocks into single large writes.
+ */
+static void replay_entries(struct undo_replay *r)
+{
+	struct undo_log_entry *e, *cur, *end;
+	errcode_t	retval;
+	unsigned long long next;
+	int		i, n = 0, bytes, full;
+	char		*buf;
+
+	if (!r->num_entries)
+		return;
+	qsort(r->entries, r->num_entries, sizeof(struct undo_log_entry),
+	      entry_cmp);
+	for (i = 0; i < r->queue_depth; i++) {
+		retval = ext2fs_get_mem(REPLAY_RUN_SIZE > r->block_size ?
+					REPLAY_RUN_SIZE : r->block_size,
+					&r->bufs[i]);
+		if (retval) {
+			com_err(prg_name, retval,
+				_("while allocating buffer\n"));
+			exit(1);
+		}
+	}
+
+	e = r->entries;
+	end = r->entries + r->num_entries;
+	while (e < end) {
+		buf = r->bufs[n];
+		r->reqs[n].block = e->block;
+		r->reqs[n].buf = buf;
+		r->reqs[n].error = 0;
+		bytes = 0;
+		full = 1;
+		next = e->block;
+		while (e < end && e->block == next &&
+		       bytes + r->block_size <= REPLAY_RUN_SIZE) {
+			cur = e;
+			if (cur->size > (unsigned) r->block_size) {
+				com_err(prg_name, 0, _("Corrupt undo log "
+					"entry at location %llu\n"),
+					cur->block);
+				exit(1);
+			}
+			retval = fetch_block(r, cur, buf + bytes);
+			if (retval) {
+				com_err(prg_name, retval,
+					_("while reading the undo log\n"));
+				exit(1);
+			}
+			bytes += cur->size;
+			next++;
+			/* Skip any newer copies of the same block */
+			for (e++; e < end && e->block == cur->block; e++)
+				;
+			/* A short block has to end the run */
+			if ((int) cur->size != r->block_size) {
+				full = 0;
+				break;
+			}
+		}
+		r->reqs[n].count = full ? bytes / r->block_size : -bytes;
+		printf(_("Replayed transaction of size %d at location %llu\n"),
+		       bytes, r->reqs[n].block);
+		if (!bytes)
+			continue;
+		if (++n == r->queue_depth) {
+			write_runs(r, n);
+			n = 0;
+		}
+	}
+	write_runs(r, n);
+
+	for (i = 0; i < r->queue_depth; i++)
+		ext2fs_free_mem(&r->bufs[i]);
+}
+
+static void replay_undo_log(const char *undo_file, struct undo_replay *r,
+			    int force)
+{
+	struct undo_log_header hdr;
+	struct undo_log_entry *entries = 0;
+	struct ext2_super_block super;
+	io_channel	channel = r->channel;
+	unsigned long	i, num;
+	errcode_t	retval;
+	int		fd, block_size;
+
+	fd = open(undo_file, O_RDONLY);
+	if (fd < 0) {
+		com_err(prg_name, errno, _("while opening %s\n"), undo_file);
+		exit(1);
+	}
+	retval = read_at(fd, 0, &hdr, sizeof(hdr));
+	if (retval) {
+		com_err(prg_name, retval, _("while reading %s\n"), undo_file);
+		exit(1);
+	}
+	if (ext2fs_le32_to_cpu(hdr.version) != E2UNDO_LOG_VERSION) {
+		com_err(prg_name, 0, _("Unsupported undo log version %u\n"),
+			ext2fs_le32_to_cpu(hdr.version));
+		exit(1);
+	}
+	block_size = ext2fs_le32_to_cpu(hdr.block_size);
+	if (!block_size) {
+		/* Nothing was ever saved */
+		close(fd);
+		return;
+	}
+	if (!hdr.index_offset)
+		printf(_("The undo log %s was not closed cleanly; "
+			 "recovering the saved blocks\n"), undo_file);
+
+	if (!force) {
+		io_channel_set_blksize(channel, SUPERBLOCK_OFFSET);
+		retval = io_channel_read_blk(channel, 1, -SUPERBLOCK_SIZE,
+					     &super);
+		if (retval) {
+			com_err(prg_name, retval,
+				_("Failed to read the file system data \n"));
+			exit(1);
+		}
+		if (super.s_mtime != hdr.fs_mtime) {
+			com_err(prg_name, 0,
+				_("The file system Mount time didn't match %u\n"),
+				hdr.fs_mtime);
+			exit(1);
+		}
+		if (memcmp(super.s_uuid, hdr.fs_uuid, sizeof(hdr.fs_uuid))) {
+			com_err(prg_name, 0,
+				_("The file system UUID didn't match \n"));
+			exit(1);
+		}
+	}
+
+	if (hdr.index_offset) {
+		num = ext2fs_le64_to_cpu(hdr.num_entries);
+		retval = ext2fs_get_array(num ? num : 1,
+					  sizeof(struct undo_log_entry),
+					  &entries);
+		if (!retval)
+			retval = read_at(fd,
+					 ext2fs_le64_to_cpu(hdr.index_offset),
+					 entries,
+					 num * sizeof(struct undo_log_entry));
+		for (i = 0; !retval && i < num; i++) {
+			entries[i].block = ext2fs_le64_to_cpu(entries[i].block);
+			entries[i].offset =
+				ext2fs_le64_to_cpu(entries[i].offset);
+			entries[i].size = ext2fs_le32_to_cpu(entries[i].size);
+		}
+	} else
+		retval = scan_undo_log(fd, block_size, &entries, &num);
+	if (retval) {
+		com_err(prg_name, retval,
+			_("while reading the undo log index\n"));
+		exit(1);
+	}
+
+	io_channel_set_blksize(channel, block_size);
+	r->fd = fd;
+	r->block_size = block_size;
+	r->entries = entries;
+	r->num_entries = num;
+	replay_entries(r);
+	ext2fs_free_mem(&entries);
+	close(fd);
+}
+
+static void replay_tdb(const char *tdb_file, struct undo_replay *r,
+		       int force)
 {
-	int c,force = 0;
 	TDB_CONTEXT *tdb;
 	TDB_DATA key, data;
+	unsigned long  max = 0;
+	errcode_t retval;
+
+	tdb = tdb_open(tdb_file, 0, 0, O_RDONLY, 0600);
+
+	if (!tdb) {
+		com_err(prg_name, errno,
+				_("Failed tdb_open %s\n"), tdb_file);
+		exit(1);
+	}
+
+	if (!force && check_filesystem(tdb, r->channel)) {
+		exit(1);
+	}
+
+	if (set_blk_size(tdb, r->channel, &r->block_size)) {
+		exit(1);
+	}
+
+	for (key = tdb_firstkey(tdb); key.dptr; key = tdb_nextkey(tdb, key)) {
+		if (!strcmp((char *) key.dptr, (char *) mtime_key) ||
+		    !strcmp((char *) key.dptr, (char *) uuid_key) ||
+		    !strcmp((char *) key.dptr, (char *) blksize_key)) {
+			continue;
+		}
+
+		data = tdb_fetch(tdb, key);
+		if (!data.dptr) {
+			com_err(prg_name, 0,
+				_("Failed tdb_fetch %s\n"), tdb_errorstr(tdb));
+			exit(1);
+		}
+		if (r->num_entries >= max) {
+			retval = ext2fs_resize_mem(max *
+					sizeof(struct undo_log_entry),
+					(max + 1024) *
+					sizeof(struct undo_log_entry),
+					&r->entries);
+			if (retval) {
+				com_err(prg_name, retval,
+					_("while allocating memory\n"));
+				exit(1);
+			}
+			max += 1024;
+		}
+		r->entries[r->num_entries].block = *(unsigned long *)key.dptr;
+		r->entries[r->num_entries].offset = 0;
+		r->entries[r->num_entries].size = data.dsize;
+		r->num_entries++;
+		free(data.dptr);
+	}
+
+	r->fd = -1;
+	r->tdb = tdb;
+	replay_entries(r);
+	ext2fs_free_mem(&r->entries);
+	tdb_close(tdb);
+}
+
+int main(int argc, char *argv[])
+{
+	int c,force = 0;
 	io_channel channel;
+	struct undo_replay replay;
 	errcode_t retval;
+	char *end;
 	int  mount_flags;
-	unsigned long  blk_num;
 	char *device_name, *tdb_file;
-	io_manager manager = unix_io_manager;
 
 #ifdef ENABLE_NLS
 	setlocale(LC_MESSAGES, "");
@@ -139,11 +532,19 @@ int main(int argc, char *argv[])
 	add_error_table(&et_ext2_error_table);
 
 	prg_name = argv[0];
-	while((c = getopt(argc, argv, "f")) != EOF) {
+	memset(&replay, 0, sizeof(replay));
+	replay.queue_depth = 1;
+	while((c = getopt(argc, argv, "fj:")) != EOF) {
 		switch (c) {
 			case 'f':
 				force = 1;
 				break;
+			case 'j':
+				replay.queue_depth = strtoul(optarg, &end, 0);
+				if (*end || replay.queue_depth < 1 ||
+				    replay.queue_depth > MAX_QUEUE_DEPTH)
+					usage(prg_name);
+				break;
 			default:
 				usage(prg_name);
 		}
@@ -155,14 +556,6 @@ int main(int argc, char *argv[])
 	tdb_file = argv[optind];
 	device_name = argv[optind+1];
 
-	tdb = tdb_open(tdb_file, 0, 0, O_RDONLY, 0600);
-
-	if (!tdb) {
-		com_err(prg_name, errno,
-				_("Failed tdb_open %s\n"), tdb_file);
-		exit(1);
-	}
-
 	retval = ext2fs_check_if_mounted(device_name, &mount_flags);
 	if (retval) {
 		com_err(prg_name, retval, _("Error while determining whether "
@@ -176,49 +569,50 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	retval = manager->open(device_name,
-				IO_FLAG_EXCLUSIVE | IO_FLAG_RW,  &channel);
+	/*
+	 * With a queue depth, the io_uring I/O manager keeps that many
+	 * writes in flight.  If io_uring isn't available, just do the
+	 * writes one by one.
+	 */
+	if (replay.queue_depth > 1) {
+		char opt[32];
+
+		retval = io_uring_io_manager->open(device_name,
+				IO_FLAG_EXCLUSIVE | IO_FLAG_RW, &channel);
+		if (!retval) {
+			sprintf(opt, "queue_depth=%d", replay.queue_depth);
+			retval = io_channel_set_options(channel, opt);
+			if (retval)
+				io_channel_close(channel);
+		}
+		if (retval == EXT2_ET_OP_NOT_SUPPORTED) {
+			com_err(prg_name, retval, _("while setting up "
+				"io_uring; writing one block run at a "
+				"time\n"));
+			replay.queue_depth = 1;
+		}
+	}
+	if (replay.queue_depth == 1)
+		retval = unix_io_manager->open(device_name,
+				IO_FLAG_EXCLUSIVE | IO_FLAG_RW, &channel);
 	if (retval) {
 		com_err(prg_name, retval,
 				_("Failed to open %s\n"), device_name);
 		exit(1);
 	}
+	replay.channel = channel;
 
-	if (!force && check_filesystem(tdb, channel)) {
-		exit(1);
-	}
+	if (is_undo_log(tdb_file))
+		replay_undo_log(tdb_file, &replay, force);
+	else
+		replay_tdb(tdb_file, &replay, force);
 
-	if (set_blk_size(tdb, channel)) {
+	retval = io_channel_flush(channel);
+	if (retval) {
+		com_err(prg_name, retval, _("Failed write\n"));
 		exit(1);
 	}
-
-	for (key = tdb_firstkey(tdb); key.dptr; key = tdb_nextkey(tdb, key)) {
-		if (!strcmp((char *) key.dptr, (char *) mtime_key) ||
-		    !strcmp((char *) key.dptr, (char *) uuid_key) ||
-		    !strcmp((char *) key.dptr, (char *) blksize_key)) {
-			continue;
-		}
-
-		data = tdb_fetch(tdb, key);
-		if (!data.dptr) {
-			com_err(prg_name, 0,
-				_("Failed tdb_fetch %s\n"), tdb_errorstr(tdb));
-			exit(1);
-		}
-		blk_num = *(unsigned long *)key.dptr;
-		printf(_("Replayed transaction of size %zd at location %ld\n"),
-							data.dsize, blk_num);
-		retval = io_channel_write_blk(channel, blk_num,
-						-data.dsize, data.dptr);
-		if (retval == -1) {
-			com_err(prg_name, retval,
-					_("Failed write %s\n"),
-					strerror(errno));
-			exit(1);
-		}
-	}
 	io_channel_close(channel);
-	tdb_close(tdb);
 
 	return 0;
 }
@@ -1512,7 +1512,8 @@ static void PRS(int argc, char *argv[])
 		io_manager	io_ptr;
 
 #ifdef CONFIG_TESTIO_DEBUG
-		if (getenv("TEST_IO_FLAGS") || getenv("TEST_IO_BLOCK")) {
+		if (getenv("TEST_IO_FLAGS") || getenv("TEST_IO_BLOCK") ||
+		    getenv("TEST_IO_TRACE")) {
 			io_ptr = test_io_manager;
 			test_io_backing_manager = unix_io_manager;
 		} else
@@ -2126,7 +2127,8 @@ int main (int argc, char *argv[])
 	PRS(argc, argv);
 
 #ifdef CONFIG_TESTIO_DEBUG
-	if (getenv("TEST_IO_FLAGS") || getenv("TEST_IO_BLOCK")) {
+	if (getenv("TEST_IO_FLAGS") || getenv("TEST_IO_BLOCK") ||
+	    getenv("TEST_IO_TRACE")) {
 		io_ptr = test_io_manager;
 		test_io_backing_manager = unix_io_manager;
 	} else
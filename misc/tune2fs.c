@@ -188,7 +188,8 @@ static void remove_journal_device(ext2_filsys fs)
 	}
 
 #ifdef CONFIG_TESTIO_DEBUG
-	if (getenv("TEST_IO_FLAGS") || getenv("TEST_IO_BLOCK")) {
+	if (getenv("TEST_IO_FLAGS") || getenv("TEST_IO_BLOCK") ||
+	    getenv("TEST_IO_TRACE")) {
 		io_ptr = test_io_manager;
 		test_io_backing_manager = unix_io_manager;
 	} else
@@ -805,7 +806,8 @@ static void add_journal(ext2_filsys fs)
 		check_plausibility(journal_device);
 		check_mount(journal_device, 0, _("journal"));
 #ifdef CONFIG_TESTIO_DEBUG
-		if (getenv("TEST_IO_FLAGS") || getenv("TEST_IO_BLOCK")) {
+		if (getenv("TEST_IO_FLAGS") || getenv("TEST_IO_BLOCK") ||
+		    getenv("TEST_IO_TRACE")) {
 			io_ptr = test_io_manager;
 			test_io_backing_manager = unix_io_manager;
 		} else
@@ -1505,6 +1507,7 @@ static int inode_scan_and_fix(ext2_filsys fs, ext2fs_block_bitmap bmap)
 	retval = ext2fs_open_inode_scan(fs, 0, &scan);
 	if (retval)
 		goto err_out;
+	ext2fs_inode_scan_flags(scan, EXT2_SF_PREFETCH, 0);
 
 	while (1) {
 		retval = ext2fs_get_next_inode(scan, &ino, &inode);
@@ -1650,6 +1653,7 @@ static int expand_inode_table(ext2_filsys fs, unsigned long new_ino_size)
 	/* Update the meta data */
 	fs->inode_blocks_per_group = new_ino_blks_per_grp;
 	fs->super->s_inode_size = new_ino_size;
+	ext2fs_flush_icache(fs);
 
 err_out:
 	if (old_itable)
@@ -1661,63 +1665,6 @@ err_out:
 	return retval;
 }
 
-static errcode_t ext2fs_calculate_summary_stats(ext2_filsys fs)
-{
-	blk_t		blk;
-	ext2_ino_t	ino;
-	unsigned int	group = 0;
-	unsigned int	count = 0;
-	int		total_free = 0;
-	int		group_free = 0;
-
-	/*
-	 * First calculate the block statistics
-	 */
-	for (blk = fs->super->s_first_data_block;
-	     blk < fs->super->s_blocks_count; blk++) {
-		if (!ext2fs_fast_test_block_bitmap(fs->block_map, blk)) {
-			group_free++;
-			total_free++;
-		}
-		count++;
-		if ((count == fs->super->s_blocks_per_group) ||
-		    (blk == fs->super->s_blocks_count-1)) {
-			fs->group_desc[group++].bg_free_blocks_count =
-				group_free;
-			count = 0;
-			group_free = 0;
-		}
-	}
-	fs->super->s_free_blocks_count = total_free;
-
-	/*
-	 * Next, calculate the inode statistics
-	 */
-	group_free = 0;
-	total_free = 0;
-	count = 0;
-	group = 0;
-
-	/* Protect loop from wrap-around if s_inodes_count maxed */
-	for (ino = 1; ino <= fs->super->s_inodes_count && ino > 0; ino++) {
-		if (!ext2fs_fast_test_inode_bitmap(fs->inode_map, ino)) {
-			group_free++;
-			total_free++;
-		}
-		count++;
-		if ((count == fs->super->s_inodes_per_group) ||
-		    (ino == fs->super->s_inodes_count)) {
-			fs->group_desc[group++].bg_free_inodes_count =
-				group_free;
-			count = 0;
-			group_free = 0;
-		}
-	}
-	fs->super->s_free_inodes_count = total_free;
-	ext2fs_mark_super_dirty(fs);
-	return 0;
-}
-
 #define list_for_each_safe(pos, pnext, head) \
 	for (pos = (head)->next, pnext = pos->next; pos != (head); \
 	     pos = pnext, pnext = pos->next)
@@ -1775,7 +1722,12 @@ static int resize_inode(ext2_filsys fs, unsigned long new_size)
 		      stderr);
 		goto err_out;
 	}
+	/* Write back the updated inodes together */
+	fs->flags |= EXT2_FLAG_ICACHE_WRITEBACK;
 	retval = inode_scan_and_fix(fs, bmap);
+	fs->flags &= ~EXT2_FLAG_ICACHE_WRITEBACK;
+	if (!retval)
+		retval = ext2fs_flush_icache(fs);
 	if (retval)
 		goto err_out_undo;
 
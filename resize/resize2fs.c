@@ -51,7 +51,6 @@ static errcode_t fix_resize_inode(ext2_filsys fs);
 #ifdef EXT2FS_SNAPSHOT_EXCLUDE_INODE
 static errcode_t fix_exclude_inode(ext2_filsys fs);
 #endif
-static errcode_t ext2fs_calculate_summary_stats(ext2_filsys fs);
 static errcode_t fix_sb_journal_backup(ext2_filsys fs);
 
 /*
@@ -136,6 +135,9 @@ errcode_t resize_fs(ext2_filsys fs, blk_t *new_size, int flags,
 	if (retval)
 		goto errout;
 
+	/* Write back the updated inodes together */
+	rfs->old_fs->flags |= EXT2_FLAG_ICACHE_WRITEBACK;
+	rfs->new_fs->flags |= EXT2_FLAG_ICACHE_WRITEBACK;
 	retval = inode_scan_and_fix(rfs);
 	if (retval)
 		goto errout;
@@ -144,6 +146,13 @@ errcode_t resize_fs(ext2_filsys fs, blk_t *new_size, int flags,
 	if (retval)
 		goto errout;
 
+	/* move_itables() copies the inode tables directly */
+	rfs->old_fs->flags &= ~EXT2_FLAG_ICACHE_WRITEBACK;
+	rfs->new_fs->flags &= ~EXT2_FLAG_ICACHE_WRITEBACK;
+	retval = ext2fs_flush_icache(rfs->new_fs);
+	if (retval)
+		goto errout;
+
 	retval = move_itables(rfs);
 	if (retval)
 		goto errout;
@@ -174,6 +183,22 @@ errcode_t resize_fs(ext2_filsys fs, blk_t *new_size, int flags,
 
 	rfs->flags = flags;
 
+#ifdef RESIZE2FS_DEBUG
+	if (rfs->flags & RESIZE_DEBUG_IO_STATS) {
+		io_stats stats = 0;
+
+		/* The old handle still holds a reference to the channel */
+		if (fs->io->manager->get_stats)
+			fs->io->manager->get_stats(fs->io, &stats);
+		if (stats) {
+			printf("I/O read: %lluMB, write: %lluMB\n",
+			       (stats->bytes_read + 1048575) / 1048576,
+			       (stats->bytes_written + 1048575) / 1048576);
+			e2p_print_io_stats(stdout, 0, stats, 0, fs->blocksize);
+		}
+	}
+#endif
+
 	ext2fs_free(rfs->old_fs);
 	if (rfs->itable_buf)
 		ext2fs_free_mem(&rfs->itable_buf);
@@ -1104,16 +1129,23 @@ static errcode_t resize2fs_get_alloc_block(ext2_filsys fs, blk64_t goal,
 	return 0;
 }
 
+/*
+ * Maximum number of separate extents moved by one batch of I/O
+ */
+#define MOVE_BATCH_SIZE	64
+
 static errcode_t block_mover(ext2_resize_t rfs)
 {
 	blk_t			blk, old_blk, new_blk;
 	ext2_filsys		fs = rfs->new_fs;
 	ext2_filsys		old_fs = rfs->old_fs;
 	errcode_t		retval;
-	int			size, c;
+	int			size, c, n, used;
 	int			to_move, moved;
 	ext2_badblocks_list	badblock_list = 0;
 	int			bb_modified = 0;
+	struct struct_io_request read_reqs[MOVE_BATCH_SIZE];
+	struct struct_io_request write_reqs[MOVE_BATCH_SIZE];
 
 	fs->get_alloc_block = resize2fs_get_alloc_block;
 	old_fs->get_alloc_block = resize2fs_get_alloc_block;
@@ -1183,40 +1215,60 @@ static errcode_t block_mover(ext2_resize_t rfs)
 		if (retval)
 			goto errout;
 	}
+	/*
+	 * Gather up pieces of extents until the buffer is full, then
+	 * read them all with one batch and write them out with
+	 * another, so the I/O manager can keep several requests in
+	 * flight.  None of the destination blocks are in use in the
+	 * old filesystem, so no block is both read and written by
+	 * the same batch.
+	 */
+	size = n = used = 0;
 	while (1) {
-		retval = ext2fs_iterate_extent(rfs->bmap, &old_blk, &new_blk, &size);
-		if (retval) goto errout;
-		if (!size)
-			break;
+		if (!size) {
+			retval = ext2fs_iterate_extent(rfs->bmap, &old_blk,
+						       &new_blk, &size);
+			if (retval) goto errout;
 #ifdef RESIZE2FS_DEBUG
-		if (rfs->flags & RESIZE_DEBUG_BMOVE)
-			printf("Moving %d blocks %u->%u\n",
-			       size, old_blk, new_blk);
+			if (size && (rfs->flags & RESIZE_DEBUG_BMOVE))
+				printf("Moving %d blocks %u->%u\n",
+				       size, old_blk, new_blk);
 #endif
-		do {
+		}
+		if (size) {
 			c = size;
-			if (c > fs->inode_blocks_per_group)
-				c = fs->inode_blocks_per_group;
-			retval = io_channel_read_blk(fs->io, old_blk, c,
-						     rfs->itable_buf);
-			if (retval) goto errout;
-			retval = io_channel_write_blk(fs->io, new_blk, c,
-						      rfs->itable_buf);
-			if (retval) goto errout;
+			if (c > fs->inode_blocks_per_group - used)
+				c = fs->inode_blocks_per_group - used;
+			read_reqs[n].block = old_blk;
+			read_reqs[n].count = c;
+			read_reqs[n].buf = rfs->itable_buf +
+				used * fs->blocksize;
+			write_reqs[n] = read_reqs[n];
+			write_reqs[n].block = new_blk;
+			n++;
+			used += c;
 			size -= c;
 			new_blk += c;
 			old_blk += c;
-			moved += c;
-			if (rfs->progress) {
-				io_channel_flush(fs->io);
-				retval = (rfs->progress)(rfs,
-						E2_RSZ_BLOCK_RELOC_PASS,
-						moved, to_move);
-				if (retval)
-					goto errout;
-			}
-		} while (size > 0);
+			if ((used < fs->inode_blocks_per_group) &&
+			    (n < MOVE_BATCH_SIZE))
+				continue;
+		}
+		if (n == 0)
+			break;
+		retval = io_channel_read_batch(fs->io, read_reqs, n);
+		if (retval) goto errout;
+		retval = io_channel_write_batch(fs->io, write_reqs, n);
+		if (retval) goto errout;
+		moved += used;
+		n = used = 0;
 		io_channel_flush(fs->io);
+		if (rfs->progress) {
+			retval = (rfs->progress)(rfs, E2_RSZ_BLOCK_RELOC_PASS,
+						 moved, to_move);
+			if (retval)
+				goto errout;
+		}
 	}
 
 errout:
@@ -1342,6 +1394,7 @@ static errcode_t inode_scan_and_fix(ext2_resize_t rfs)
 
 	retval = ext2fs_open_inode_scan(rfs->old_fs, 0, &scan);
 	if (retval) goto errout;
+	ext2fs_inode_scan_flags(scan, EXT2_SF_PREFETCH, 0);
 
 	retval = ext2fs_init_dblist(rfs->old_fs, 0);
 	if (retval) goto errout;
@@ -1683,6 +1736,8 @@ static errcode_t move_itables(ext2_resize_t rfs)
 			if (retval)
 				goto errout;
 		}
+		/* The new table may overlap the old one */
+		ext2fs_flush_icache(fs);
 
 		for (blk = rfs->old_fs->group_desc[i].bg_inode_table, j=0;
 		     j < fs->inode_blocks_per_group ; j++, blk++)
@@ -1784,111 +1839,6 @@ static errcode_t fix_exclude_inode(ext2_filsys fs)
 }
 
 #endif
-/*
- * Finally, recalculate the summary information
- */
-static errcode_t ext2fs_calculate_summary_stats(ext2_filsys fs)
-{
-	blk_t		blk;
-	ext2_ino_t	ino;
-	unsigned int	group = 0;
-	unsigned int	count = 0;
-	int		total_free = 0;
-	int		group_free = 0;
-	int		uninit = 0;
-	blk_t		super_blk, old_desc_blk, new_desc_blk;
-	int		old_desc_blocks;
-
-	/*
-	 * First calculate the block statistics
-	 */
-	uninit = fs->group_desc[group].bg_flags & EXT2_BG_BLOCK_UNINIT;
-	ext2fs_super_and_bgd_loc(fs, group, &super_blk, &old_desc_blk,
-				 &new_desc_blk, 0);
-	if (fs->super->s_feature_incompat & EXT2_FEATURE_INCOMPAT_META_BG)
-		old_desc_blocks = fs->super->s_first_meta_bg;
-	else
-		old_desc_blocks = fs->desc_blocks +
-			fs->super->s_reserved_gdt_blocks;
-	for (blk = fs->super->s_first_data_block;
-	     blk < fs->super->s_blocks_count; blk++) {
-		if ((uninit &&
-		     !((blk == super_blk) ||
-		       ((old_desc_blk && old_desc_blocks &&
-			 (blk >= old_desc_blk) &&
-			 (blk < old_desc_blk + old_desc_blocks))) ||
-		       ((new_desc_blk && (blk == new_desc_blk))) ||
-		       (blk == fs->group_desc[group].bg_block_bitmap) ||
-		       (blk == fs->group_desc[group].bg_inode_bitmap) ||
-		       ((blk >= fs->group_desc[group].bg_inode_table &&
-			 (blk < fs->group_desc[group].bg_inode_table
-			  + fs->inode_blocks_per_group))))) ||
-		    (!ext2fs_fast_test_block_bitmap(fs->block_map, blk))) {
-			group_free++;
-			total_free++;
-		}
-		count++;
-		if ((count == fs->super->s_blocks_per_group) ||
-		    (blk == fs->super->s_blocks_count-1)) {
-			fs->group_desc[group].bg_free_blocks_count =
-				group_free;
-			ext2fs_group_desc_csum_set(fs, group);
-			group++;
-			if (group >= fs->group_desc_count)
-				break;
-			count = 0;
-			group_free = 0;
-			uninit = (fs->group_desc[group].bg_flags &
-				  EXT2_BG_BLOCK_UNINIT);
-			ext2fs_super_and_bgd_loc(fs, group, &super_blk,
-						 &old_desc_blk,
-						 &new_desc_blk, 0);
-			if (fs->super->s_feature_incompat &
-			    EXT2_FEATURE_INCOMPAT_META_BG)
-				old_desc_blocks = fs->super->s_first_meta_bg;
-			else
-				old_desc_blocks = fs->desc_blocks +
-					fs->super->s_reserved_gdt_blocks;
-		}
-	}
-	fs->super->s_free_blocks_count = total_free;
-
-	/*
-	 * Next, calculate the inode statistics
-	 */
-	group_free = 0;
-	total_free = 0;
-	count = 0;
-	group = 0;
-
-	/* Protect loop from wrap-around if s_inodes_count maxed */
-	uninit = fs->group_desc[group].bg_flags & EXT2_BG_INODE_UNINIT;
-	for (ino = 1; ino <= fs->super->s_inodes_count && ino > 0; ino++) {
-		if (uninit ||
-		    !ext2fs_fast_test_inode_bitmap(fs->inode_map, ino)) {
-			group_free++;
-			total_free++;
-		}
-		count++;
-		if ((count == fs->super->s_inodes_per_group) ||
-		    (ino == fs->super->s_inodes_count)) {
-			fs->group_desc[group].bg_free_inodes_count =
-				group_free;
-			ext2fs_group_desc_csum_set(fs, group);
-			group++;
-			if (group >= fs->group_desc_count)
-				break;
-			count = 0;
-			group_free = 0;
-			uninit = (fs->group_desc[group].bg_flags &
-				  EXT2_BG_INODE_UNINIT);
-		}
-	}
-	fs->super->s_free_inodes_count = total_free;
-	ext2fs_mark_super_dirty(fs);
-	return 0;
-}
-
 /*
  *  Journal may have been relocated; update the backup journal blocks
  *  in the superblock.
@@ -0,0 +1,348 @@
+/*
+ * replay_trace.c --- Replay a binary I/O trace recorded by the test
+ * 	I/O manager (see TEST_IO_TRACE) against a device or image, so
+ * 	that changes to the I/O path can be benchmarked without the
+ * 	data the trace was taken from.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#else
+extern char *optarg;
+extern int optind;
+#endif
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "ext2fs/ext2_fs.h"
+#include "ext2fs/ext2fs.h"
+
+static const char *program_name = "replay_trace";
+
+struct replay_stats {
+	unsigned long long	reads, writes, skipped, errors;
+	unsigned long long	bytes;
+};
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: %s [-c concurrency] [-m unix|io_uring|mmap] "
+		"[-o io_options]\n\t[-p tag] [-t] [-w] trace_file device\n",
+		program_name);
+	fprintf(stderr, "\nThe trace only records where I/O was done, not the "
+		"data.  With -w, each\nwrite first reads the blocks it "
+		"covers and writes the same contents back,\nso the data is "
+		"left unchanged; the extra reads are not counted.  Don't\n"
+		"use -w on a device which is mounted or otherwise in use, "
+		"since anything\nwritten to it while the replay is running "
+		"may be overwritten.\n");
+	exit(1);
+}
+
+static int read_record(FILE *f, struct test_io_trace_rec *rec, int rec_size)
+{
+	char	buf[256];
+
+	if (fread(buf, rec_size, 1, f) != 1)
+		return 0;
+	memcpy(rec, buf, sizeof(struct test_io_trace_rec));
+	rec->block = ext2fs_le64_to_cpu(rec->block);
+	rec->count = ext2fs_le32_to_cpu(rec->count);
+	rec->op = ext2fs_le16_to_cpu(rec->op);
+	rec->tag = ext2fs_le16_to_cpu(rec->tag);
+	rec->usec = ext2fs_le64_to_cpu(rec->usec);
+	rec->block_size = ext2fs_le32_to_cpu(rec->block_size);
+	rec->error = ext2fs_le32_to_cpu(rec->error);
+	return 1;
+}
+
+static FILE *open_trace(const char *name, int *rec_size)
+{
+	struct test_io_trace_hdr hdr;
+	FILE	*f;
+
+	f = fopen(name, "r");
+	if (!f) {
+		perror(name);
+		exit(1);
+	}
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    ext2fs_le32_to_cpu(hdr.magic) != TEST_IO_TRACE_MAGIC ||
+	    ext2fs_le32_to_cpu(hdr.version) != TEST_IO_TRACE_VERSION) {
+		fprintf(stderr, "%s: %s is not an I/O trace\n",
+			program_name, name);
+		exit(1);
+	}
+	*rec_size = ext2fs_le32_to_cpu(hdr.rec_size);
+	if (*rec_size < (int) sizeof(struct test_io_trace_rec) ||
+	    *rec_size > 256) {
+		fprintf(stderr, "%s: bad record size %d in %s\n",
+			program_name, *rec_size, name);
+		exit(1);
+	}
+	return f;
+}
+
+/*
+ * The trace doesn't have the data which was written, so read what is
+ * there now into buf; writing it back then leaves the device as it
+ * was.  Byte writes are read back through the blocks which cover them.
+ */
+static errcode_t read_back(io_channel io, struct test_io_trace_rec *rec,
+			   char **buf, size_t *buf_size)
+{
+	unsigned long long first, last;
+	size_t		size;
+	errcode_t	retval;
+
+	if (rec->op == TEST_IO_TRACE_WRITE)
+		return io_channel_read_blk64(io, rec->block, rec->count, *buf);
+
+	first = rec->block / io->block_size;
+	last = (rec->block + rec->count - 1) / io->block_size;
+	size = (last - first + 1) * io->block_size;
+	if (size > *buf_size) {
+		ext2fs_free_mem(buf);
+		*buf_size = 0;
+		retval = ext2fs_get_memalign(size, 4096, buf);
+		if (retval)
+			return retval;
+		*buf_size = size;
+	}
+	retval = io_channel_read_blk64(io, first, last - first + 1, *buf);
+	if (retval)
+		return retval;
+	memmove(*buf, *buf + (rec->block % io->block_size), rec->count);
+	return 0;
+}
+
+static unsigned long long now_usec(struct timeval *start)
+{
+	struct timeval	now;
+
+	gettimeofday(&now, 0);
+	return (unsigned long long) (now.tv_sec - start->tv_sec) * 1000000 +
+		now.tv_usec - start->tv_usec;
+}
+
+/*
+ * Replay every nworkers'th record of the trace, starting with record
+ * number worker.  Records from the same trace thus get spread over
+ * all of the workers, which run concurrently.
+ */
+static void replay(const char *trace, const char *device, io_manager manager,
+		   const char *io_options, int tag, int timed, int do_writes,
+		   int worker, int nworkers, struct replay_stats *stats)
+{
+	struct test_io_trace_rec rec;
+	struct timeval	start;
+	unsigned long long now;
+	io_channel	io;
+	errcode_t	retval;
+	FILE		*f;
+	char		*buf = 0;
+	size_t		buf_size = 0, size;
+	int		rec_size, n;
+
+	f = open_trace(trace, &rec_size);
+	retval = manager->open(device, do_writes ? IO_FLAG_RW : 0, &io);
+	if (!retval && io_options)
+		retval = io_channel_set_options(io, io_options);
+	if (retval) {
+		com_err(program_name, retval, "while opening %s", device);
+		exit(1);
+	}
+
+	memset(stats, 0, sizeof(struct replay_stats));
+	gettimeofday(&start, 0);
+	for (n = 0; read_record(f, &rec, rec_size); n++) {
+		if ((n % nworkers) != worker)
+			continue;
+		if (tag >= 0 && rec.tag != tag) {
+			stats->skipped++;
+			continue;
+		}
+		if (timed) {
+			now = now_usec(&start);
+			if (rec.usec > now)
+				usleep(rec.usec - now);
+		}
+		if (rec.block_size &&
+		    rec.block_size != (unsigned) io->block_size)
+			io_channel_set_blksize(io, rec.block_size);
+		size = (rec.count < 0) ? (size_t) -rec.count :
+			(size_t) rec.count * io->block_size;
+		if (size > buf_size) {
+			ext2fs_free_mem(&buf);
+			retval = ext2fs_get_memalign(size, 4096, &buf);
+			if (retval) {
+				com_err(program_name, retval,
+					"while allocating buffer");
+				exit(1);
+			}
+			memset(buf, 0, size);
+			buf_size = size;
+		}
+
+		retval = 0;
+		switch (rec.op) {
+		case TEST_IO_TRACE_READ:
+			retval = io_channel_read_blk64(io, rec.block,
+						       rec.count, buf);
+			stats->reads++;
+			stats->bytes += size;
+			break;
+		case TEST_IO_TRACE_WRITE:
+			if (!do_writes) {
+				stats->skipped++;
+				break;
+			}
+			retval = read_back(io, &rec, &buf, &buf_size);
+			if (retval)
+				break;
+			retval = io_channel_write_blk64(io, rec.block,
+							rec.count, buf);
+			stats->writes++;
+			stats->bytes += size;
+			break;
+		case TEST_IO_TRACE_WRITE_BYTE:
+			if (!do_writes || rec.count <= 0) {
+				stats->skipped++;
+				break;
+			}
+			retval = read_back(io, &rec, &buf, &buf_size);
+			if (retval)
+				break;
+			retval = io_channel_write_byte(io, rec.block,
+						       rec.count, buf);
+			stats->writes++;
+			stats->bytes += rec.count;
+			break;
+		case TEST_IO_TRACE_READAHEAD:
+			io_channel_readahead(io, rec.block, rec.count);
+			break;
+		case TEST_IO_TRACE_FLUSH:
+			if (do_writes)
+				retval = io_channel_flush(io);
+			break;
+		default:
+			stats->skipped++;
+		}
+		if (retval)
+			stats->errors++;
+	}
+	io_channel_close(io);
+	fclose(f);
+	ext2fs_free_mem(&buf);
+}
+
+int main(int argc, char **argv)
+{
+	struct replay_stats stats, total;
+	struct timeval	start;
+	io_manager	manager = unix_io_manager;
+	char		*io_options = 0;
+	char		*end;
+	int		c, i, nworkers = 1, tag = -1, timed = 0, do_writes = 0;
+	int		fds[2], status;
+	pid_t		pid;
+	double		elapsed;
+
+	add_error_table(&et_ext2_error_table);
+	while ((c = getopt(argc, argv, "c:m:o:p:tw")) != EOF) {
+		switch (c) {
+		case 'c':
+			nworkers = strtoul(optarg, &end, 0);
+			if (*end || nworkers < 1)
+				usage();
+			break;
+		case 'm':
+			if (!strcmp(optarg, "unix"))
+				manager = unix_io_manager;
+			else if (!strcmp(optarg, "io_uring"))
+				manager = io_uring_io_manager;
+			else if (!strcmp(optarg, "mmap"))
+				manager = mmap_io_manager;
+			else
+				usage();
+			break;
+		case 'o':
+			io_options = optarg;
+			break;
+		case 'p':
+			tag = strtoul(optarg, &end, 0);
+			if (*end)
+				usage();
+			break;
+		case 't':
+			timed++;
+			break;
+		case 'w':
+			do_writes++;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 2)
+		usage();
+
+	gettimeofday(&start, 0);
+	memset(&total, 0, sizeof(total));
+	if (nworkers == 1)
+		replay(argv[optind], argv[optind+1], manager, io_options,
+		       tag, timed, do_writes, 0, 1, &total);
+	else {
+		if (pipe(fds) < 0) {
+			perror("pipe");
+			exit(1);
+		}
+		for (i = 0; i < nworkers; i++) {
+			pid = fork();
+			if (pid < 0) {
+				perror("fork");
+				exit(1);
+			}
+			if (pid == 0) {
+				close(fds[0]);
+				replay(argv[optind], argv[optind+1], manager,
+				       io_options, tag, timed, do_writes,
+				       i, nworkers, &stats);
+				if (write(fds[1], &stats, sizeof(stats)) !=
+				    sizeof(stats))
+					exit(1);
+				exit(0);
+			}
+		}
+		close(fds[1]);
+		while (read(fds[0], &stats, sizeof(stats)) == sizeof(stats)) {
+			total.reads += stats.reads;
+			total.writes += stats.writes;
+			total.skipped += stats.skipped;
+			total.errors += stats.errors;
+			total.bytes += stats.bytes;
+		}
+		while (wait(&status) > 0)
+			;
+	}
+	elapsed = now_usec(&start) / 1000000.0;
+
+	printf("%s: %llu reads, %llu writes, %llu skipped, %llu errors\n",
+	       argv[optind], total.reads, total.writes, total.skipped,
+	       total.errors);
+	printf("%llu bytes in %.3f seconds (%.2f MB/s, %.0f ops/s)\n",
+	       total.bytes, elapsed,
+	       elapsed ? total.bytes / elapsed / 1048576 : 0.0,
+	       elapsed ? (total.reads + total.writes) / elapsed : 0.0);
+	return 0;
+}
@@ -0,0 +1,113 @@
+/*
+ * undo_crash.c --- Overwrite some blocks through the undo I/O manager
+ * 	and then exit without closing the channel, as if the program
+ * 	had crashed, so that recovery of the undo log can be tested.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#else
+extern char *optarg;
+extern int optind;
+#endif
+
+#include "ext2fs/ext2_fs.h"
+#include "ext2fs/ext2fs.h"
+
+static const char *program_name = "undo_crash";
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: %s [-b blocksize] [-c count] [-s start] "
+		"device undo_file\n", program_name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	io_channel	channel;
+	errcode_t	retval;
+	char		*buf, *end;
+	int		c, block_size = 1024;
+	unsigned long	i, start = 64, count = 64;
+
+	while ((c = getopt(argc, argv, "b:c:s:")) != EOF) {
+		switch (c) {
+		case 'b':
+			block_size = strtol(optarg, &end, 0);
+			if (*end || block_size <= 0)
+				usage();
+			break;
+		case 'c':
+			count = strtoul(optarg, &end, 0);
+			if (*end)
+				usage();
+			break;
+		case 's':
+			start = strtoul(optarg, &end, 0);
+			if (*end)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 2)
+		usage();
+
+	add_error_table(&et_ext2_error_table);
+	set_undo_io_backing_manager(unix_io_manager);
+	set_undo_io_backup_file(argv[optind + 1]);
+	retval = undo_io_manager->open(argv[optind], IO_FLAG_RW, &channel);
+	if (retval) {
+		com_err(program_name, retval, "while opening %s",
+			argv[optind]);
+		exit(1);
+	}
+	retval = io_channel_set_blksize(channel, block_size);
+	if (retval) {
+		com_err(program_name, retval, "while setting block size");
+		exit(1);
+	}
+	retval = ext2fs_get_mem(block_size, &buf);
+	if (retval) {
+		com_err(program_name, retval, "while allocating buffer");
+		exit(1);
+	}
+
+	/*
+	 * Write the blocks one at a time, and the first half of them a
+	 * second time, so that blocks which were already saved are
+	 * written over again as well.
+	 */
+	for (i = 0; i < count + count / 2; i++) {
+		memset(buf, 0xa5 + i, block_size);
+		retval = io_channel_write_blk(channel, start + i % count,
+					      1, buf);
+		if (retval) {
+			com_err(program_name, retval,
+				"while writing block %lu", start + i % count);
+			exit(1);
+		}
+	}
+
+	/*
+	 * Push everything out to the device, and then go away without
+	 * closing the channel, so the undo log never gets its index.
+	 */
+	retval = io_channel_flush(channel);
+	if (retval) {
+		com_err(program_name, retval, "while flushing");
+		exit(1);
+	}
+	_exit(0);
+}